@@ -1,9 +1,22 @@
+// Define _GNU_SOURCE so that fopencookie is defined for non macOS builds
+#ifndef __APPLE__
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <zlib.h>
 
 #include "archive.h"
-#include "engine.h"
 
 #ifndef ZIP_RDONLY
 typedef struct zip zip_t;
@@ -12,81 +25,709 @@ typedef struct zip_file zip_file_t;
 #define ZIP_RDONLY 16
 #endif
 
-void format_zip_error(const char *prefix, zip_t *zip, char **error_msg);
+// Archives are read from a read-only mapping of the file, finding entries using
+// its central directory, so that stored entries can be viewed in place, and
+// deflated entries inflated with zlib. Anything else, like other compression
+// methods, is read with libzip. Open archives are cached by path, and reused
+// while the file has the same device, inode, size and mtime.
 
-void* open_archive(const char *path, char **error_msg) {
-    zip_t *archive = zip_open(path, ZIP_RDONLY, NULL);
+#define METHOD_STORED 0
+#define METHOD_DEFLATED 8
+
+struct archive_entry {
+    char *name;
+    uint16_t method;
+    uint16_t flags;
+    uint64_t compressed_size;
+    uint64_t size;
+    uint64_t local_header_offset;
+    time_t mtime;
+};
+
+// Identifies the version of a file an archive was read from
+struct file_id {
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+};
 
-    if (archive == NULL && error_msg) {
+struct archive {
+    char *path;
+    struct file_id file_id;
+    int refs;
+
+    const uint8_t *map;
+    size_t map_len;
+    struct archive_entry *entries;
+    uint64_t num_entries;
+    // Open addressing hash table of entry indexes plus one, by name
+    uint64_t *table;
+    size_t table_size;
+
+    // Opened if any entry can't be read from the mapping
+    zip_t *zip;
+    pthread_mutex_t zip_lock;
+
+    struct archive *next;
+};
+
+static pthread_mutex_t archives_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct archive *archives = NULL;
+
+void format_zip_error(const char *prefix, zip_t *zip, char **error_msg);
+
+static void format_error(char **error_msg, const char *format, const char *arg) {
+    if (error_msg) {
         *error_msg = malloc(1024);
         if (*error_msg) {
-            snprintf(*error_msg, 1024, "Could not open %s", path);
+            snprintf(*error_msg, 1024, format, arg);
+        }
+    }
+}
+
+static uint16_t read16(const uint8_t *p) {
+    return (uint16_t) (p[0] | p[1] << 8);
+}
+
+static uint32_t read32(const uint8_t *p) {
+    return (uint32_t) p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+static uint64_t read64(const uint8_t *p) {
+    return (uint64_t) read32(p) | (uint64_t) read32(p + 4) << 32;
+}
+
+static uint32_t name_hash(const char *name) {
+    uint32_t h = 2166136261u;
+    for (; *name; name++) {
+        h ^= (unsigned char) *name;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static time_t dos_time(uint16_t time, uint16_t date) {
+    struct tm tm;
+    memset(&tm, 0, sizeof(struct tm));
+    tm.tm_year = ((date >> 9) & 127) + 80;
+    tm.tm_mon = ((date >> 5) & 15) - 1;
+    tm.tm_mday = date & 31;
+    tm.tm_hour = (time >> 11) & 31;
+    tm.tm_min = (time >> 5) & 63;
+    tm.tm_sec = (time << 1) & 62;
+    tm.tm_isdst = -1;
+    return mktime(&tm);
+}
+
+// Finds the central directory, returning false if the archive isn't a ZIP file
+static bool find_central_directory(struct archive *archive, uint64_t *offset, uint64_t *size) {
+    const uint8_t *map = archive->map;
+    size_t len = archive->map_len;
+    if (len < 22) {
+        return false;
+    }
+
+    // The end of central directory record is followed by a comment of up to 64K
+    size_t eocd = len - 22;
+    size_t min = len > 22 + 65535 ? len - 22 - 65535 : 0;
+    while (read32(map + eocd) != 0x06054b50) {
+        if (eocd == min) {
+            return false;
         }
+        eocd--;
+    }
+
+    archive->num_entries = read16(map + eocd + 10);
+    *size = read32(map + eocd + 12);
+    *offset = read32(map + eocd + 16);
+
+    if ((archive->num_entries == 0xffff || *size == 0xffffffff || *offset == 0xffffffff) && eocd >= 20
+        && read32(map + eocd - 20) == 0x07064b50) {
+        uint64_t zip64_eocd = read64(map + eocd - 20 + 8);
+        if (len < 56 || zip64_eocd > len - 56 || read32(map + zip64_eocd) != 0x06064b50) {
+            return false;
+        }
+        archive->num_entries = read64(map + zip64_eocd + 32);
+        *size = read64(map + zip64_eocd + 40);
+        *offset = read64(map + zip64_eocd + 48);
+    }
+
+    return *offset <= len && *size <= len - *offset;
+}
+
+static bool read_central_directory(struct archive *archive) {
+    uint64_t offset, size;
+    if (!find_central_directory(archive, &offset, &size) || archive->num_entries > size / 46) {
+        return false;
+    }
+
+    archive->entries = calloc(archive->num_entries ? archive->num_entries : 1, sizeof(struct archive_entry));
+    if (!archive->entries) {
+        return false;
+    }
+
+    const uint8_t *p = archive->map + offset;
+    const uint8_t *end = p + size;
+    uint64_t i;
+    for (i = 0; i < archive->num_entries; i++) {
+        if (end - p < 46 || read32(p) != 0x02014b50) {
+            return false;
+        }
+        uint16_t name_len = read16(p + 28);
+        uint16_t extra_len = read16(p + 30);
+        uint16_t comment_len = read16(p + 32);
+        if (end - p < 46 + name_len + extra_len + comment_len) {
+            return false;
+        }
+
+        struct archive_entry *entry = &archive->entries[i];
+        entry->flags = read16(p + 8);
+        entry->method = read16(p + 10);
+        entry->mtime = dos_time(read16(p + 12), read16(p + 14));
+        entry->compressed_size = read32(p + 20);
+        entry->size = read32(p + 24);
+        entry->local_header_offset = read32(p + 42);
+        entry->name = strndup((const char *) p + 46, name_len);
+        if (!entry->name) {
+            return false;
+        }
+
+        // Sizes and offsets too large for the record are in the ZIP64 extra field
+        const uint8_t *extra = p + 46 + name_len;
+        const uint8_t *extra_end = extra + extra_len;
+        while (extra_end - extra >= 4) {
+            uint16_t id = read16(extra);
+            uint16_t len = read16(extra + 2);
+            const uint8_t *field = extra + 4;
+            if (extra_end - field < len) {
+                break;
+            }
+            if (id == 0x0001) {
+                const uint8_t *field_end = field + len;
+                if (entry->size == 0xffffffff && field_end - field >= 8) {
+                    entry->size = read64(field);
+                    field += 8;
+                }
+                if (entry->compressed_size == 0xffffffff && field_end - field >= 8) {
+                    entry->compressed_size = read64(field);
+                    field += 8;
+                }
+                if (entry->local_header_offset == 0xffffffff && field_end - field >= 8) {
+                    entry->local_header_offset = read64(field);
+                }
+            }
+            extra += 4 + len;
+        }
+
+        p += 46 + name_len + extra_len + comment_len;
+    }
+
+    archive->table_size = 16;
+    while (archive->table_size < 2 * archive->num_entries) {
+        archive->table_size *= 2;
+    }
+    archive->table = calloc(archive->table_size, sizeof(uint64_t));
+    if (!archive->table) {
+        return false;
+    }
+    for (i = 0; i < archive->num_entries; i++) {
+        size_t slot = name_hash(archive->entries[i].name) & (archive->table_size - 1);
+        while (archive->table[slot]) {
+            // The first of any duplicate names is found, as with libzip
+            if (strcmp(archive->entries[archive->table[slot] - 1].name, archive->entries[i].name) == 0) {
+                break;
+            }
+            slot = (slot + 1) & (archive->table_size - 1);
+        }
+        if (!archive->table[slot]) {
+            archive->table[slot] = i + 1;
+        }
+    }
+
+    return true;
+}
+
+static void free_archive(struct archive *archive) {
+    uint64_t i;
+    if (archive->entries) {
+        for (i = 0; i < archive->num_entries; i++) {
+            free(archive->entries[i].name);
+        }
+    }
+    free(archive->entries);
+    free(archive->table);
+    if (archive->map) {
+        munmap((void *) archive->map, archive->map_len);
+    }
+    if (archive->zip) {
+        zip_close(archive->zip);
+    }
+    pthread_mutex_destroy(&archive->zip_lock);
+    free(archive->path);
+    free(archive);
+}
+
+static struct file_id get_file_id(const struct stat *file_stat) {
+    struct file_id id;
+    id.dev = file_stat->st_dev;
+    id.ino = file_stat->st_ino;
+    id.size = file_stat->st_size;
+#ifdef __APPLE__
+    id.mtime = file_stat->st_mtimespec;
+#else
+    id.mtime = file_stat->st_mtim;
+#endif
+    return id;
+}
+
+static bool same_file_id(const struct file_id *a, const struct file_id *b) {
+    return a->dev == b->dev && a->ino == b->ino && a->size == b->size &&
+           a->mtime.tv_sec == b->mtime.tv_sec && a->mtime.tv_nsec == b->mtime.tv_nsec;
+}
+
+static struct archive *load_archive(const char *path, struct stat *file_stat, char **error_msg) {
+    struct archive *archive = calloc(1, sizeof(struct archive));
+    if (!archive) {
+        format_error(error_msg, "Could not open %s", path);
         return NULL;
     }
+    archive->path = strdup(path);
+    archive->refs = 1;
+    pthread_mutex_init(&archive->zip_lock, NULL);
+
+    // Identify the file that is actually mapped, in case it was replaced
+    // since it was checked
+    int fd = open(path, O_RDONLY);
+    if (fd != -1 && fstat(fd, file_stat) != 0) {
+        close(fd);
+        fd = -1;
+    }
+    archive->file_id = get_file_id(file_stat);
+    if (fd != -1 && file_stat->st_size > 0) {
+        void *map = mmap(NULL, file_stat->st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (map != MAP_FAILED) {
+            archive->map = map;
+            archive->map_len = file_stat->st_size;
+        }
+    }
+    if (fd != -1) {
+        close(fd);
+    }
+
+    if (!archive->map || !read_central_directory(archive)) {
+        free_archive(archive);
+        format_error(error_msg, "Could not open %s", path);
+        return NULL;
+    }
+
+    return archive;
+}
+
+void* open_archive(const char *path, char **error_msg) {
+    struct stat file_stat;
+    if (stat(path, &file_stat) != 0) {
+        format_error(error_msg, "Could not open %s", path);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&archives_lock);
+    struct archive **p = &archives;
+    while (*p && strcmp((*p)->path, path) != 0) {
+        p = &(*p)->next;
+    }
+    struct archive *archive = *p;
+    struct file_id file_id = get_file_id(&file_stat);
+    if (archive && same_file_id(&archive->file_id, &file_id)) {
+        archive->refs++;
+        pthread_mutex_unlock(&archives_lock);
+        return archive;
+    }
+    if (archive) {
+        // The file has changed, so stop caching the archive read from it
+        *p = archive->next;
+        if (--archive->refs == 0) {
+            free_archive(archive);
+        }
+    }
+    pthread_mutex_unlock(&archives_lock);
+
+    archive = load_archive(path, &file_stat, error_msg);
+    if (!archive) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&archives_lock);
+    archive->refs++;
+    archive->next = archives;
+    archives = archive;
+    pthread_mutex_unlock(&archives_lock);
 
     return archive;
 }
 
-void close_archive(void* archive) {
-    zip_close(archive);
+void close_archive(void* archive_p) {
+    struct archive *archive = archive_p;
+    pthread_mutex_lock(&archives_lock);
+    bool unused = --archive->refs == 0;
+    pthread_mutex_unlock(&archives_lock);
+    if (unused) {
+        free_archive(archive);
+    }
 }
 
-contents_zip_t get_contents_zip(void* archive_p, const char *name, time_t *last_modified, char **error_msg) {
-    contents_zip_t rv;
-    rv.payload = NULL;
-    rv.length = 0;
-
-    zip_t *archive = archive_p;
-    
-    zip_stat_t stat;
-    if (zip_stat(archive, name, 0, &stat) < 0) {
+static struct archive_entry *find_entry(struct archive *archive, const char *name) {
+    size_t slot = name_hash(name) & (archive->table_size - 1);
+    while (archive->table[slot]) {
+        struct archive_entry *entry = &archive->entries[archive->table[slot] - 1];
+        if (strcmp(entry->name, name) == 0) {
+            return entry;
+        }
+        slot = (slot + 1) & (archive->table_size - 1);
+    }
+    return NULL;
+}
+
+// Returns the data of an entry in the mapping, or NULL if it is out of bounds
+static const uint8_t *entry_data(struct archive *archive, struct archive_entry *entry) {
+    uint64_t offset = entry->local_header_offset;
+    if (offset > archive->map_len || archive->map_len - offset < 30
+        || read32(archive->map + offset) != 0x04034b50) {
+        return NULL;
+    }
+    offset += 30 + read16(archive->map + offset + 26) + read16(archive->map + offset + 28);
+    if (offset > archive->map_len || archive->map_len - offset < entry->compressed_size) {
+        return NULL;
+    }
+    return archive->map + offset;
+}
+
+// Whether an entry can be read from the mapping, rather than with libzip
+static bool is_mapped(struct archive_entry *entry) {
+    // Bit 0 marks encrypted entries
+    return (entry->flags & 1) == 0
+           && (entry->method == METHOD_DEFLATED
+               || (entry->method == METHOD_STORED && entry->compressed_size == entry->size));
+}
+
+static zip_t *open_zip(struct archive *archive, char **error_msg) {
+    pthread_mutex_lock(&archive->zip_lock);
+    if (!archive->zip) {
+        archive->zip = zip_open(archive->path, ZIP_RDONLY, NULL);
+    }
+    pthread_mutex_unlock(&archive->zip_lock);
+    if (!archive->zip) {
+        format_error(error_msg, "Could not open %s", archive->path);
+    }
+    return archive->zip;
+}
+
+static contents_zip_t read_zip_entry(struct archive *archive, uint64_t index, char **error_msg) {
+    contents_zip_t rv = {NULL, 0};
+    zip_t *zip = open_zip(archive, error_msg);
+    if (!zip) {
         return rv;
     }
 
-    zip_file_t *f = zip_fopen(archive, name, 0);
+    pthread_mutex_lock(&archive->zip_lock);
+    zip_file_t *f = zip_fopen_index(zip, index, 0);
     if (f == NULL) {
         if (error_msg) {
-            format_zip_error("zip_fopen", archive, error_msg);
+            format_zip_error("zip_fopen", zip, error_msg);
         }
+        pthread_mutex_unlock(&archive->zip_lock);
         return rv;
     }
 
-    if (last_modified != NULL) {
-        *last_modified = stat.mtime;
+    uint64_t size = archive->entries[index].size;
+    uint8_t *buf = malloc(size + 1);
+    if (!buf) {
+        if (error_msg) {
+            *error_msg = strdup("zip malloc");
+        }
+    } else if (zip_fread(f, buf, size) < 0) {
+        if (error_msg) {
+            format_zip_error("zip_fread", zip, error_msg);
+        }
+        free(buf);
+        buf = NULL;
+    } else {
+        // NULL-terminate in case client wants to treat contents as a string
+        buf[size] = '\0';
+        rv.payload = buf;
+        rv.length = size;
+    }
+    zip_fclose(f);
+    pthread_mutex_unlock(&archive->zip_lock);
+
+    return rv;
+}
+
+static contents_zip_t read_entry(struct archive *archive, struct archive_entry *entry, char **error_msg) {
+    contents_zip_t rv = {NULL, 0};
+
+    if (!is_mapped(entry)) {
+        return read_zip_entry(archive, entry - archive->entries, error_msg);
+    }
+
+    const uint8_t *data = entry_data(archive, entry);
+    if (!data) {
+        format_error(error_msg, "Could not read %s", entry->name);
+        return rv;
     }
 
-    uint8_t *buf = malloc(stat.size + 1);
+    uint8_t *buf = malloc(entry->size + 1);
     if (!buf) {
         if (error_msg) {
             *error_msg = strdup("zip malloc");
         }
-        goto close_f;
+        return rv;
     }
 
-    if (zip_fread(f, buf, stat.size) < 0) {
-        if (error_msg) {
-            format_zip_error("zip_fread", archive, error_msg);
+    if (entry->method == METHOD_STORED) {
+        memcpy(buf, data, entry->size);
+    } else {
+        z_stream strm;
+        memset(&strm, 0, sizeof(z_stream));
+        bool ok = inflateInit2(&strm, -MAX_WBITS) == Z_OK;
+        if (ok) {
+            // Inflate in chunks, as zlib sizes are 32-bit
+            const uint8_t *in = data;
+            uint64_t in_left = entry->compressed_size;
+            uint8_t *out = buf;
+            uint64_t out_left = entry->size;
+            int ret = Z_OK;
+            while (ret == Z_OK) {
+                strm.next_in = (Bytef *) in;
+                strm.avail_in = in_left > UINT32_MAX ? UINT32_MAX : (uInt) in_left;
+                strm.next_out = out;
+                strm.avail_out = out_left > UINT32_MAX ? UINT32_MAX : (uInt) out_left;
+                uInt avail_in = strm.avail_in;
+                uInt avail_out = strm.avail_out;
+                ret = inflate(&strm, Z_NO_FLUSH);
+                in += avail_in - strm.avail_in;
+                in_left -= avail_in - strm.avail_in;
+                out += avail_out - strm.avail_out;
+                out_left -= avail_out - strm.avail_out;
+                if (ret == Z_OK && avail_in == strm.avail_in && avail_out == strm.avail_out) {
+                    break;
+                }
+            }
+            ok = ret == Z_STREAM_END && out_left == 0;
+            inflateEnd(&strm);
+        }
+        if (!ok) {
+            free(buf);
+            format_error(error_msg, "Could not inflate %s", entry->name);
+            return rv;
         }
-        goto free_buf;
     }
+
     // NULL-terminate in case client wants to treat contents as a string
-    buf[stat.size] = '\0';
+    buf[entry->size] = '\0';
+    rv.payload = buf;
+    rv.length = entry->size;
+    return rv;
+}
 
-    zip_fclose(f);
+contents_zip_t get_contents_zip(void* archive_p, const char *name, time_t *last_modified, char **error_msg) {
+    struct archive *archive = archive_p;
+    contents_zip_t rv = {NULL, 0};
 
-    rv.payload = buf;
-    rv.length = stat.size;
+    struct archive_entry *entry = find_entry(archive, name);
+    if (!entry) {
+        return rv;
+    }
 
+    rv = read_entry(archive, entry, error_msg);
+    if (rv.payload && last_modified != NULL) {
+        *last_modified = entry->mtime;
+    }
     return rv;
+}
 
-    free_buf:
-    free(buf);
+contents_zip_t get_contents_zip_index(void* archive_p, uint64_t index, char **error_msg) {
+    struct archive *archive = archive_p;
+    if (index >= archive->num_entries) {
+        format_error(error_msg, "No entry in %s", archive->path);
+        contents_zip_t rv = {NULL, 0};
+        return rv;
+    }
+    return read_entry(archive, &archive->entries[index], error_msg);
+}
 
-    close_f:
-    zip_fclose(f);
+const uint8_t *get_contents_zip_view(void* archive_p, const char *name, size_t *length) {
+    struct archive *archive = archive_p;
+    struct archive_entry *entry = find_entry(archive, name);
+    if (!entry || entry->method != METHOD_STORED || !is_mapped(entry)) {
+        return NULL;
+    }
+    const uint8_t *data = entry_data(archive, entry);
+    if (data) {
+        *length = entry->size;
+    }
+    return data;
+}
 
-    return rv;
+bool for_each_archive_entry(void* archive_p, archive_entry_fn fn, void *data) {
+    struct archive *archive = archive_p;
+    uint64_t i;
+    for (i = 0; i < archive->num_entries; i++) {
+        struct archive_entry *entry = &archive->entries[i];
+        size_t len = strlen(entry->name);
+        // Skip directories
+        if (len > 0 && entry->name[len - 1] != '/') {
+            fn(entry->name, i, entry->size, entry->mtime, data);
+        }
+    }
+    return true;
+}
+
+// Entries are streamed by inflating, or copying from the mapping, only as much
+// as is read, so that large entries are read in constant memory.
+struct archive_stream {
+    struct archive *archive;
+    struct archive_entry *entry;
+    const uint8_t *in;
+    uint64_t in_left;
+    uint64_t out_left;
+    z_stream strm;
+    zip_file_t *zip_file;
+};
+
+static ssize_t read_stream(void *cookie, char *buf, size_t size) {
+    struct archive_stream *stream = cookie;
+    if (size > stream->out_left) {
+        size = stream->out_left;
+    }
+    if (size == 0) {
+        return 0;
+    }
+
+    if (stream->zip_file) {
+        pthread_mutex_lock(&stream->archive->zip_lock);
+        zip_int64_t n = zip_fread(stream->zip_file, buf, size);
+        pthread_mutex_unlock(&stream->archive->zip_lock);
+        if (n < 0) {
+            errno = EIO;
+            return -1;
+        }
+        stream->out_left -= n;
+        return n;
+    }
+
+    if (stream->entry->method == METHOD_STORED) {
+        memcpy(buf, stream->in, size);
+        stream->in += size;
+        stream->out_left -= size;
+        return size;
+    }
+
+    stream->strm.next_out = (Bytef *) buf;
+    stream->strm.avail_out = size > UINT32_MAX ? UINT32_MAX : (uInt) size;
+    while (stream->strm.avail_out > 0) {
+        if (stream->strm.avail_in == 0) {
+            uInt avail_in = stream->in_left > UINT32_MAX ? UINT32_MAX : (uInt) stream->in_left;
+            stream->strm.next_in = (Bytef *) stream->in;
+            stream->strm.avail_in = avail_in;
+            stream->in += avail_in;
+            stream->in_left -= avail_in;
+        }
+        uInt avail_out = stream->strm.avail_out;
+        int ret = inflate(&stream->strm, Z_NO_FLUSH);
+        if (ret == Z_STREAM_END) {
+            break;
+        }
+        if (ret != Z_OK || (avail_out == stream->strm.avail_out && stream->strm.avail_in == 0
+                            && stream->in_left == 0)) {
+            errno = EIO;
+            return -1;
+        }
+    }
+    size_t n = (char *) stream->strm.next_out - buf;
+    stream->out_left -= n;
+    return n;
+}
+
+static int close_stream(void *cookie) {
+    struct archive_stream *stream = cookie;
+    if (stream->zip_file) {
+        pthread_mutex_lock(&stream->archive->zip_lock);
+        zip_fclose(stream->zip_file);
+        pthread_mutex_unlock(&stream->archive->zip_lock);
+    } else if (stream->entry->method == METHOD_DEFLATED) {
+        inflateEnd(&stream->strm);
+    }
+    close_archive(stream->archive);
+    free(stream);
+    return 0;
+}
+
+#ifdef __APPLE__
+static int read_stream_apple(void *cookie, char *buf, int size) {
+    return (int) read_stream(cookie, buf, (size_t) size);
+}
+#endif
+
+FILE *open_archive_stream(const char *path, const char *name, char **error_msg) {
+    struct archive *archive = open_archive(path, error_msg);
+    if (!archive) {
+        return NULL;
+    }
+
+    struct archive_entry *entry = find_entry(archive, name);
+    if (!entry) {
+        close_archive(archive);
+        return NULL;
+    }
+
+    struct archive_stream *stream = calloc(1, sizeof(struct archive_stream));
+    if (!stream) {
+        close_archive(archive);
+        return NULL;
+    }
+    stream->archive = archive;
+    stream->entry = entry;
+    stream->out_left = entry->size;
+
+    bool ok;
+    if (!is_mapped(entry)) {
+        zip_t *zip = open_zip(archive, error_msg);
+        if (zip) {
+            pthread_mutex_lock(&archive->zip_lock);
+            stream->zip_file = zip_fopen_index(zip, entry - archive->entries, 0);
+            if (!stream->zip_file && error_msg) {
+                format_zip_error("zip_fopen", zip, error_msg);
+            }
+            pthread_mutex_unlock(&archive->zip_lock);
+        }
+        ok = stream->zip_file != NULL;
+    } else {
+        stream->in = entry_data(archive, entry);
+        stream->in_left = entry->compressed_size;
+        ok = stream->in != NULL
+             && (entry->method == METHOD_STORED || inflateInit2(&stream->strm, -MAX_WBITS) == Z_OK);
+        if (!ok) {
+            format_error(error_msg, "Could not read %s", name);
+        }
+    }
+    if (!ok) {
+        close_archive(archive);
+        free(stream);
+        return NULL;
+    }
+
+#ifdef __APPLE__
+    FILE *file = funopen(stream, read_stream_apple, NULL, NULL, close_stream);
+#else
+    cookie_io_functions_t functions = {read_stream, NULL, NULL, close_stream};
+    FILE *file = fopencookie(stream, "r", functions);
+#endif
+    if (!file) {
+        close_stream(stream);
+        format_error(error_msg, "Could not read %s", name);
+    }
+    return file;
 }
 
 void format_zip_error(const char *prefix, zip_t *zip, char **error_msg) {
@@ -103,13 +744,19 @@ int main(int argc, char **argv) {
         return 1;
     }
 
-    char *contents = get_contents_zip(argv[1], argv[2], NULL);
-    if (contents == NULL) {
+    void *archive = open_archive(argv[1], NULL);
+    if (archive == NULL) {
+        return 1;
+    }
+
+    contents_zip_t contents = get_contents_zip(archive, argv[2], NULL, NULL);
+    if (contents.payload == NULL) {
         return 1;
     }
 
-    printf("%s", contents);
-    free(contents);
+    fwrite(contents.payload, 1, contents.length, stdout);
+    free(contents.payload);
+    close_archive(archive);
 
     return 0;
 }
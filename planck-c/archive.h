@@ -1,3 +1,5 @@
+#include <stdbool.h>
+#include <stdio.h>
 #include <zip.h>
 
 typedef struct contents_zip {
@@ -5,6 +7,25 @@ typedef struct contents_zip {
     size_t length;
 } contents_zip_t;
 
+// Opens an archive, reusing an open one while the file has the same device,
+// inode, size and mtime. The file is mapped, so it must not be truncated or
+// rewritten in place while open: reading a truncated mapping raises SIGBUS.
+// Replacing a JAR by renaming a new file over it is safe.
 void* open_archive(const char *path, char **error_msg);
 void close_archive(void* archive);
 contents_zip_t get_contents_zip(void* archive, const char *name, time_t *last_modified, char **error_msg);
+contents_zip_t get_contents_zip_index(void* archive, uint64_t index, char **error_msg);
+
+// Returns the contents of an entry stored without compression, in place in the
+// archive, or NULL if the entry needs to be read with get_contents_zip. The
+// contents remain valid until the archive is closed.
+const uint8_t *get_contents_zip_view(void* archive, const char *name, size_t *length);
+
+// Opens an entry as a stream, which is read without holding the whole entry in
+// memory. Returns NULL if the archive or entry can't be opened.
+FILE *open_archive_stream(const char *path, const char *name, char **error_msg);
+
+// Calls fn for each file in the archive, returning false if the archive can't
+// be read
+typedef void (*archive_entry_fn)(const char *name, uint64_t index, uint64_t size, time_t mtime, void *data);
+bool for_each_archive_entry(void* archive, archive_entry_fn fn, void *data);
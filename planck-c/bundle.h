@@ -1 +1,21 @@
-char *bundle_get_contents(char *path);
\ No newline at end of file
+#include <stddef.h>
+#include <stdint.h>
+
+char *bundle_get_contents(char *path);
+
+// Like bundle_get_contents, but read-only, and shared with other processes if
+// PLANCK_BUNDLE_CACHE is set. Release with bundle_release_contents.
+const char *bundle_map_contents(const char *path);
+
+// Returns the UTF-16 contents of a bundled file that script/bundle stored
+// pre-transcoded, setting length to the number of characters, or NULL if the
+// file isn't stored that way. Release with bundle_release_contents.
+const uint16_t *bundle_map_characters(const char *path, size_t *length);
+
+void bundle_release_contents(const void *contents);
+
+const char *bundle_get_cljs_version();
+
+size_t bundle_get_count();
+
+const char *bundle_get_path(size_t index);
@@ -0,0 +1,130 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "bundle_cache.h"
+#include "bundle_codec.h"
+#include "bundle_index.h"
+#include "globals.h"
+
+// When PLANCK_BUNDLE_CACHE names a directory, bundled files are decoded once
+// into a subdirectory for this Planck version and bundle, and every process
+// maps them read-only from there, sharing their pages. Files are written
+// under a temporary name and renamed into place, so a process never sees a
+// partially written file, and racing processes simply write the same file.
+
+static pthread_once_t cache_dir_once = PTHREAD_ONCE_INIT;
+static char *cache_dir = NULL;
+
+static void init_cache_dir() {
+    char *dir = getenv("PLANCK_BUNDLE_CACHE");
+    if (dir == NULL || *dir == '\0' || bundle_header.id == NULL) {
+        return;
+    }
+
+    char path[PATH_MAX];
+    snprintf(path, PATH_MAX, "%s/%s-%s", dir, PLANCK_VERSION, bundle_header.id);
+    if ((mkdir(dir, 0755) == 0 || errno == EEXIST) && (mkdir(path, 0755) == 0 || errno == EEXIST)) {
+        cache_dir = strdup(path);
+    } else {
+        fprintf(stderr, "WARN: Can't use bundle cache %s: %s\n", path, strerror(errno));
+    }
+}
+
+static struct bundle_contents_header *map_file(int fd, uint32_t len) {
+    size_t size = sizeof(struct bundle_contents_header) + len + 1;
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size != size) {
+        return NULL;
+    }
+
+    struct bundle_contents_header *header = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (header == MAP_FAILED) {
+        return NULL;
+    }
+    if (header->magic != BUNDLE_CONTENTS_MAGIC || !header->mapped || header->len != len) {
+        munmap(header, size);
+        return NULL;
+    }
+    return header;
+}
+
+static bool write_fully(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+static struct bundle_contents_header *write_file(const struct bundle_entry *entry, const char *path) {
+    char tmp_path[PATH_MAX];
+    if (snprintf(tmp_path, PATH_MAX, "%s.XXXXXX", path) >= PATH_MAX) {
+        return NULL;
+    }
+
+    size_t size = sizeof(struct bundle_contents_header) + entry->len + 1;
+    struct bundle_contents_header *header = calloc(1, size);
+    header->magic = BUNDLE_CONTENTS_MAGIC;
+    header->mapped = 1;
+    header->len = entry->len;
+    if (bundle_decode(entry, (char *) (header + 1)) < 0) {
+        free(header);
+        return NULL;
+    }
+
+    int fd = mkstemp(tmp_path);
+    if (fd == -1) {
+        free(header);
+        return NULL;
+    }
+
+    bool written = fchmod(fd, 0644) == 0 && write_fully(fd, (const char *) header, size);
+    free(header);
+    if (!written || rename(tmp_path, path) == -1) {
+        close(fd);
+        unlink(tmp_path);
+        return NULL;
+    }
+
+    header = map_file(fd, entry->len);
+    close(fd);
+    return header;
+}
+
+struct bundle_contents_header *bundle_cache_map(const struct bundle_entry *entry) {
+    pthread_once(&cache_dir_once, init_cache_dir);
+    if (cache_dir == NULL) {
+        return NULL;
+    }
+
+    char path[PATH_MAX];
+    snprintf(path, PATH_MAX, "%s/%zu", cache_dir, (size_t) (entry - bundle_entries));
+
+    int fd = open(path, O_RDONLY);
+    if (fd != -1) {
+        struct bundle_contents_header *header = map_file(fd, entry->len);
+        close(fd);
+        if (header) {
+            return header;
+        }
+    }
+
+    return write_file(entry, path);
+}
@@ -0,0 +1,19 @@
+#include <stdint.h>
+
+struct bundle_entry;
+
+// Decoded bundled files are prefixed with this header, both in
+// PLANCK_BUNDLE_CACHE and in memory, so that they can be released without
+// knowing where they came from.
+struct bundle_contents_header {
+    uint32_t magic;
+    uint32_t mapped;
+    uint64_t len;
+};
+
+#define BUNDLE_CONTENTS_MAGIC 0x504c4243
+
+// Maps the decoded contents of a bundled file from PLANCK_BUNDLE_CACHE, first
+// decoding it into the cache if needed. Returns NULL if the cache isn't enabled
+// or can't be used.
+struct bundle_contents_header *bundle_cache_map(const struct bundle_entry *entry);
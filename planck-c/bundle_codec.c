@@ -0,0 +1,92 @@
+#include <stdio.h>
+#include <string.h>
+
+#ifdef HAVE_ZSTD
+#include <pthread.h>
+#include <zstd.h>
+#endif
+
+#ifdef HAVE_LZ4
+#include <lz4frame.h>
+#endif
+
+#include "bundle_codec.h"
+#include "bundle_index.h"
+#include "bundle_inflate.h"
+
+#ifdef HAVE_ZSTD
+static pthread_once_t zstd_ddict_once = PTHREAD_ONCE_INIT;
+static ZSTD_DDict *zstd_ddict = NULL;
+
+static void create_zstd_ddict() {
+    if (bundle_header.zstd_dict_len > 0) {
+        zstd_ddict = ZSTD_createDDict(bundle_header.zstd_dict, bundle_header.zstd_dict_len);
+    }
+}
+
+static int decode_zstd(const struct bundle_entry *entry, char *dest) {
+    pthread_once(&zstd_ddict_once, create_zstd_ddict);
+
+    ZSTD_DCtx *dctx = ZSTD_createDCtx();
+    if (dctx == NULL) {
+        return -1;
+    }
+    size_t n;
+    if (zstd_ddict) {
+        n = ZSTD_decompress_usingDDict(dctx, dest, entry->len, entry->data, entry->data_len, zstd_ddict);
+    } else {
+        n = ZSTD_decompressDCtx(dctx, dest, entry->len, entry->data, entry->data_len);
+    }
+    ZSTD_freeDCtx(dctx);
+
+    return ZSTD_isError(n) || n != entry->len ? -1 : 0;
+}
+#endif
+
+#ifdef HAVE_LZ4
+static int decode_lz4(const struct bundle_entry *entry, char *dest) {
+    LZ4F_dctx *dctx;
+    if (LZ4F_isError(LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION))) {
+        return -1;
+    }
+
+    size_t in_pos = 0;
+    size_t out_pos = 0;
+    size_t status = 1;
+    while (status != 0 && in_pos < entry->data_len) {
+        size_t in_size = entry->data_len - in_pos;
+        size_t out_size = entry->len - out_pos;
+        status = LZ4F_decompress(dctx, dest + out_pos, &out_size, entry->data + in_pos, &in_size, NULL);
+        if (LZ4F_isError(status) || (in_size == 0 && out_size == 0)) {
+            break;
+        }
+        in_pos += in_size;
+        out_pos += out_size;
+    }
+    LZ4F_freeDecompressionContext(dctx);
+
+    return status == 0 && out_pos == entry->len ? 0 : -1;
+}
+#endif
+
+int bundle_decode(const struct bundle_entry *entry, char *dest) {
+    switch (entry->codec) {
+        case BUNDLE_CODEC_STORED:
+            memcpy(dest, entry->data, entry->len);
+            return 0;
+        case BUNDLE_CODEC_GZIP:
+            return bundle_inflate(dest, (unsigned char *) entry->data, entry->data_len, entry->len);
+#ifdef HAVE_ZSTD
+        case BUNDLE_CODEC_ZSTD:
+            return decode_zstd(entry, dest);
+#endif
+#ifdef HAVE_LZ4
+        case BUNDLE_CODEC_LZ4:
+            return decode_lz4(entry, dest);
+#endif
+        default:
+            fprintf(stderr, "WARN: %s is bundled with codec %u, which this build doesn't support\n",
+                    entry->path, entry->codec);
+            return -1;
+    }
+}
@@ -0,0 +1,5 @@
+struct bundle_entry;
+
+// Decodes a bundled file into dest, which must hold entry->len bytes.
+// Returns 0 on success.
+int bundle_decode(const struct bundle_entry *entry, char *dest);
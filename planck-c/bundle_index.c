@@ -0,0 +1,258 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "bundle.h"
+#include "bundle_cache.h"
+#include "bundle_codec.h"
+#include "bundle_index.h"
+
+const struct bundle_entry *bundle_lookup(const char *path) {
+    if (path == NULL || bundle_header.count == 0) {
+        return NULL;
+    }
+
+    uint32_t hash = bundle_hash(path, bundle_header.seed);
+    uint32_t displacement = bundle_displacements[hash % bundle_header.num_buckets];
+    const struct bundle_entry *entry = &bundle_entries[bundle_slot(hash, displacement, bundle_header.count)];
+
+    if (entry->hash == hash && strcmp(entry->path, path) == 0) {
+        return entry;
+    }
+    return NULL;
+}
+
+static const struct bundle_entry *lookup_contents(const char *path) {
+    if (bundle_header.count == 0) {
+        fprintf(stderr, "WARN: no bundled sources, need to run script/bundle-c\n");
+        return NULL;
+    }
+    return bundle_lookup(path);
+}
+
+static void unmap_contents(struct bundle_contents_header *header) {
+    munmap(header, sizeof(struct bundle_contents_header) + header->len + 1);
+}
+
+static struct bundle_contents_header *alloc_contents(size_t len) {
+    struct bundle_contents_header *header = malloc(sizeof(struct bundle_contents_header) + len + 1);
+    header->magic = BUNDLE_CONTENTS_MAGIC;
+    header->mapped = 0;
+    header->len = len;
+    ((char *) (header + 1))[len] = '\0';
+    return header;
+}
+
+// Returns the decoded contents of an entry, mapped from PLANCK_BUNDLE_CACHE
+// if it is enabled
+static struct bundle_contents_header *decode_contents(const struct bundle_entry *entry) {
+    struct bundle_contents_header *header = bundle_cache_map(entry);
+    if (header == NULL) {
+        header = alloc_contents(entry->len);
+        if (bundle_decode(entry, (char *) (header + 1)) < 0) {
+            free(header);
+            return NULL;
+        }
+    }
+    return header;
+}
+
+// Converts the contents of an entry stored as UTF-16LE to UTF-8
+static struct bundle_contents_header *utf16le_to_utf8(struct bundle_contents_header *utf16) {
+    const unsigned char *src = (const unsigned char *) (utf16 + 1);
+    size_t len = utf16->len / 2;
+    struct bundle_contents_header *header = alloc_contents(len * 3);
+    unsigned char *dest = (unsigned char *) (header + 1);
+    size_t i;
+    for (i = 0; i < len; i++) {
+        uint32_t c = src[2 * i] | src[2 * i + 1] << 8;
+        if (c >= 0xd800 && c < 0xdc00 && i + 1 < len) {
+            uint32_t low = src[2 * i + 2] | src[2 * i + 3] << 8;
+            if (low >= 0xdc00 && low < 0xe000) {
+                c = 0x10000 + ((c - 0xd800) << 10) + (low - 0xdc00);
+                i++;
+            }
+        }
+        if (c < 0x80) {
+            *dest++ = c;
+        } else if (c < 0x800) {
+            *dest++ = 0xc0 | c >> 6;
+            *dest++ = 0x80 | (c & 0x3f);
+        } else if (c < 0x10000) {
+            *dest++ = 0xe0 | c >> 12;
+            *dest++ = 0x80 | (c >> 6 & 0x3f);
+            *dest++ = 0x80 | (c & 0x3f);
+        } else {
+            *dest++ = 0xf0 | c >> 18;
+            *dest++ = 0x80 | (c >> 12 & 0x3f);
+            *dest++ = 0x80 | (c >> 6 & 0x3f);
+            *dest++ = 0x80 | (c & 0x3f);
+        }
+    }
+    *dest = '\0';
+    header->len = dest - (unsigned char *) (header + 1);
+    bundle_release_contents(utf16 + 1);
+    return header;
+}
+
+char *bundle_get_contents(char *path) {
+    const struct bundle_entry *entry = lookup_contents(path);
+    if (entry == NULL) {
+        return NULL;
+    }
+
+    if (entry->encoding == BUNDLE_ENCODING_UTF16LE) {
+        struct bundle_contents_header *header = decode_contents(entry);
+        if (header == NULL) {
+            return NULL;
+        }
+        header = utf16le_to_utf8(header);
+        char *contents = strdup((char *) (header + 1));
+        free(header);
+        return contents;
+    }
+
+    char *contents = malloc((entry->len + 1) * sizeof(char));
+    contents[entry->len] = '\0';
+
+    struct bundle_contents_header *header = bundle_cache_map(entry);
+    if (header) {
+        memcpy(contents, header + 1, entry->len);
+        unmap_contents(header);
+    } else if (bundle_decode(entry, contents) < 0) {
+        free(contents);
+        return NULL;
+    }
+
+    return contents;
+}
+
+const char *bundle_map_contents(const char *path) {
+    const struct bundle_entry *entry = lookup_contents(path);
+    if (entry == NULL) {
+        return NULL;
+    }
+
+    struct bundle_contents_header *header = decode_contents(entry);
+    if (header && entry->encoding == BUNDLE_ENCODING_UTF16LE) {
+        header = utf16le_to_utf8(header);
+    }
+
+    return header ? (const char *) (header + 1) : NULL;
+}
+
+const uint16_t *bundle_map_characters(const char *path, size_t *length) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    const struct bundle_entry *entry = bundle_lookup(path);
+    if (entry == NULL || entry->encoding != BUNDLE_ENCODING_UTF16LE) {
+        return NULL;
+    }
+
+    struct bundle_contents_header *header = decode_contents(entry);
+    if (header == NULL) {
+        return NULL;
+    }
+
+    *length = entry->len / 2;
+    return (const uint16_t *) (header + 1);
+#else
+    return NULL;
+#endif
+}
+
+void bundle_release_contents(const void *contents) {
+    if (contents == NULL) {
+        return;
+    }
+
+    struct bundle_contents_header *header = (struct bundle_contents_header *) contents - 1;
+    assert(header->magic == BUNDLE_CONTENTS_MAGIC);
+    if (header->mapped) {
+        unmap_contents(header);
+    } else {
+        free(header);
+    }
+}
+
+const char *bundle_get_cljs_version() {
+    return bundle_header.cljs_version;
+}
+
+size_t bundle_get_count() {
+    return bundle_header.count;
+}
+
+const char *bundle_get_path(size_t index) {
+    return index < bundle_header.count ? bundle_entries[index].path : NULL;
+}
+
+#ifdef BUNDLE_TEST
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        printf("%s <path>\n", argv[0]);
+        exit(1);
+    }
+
+    const char *contents = bundle_map_contents(argv[1]);
+    if (contents == NULL) {
+        printf("not in bundle\n");
+        exit(1);
+    }
+
+    printf("%s", contents);
+    bundle_release_contents(contents);
+
+    return 0;
+}
+#endif
+
+#ifdef BUNDLE_BENCH
+#include <time.h>
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Finds a path the way the generated strcmp chain used to, for comparison
+static const struct bundle_entry *linear_lookup(const char *path) {
+    uint32_t i;
+    for (i = 0; i < bundle_header.count; i++) {
+        if (strcmp(bundle_entries[i].path, path) == 0) {
+            return &bundle_entries[i];
+        }
+    }
+    return NULL;
+}
+
+static void bench(const char *label, const struct bundle_entry *(*lookup)(const char *), long iterations) {
+    size_t count = bundle_get_count();
+    size_t found = 0;
+    double start = now();
+    long i;
+    for (i = 0; i < iterations; i++) {
+        // Alternate between hits and misses
+        const char *path = bundle_get_path(i % count);
+        if (lookup(i & 1 ? path + 1 : path)) {
+            found++;
+        }
+    }
+    double elapsed = now() - start;
+    printf("%-14s %12.0f lookups/s (%zu found)\n", label, iterations / elapsed, found);
+}
+
+int main(int argc, char **argv) {
+    long iterations = argc > 1 ? atol(argv[1]) : 1000000;
+    if (bundle_get_count() == 0) {
+        printf("no bundled sources, need to run script/bundle-c\n");
+        return 1;
+    }
+    printf("%zu bundled files, ClojureScript %s\n", bundle_get_count(), bundle_get_cljs_version());
+    bench("perfect hash", bundle_lookup, iterations);
+    bench("strcmp chain", linear_lookup, iterations / 100);
+    return 0;
+}
+#endif
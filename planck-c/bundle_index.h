@@ -0,0 +1,70 @@
+#include <stdint.h>
+
+// Bundled files are indexed by a minimal perfect hash, built by
+// bundle_index_gen when script/bundle runs: a path's hash selects a bucket,
+// and the bucket's displacement selects the path's slot in bundle_entries.
+
+#define BUNDLE_FORMAT_VERSION 4
+
+// How each bundled file is compressed, chosen per file by script/bundle
+#define BUNDLE_CODEC_STORED 0
+#define BUNDLE_CODEC_GZIP 1
+#define BUNDLE_CODEC_ZSTD 2
+#define BUNDLE_CODEC_LZ4 3
+
+// Files read at startup are transcoded to UTF-16LE by script/bundle, so that
+// they can be handed to JavaScriptCore without transcoding at runtime
+#define BUNDLE_ENCODING_UTF8 0
+#define BUNDLE_ENCODING_UTF16LE 1
+
+struct bundle_header {
+    uint32_t format_version;
+    uint32_t count;
+    uint32_t num_buckets;
+    uint32_t seed;
+    const char *cljs_version;
+    // Hash of the bundled data, identifying this bundle in PLANCK_BUNDLE_CACHE
+    const char *id;
+    // Dictionary trained on the bundled files, used by BUNDLE_CODEC_ZSTD
+    const unsigned char *zstd_dict;
+    uint32_t zstd_dict_len;
+};
+
+struct bundle_entry {
+    const char *path;
+    uint32_t hash;
+    const unsigned char *data;
+    uint32_t data_len;
+    uint32_t len;
+    int64_t mtime;
+    uint32_t codec;
+    uint32_t encoding;
+};
+
+extern const struct bundle_header bundle_header;
+extern const uint32_t bundle_displacements[];
+extern const struct bundle_entry bundle_entries[];
+
+static inline uint32_t bundle_hash(const char *path, uint32_t seed) {
+    uint32_t h = 2166136261u ^ seed;
+    for (; *path; path++) {
+        h ^= (unsigned char) *path;
+        h *= 16777619u;
+    }
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
+
+static inline uint32_t bundle_slot(uint32_t hash, uint32_t displacement, uint32_t count) {
+    uint32_t h = hash ^ (displacement * 0x9e3779b9u);
+    h ^= h >> 15;
+    h *= 0x2c1b3c6du;
+    h ^= h >> 12;
+    h *= 0x297a2d39u;
+    h ^= h >> 15;
+    return h % count;
+}
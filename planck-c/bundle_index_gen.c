@@ -0,0 +1,242 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bundle_index.h"
+
+// Run by script/bundle to emit the index of bundled files. Reads the
+// ClojureScript version and a hash identifying the bundle, separated by a tab,
+// on the first line, followed by a line per file:
+//
+//   path <tab> data symbol <tab> compressed size <tab> size <tab> mtime <tab> codec <tab> encoding
+//
+// and writes bundle_header, bundle_displacements and bundle_entries, with each
+// entry placed in the slot its path hashes to. If zstd is used, the symbol and
+// size of its dictionary are passed as arguments.
+
+#define MAX_DISPLACEMENT 100000000u
+
+struct input {
+    char *path;
+    char *data_ref;
+    unsigned long data_len;
+    unsigned long len;
+    long long mtime;
+    const char *codec;
+    const char *encoding;
+    uint32_t hash;
+};
+
+struct bucket {
+    uint32_t index;
+    uint32_t size;
+    uint32_t *members;
+};
+
+static int compare_bucket_size(const void *a, const void *b) {
+    const struct bucket *x = a;
+    const struct bucket *y = b;
+    if (x->size != y->size) {
+        return x->size < y->size ? 1 : -1;
+    }
+    return x->index < y->index ? -1 : x->index > y->index;
+}
+
+static const char *codec_name(const char *codec) {
+    if (strcmp(codec, "stored") == 0) {
+        return "BUNDLE_CODEC_STORED";
+    } else if (strcmp(codec, "gzip") == 0) {
+        return "BUNDLE_CODEC_GZIP";
+    } else if (strcmp(codec, "zstd") == 0) {
+        return "BUNDLE_CODEC_ZSTD";
+    } else if (strcmp(codec, "lz4") == 0) {
+        return "BUNDLE_CODEC_LZ4";
+    }
+    return NULL;
+}
+
+static const char *encoding_name(const char *encoding) {
+    if (strcmp(encoding, "utf8") == 0) {
+        return "BUNDLE_ENCODING_UTF8";
+    } else if (strcmp(encoding, "utf16le") == 0) {
+        return "BUNDLE_ENCODING_UTF16LE";
+    }
+    return NULL;
+}
+
+static char *chomp(char *s) {
+    size_t len = strlen(s);
+    while (len > 0 && (s[len - 1] == '\n' || s[len - 1] == '\r')) {
+        s[--len] = '\0';
+    }
+    return s;
+}
+
+static void print_c_string(const char *s) {
+    putchar('"');
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') {
+            putchar('\\');
+        }
+        putchar(*s);
+    }
+    putchar('"');
+}
+
+// Attempts to place every bucket, returning false if two paths can't be
+// separated with this seed.
+static bool build(struct input *inputs, uint32_t count, uint32_t num_buckets, uint32_t seed,
+                  uint32_t *displacements, int32_t *slots) {
+    struct bucket *buckets = calloc(num_buckets, sizeof(struct bucket));
+    uint32_t i, j;
+    for (i = 0; i < num_buckets; i++) {
+        buckets[i].index = i;
+        buckets[i].members = malloc(count * sizeof(uint32_t));
+    }
+    for (i = 0; i < count; i++) {
+        inputs[i].hash = bundle_hash(inputs[i].path, seed);
+        struct bucket *bucket = &buckets[inputs[i].hash % num_buckets];
+        bucket->members[bucket->size++] = i;
+    }
+    qsort(buckets, num_buckets, sizeof(struct bucket), compare_bucket_size);
+
+    for (i = 0; i < count; i++) {
+        slots[i] = -1;
+    }
+    memset(displacements, 0, num_buckets * sizeof(uint32_t));
+
+    uint32_t *candidate = malloc(count * sizeof(uint32_t));
+    bool ok = true;
+    for (i = 0; i < num_buckets && buckets[i].size > 0 && ok; i++) {
+        struct bucket *bucket = &buckets[i];
+        uint32_t d;
+        for (d = 0; d < MAX_DISPLACEMENT; d++) {
+            bool placed = true;
+            for (j = 0; j < bucket->size && placed; j++) {
+                candidate[j] = bundle_slot(inputs[bucket->members[j]].hash, d, count);
+                if (slots[candidate[j]] != -1) {
+                    placed = false;
+                }
+                uint32_t k;
+                for (k = 0; k < j && placed; k++) {
+                    if (candidate[k] == candidate[j]) {
+                        placed = false;
+                    }
+                }
+            }
+            if (placed) {
+                for (j = 0; j < bucket->size; j++) {
+                    slots[candidate[j]] = (int32_t) bucket->members[j];
+                }
+                displacements[bucket->index] = d;
+                break;
+            }
+        }
+        if (d == MAX_DISPLACEMENT) {
+            ok = false;
+        }
+    }
+
+    free(candidate);
+    for (i = 0; i < num_buckets; i++) {
+        free(buckets[i].members);
+    }
+    free(buckets);
+    return ok;
+}
+
+int main(int argc, char **argv) {
+    if (argc != 1 && argc != 3) {
+        fprintf(stderr, "Usage: %s [zstd dictionary symbol] [zstd dictionary size]\n", argv[0]);
+        return 1;
+    }
+
+    char line[8192];
+    char *cljs_version = fgets(line, sizeof(line), stdin) ? strtok(chomp(line), "\t") : NULL;
+    char *id = cljs_version ? strtok(NULL, "\t") : NULL;
+    if (!cljs_version || !id) {
+        fprintf(stderr, "bundle_index_gen: missing ClojureScript version or bundle hash\n");
+        return 1;
+    }
+    cljs_version = strdup(cljs_version);
+    id = strdup(id);
+
+    uint32_t count = 0;
+    uint32_t capacity = 1024;
+    struct input *inputs = malloc(capacity * sizeof(struct input));
+    while (fgets(line, sizeof(line), stdin)) {
+        chomp(line);
+        char *path = strtok(line, "\t");
+        char *data_ref = strtok(NULL, "\t");
+        char *data_len = strtok(NULL, "\t");
+        char *len = strtok(NULL, "\t");
+        char *mtime = strtok(NULL, "\t");
+        char *codec = strtok(NULL, "\t");
+        char *encoding = strtok(NULL, "\t");
+        if (!path || !data_ref || !data_len || !len || !mtime || !codec || !codec_name(codec)
+            || !encoding || !encoding_name(encoding)) {
+            fprintf(stderr, "bundle_index_gen: malformed line: %s\n", line);
+            return 1;
+        }
+        if (count == capacity) {
+            capacity *= 2;
+            inputs = realloc(inputs, capacity * sizeof(struct input));
+        }
+        inputs[count].path = strdup(path);
+        inputs[count].data_ref = strdup(data_ref);
+        inputs[count].data_len = strtoul(data_len, NULL, 10);
+        inputs[count].len = strtoul(len, NULL, 10);
+        inputs[count].mtime = strtoll(mtime, NULL, 10);
+        inputs[count].codec = codec_name(codec);
+        inputs[count].encoding = encoding_name(encoding);
+        count++;
+    }
+
+    if (count == 0) {
+        fprintf(stderr, "bundle_index_gen: no files\n");
+        return 1;
+    }
+
+    uint32_t num_buckets = count / 4 + 1;
+    uint32_t *displacements = malloc(num_buckets * sizeof(uint32_t));
+    int32_t *slots = malloc(count * sizeof(int32_t));
+    uint32_t seed = 0;
+    while (!build(inputs, count, num_buckets, seed, displacements, slots)) {
+        seed++;
+    }
+
+    printf("#include \"bundle_index.h\"\n\n");
+    printf("const struct bundle_header bundle_header = {\n");
+    printf("\tBUNDLE_FORMAT_VERSION, %u, %u, %u, ", count, num_buckets, seed);
+    print_c_string(cljs_version);
+    printf(", ");
+    print_c_string(id);
+    if (argc == 3) {
+        printf(",\n\t%s, %lu", argv[1], strtoul(argv[2], NULL, 10));
+    }
+    printf("\n};\n\n");
+
+    uint32_t i;
+    printf("const uint32_t bundle_displacements[] = {");
+    for (i = 0; i < num_buckets; i++) {
+        printf("%s%u", i % 12 == 0 ? "\n\t" : " ", displacements[i]);
+        if (i + 1 < num_buckets) {
+            putchar(',');
+        }
+    }
+    printf("\n};\n\n");
+
+    printf("const struct bundle_entry bundle_entries[] = {\n");
+    for (i = 0; i < count; i++) {
+        struct input *input = &inputs[slots[i]];
+        printf("\t{");
+        print_c_string(input->path);
+        printf(", 0x%08xu, %s, %lu, %lu, %lld, %s, %s},\n",
+               input->hash, input->data_ref, input->data_len, input->len, input->mtime, input->codec,
+               input->encoding);
+    }
+    printf("};\n");
+
+    return 0;
+}
@@ -0,0 +1,92 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bundle.h"
+#include "bundle_string.h"
+#include "str.h"
+
+#ifdef HAVE_JSC_STRING_NO_COPY
+// Not in the public headers, but exported by JavaScriptCore
+JSStringRef JSStringCreateWithCharactersNoCopy(const JSChar *chars, size_t numChars);
+#endif
+
+#ifdef HAVE_JSC_STRING_NO_COPY
+// Scripts handed to JavaScriptCore without copying are decoded once per
+// process and shared by every context, as prelink.c does for its blob
+struct shared_characters {
+    char *path;
+    const uint16_t *characters;
+    size_t length;
+    struct shared_characters *next;
+};
+
+static pthread_mutex_t shared_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct shared_characters *shared = NULL;
+
+static const uint16_t *map_shared_characters(const char *path, size_t *length) {
+    pthread_mutex_lock(&shared_lock);
+    struct shared_characters *entry;
+    for (entry = shared; entry; entry = entry->next) {
+        if (strcmp(entry->path, path) == 0) {
+            break;
+        }
+    }
+    if (entry == NULL) {
+        size_t len = 0;
+        const uint16_t *characters = bundle_map_characters(path, &len);
+        if (characters) {
+            entry = malloc(sizeof(struct shared_characters));
+            entry->path = strdup(path);
+            entry->characters = characters;
+            entry->length = len;
+            entry->next = shared;
+            shared = entry;
+        }
+    }
+    pthread_mutex_unlock(&shared_lock);
+
+    if (entry == NULL) {
+        return NULL;
+    }
+    *length = entry->length;
+    return entry->characters;
+}
+#endif
+
+JSStringRef bundle_string_create(const char *path) {
+    size_t length = 0;
+#ifdef HAVE_JSC_STRING_NO_COPY
+    // Only scripts are worth keeping, as anything else, like the analysis
+    // caches, is parsed once and dropped
+    if (str_has_suffix(path, ".js") == 0) {
+        const uint16_t *characters = map_shared_characters(path, &length);
+        if (characters) {
+            return bundle_string_create_with_characters(characters, length);
+        }
+    }
+#endif
+
+    const uint16_t *characters = bundle_map_characters(path, &length);
+    if (characters) {
+        JSStringRef string = JSStringCreateWithCharacters(characters, length);
+        bundle_release_contents(characters);
+        return string;
+    }
+
+    const char *utf8 = bundle_map_contents(path);
+    if (utf8 == NULL) {
+        return NULL;
+    }
+    JSStringRef string = JSStringCreateWithUTF8CString(utf8);
+    bundle_release_contents(utf8);
+    return string;
+}
+
+JSStringRef bundle_string_create_with_characters(const uint16_t *characters, size_t length) {
+#ifdef HAVE_JSC_STRING_NO_COPY
+    return JSStringCreateWithCharactersNoCopy(characters, length);
+#else
+    return JSStringCreateWithCharacters(characters, length);
+#endif
+}
@@ -0,0 +1,11 @@
+#include <JavaScriptCore/JavaScript.h>
+
+// Creates a JavaScript string holding a bundled file, or returns NULL if it
+// isn't bundled. Scripts bundled as UTF-16 may be referred to without copying,
+// in which case their characters are decoded once and kept for the life of the
+// process, as JavaScriptCore refers to them for as long as anything derived
+// from the string, such as the source of a lazily compiled function, lives.
+JSStringRef bundle_string_create(const char *path);
+
+// Creates a JavaScript string from characters that must outlive it
+JSStringRef bundle_string_create_with_characters(const uint16_t *characters, size_t length);
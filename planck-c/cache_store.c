@@ -0,0 +1,581 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <zlib.h>
+
+#include "cache_store.h"
+#include "globals.h"
+#include "str.h"
+
+#define STORE_DIR "store"
+#define TMP_PREFIX ".tmp-"
+
+#define ENTRY_MAGIC 0x504c4345
+#define ENTRY_VERSION 1
+
+// Keys are a 64-bit FNV-1a hash followed by a CRC-32, in hex
+#define KEY_LENGTH 24
+
+#define DEFAULT_MAX_SIZE_MB 512
+
+// Payloads larger than this, in bytes, aren't stored, and entries claiming
+// them are corrupt
+#define MAX_PAYLOAD_LENGTH (256 * 1024 * 1024)
+
+// Payloads smaller than this aren't worth compressing
+#define COMPRESS_MIN_LENGTH 1024
+
+// Reading an entry marks it as recently used at most this often, in seconds
+#define TOUCH_INTERVAL 3600
+
+// Temporary files older than this, in seconds, were left by processes that
+// died while writing them
+#define ABANDONED_AGE 3600
+
+// Classpath manifests unused for this long, in seconds, are removed
+#define STALE_MANIFEST_AGE (30 * 24 * 3600)
+
+#define NUM_PAYLOADS 3
+
+enum payload_method {
+    PAYLOAD_ABSENT,
+    PAYLOAD_STORED,
+    PAYLOAD_DEFLATED
+};
+
+struct entry_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t build_info_len;
+    struct {
+        uint32_t method;
+        uint32_t len;
+        uint32_t stored_len;
+    } payloads[NUM_PAYLOADS];
+};
+
+static bool wrote_entries = false;
+
+static uint64_t fnv1a(uint64_t hash, const void *data, size_t len) {
+    const uint8_t *p = data;
+    size_t i;
+    for (i = 0; i < len; i++) {
+        hash ^= p[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+static void hash_field(uint64_t *hash, uLong *crc, const char *field) {
+    if (field == NULL) {
+        field = "-";
+    }
+    size_t len = strlen(field) + 1;
+    *hash = fnv1a(*hash, field, len);
+    *crc = crc32(*crc, (const Bytef *) field, (uInt) len);
+}
+
+char *cache_store_key(const char *name, JSStringRef source) {
+    uint64_t hash = 14695981039346656037ull;
+    uLong crc = crc32(0L, Z_NULL, 0);
+
+    // A .cljc source may be compiled both as a namespace and as macros
+    hash_field(&hash, &crc, name);
+    hash_field(&hash, &crc, config.clojurescript_version);
+    hash_field(&hash, &crc, config.checked_arrays);
+    hash_field(&hash, &crc, config.static_fns ? "static-fns" : NULL);
+    hash_field(&hash, &crc, config.fn_invoke_direct ? "fn-invoke-direct" : NULL);
+    hash_field(&hash, &crc, config.elide_asserts ? "elide-asserts" : NULL);
+    hash_field(&hash, &crc, config.optimizations);
+    size_t i;
+    for (i = 0; i < config.num_compile_opts; i++) {
+        hash_field(&hash, &crc, config.compile_opts[i]);
+    }
+
+    const JSChar *chars = JSStringGetCharactersPtr(source);
+    size_t len = JSStringGetLength(source) * sizeof(JSChar);
+    hash = fnv1a(hash, chars, len);
+    crc = crc32(crc, (const Bytef *) chars, (uInt) len);
+
+    char *key = malloc(KEY_LENGTH + 1);
+    snprintf(key, KEY_LENGTH + 1, "%016llx%08lx", (unsigned long long) hash, (unsigned long) crc & 0xffffffff);
+    return key;
+}
+
+static bool valid_key(const char *key) {
+    if (strlen(key) != KEY_LENGTH) {
+        return false;
+    }
+    for (; *key; key++) {
+        if (!((*key >= '0' && *key <= '9') || (*key >= 'a' && *key <= 'f'))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool entry_path(char *path, const char *key) {
+    return config.cache_path != NULL && valid_key(key) &&
+           snprintf(path, PATH_MAX, "%s/%s/%s", config.cache_path, STORE_DIR, key) < PATH_MAX;
+}
+
+static bool read_fully(int fd, char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = read(fd, buf, len);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool write_fully(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+// Checks that a payload's lengths agree with its method, before any of it is read
+static bool valid_payload(const struct entry_header *header, int i) {
+    uint32_t len = header->payloads[i].len;
+    uint32_t stored_len = header->payloads[i].stored_len;
+    switch (header->payloads[i].method) {
+        case PAYLOAD_ABSENT:
+            return len == 0 && stored_len == 0;
+        case PAYLOAD_STORED:
+            return len <= MAX_PAYLOAD_LENGTH && stored_len == len;
+        case PAYLOAD_DEFLATED:
+            // Payloads are only deflated when that makes them smaller
+            return len <= MAX_PAYLOAD_LENGTH && stored_len < len;
+        default:
+            return false;
+    }
+}
+
+// Reads a payload validated by valid_payload into a string, returning false
+// if it is corrupt
+static bool read_payload(int fd, const struct entry_header *header, int i, JSStringRef *payload) {
+    size_t len = header->payloads[i].len;
+    size_t stored_len = header->payloads[i].stored_len;
+    if (header->payloads[i].method == PAYLOAD_ABSENT) {
+        *payload = NULL;
+        return true;
+    }
+
+    char *contents = malloc(len + 1);
+    if (contents == NULL) {
+        return false;
+    }
+    if (header->payloads[i].method == PAYLOAD_STORED) {
+        if (!read_fully(fd, contents, len)) {
+            free(contents);
+            return false;
+        }
+    } else {
+        char *data = malloc(stored_len);
+        uLongf dest_len = len;
+        bool inflated = data != NULL && read_fully(fd, data, stored_len) &&
+                        uncompress((Bytef *) contents, &dest_len, (const Bytef *) data, stored_len) == Z_OK &&
+                        dest_len == len;
+        free(data);
+        if (!inflated) {
+            free(contents);
+            return false;
+        }
+    }
+    contents[len] = '\0';
+    *payload = JSStringCreateWithUTF8CString(contents);
+    free(contents);
+    return true;
+}
+
+bool cache_store_read(const char *key, const char *build_info, bool source_map, cache_entry_t *entry) {
+    char path[PATH_MAX];
+    if (!entry_path(path, key)) {
+        return false;
+    }
+
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return false;
+    }
+
+    // The header and build info are checked before any payload is read, so
+    // entries compiled differently cost a single small read
+    struct stat st;
+    struct entry_header header;
+    if (fstat(fd, &st) == -1 || st.st_size < (off_t) sizeof(header) || !read_fully(fd, (char *) &header, sizeof(header))) {
+        close(fd);
+        return false;
+    }
+
+    // The lengths are 32-bit, so their sum can't overflow
+    uint64_t size = sizeof(header) + (uint64_t) header.build_info_len;
+    bool valid = true;
+    int i;
+    for (i = 0; i < NUM_PAYLOADS; i++) {
+        valid = valid && valid_payload(&header, i);
+        size += header.payloads[i].stored_len;
+    }
+    if (!valid || header.magic != ENTRY_MAGIC || header.version != ENTRY_VERSION || size != (uint64_t) st.st_size ||
+        header.payloads[0].method == PAYLOAD_ABSENT ||
+        (build_info != NULL && header.build_info_len != strlen(build_info))) {
+        close(fd);
+        return false;
+    }
+
+    memset(entry, 0, sizeof(cache_entry_t));
+    entry->build_info = malloc(header.build_info_len + 1);
+    if (!read_fully(fd, entry->build_info, header.build_info_len)) {
+        goto err;
+    }
+    entry->build_info[header.build_info_len] = '\0';
+    if (build_info != NULL && strcmp(entry->build_info, build_info) != 0) {
+        goto err;
+    }
+
+    // The source map is the last payload, so it is skipped by not reading it
+    JSStringRef *payloads[NUM_PAYLOADS] = {&entry->js, &entry->analysis_cache, &entry->source_map};
+    for (i = 0; i < (source_map ? NUM_PAYLOADS : NUM_PAYLOADS - 1); i++) {
+        if (!read_payload(fd, &header, i, payloads[i])) {
+            goto err;
+        }
+    }
+
+    // The modification time of an entry records when it was last used
+    if (time(NULL) - st.st_mtime > TOUCH_INTERVAL) {
+        futimens(fd, NULL);
+    }
+    close(fd);
+    return true;
+
+    err:
+    free_cache_entry(entry);
+    close(fd);
+    return false;
+}
+
+static bool compress_enabled() {
+    const char *value = getenv("PLANCK_CACHE_COMPRESS");
+    return value == NULL || strcmp(value, "0") != 0;
+}
+
+// Encodes a payload, returning the bytes to write, which may be the payload
+// itself, or NULL if it is absent
+static const char *encode_payload(struct entry_header *header, int i, const char *payload, bool compress) {
+    if (payload == NULL) {
+        header->payloads[i].method = PAYLOAD_ABSENT;
+        header->payloads[i].len = 0;
+        header->payloads[i].stored_len = 0;
+        return NULL;
+    }
+
+    size_t len = strlen(payload);
+    header->payloads[i].method = PAYLOAD_STORED;
+    header->payloads[i].len = (uint32_t) len;
+    header->payloads[i].stored_len = (uint32_t) len;
+    if (!compress || len < COMPRESS_MIN_LENGTH) {
+        return payload;
+    }
+
+    uLongf compressed_len = compressBound(len);
+    Bytef *compressed = malloc(compressed_len);
+    if (compress2(compressed, &compressed_len, (const Bytef *) payload, len, Z_BEST_SPEED) != Z_OK ||
+        compressed_len >= len) {
+        free(compressed);
+        return payload;
+    }
+    header->payloads[i].method = PAYLOAD_DEFLATED;
+    header->payloads[i].stored_len = (uint32_t) compressed_len;
+    return (const char *) compressed;
+}
+
+bool cache_store_write(const char *key, const char *build_info, const char *js,
+                       const char *analysis_cache, const char *source_map) {
+    char path[PATH_MAX];
+    char tmp_path[PATH_MAX];
+    if (!entry_path(path, key) ||
+        snprintf(tmp_path, PATH_MAX, "%s/%s/" TMP_PREFIX "XXXXXX", config.cache_path, STORE_DIR) >= PATH_MAX) {
+        return false;
+    }
+
+    const char *payloads[NUM_PAYLOADS] = {js, analysis_cache, source_map};
+    int i;
+    for (i = 0; i < NUM_PAYLOADS; i++) {
+        if (payloads[i] != NULL && strlen(payloads[i]) > MAX_PAYLOAD_LENGTH) {
+            return false;
+        }
+    }
+
+    char store_path[PATH_MAX];
+    snprintf(store_path, PATH_MAX, "%s/%s", config.cache_path, STORE_DIR);
+    if (mkdir(store_path, 0755) == -1 && errno != EEXIST) {
+        return false;
+    }
+
+    // Analysis caches and source maps are JSON, which compresses well, while
+    // JavaScript is stored as is
+    bool compress = compress_enabled();
+    struct entry_header header;
+    memset(&header, 0, sizeof(header));
+    header.magic = ENTRY_MAGIC;
+    header.version = ENTRY_VERSION;
+    header.build_info_len = (uint32_t) strlen(build_info);
+    const char *encoded[NUM_PAYLOADS];
+    for (i = 0; i < NUM_PAYLOADS; i++) {
+        encoded[i] = encode_payload(&header, i, payloads[i], compress && i > 0);
+    }
+
+    bool written = false;
+    int fd = mkstemp(tmp_path);
+    if (fd != -1) {
+        written = fchmod(fd, 0644) == 0 &&
+                  write_fully(fd, (const char *) &header, sizeof(header)) &&
+                  write_fully(fd, build_info, header.build_info_len);
+        for (i = 0; i < NUM_PAYLOADS && written; i++) {
+            written = encoded[i] == NULL || write_fully(fd, encoded[i], header.payloads[i].stored_len);
+        }
+        written = close(fd) == 0 && written && rename(tmp_path, path) == 0;
+        if (!written) {
+            unlink(tmp_path);
+        }
+    }
+
+    for (i = 0; i < NUM_PAYLOADS; i++) {
+        if (encoded[i] != payloads[i]) {
+            free((void *) encoded[i]);
+        }
+    }
+
+    wrote_entries = wrote_entries || written;
+    return written;
+}
+
+void free_cache_entry(cache_entry_t *entry) {
+    free(entry->build_info);
+    if (entry->js) {
+        JSStringRelease(entry->js);
+    }
+    if (entry->analysis_cache) {
+        JSStringRelease(entry->analysis_cache);
+    }
+    if (entry->source_map) {
+        JSStringRelease(entry->source_map);
+    }
+}
+
+static off_t max_size() {
+    const char *value = getenv("PLANCK_CACHE_MAX_SIZE");
+    long mb = value ? strtol(value, NULL, 10) : DEFAULT_MAX_SIZE_MB;
+    if (mb <= 0) {
+        mb = DEFAULT_MAX_SIZE_MB;
+    }
+    return (off_t) mb * 1024 * 1024;
+}
+
+struct stored_entry {
+    char *name;
+    off_t size;
+    time_t mtime;
+};
+
+struct gc_stats {
+    size_t kept;
+    off_t kept_size;
+    size_t evicted;
+    off_t evicted_size;
+    size_t removed;
+    off_t removed_size;
+};
+
+static int compare_mtime(const void *a, const void *b) {
+    const struct stored_entry *x = a;
+    const struct stored_entry *y = b;
+    return (x->mtime > y->mtime) - (x->mtime < y->mtime);
+}
+
+static bool remove_file(const char *dir, const char *name) {
+    char path[PATH_MAX];
+    return snprintf(path, PATH_MAX, "%s/%s", dir, name) < PATH_MAX && (unlink(path) == 0 || errno == ENOENT);
+}
+
+// Removes abandoned temporary files, and the least recently used entries
+// while the store is larger than max_size
+static bool collect_store(off_t max_size, struct gc_stats *stats) {
+    char store_path[PATH_MAX];
+    snprintf(store_path, PATH_MAX, "%s/%s", config.cache_path, STORE_DIR);
+    DIR *dir = opendir(store_path);
+    if (dir == NULL) {
+        return errno == ENOENT;
+    }
+
+    size_t count = 0;
+    size_t capacity = 256;
+    struct stored_entry *entries = malloc(capacity * sizeof(struct stored_entry));
+    off_t total_size = 0;
+    time_t now = time(NULL);
+    struct dirent *dirent;
+    while ((dirent = readdir(dir)) != NULL) {
+        char path[PATH_MAX];
+        struct stat st;
+        if (snprintf(path, PATH_MAX, "%s/%s", store_path, dirent->d_name) >= PATH_MAX ||
+            lstat(path, &st) == -1 || !S_ISREG(st.st_mode)) {
+            continue;
+        }
+        if (strncmp(dirent->d_name, TMP_PREFIX, strlen(TMP_PREFIX)) == 0) {
+            if (now - st.st_mtime > ABANDONED_AGE && remove_file(store_path, dirent->d_name)) {
+                stats->removed++;
+                stats->removed_size += st.st_size;
+            }
+        } else if (valid_key(dirent->d_name)) {
+            if (count == capacity) {
+                capacity *= 2;
+                entries = realloc(entries, capacity * sizeof(struct stored_entry));
+            }
+            entries[count].name = strdup(dirent->d_name);
+            entries[count].size = st.st_size;
+            entries[count].mtime = st.st_mtime;
+            total_size += st.st_size;
+            count++;
+        }
+    }
+    closedir(dir);
+
+    qsort(entries, count, sizeof(struct stored_entry), compare_mtime);
+    size_t i;
+    for (i = 0; i < count; i++) {
+        if (total_size > max_size && remove_file(store_path, entries[i].name)) {
+            total_size -= entries[i].size;
+            stats->evicted++;
+            stats->evicted_size += entries[i].size;
+        } else {
+            stats->kept++;
+            stats->kept_size += entries[i].size;
+        }
+        free(entries[i].name);
+    }
+    free(entries);
+    return true;
+}
+
+static bool remove_counted(const char *dir, const char *name, struct gc_stats *stats) {
+    char path[PATH_MAX];
+    struct stat st;
+    if (snprintf(path, PATH_MAX, "%s/%s", dir, name) >= PATH_MAX || lstat(path, &st) == -1 ||
+        !S_ISREG(st.st_mode) || !remove_file(dir, name)) {
+        return false;
+    }
+    stats->removed++;
+    stats->removed_size += st.st_size;
+    return true;
+}
+
+// Returns whether a file was written by the Planck compilation cache, as
+// opposed to being JavaScript a user keeps in the same directory
+static bool compiled_by_clojurescript(const char *dir, const char *name) {
+    static const char marker[] = "// Compiled by ClojureScript ";
+    char path[PATH_MAX];
+    char line[sizeof(marker) - 1];
+    if (snprintf(path, PATH_MAX, "%s/%s", dir, name) >= PATH_MAX) {
+        return false;
+    }
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return false;
+    }
+    bool compiled = read_fully(fd, line, sizeof(line)) && memcmp(line, marker, sizeof(line)) == 0;
+    close(fd);
+    return compiled;
+}
+
+// Removes the files earlier versions of Planck cached in the cache directory,
+// where each namespace has a .js file, starting with a "// Compiled by" line,
+// next to its .cache.json and .js.map.json files. Also removes classpath
+// manifests that haven't been used for a while, which are left behind each
+// time the classpath changes.
+static void collect_cache_root(struct gc_stats *stats) {
+    const char *cache_path = config.cache_path;
+    DIR *dir = opendir(cache_path);
+    if (dir == NULL) {
+        return;
+    }
+    time_t now = time(NULL);
+    struct dirent *dirent;
+    while ((dirent = readdir(dir)) != NULL) {
+        const char *name = dirent->d_name;
+        if (strncmp(name, "classpath-", 10) == 0) {
+            char path[PATH_MAX];
+            struct stat st;
+            bool manifest = str_has_suffix(name, ".manifest") == 0;
+            if ((manifest || strstr(name, ".manifest.") != NULL) &&
+                snprintf(path, PATH_MAX, "%s/%s", cache_path, name) < PATH_MAX && lstat(path, &st) == 0 &&
+                now - st.st_mtime > (manifest ? STALE_MANIFEST_AGE : ABANDONED_AGE)) {
+                remove_counted(cache_path, name, stats);
+            }
+        } else if (str_has_suffix(name, ".js") == 0 && compiled_by_clojurescript(cache_path, name)) {
+            size_t prefix_len = strlen(name) - 3;
+            char companion[PATH_MAX];
+            if (remove_counted(cache_path, name, stats) && prefix_len + 13 < PATH_MAX) {
+                snprintf(companion, PATH_MAX, "%.*s.cache.json", (int) prefix_len, name);
+                remove_counted(cache_path, companion, stats);
+                snprintf(companion, PATH_MAX, "%.*s.js.map.json", (int) prefix_len, name);
+                remove_counted(cache_path, companion, stats);
+            }
+        }
+    }
+    closedir(dir);
+}
+
+void cache_store_evict(void) {
+    if (!wrote_entries || config.cache_path == NULL) {
+        return;
+    }
+    struct gc_stats stats;
+    memset(&stats, 0, sizeof(stats));
+    collect_store(max_size(), &stats);
+}
+
+static double megabytes(off_t size) {
+    return size / (1024.0 * 1024.0);
+}
+
+int cache_store_gc(void) {
+    struct gc_stats stats;
+    memset(&stats, 0, sizeof(stats));
+    if (!collect_store(max_size(), &stats)) {
+        fprintf(stderr, "Could not read %s/%s: %s\n", config.cache_path, STORE_DIR, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    collect_cache_root(&stats);
+
+    printf("Evicted %zu cache entries (%.1f MB), kept %zu (%.1f MB)\n",
+           stats.evicted, megabytes(stats.evicted_size), stats.kept, megabytes(stats.kept_size));
+    if (stats.removed > 0) {
+        printf("Removed %zu stale cache files (%.1f MB)\n", stats.removed, megabytes(stats.removed_size));
+    }
+    return EXIT_SUCCESS;
+}
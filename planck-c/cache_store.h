@@ -0,0 +1,45 @@
+#include <stdbool.h>
+
+#include <JavaScriptCore/JavaScript.h>
+
+// Compiled namespaces are cached in the store subdirectory of the cache
+// directory, each in a single file named for a hash of its name, source, the
+// ClojureScript version, and the options affecting compilation. Entries are
+// written under a temporary name and renamed into place, so processes sharing
+// a cache directory never read a partially written entry. The least recently
+// used entries are evicted once the store grows past PLANCK_CACHE_MAX_SIZE
+// megabytes.
+
+typedef struct cache_entry {
+    // The "// Compiled by ClojureScript" line the entry was written with
+    char *build_info;
+    JSStringRef js;
+    JSStringRef analysis_cache;
+    JSStringRef source_map;
+} cache_entry_t;
+
+// Returns the key for the compiled form of the source of a namespace, named
+// with the $macros suffix if compiled as macros, to be freed by the caller
+char *cache_store_key(const char *name, JSStringRef source);
+
+// Reads an entry, if it was compiled with the given build info, or any build
+// info if NULL, without reading its payloads otherwise. The source map is only
+// read if asked for.
+bool cache_store_read(const char *key, const char *build_info, bool source_map, cache_entry_t *entry);
+
+// Writes an entry, with the analysis cache and source map, either of which may
+// be NULL, compressed unless PLANCK_CACHE_COMPRESS is 0
+bool cache_store_write(const char *key, const char *build_info, const char *js,
+                       const char *analysis_cache, const char *source_map);
+
+void free_cache_entry(cache_entry_t *entry);
+
+// Evicts the least recently used entries if entries were written by this
+// process and the store has grown past its maximum size
+void cache_store_evict(void);
+
+// Evicts entries down to the maximum size, removes abandoned temporary files,
+// files cached by earlier versions of Planck, and classpath manifests unused
+// for 30 days, and reports what was removed, for --cache-gc. Returns an exit
+// status.
+int cache_store_gc(void);
@@ -0,0 +1,522 @@
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "archive.h"
+#include "classpath.h"
+#include "globals.h"
+
+#define MAX_INDEX_THREADS 8
+
+#define MANIFEST_VERSION 1
+
+// Using a manifest marks it as recently used at most this often, in seconds,
+// so that planck --cache-gc keeps it
+#define MANIFEST_TOUCH_INTERVAL 3600
+
+// Files gathered from every JAR by load-all-files, whose contents are indexed
+static const char *gathered_files[] = {"deps.cljs", "data_readers.cljc"};
+
+// The entries read from a JAR
+struct jar_entries {
+    classpath_entry_t *entries;
+    size_t count;
+    size_t capacity;
+    bool indexed;
+};
+
+static pthread_once_t index_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t archive_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct jar_entries *jars = NULL;
+static size_t num_jars = 0;
+
+// Open addressing hash table of the first entry for each path
+static classpath_entry_t **table = NULL;
+static size_t table_size = 0;
+
+static pthread_mutex_t next_jar_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t next_jar = 0;
+
+static uint32_t path_hash(const char *path) {
+    uint32_t h = 2166136261u;
+    for (; *path; path++) {
+        h ^= (unsigned char) *path;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static void add_entry(const char *name, uint64_t index, uint64_t size, time_t mtime, void *data) {
+    struct jar_entries *jar = data;
+    if (jar->count == jar->capacity) {
+        jar->capacity = jar->capacity ? 2 * jar->capacity : 64;
+        jar->entries = realloc(jar->entries, jar->capacity * sizeof(classpath_entry_t));
+    }
+    classpath_entry_t *entry = &jar->entries[jar->count++];
+    entry->path = strdup(name);
+    entry->src_path = jar - jars;
+    entry->index = index;
+    entry->size = size;
+    entry->mtime = mtime;
+    entry->contents = NULL;
+    entry->next = NULL;
+}
+
+static bool is_gathered(const char *path) {
+    size_t i;
+    for (i = 0; i < sizeof(gathered_files) / sizeof(gathered_files[0]); i++) {
+        if (strcmp(path, gathered_files[i]) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void index_jar(size_t i) {
+    struct src_path *src_path = &config.src_paths[i];
+    struct stat file_stat;
+    if (strcmp(src_path->type, "jar") != 0 || src_path->blacklisted || stat(src_path->path, &file_stat) != 0) {
+        return;
+    }
+
+    // Errors opening JARs are left to be reported when they are probed
+    if (classpath_archive(i, NULL)) {
+        jars[i].indexed = for_each_archive_entry(src_path->archive, add_entry, &jars[i]);
+    }
+
+    size_t j;
+    for (j = 0; j < jars[i].count; j++) {
+        classpath_entry_t *entry = &jars[i].entries[j];
+        if (is_gathered(entry->path)) {
+            entry->contents = (char *) get_contents_zip_index(src_path->archive, entry->index, NULL).payload;
+        }
+    }
+}
+
+static void *index_jars(void *data) {
+    for (;;) {
+        pthread_mutex_lock(&next_jar_lock);
+        size_t i = next_jar++;
+        pthread_mutex_unlock(&next_jar_lock);
+        if (i >= num_jars) {
+            return NULL;
+        }
+        index_jar(i);
+    }
+}
+
+static void insert_entry(classpath_entry_t *entry) {
+    size_t slot = path_hash(entry->path) & (table_size - 1);
+    while (table[slot] && strcmp(table[slot]->path, entry->path) != 0) {
+        slot = (slot + 1) & (table_size - 1);
+    }
+    if (!table[slot]) {
+        table[slot] = entry;
+    } else {
+        classpath_entry_t *last = table[slot];
+        while (last->next) {
+            last = last->next;
+        }
+        last->next = entry;
+    }
+}
+
+static void free_jars() {
+    size_t i, j;
+    for (i = 0; i < num_jars; i++) {
+        for (j = 0; j < jars[i].count; j++) {
+            free(jars[i].entries[j].path);
+            free(jars[i].entries[j].contents);
+        }
+        free(jars[i].entries);
+    }
+    memset(jars, 0, num_jars * sizeof(struct jar_entries));
+}
+
+static void append(char **buf, size_t *len, const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(NULL, 0, fmt, args);
+    va_end(args);
+
+    *buf = realloc(*buf, *len + n + 1);
+    va_start(args, fmt);
+    vsnprintf(*buf + *len, n + 1, fmt, args);
+    va_end(args);
+    *len += n;
+}
+
+// Identifies the classpath, by the path, size and mtime of each JAR and the
+// device and inode of each source directory
+static char *manifest_key() {
+    char *key = NULL;
+    size_t len = 0;
+    append(&key, &len, "planck-classpath-manifest %d %s\n", MANIFEST_VERSION, PLANCK_VERSION);
+    size_t i;
+    for (i = 0; i < config.num_src_paths; i++) {
+        struct src_path *src_path = &config.src_paths[i];
+        struct stat file_stat;
+        if (stat(src_path->path, &file_stat) != 0) {
+            append(&key, &len, "missing\t%s\n", src_path->path);
+        } else if (strcmp(src_path->type, "jar") == 0) {
+            append(&key, &len, "jar\t%s\t%lld\t%lld\n", src_path->path,
+                   (long long) file_stat.st_size, (long long) file_stat.st_mtime);
+        } else {
+            append(&key, &len, "%s\t%s\t%llu\t%llu\n", src_path->type, src_path->path,
+                   (unsigned long long) file_stat.st_dev, (unsigned long long) file_stat.st_ino);
+        }
+    }
+    append(&key, &len, "\n");
+    return key;
+}
+
+static bool manifest_path(const char *key, char *path) {
+    uint64_t h = 14695981039346656037u;
+    for (; *key; key++) {
+        h ^= (unsigned char) *key;
+        h *= 1099511628211u;
+    }
+    return snprintf(path, PATH_MAX, "%s/classpath-%016llx.manifest", config.cache_path,
+                    (unsigned long long) h) < PATH_MAX;
+}
+
+// The manifest holds the key, followed by a line for each indexed JAR,
+//
+//   J <tab> index in config.src_paths <tab> number of entries
+//
+// followed by a line for each of its entries,
+//
+//   index <tab> size <tab> mtime <tab> length of contents, or - <tab> path
+//
+// followed by the contents, and a newline, for gathered files.
+static bool read_manifest(const char *key, const char *path) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        return false;
+    }
+    struct stat file_stat;
+    char *buf = NULL;
+    if (fstat(fileno(file), &file_stat) == 0) {
+        buf = malloc(file_stat.st_size + 1);
+        if (buf && fread(buf, 1, file_stat.st_size, file) == file_stat.st_size) {
+            buf[file_stat.st_size] = '\0';
+        } else {
+            free(buf);
+            buf = NULL;
+        }
+    }
+    fclose(file);
+    if (!buf) {
+        return false;
+    }
+
+    size_t key_len = strlen(key);
+    bool ok = strncmp(buf, key, key_len) == 0;
+    char *p = buf + key_len;
+    char *end = buf + file_stat.st_size;
+    while (ok && p < end) {
+        size_t i = 0, count = 0;
+        // The format's trailing newline matches any whitespace, even none
+        char *jar_newline = strchr(p, '\n');
+        if (!jar_newline || sscanf(p, "J\t%zu\t%zu\n", &i, &count) != 2 || i >= num_jars || jars[i].indexed) {
+            ok = false;
+            break;
+        }
+        p = jar_newline + 1;
+        jars[i].indexed = true;
+        jars[i].entries = calloc(count ? count : 1, sizeof(classpath_entry_t));
+        jars[i].capacity = count;
+        while (ok && jars[i].count < count) {
+            char *newline = strchr(p, '\n');
+            char *fields[4];
+            int k;
+            for (k = 0; k < 4 && newline; k++) {
+                fields[k] = p;
+                p = memchr(p, '\t', newline - p);
+                if (!p) {
+                    break;
+                }
+                *p++ = '\0';
+            }
+            if (k < 4) {
+                ok = false;
+                break;
+            }
+            *newline = '\0';
+            add_entry(p, strtoull(fields[0], NULL, 10), strtoull(fields[1], NULL, 10),
+                      strtoll(fields[2], NULL, 10), &jars[i]);
+            p = newline + 1;
+            if (strcmp(fields[3], "-") != 0) {
+                size_t len = strtoul(fields[3], NULL, 10);
+                if (p + len >= end) {
+                    ok = false;
+                    break;
+                }
+                classpath_entry_t *entry = &jars[i].entries[jars[i].count - 1];
+                entry->contents = strndup(p, len);
+                p += len + 1;
+            }
+        }
+    }
+
+    free(buf);
+    if (!ok) {
+        free_jars();
+    } else if (time(NULL) - file_stat.st_mtime > MANIFEST_TOUCH_INTERVAL) {
+        utimensat(AT_FDCWD, path, NULL, 0);
+    }
+    return ok;
+}
+
+static void write_manifest(const char *key, const char *path) {
+    char tmp_path[PATH_MAX];
+    if (snprintf(tmp_path, PATH_MAX, "%s.XXXXXX", path) >= PATH_MAX) {
+        return;
+    }
+    int fd = mkstemp(tmp_path);
+    if (fd == -1) {
+        return;
+    }
+    FILE *file = fdopen(fd, "w");
+    if (!file) {
+        close(fd);
+        unlink(tmp_path);
+        return;
+    }
+
+    bool ok = fchmod(fd, 0644) == 0 && fputs(key, file) >= 0;
+    size_t i, j;
+    for (i = 0; i < num_jars && ok; i++) {
+        if (!jars[i].indexed) {
+            continue;
+        }
+        fprintf(file, "J\t%zu\t%zu\n", i, jars[i].count);
+        for (j = 0; j < jars[i].count && ok; j++) {
+            classpath_entry_t *entry = &jars[i].entries[j];
+            // Paths are terminated by newlines
+            if (strchr(entry->path, '\n')) {
+                ok = false;
+                break;
+            }
+            fprintf(file, "%llu\t%llu\t%lld\t", (unsigned long long) entry->index,
+                    (unsigned long long) entry->size, (long long) entry->mtime);
+            if (entry->contents) {
+                fprintf(file, "%zu\t%s\n%s\n", strlen(entry->contents), entry->path, entry->contents);
+            } else {
+                fprintf(file, "-\t%s\n", entry->path);
+            }
+        }
+    }
+
+    if (fclose(file) != 0 || !ok || rename(tmp_path, path) == -1) {
+        unlink(tmp_path);
+    }
+}
+
+static void read_jars() {
+    size_t num_threads = 0;
+    size_t i;
+    for (i = 0; i < num_jars; i++) {
+        if (strcmp(config.src_paths[i].type, "jar") == 0) {
+            num_threads++;
+        }
+    }
+    long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_cpus > 0 && num_threads > num_cpus) {
+        num_threads = num_cpus;
+    }
+    if (num_threads > MAX_INDEX_THREADS) {
+        num_threads = MAX_INDEX_THREADS;
+    }
+
+    pthread_t threads[MAX_INDEX_THREADS];
+    size_t num_started = 0;
+    for (i = 1; i < num_threads; i++) {
+        if (pthread_create(&threads[num_started], NULL, index_jars, NULL) == 0) {
+            num_started++;
+        }
+    }
+    index_jars(NULL);
+    for (i = 0; i < num_started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+// Reads the JARs in parallel, unless they are in the manifest, and then builds
+// the table in classpath order, so that the first entry for each path is in the
+// JAR taking precedence.
+static void build_index() {
+    num_jars = config.num_src_paths;
+    jars = calloc(num_jars, sizeof(struct jar_entries));
+    if (!jars) {
+        num_jars = 0;
+        return;
+    }
+
+    char *key = config.cache_path ? manifest_key() : NULL;
+    char path[PATH_MAX];
+    bool cached = key && manifest_path(key, path) && read_manifest(key, path);
+    if (!cached) {
+        read_jars();
+        if (key && manifest_path(key, path)) {
+            write_manifest(key, path);
+        }
+    }
+    free(key);
+
+    size_t count = 0;
+    size_t i;
+    for (i = 0; i < num_jars; i++) {
+        count += jars[i].count;
+    }
+    table_size = 16;
+    while (table_size < 2 * count) {
+        table_size *= 2;
+    }
+    table = calloc(table_size, sizeof(classpath_entry_t *));
+    if (!table) {
+        table_size = 0;
+        return;
+    }
+
+    for (i = 0; i < num_jars; i++) {
+        size_t j;
+        for (j = 0; j < jars[i].count; j++) {
+            insert_entry(&jars[i].entries[j]);
+        }
+    }
+}
+
+const classpath_entry_t *classpath_lookup(const char *path) {
+    pthread_once(&index_once, build_index);
+    if (table_size == 0) {
+        return NULL;
+    }
+
+    size_t slot = path_hash(path) & (table_size - 1);
+    while (table[slot]) {
+        if (strcmp(table[slot]->path, path) == 0) {
+            return table[slot];
+        }
+        slot = (slot + 1) & (table_size - 1);
+    }
+    return NULL;
+}
+
+uint8_t *classpath_read(const classpath_entry_t *entry, char **error_msg) {
+    void *archive = classpath_archive(entry->src_path, error_msg);
+    if (!archive) {
+        return NULL;
+    }
+    return get_contents_zip_index(archive, entry->index, error_msg).payload;
+}
+
+void *classpath_archive(size_t src_path, char **error_msg) {
+    // Prefetch threads and the engine thread may both open a JAR first
+    pthread_mutex_lock(&archive_lock);
+    struct src_path *path = &config.src_paths[src_path];
+    if (!path->archive) {
+        path->archive = open_archive(path->path, error_msg);
+    }
+    void *archive = path->archive;
+    pthread_mutex_unlock(&archive_lock);
+    return archive;
+}
+
+bool classpath_indexed(size_t src_path) {
+    pthread_once(&index_once, build_index);
+    return table_size != 0 && src_path < num_jars && jars[src_path].indexed;
+}
+
+#ifdef CLASSPATH_BENCH
+#include <time.h>
+
+struct config config;
+
+// The JARs opened with libzip, for probing
+static zip_t **zips;
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Finds a path the way function_load used to, probing each JAR in turn
+static bool probe(const char *path) {
+    size_t i;
+    for (i = 0; i < config.num_src_paths; i++) {
+        zip_stat_t stat;
+        if (zips[i] && zip_stat(zips[i], path, 0, &stat) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool lookup(const char *path) {
+    return classpath_lookup(path) != NULL;
+}
+
+static void bench(const char *label, bool (*find)(const char *), char **paths, size_t num_paths, long iterations) {
+    size_t found = 0;
+    double start = now();
+    long i;
+    for (i = 0; i < iterations; i++) {
+        if (find(paths[i % num_paths])) {
+            found++;
+        }
+    }
+    double elapsed = now() - start;
+    printf("%-14s %12.0f lookups/s (%zu found)\n", label, iterations / elapsed, found);
+}
+
+// Takes the JARs forming the classpath, and paths to look up in them, along
+// with a cache directory, if the manifest is to be used
+int main(int argc, char **argv) {
+    int first = 1;
+    if (argc > 2 && strcmp(argv[1], "-k") == 0) {
+        config.cache_path = argv[2];
+        first = 3;
+    }
+
+    int separator;
+    for (separator = first; separator < argc && strcmp(argv[separator], "--") != 0; separator++) {
+    }
+    if (separator >= argc - 1) {
+        printf("%s <jar>... -- <path>...\n", argv[0]);
+        return 1;
+    }
+
+    config.num_src_paths = separator - first;
+    config.src_paths = calloc(config.num_src_paths, sizeof(struct src_path));
+    int i;
+    for (i = first; i < separator; i++) {
+        config.src_paths[i - first].type = "jar";
+        config.src_paths[i - first].path = argv[i];
+    }
+
+    double start = now();
+    classpath_lookup("");
+    printf("Indexed %zu JARs in %.1f ms%s\n", config.num_src_paths, (now() - start) * 1000,
+           config.cache_path ? " with a cache directory" : "");
+
+    zips = calloc(config.num_src_paths, sizeof(zip_t *));
+    for (i = 0; i < config.num_src_paths; i++) {
+        zips[i] = zip_open(config.src_paths[i].path, ZIP_RDONLY, NULL);
+    }
+
+    char **paths = argv + separator + 1;
+    size_t num_paths = argc - separator - 1;
+    bench("index", lookup, paths, num_paths, 1000000);
+    bench("probing", probe, paths, num_paths, 10000);
+    return 0;
+}
+#endif
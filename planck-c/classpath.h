@@ -0,0 +1,39 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+// The files in the JARs on the classpath are indexed by path on the first
+// lookup, reading each JAR's directory once, so that finding a file doesn't
+// involve probing every JAR in turn. If there is a cache directory, the index
+// is persisted there as a manifest, which is used by later runs for as long as
+// the classpath and its JARs are unchanged, without opening any JAR.
+
+typedef struct classpath_entry {
+    char *path;
+    // Index of the JAR in config.src_paths
+    size_t src_path;
+    // Index of the file in the JAR
+    uint64_t index;
+    uint64_t size;
+    time_t mtime;
+    // The contents of files gathered from every JAR, like deps.cljs
+    char *contents;
+    // The same path in a later JAR on the classpath
+    struct classpath_entry *next;
+} classpath_entry_t;
+
+// Returns the entry for a path in the first JAR on the classpath containing it,
+// or NULL if no indexed JAR contains it.
+const classpath_entry_t *classpath_lookup(const char *path);
+
+// Returns whether the JAR at an index in config.src_paths is indexed. JARs
+// that can't be opened aren't, and need to be probed instead.
+bool classpath_indexed(size_t src_path);
+
+// Reads a file from the JAR holding it, returning NULL-terminated contents
+uint8_t *classpath_read(const classpath_entry_t *entry, char **error_msg);
+
+// Returns the archive of the JAR at an index in config.src_paths, opening it
+// on first use from any thread, or NULL if it can't be opened.
+void *classpath_archive(size_t src_path, char **error_msg);
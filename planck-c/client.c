@@ -0,0 +1,188 @@
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "server_protocol.h"
+
+// planck-client runs planck in a process forked from a warm engine held by
+// planck --server, passing along its arguments, environment, working directory
+// and standard streams, and exiting with the same status. If no server is
+// running, or the server can't handle the request, planck is run directly.
+
+extern char **environ;
+
+static pid_t child_pid = 0;
+
+// Runs the planck installed alongside planck-client, or otherwise on the PATH
+static void run_planck(char **argv) {
+    char *slash = strrchr(argv[0], '/');
+    if (slash) {
+        size_t len = slash - argv[0] + sizeof("/planck");
+        char *path = malloc(len);
+        snprintf(path, len, "%.*s/planck", (int) (slash - argv[0]), argv[0]);
+        argv[0] = path;
+        execv(path, argv);
+    }
+    argv[0] = "planck";
+    execvp(argv[0], argv);
+    perror("planck-client: planck");
+    exit(127);
+}
+
+static void forward_signal(int sig) {
+    if (child_pid > 0) {
+        kill(-child_pid, sig);
+    }
+}
+
+static void forward_signals() {
+    int signals[] = {SIGINT, SIGTERM, SIGHUP, SIGQUIT};
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(struct sigaction));
+    sigemptyset(&sa.sa_mask);
+    sa.sa_handler = forward_signal;
+    sa.sa_flags = 0;
+    int i;
+    for (i = 0; i < sizeof(signals) / sizeof(signals[0]); i++) {
+        sigaction(signals[i], &sa, NULL);
+    }
+}
+
+static int connect_to_server() {
+    char *path = server_socket_path();
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        free(path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    free(path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static char *append(char *payload, size_t *size, const char *s) {
+    size_t len = strlen(s) + 1;
+    payload = realloc(payload, *size + len);
+    memcpy(payload + *size, s, len);
+    *size += len;
+    return payload;
+}
+
+static bool send_request(int fd, int argc, char **argv) {
+    char cwd[PATH_MAX];
+    if (getcwd(cwd, sizeof(cwd)) == NULL) {
+        return false;
+    }
+
+    size_t size = 0;
+    char *payload = append(NULL, &size, cwd);
+    payload = append(payload, &size, "planck");
+    int i;
+    for (i = 1; i < argc; i++) {
+        payload = append(payload, &size, argv[i]);
+    }
+    uint32_t envc = 0;
+    for (i = 0; environ[i]; i++) {
+        payload = append(payload, &size, environ[i]);
+        envc++;
+    }
+
+    if (size > SERVER_MAX_PAYLOAD_SIZE) {
+        free(payload);
+        return false;
+    }
+
+    mode_t mask = umask(0);
+    umask(mask);
+
+    struct server_request request;
+    request.payload_size = (uint32_t) size;
+    request.argc = (uint32_t) argc;
+    request.envc = envc;
+    request.umask = (uint32_t) mask;
+
+    struct iovec iov;
+    iov.iov_base = &request;
+    iov.iov_len = sizeof(request);
+
+    union {
+        char buf[CMSG_SPACE(3 * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    memset(&control, 0, sizeof(control));
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(3 * sizeof(int));
+    int fds[3] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    ssize_t n;
+    while ((n = sendmsg(fd, &msg, 0)) == -1 && errno == EINTR) {
+    }
+
+    bool rv = n == sizeof(request) && server_write_fully(fd, payload, size);
+    free(payload);
+    return rv;
+}
+
+int main(int argc, char **argv) {
+
+    signal(SIGPIPE, SIG_IGN);
+
+    int fd = connect_to_server();
+    if (fd == -1) {
+        run_planck(argv);
+    }
+
+    // Until the server reports it has started handling the request, nothing has
+    // run, so it is safe to fall back to running planck directly.
+    struct server_reply reply;
+    if (!send_request(fd, argc, argv)
+        || !server_read_fully(fd, &reply, sizeof(reply))
+        || reply.kind == SERVER_REPLY_FALLBACK) {
+        close(fd);
+        run_planck(argv);
+    }
+
+    child_pid = reply.value;
+    forward_signals();
+
+    if (!server_read_fully(fd, &reply, sizeof(reply))) {
+        fprintf(stderr, "planck-client: Lost connection to the Planck server\n");
+        return EXIT_FAILURE;
+    }
+
+    if (reply.kind == SERVER_REPLY_FALLBACK) {
+        close(fd);
+        run_planck(argv);
+    }
+
+    return reply.value;
+}
@@ -2,6 +2,7 @@
 #include "engine.h"
 #include <time.h>
 #include <stdio.h>
+#include <sys/resource.h>
 
 #if __DARWIN_UNIX03
 
@@ -40,8 +41,17 @@ void display_launch_timing(const char *label) {
         uint64_t total_elapsed = now - launch_time;
         uint64_t elapsed = now - last_display;
         last_display = now;
+        // Peak resident set size, reported in kilobytes on Linux and bytes on macOS
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+#if __DARWIN_UNIX03
+        double max_rss = usage.ru_maxrss / (1024.0 * 1024.0);
+#else
+        double max_rss = usage.ru_maxrss / 1024.0;
+#endif
         char buffer[1024];
-        snprintf(buffer, 1024, "%50s: %10.6f %10.6f\n", label, 1e-6 * elapsed, 1e-6 * total_elapsed);
+        snprintf(buffer, 1024, "%50s: %10.6f %10.6f %8.1f MB\n", label, 1e-6 * elapsed, 1e-6 * total_elapsed,
+                 max_rss);
         engine_print(buffer);
     }
 }
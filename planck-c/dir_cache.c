@@ -0,0 +1,509 @@
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#define HAVE_INOTIFY
+#endif
+
+#include "dir_cache.h"
+
+struct dir {
+    // With a trailing slash
+    char *path;
+    size_t len;
+    uint32_t hash;
+    // Whether the listing is current
+    bool valid;
+    bool exists;
+    // The sorted names of the directory's entries
+    char **names;
+    size_t num_names;
+#ifdef HAVE_INOTIFY
+    int wd;
+#else
+    struct timespec mtime;
+#endif
+    struct dir *next;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static bool initialized = false;
+static struct dir **table = NULL;
+static size_t table_size = 0;
+static size_t num_dirs = 0;
+
+#ifdef HAVE_INOTIFY
+#define WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+static int inotify_fd = -1;
+// Listed directories by watch descriptor
+static struct dir **watched = NULL;
+static size_t watched_size = 0;
+#endif
+
+static uint32_t path_hash(const char *path, size_t len) {
+    uint32_t h = 2166136261u;
+    size_t i;
+    for (i = 0; i < len; i++) {
+        h ^= (unsigned char) path[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static struct dir *find_dir(const char *path, size_t len, uint32_t hash) {
+    struct dir *d;
+    for (d = table[hash & (table_size - 1)]; d; d = d->next) {
+        if (d->hash == hash && d->len == len && memcmp(d->path, path, len) == 0) {
+            return d;
+        }
+    }
+    return NULL;
+}
+
+static struct dir *get_dir(const char *path, size_t len) {
+    uint32_t hash = path_hash(path, len);
+    struct dir *d = find_dir(path, len, hash);
+    if (d) {
+        return d;
+    }
+
+    if (num_dirs == table_size) {
+        struct dir **new_table = calloc(table_size * 2, sizeof(struct dir *));
+        if (!new_table) {
+            return NULL;
+        }
+        size_t i;
+        for (i = 0; i < table_size; i++) {
+            while (table[i]) {
+                d = table[i];
+                table[i] = d->next;
+                d->next = new_table[d->hash & (table_size * 2 - 1)];
+                new_table[d->hash & (table_size * 2 - 1)] = d;
+            }
+        }
+        free(table);
+        table = new_table;
+        table_size *= 2;
+    }
+
+    d = calloc(1, sizeof(struct dir));
+    if (!d || !(d->path = strndup(path, len))) {
+        free(d);
+        return NULL;
+    }
+    d->len = len;
+    d->hash = hash;
+#ifdef HAVE_INOTIFY
+    d->wd = -1;
+#endif
+    d->next = table[hash & (table_size - 1)];
+    table[hash & (table_size - 1)] = d;
+    num_dirs++;
+    return d;
+}
+
+static void free_names(struct dir *d) {
+    size_t i;
+    for (i = 0; i < d->num_names; i++) {
+        free(d->names[i]);
+    }
+    free(d->names);
+    d->names = NULL;
+    d->num_names = 0;
+}
+
+static int compare_names(const void *a, const void *b) {
+    return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+static bool contains(struct dir *d, const char *name, size_t len) {
+    size_t lo = 0;
+    size_t hi = d->num_names;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        int cmp = strncmp(d->names[mid], name, len);
+        if (cmp == 0 && d->names[mid][len] != '\0') {
+            cmp = 1;
+        }
+        if (cmp == 0) {
+            return true;
+        } else if (cmp < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return false;
+}
+
+// Reads a directory's entries, returning false if they can't be read
+static bool read_names(struct dir *d) {
+    free_names(d);
+    DIR *dir = opendir(d->path);
+    if (!dir) {
+        d->exists = false;
+        return errno == ENOENT || errno == ENOTDIR;
+    }
+
+    size_t capacity = 0;
+    struct dirent *entry;
+    bool ok = true;
+    while (ok && (entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        if (d->num_names == capacity) {
+            capacity = capacity ? capacity * 2 : 16;
+            char **names = realloc(d->names, capacity * sizeof(char *));
+            if (!names) {
+                ok = false;
+                break;
+            }
+            d->names = names;
+        }
+        if ((d->names[d->num_names] = strdup(entry->d_name)) == NULL) {
+            ok = false;
+        } else {
+            d->num_names++;
+        }
+    }
+    closedir(dir);
+
+    if (!ok) {
+        free_names(d);
+        return false;
+    }
+    qsort(d->names, d->num_names, sizeof(char *), compare_names);
+    d->exists = true;
+    return true;
+}
+
+#ifdef HAVE_INOTIFY
+
+// Returns the length of the parent of a directory, or 0 if it has none
+static size_t parent_length(const char *path, size_t len) {
+    size_t i = len - 1;
+    while (i > 0 && path[i - 1] != '/') {
+        i--;
+    }
+    return i;
+}
+
+static bool watch(struct dir *d) {
+    if (d->wd != -1) {
+        return true;
+    }
+
+    int wd = inotify_add_watch(inotify_fd, d->path, WATCH_MASK);
+    if (wd == -1) {
+        return errno == ENOENT || errno == ENOTDIR;
+    }
+
+    if ((size_t) wd >= watched_size) {
+        size_t size = watched_size ? watched_size : 256;
+        while (size <= (size_t) wd) {
+            size *= 2;
+        }
+        struct dir **new_watched = realloc(watched, size * sizeof(struct dir *));
+        if (!new_watched) {
+            return false;
+        }
+        memset(new_watched + watched_size, 0, (size - watched_size) * sizeof(struct dir *));
+        watched = new_watched;
+        watched_size = size;
+    }
+    if (watched[wd] != NULL) {
+        // The same directory is already listed under another path
+        return false;
+    }
+    watched[wd] = d;
+    d->wd = wd;
+    return true;
+}
+
+// Returns the listing of a directory, or NULL if it can't be cached
+static struct dir *listing(const char *path, size_t len) {
+    struct dir *d = get_dir(path, len);
+    if (!d) {
+        return NULL;
+    }
+
+    // The directory is watched before being read, so that no change is missed
+    if (!d->valid && (!watch(d) || !read_names(d))) {
+        return NULL;
+    }
+    if (d->exists && d->wd == -1) {
+        // Created after failing to be watched
+        return NULL;
+    }
+    d->valid = true;
+    if (d->exists) {
+        return d;
+    }
+
+    // A directory that doesn't exist is known not to for as long as its
+    // parent's listing doesn't contain it
+    size_t parent_len = parent_length(path, len);
+    const char *name = path + parent_len;
+    size_t name_len = len - parent_len - 1;
+    if (parent_len == 0 || name_len == 0 || (name[0] == '.' && (name_len == 1 || (name_len == 2 && name[1] == '.')))) {
+        d->valid = false;
+        return NULL;
+    }
+    struct dir *parent = listing(path, parent_len);
+    if (!parent || (parent->exists && contains(parent, name, name_len))) {
+        d->valid = false;
+        return NULL;
+    }
+    return d;
+}
+
+// Drops the listings of a directory and everything below it, along with their
+// watches, as the directories at those paths may have been replaced
+static void forget(const char *path, size_t len) {
+    size_t i;
+    struct dir *d;
+    for (i = 0; i < table_size; i++) {
+        for (d = table[i]; d; d = d->next) {
+            if (d->len >= len && memcmp(d->path, path, len) == 0) {
+                d->valid = false;
+                if (d->wd != -1) {
+                    inotify_rm_watch(inotify_fd, d->wd);
+                    watched[d->wd] = NULL;
+                    d->wd = -1;
+                }
+            }
+        }
+    }
+}
+
+static void handle_event(struct inotify_event *event) {
+    if (event->mask & IN_Q_OVERFLOW) {
+        forget("", 0);
+        return;
+    }
+    if (event->wd < 0 || (size_t) event->wd >= watched_size || !watched[event->wd]) {
+        return;
+    }
+
+    struct dir *d = watched[event->wd];
+    if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+        forget(d->path, d->len);
+        return;
+    }
+
+    d->valid = false;
+    if (event->len > 0) {
+        size_t name_len = strlen(event->name);
+        char *path = malloc(d->len + name_len + 1);
+        if (path) {
+            memcpy(path, d->path, d->len);
+            memcpy(path + d->len, event->name, name_len);
+            path[d->len + name_len] = '/';
+            forget(path, d->len + name_len + 1);
+            free(path);
+        }
+    }
+}
+
+#else
+
+static bool same_mtime(struct timespec *a, struct timespec *b) {
+    return a->tv_sec == b->tv_sec && a->tv_nsec == b->tv_nsec;
+}
+
+// Returns the listing of a directory, or NULL if it can't be cached
+static struct dir *listing(const char *path, size_t len) {
+    struct dir *d = get_dir(path, len);
+    if (!d) {
+        return NULL;
+    }
+
+    struct stat dir_stat;
+    if (stat(d->path, &dir_stat) != 0) {
+        free_names(d);
+        d->valid = false;
+        d->exists = false;
+        return errno == ENOENT || errno == ENOTDIR ? d : NULL;
+    }
+
+#ifdef __APPLE__
+    struct timespec mtime = dir_stat.st_mtimespec;
+#else
+    struct timespec mtime = dir_stat.st_mtim;
+#endif
+    if (!d->valid || !same_mtime(&d->mtime, &mtime)) {
+        d->valid = read_names(d);
+        d->mtime = mtime;
+    }
+    return d->valid ? d : NULL;
+}
+
+#endif
+
+static void prepare_fork() {
+    pthread_mutex_lock(&lock);
+}
+
+static void parent_after_fork() {
+    pthread_mutex_unlock(&lock);
+}
+
+// The child can't share the parent's inotify instance, so starts afresh,
+// leaving the parent's listings behind
+static void child_after_fork() {
+#ifdef HAVE_INOTIFY
+    if (inotify_fd != -1) {
+        close(inotify_fd);
+        inotify_fd = -1;
+    }
+    watched = NULL;
+    watched_size = 0;
+#endif
+    table = NULL;
+    table_size = 0;
+    num_dirs = 0;
+    initialized = false;
+    pthread_mutex_unlock(&lock);
+}
+
+static bool init() {
+    static bool registered = false;
+    if (!registered) {
+        pthread_atfork(prepare_fork, parent_after_fork, child_after_fork);
+        registered = true;
+    }
+
+    if (!initialized) {
+        table_size = 256;
+        table = calloc(table_size, sizeof(struct dir *));
+        if (!table) {
+            return false;
+        }
+#ifdef HAVE_INOTIFY
+        // Without inotify, as when PLANCK_INOTIFY is 0 or the limit on
+        // instances is reached, nothing is cached
+        const char *value = getenv("PLANCK_INOTIFY");
+        inotify_fd = value != NULL && strcmp(value, "0") == 0 ? -1 : inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+#endif
+        initialized = true;
+    }
+
+#ifdef HAVE_INOTIFY
+    return inotify_fd != -1;
+#else
+    return true;
+#endif
+}
+
+void dir_cache_sync(void) {
+#ifdef HAVE_INOTIFY
+    pthread_mutex_lock(&lock);
+    if (initialized && inotify_fd != -1) {
+        char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+        ssize_t n;
+        while ((n = read(inotify_fd, buf, sizeof(buf))) > 0) {
+            char *p = buf;
+            while (p < buf + n) {
+                struct inotify_event *event = (struct inotify_event *) p;
+                handle_event(event);
+                p += sizeof(struct inotify_event) + event->len;
+            }
+        }
+    }
+    pthread_mutex_unlock(&lock);
+#endif
+}
+
+bool dir_cache_may_exist(const char *path) {
+    const char *slash = strrchr(path, '/');
+    if (path[0] != '/' || slash[1] == '\0') {
+        return true;
+    }
+
+    pthread_mutex_lock(&lock);
+    bool rv = true;
+    if (init()) {
+        struct dir *d = listing(path, slash - path + 1);
+        rv = !d || (d->exists && contains(d, slash + 1, strlen(slash + 1)));
+    }
+    pthread_mutex_unlock(&lock);
+    return rv;
+}
+
+#ifdef DIR_CACHE_BENCH
+#include <limits.h>
+#include <time.h>
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static const char *extensions[] = {".cljs", ".cljc", ".clj", ".js", "$macros.cljc", "$macros.clj"};
+
+#define NUM_EXTENSIONS (sizeof(extensions) / sizeof(extensions[0]))
+
+// Finds a file in source directories the way function_load does, trying each
+// candidate extension in each directory, returning the number found
+static size_t load(char **dirs, int num_dirs, char **names, int num_names, bool cached) {
+    char path[PATH_MAX];
+    size_t found = 0;
+    int i, j;
+    size_t k;
+    for (i = 0; i < num_names; i++) {
+        for (k = 0; k < NUM_EXTENSIONS; k++) {
+            if (cached) {
+                dir_cache_sync();
+            }
+            for (j = 0; j < num_dirs; j++) {
+                snprintf(path, sizeof(path), "%s%s%s", dirs[j], names[i], extensions[k]);
+                if (cached && !dir_cache_may_exist(path)) {
+                    continue;
+                }
+                FILE *f = fopen(path, "r");
+                if (f) {
+                    fclose(f);
+                    found++;
+                    break;
+                }
+            }
+        }
+    }
+    return found;
+}
+
+// Takes the source directories, with trailing slashes, and the names to load
+// from them, without extensions. Looks the names up either by probing or using
+// listings, for a count of syscalls to be taken by strace -c.
+int main(int argc, char **argv) {
+    if (argc < 5 || (strcmp(argv[1], "probe") != 0 && strcmp(argv[1], "cached") != 0)) {
+        printf("%s probe|cached <dir>... -- <name>...\n", argv[0]);
+        return 1;
+    }
+    bool cached = strcmp(argv[1], "cached") == 0;
+
+    int separator;
+    for (separator = 2; separator < argc && strcmp(argv[separator], "--") != 0; separator++) {
+    }
+    if (separator >= argc - 1) {
+        printf("%s probe|cached <dir>... -- <name>...\n", argv[0]);
+        return 1;
+    }
+
+    double start = now();
+    size_t found = load(argv + 2, separator - 2, argv + separator + 1, argc - separator - 1, cached);
+    printf("%-8s %8.1f ms (%zu found)\n", argv[1], (now() - start) * 1000, found);
+    return 0;
+}
+#endif
@@ -0,0 +1,16 @@
+#include <stdbool.h>
+
+// Listings of the directories files are loaded from, each read once, so that
+// checking whether a file exists, as is done for every candidate file in every
+// source directory, doesn't involve a syscall. On Linux, listings are watched
+// with inotify and refreshed by dir_cache_sync, unless inotify is unavailable,
+// or PLANCK_INOTIFY is 0, in which case nothing is cached. Elsewhere, a listing
+// is refreshed when its directory's mtime changes.
+
+// Applies the changes to listed directories made since the last call. Called
+// once before a batch of dir_cache_may_exist calls.
+void dir_cache_sync(void);
+
+// Returns false if an absolute path is known not to exist, or true if it exists
+// or may exist.
+bool dir_cache_may_exist(const char *path);
@@ -2,6 +2,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <wchar.h>
 #include <wctype.h>
 
 // Core Utilities
@@ -376,6 +377,76 @@ static clj_Result read_meta(clj_Reader *r, wint_t initch) {
   return read_discard(r, initch);
 }
 
+// Reads the forms in a spliced reader conditional's list or vector
+static void read_spliced(clj_Reader *r) {
+  wint_t c = skip_whitespace(r);
+  wint_t terminator;
+  form_reader macro_reader;
+  if (c == L'[') {
+    terminator = L']';
+  } else if (c == L'(') {
+    terminator = L')';
+  } else {
+    reader_error(r, CLJ_UNREADABLE);
+  }
+  while (1) {
+    c = skip_whitespace(r);
+    if (c == terminator) {
+      return;
+    } else if ((macro_reader = get_macro_reader(c))) {
+      macro_reader(r, c);
+    } else if (c == WEOF) {
+      reader_error(r, CLJ_UNEXPECTED_EOF);
+    } else {
+      push_char(r, c);
+      read_form(r);
+    }
+  }
+}
+
+// Reads the first :cljs or :default branch of a reader conditional
+static clj_Result read_conditional(clj_Reader *r, wint_t initch) {
+  wint_t c = pop_char(r);
+  int splicing = c == L'@';
+  int matched = 0;
+  StringBuffer feature;
+  if (splicing) {
+    c = pop_char(r);
+  }
+  if (c != L'(') {
+    reader_error(r, CLJ_UNREADABLE);
+  }
+  while (1) {
+    c = skip_whitespace(r);
+    if (c == L')') {
+      return CLJ_MORE;
+    } else if (c != L':') {
+      reader_error(r, c == WEOF ? CLJ_UNEXPECTED_EOF : CLJ_UNREADABLE);
+    }
+    strbuf_init(&feature, 10);
+    do {
+      strbuf_append(&feature, c);
+      c = pop_char(r);
+    } while (c != WEOF && !is_clj_whitespace(c) && !is_macro_terminating(c));
+    push_char(r, c);
+    int selected = !matched && (wcscmp(feature.chars, L":cljs") == 0 ||
+                                wcscmp(feature.chars, L":default") == 0);
+    strbuf_free(&feature);
+    if (!selected) {
+      r->_discard++;
+    }
+    if (selected && splicing) {
+      read_spliced(r);
+    } else {
+      read_form(r);
+    }
+    if (!selected) {
+      r->_discard--;
+    }
+    matched = matched || selected;
+  }
+}
+
 static form_reader get_dispatch_reader(wint_t c) {
   switch (c) {
     case L'{': return read_set;
@@ -383,6 +454,7 @@ static form_reader get_dispatch_reader(wint_t c) {
     case L'"': return read_regex;
     case L'!': return read_comment;
     case L'_': return read_discard;
+    case L'?': return read_conditional;
     default:   return 0;
   }
 }
@@ -395,7 +467,8 @@ static clj_Result read_dispatch(clj_Reader *r, wint_t initch) {
   if ((dispatch_reader = get_dispatch_reader(c))) {
     return dispatch_reader(r, c);
   } else {
-    assert(0); //TODO tagged types and unknown dispatch macros
+    //TODO tagged types and unknown dispatch macros
+    reader_error(r, CLJ_NOT_IMPLEMENTED);
   }
 }
 
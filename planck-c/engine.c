@@ -9,6 +9,7 @@
 #include <JavaScriptCore/JavaScript.h>
 
 #include "bundle.h"
+#include "bundle_string.h"
 #include "functions.h"
 #include "globals.h"
 #include "http.h"
@@ -17,7 +18,11 @@
 #include "jsc_utils.h"
 #include "str.h"
 #include "engine.h"
+#include "threads.h"
 #include "clock.h"
+#include "parallel.h"
+#include "prelink.h"
+#include "worker.h"
 
 JSGlobalContextRef ctx = NULL;
 
@@ -175,7 +180,7 @@ JSValueRef get_value(JSContextRef ctx, char *namespace, char *name) {
     return val;
 }
 
-JSObjectRef get_function(char *namespace, char *name) {
+static JSObjectRef get_function_in_context(JSContextRef ctx, char *namespace, char *name) {
     JSValueRef val = get_value(ctx, namespace, name);
     if (JSValueIsUndefined(ctx, val)) {
         char buffer[1024];
@@ -186,18 +191,12 @@ JSObjectRef get_function(char *namespace, char *name) {
     return JSValueToObject(ctx, val, NULL);
 }
 
+JSObjectRef get_function(char *namespace, char *name) {
+    return get_function_in_context(ctx, namespace, name);
+}
 
-void evaluate_source(char *type, char *source, bool expression, bool print_nil, char *set_ns, const char *theme,
-                bool block_until_ready, int session_id) {
-    if (block_until_ready) {
-        int err = block_until_engine_ready();
-        if (err) {
-            engine_println(block_until_engine_ready_failed_msg);
-            return;
-        }
-    }
-
-    acquire_eval_lock();
+static void execute_source(JSContextRef ctx, JSObjectRef execute_fn, char *type, char *source, bool expression,
+                           bool print_nil, char *set_ns, const char *theme, int session_id) {
     JSValueRef args[6];
     size_t num_args = 6;
 
@@ -220,18 +219,32 @@ void evaluate_source(char *type, char *source, bool expression, bool print_nil,
     args[4] = JSValueMakeString(ctx, theme_str);
     args[5] = JSValueMakeNumber(ctx, session_id);
 
+    JSObjectRef global_obj = JSContextGetGlobalObject(ctx);
+
+    JSObjectCallAsFunction(ctx, execute_fn, global_obj, num_args, args, NULL);
+}
+
+void evaluate_source(char *type, char *source, bool expression, bool print_nil, char *set_ns, const char *theme,
+                bool block_until_ready, int session_id) {
+    if (block_until_ready) {
+        int err = block_until_engine_ready();
+        if (err) {
+            engine_println(block_until_engine_ready_failed_msg);
+            return;
+        }
+    }
+
+    acquire_eval_lock();
     static JSObjectRef execute_fn = NULL;
     if (!execute_fn) {
         execute_fn = get_function("planck.repl", "execute");
         JSValueProtect(ctx, execute_fn);
     }
-    JSObjectRef global_obj = JSContextGetGlobalObject(ctx);
-
-    JSObjectCallAsFunction(ctx, execute_fn, global_obj, num_args, args, NULL);
+    execute_source(ctx, execute_fn, type, source, expression, print_nil, set_ns, theme, session_id);
     release_eval_lock();
 }
 
-void bootstrap(char *out_path) {
+void bootstrap(JSContextRef ctx, char *out_path) {
     char *deps_file_path = "main.js";
     char *goog_base_path = "goog/base.js";
     if (out_path != NULL) {
@@ -246,34 +259,42 @@ void bootstrap(char *out_path) {
                     source);
 
     // Load goog base
-    char *base_script_str = NULL;
+    JSStringRef base_script_str = NULL;
     if (out_path) {
-        base_script_str = get_contents(goog_base_path, NULL);
+        char *contents = get_contents(goog_base_path, NULL);
         free(goog_base_path);
+        if (contents) {
+            base_script_str = JSStringCreateWithUTF8CString(contents);
+            free(contents);
+        }
     } else {
-        base_script_str = bundle_get_contents(goog_base_path);
+        base_script_str = bundle_string_create(goog_base_path);
     }
     if (base_script_str == NULL) {
         fprintf(stderr, "The goog base JavaScript text could not be loaded\n");
         exit(1);
     }
-    evaluate_script(ctx, base_script_str, "<bootstrap:base>");
-    free(base_script_str);
+    evaluate_script_string(ctx, base_script_str, "<bootstrap:base>");
+    JSStringRelease(base_script_str);
 
     // Load the deps file
-    char *deps_script_str = NULL;
+    JSStringRef deps_script_str = NULL;
     if (out_path) {
-        deps_script_str = get_contents(deps_file_path, NULL);
+        char *contents = get_contents(deps_file_path, NULL);
         free(deps_file_path);
+        if (contents) {
+            deps_script_str = JSStringCreateWithUTF8CString(contents);
+            free(contents);
+        }
     } else {
-        deps_script_str = bundle_get_contents(deps_file_path);
+        deps_script_str = bundle_string_create(deps_file_path);
     }
     if (deps_script_str == NULL) {
         fprintf(stderr, "The deps JavaScript text could not be loaded\n");
         exit(1);
     }
-    evaluate_script(ctx, deps_script_str, "<bootstrap:deps>");
-    free(deps_script_str);
+    evaluate_script_string(ctx, deps_script_str, "<bootstrap:deps>");
+    JSStringRelease(deps_script_str);
 
     evaluate_script(ctx, "goog.isProvided_ = function(x) { return false; };", source);
 
@@ -284,7 +305,11 @@ void bootstrap(char *out_path) {
                     "                                goog.dependencies_.nameToPath[name]); };",
                     source);
 
-    evaluate_script(ctx, "goog.require('cljs.core');", source);
+    if (out_path != NULL || !prelink_evaluate(ctx, PRELINK_PHASE_CORE)) {
+        prelink_trace_phase(PRELINK_PHASE_CORE);
+        evaluate_script(ctx, "goog.require('cljs.core');", source);
+        prelink_trace_phase(NULL);
+    }
 
     // redef goog.require to track loaded libs
     evaluate_script(ctx,
@@ -404,12 +429,12 @@ void discarding_sender(const char *msg) {
     /* Intentionally empty. */
 }
 
-void maybe_load_user_file() {
+void maybe_load_user_file(JSContextRef ctx) {
     if (config.repl) {
         JSValueRef arguments[0];
         JSValueRef ex = NULL;
-        JSObjectCallAsFunction(ctx, get_function("planck.repl", "maybe-load-user-file"), JSContextGetGlobalObject(ctx),
-                               0, arguments, &ex);
+        JSObjectCallAsFunction(ctx, get_function_in_context(ctx, "planck.repl", "maybe-load-user-file"),
+                               JSContextGetGlobalObject(ctx), 0, arguments, &ex);
         debug_print_value("planck.repl/maybe-load-user-file", ctx, ex);
 
         if (ex) {
@@ -421,7 +446,7 @@ void maybe_load_user_file() {
 void init_paredit(JSContextRef ctx) {
     JSValueRef arguments[0];
     JSValueRef ex = NULL;
-    JSObjectCallAsFunction(ctx, get_function("planck.repl", "init-paredit"),
+    JSObjectCallAsFunction(ctx, get_function_in_context(ctx, "planck.repl", "init-paredit"),
                            JSContextGetGlobalObject(ctx), 0, arguments, &ex);
 
     if (ex) {
@@ -429,15 +454,13 @@ void init_paredit(JSContextRef ctx) {
     }
 }
 
-void *do_engine_init(void *data) {
-    ctx = JSGlobalContextCreate(NULL);
-
-    display_launch_timing("JS context created");
-
+// Bootstraps a fresh context, loading planck.repl and installing Planck's
+// native functions and timer support.
+static void load_runtime(JSContextRef ctx) {
     evaluate_script(ctx, "var global = this;", "<init>");
 
     register_global_function(ctx, "AMBLY_IMPORT_SCRIPT", function_import_script);
-    bootstrap(config.out_path);
+    bootstrap(ctx, config.out_path);
 
     display_launch_timing("bootstrap");
 
@@ -449,7 +472,15 @@ void *do_engine_init(void *data) {
     display_launch_timing("version");
 
     // require app namespaces
-    evaluate_script(ctx, "goog.require('planck.repl');", "<init>");
+    if (config.out_path == NULL && prelink_evaluate(ctx, PRELINK_PHASE_APP)) {
+        evaluate_script(ctx,
+                        "cljs.core._STAR_loaded_libs_STAR_ = cljs.core.conj.call(null, cljs.core._STAR_loaded_libs_STAR_, \"planck.repl\");",
+                        "<init>");
+    } else {
+        prelink_trace_phase(PRELINK_PHASE_APP);
+        evaluate_script(ctx, "goog.require('planck.repl');", "<init>");
+        prelink_trace_phase(NULL);
+    }
 
     display_launch_timing("require app namespaces");
 
@@ -464,6 +495,8 @@ void *do_engine_init(void *data) {
     register_global_function(ctx, "PLANCK_LOAD_DATA_READERS_FILES", function_load_data_readers_files);
     register_global_function(ctx, "PLANCK_LOAD_FROM_JAR", function_load_from_jar);
     register_global_function(ctx, "PLANCK_CACHE", function_cache);
+    register_global_function(ctx, "PLANCK_CACHE_KEY", function_cache_key);
+    register_global_function(ctx, "PLANCK_CACHE_READ", function_cache_read);
 
     register_global_function(ctx, "PLANCK_EVAL", function_eval);
 
@@ -492,6 +525,9 @@ void *do_engine_init(void *data) {
     register_global_function(ctx, "PLANCK_FILE_INPUT_STREAM_READ", function_file_input_stream_read);
     register_global_function(ctx, "PLANCK_FILE_INPUT_STREAM_CLOSE", function_file_input_stream_close);
 
+    register_global_function(ctx, "PLANCK_JAR_READER_OPEN", function_jar_reader_open);
+    register_global_function(ctx, "PLANCK_JAR_INPUT_STREAM_OPEN", function_jar_input_stream_open);
+
     register_global_function(ctx, "PLANCK_FILE_OUTPUT_STREAM_OPEN", function_file_output_stream_open);
     register_global_function(ctx, "PLANCK_FILE_OUTPUT_STREAM_WRITE", function_file_output_stream_write);
     register_global_function(ctx, "PLANCK_FILE_OUTPUT_STREAM_FLUSH", function_file_output_stream_flush);
@@ -519,10 +555,20 @@ void *do_engine_init(void *data) {
     register_global_function(ctx, "PLANCK_SOCKET_LISTEN", function_socket_listen);
     register_global_function(ctx, "PLANCK_SOCKET_WRITE", function_socket_write);
     register_global_function(ctx, "PLANCK_SOCKET_CLOSE", function_socket_close);
+    register_global_function(ctx, "PLANCK_SOCKET_STATS", function_socket_stats);
+
+    register_global_function(ctx, "PLANCK_WORKER_START", function_worker_start);
+    register_global_function(ctx, "PLANCK_WORKER_POST_MESSAGE", function_worker_post_message);
+    register_global_function(ctx, "PLANCK_WORKER_ON_MESSAGE", function_worker_on_message);
+    register_global_function(ctx, "PLANCK_WORKER_TERMINATE", function_worker_terminate);
+    register_global_function(ctx, "PLANCK_WORKER_ARRAY_BUFFER", function_worker_array_buffer);
+
+    register_global_function(ctx, "PLANCK_PARALLEL_RUN", function_parallel_run);
 
     register_global_function(ctx, "PLANCK_SLEEP", function_sleep);
 
     register_global_function(ctx, "PLANCK_SIGNAL_TASK_COMPLETE", function_signal_task_complete);
+    register_global_function(ctx, "PLANCK_TASK_QUEUE_STATS", function_task_queue_stats);
 
     register_global_function(ctx, "PLANCK_GETENV", function_getenv);
 
@@ -554,6 +600,7 @@ void *do_engine_init(void *data) {
 
     register_global_function(ctx, "PLANCK_SET_TIMEOUT", function_set_timeout);
     register_global_function(ctx, "PLANCK_SET_INTERVAL", function_set_interval);
+    register_global_function(ctx, "PLANCK_CLEAR_TIMER", function_clear_timer);
     evaluate_script(ctx,
                     "var PLANCK_TIMEOUT_CALLBACK_STORE = {};\
                      var setTimeout = function( fn, ms ) {\
@@ -578,15 +625,15 @@ void *do_engine_init(void *data) {
                      var clearTimeout = function( id ) {\
                        if ( PLANCK_TIMEOUT_CALLBACK_STORE[id] ) {\
                          delete PLANCK_TIMEOUT_CALLBACK_STORE[id];\
+                         PLANCK_CLEAR_TIMER(id);\
                          PLANCK_SIGNAL_TASK_COMPLETE();\
                        }\
                      };\
                      var PLANCK_INTERVAL_CALLBACK_STORE = {};\
                      var setInterval = function( fn, ms ) {\
                         if ( cljs.core.fn_QMARK_(fn) ) {\
-                          var id = PLANCK_SET_INTERVAL(ms, null);\
-                          PLANCK_INTERVAL_CALLBACK_STORE[id] = \
-                            function(){ fn(); PLANCK_SET_INTERVAL(ms, id); };\
+                          var id = PLANCK_SET_INTERVAL(ms);\
+                          PLANCK_INTERVAL_CALLBACK_STORE[id] = fn;\
                           return id;\
                         } else {\
                           throw new Error(\"Callback must be a function\");\
@@ -600,54 +647,53 @@ void *do_engine_init(void *data) {
                      var clearInterval = function( id ) {\
                        if ( PLANCK_INTERVAL_CALLBACK_STORE[id] ) {\
                          delete PLANCK_INTERVAL_CALLBACK_STORE[id];\
+                         PLANCK_CLEAR_TIMER(id);\
                          PLANCK_SIGNAL_TASK_COMPLETE();\
                        }\
                      };",
                     "<init>");
 
     display_launch_timing("setTimeout");
+}
 
-    set_print_sender(&discarding_sender);
-
-    {
-        JSValueRef arguments[9];
-        arguments[0] = JSValueMakeBoolean(ctx, config.repl);
-        arguments[1] = JSValueMakeBoolean(ctx, config.verbose);
-        JSValueRef cache_path_ref = NULL;
-        if (config.cache_path != NULL) {
-            JSStringRef cache_path_str = JSStringCreateWithUTF8CString(config.cache_path);
-            cache_path_ref = JSValueMakeString(ctx, cache_path_str);
-        }
-        arguments[2] = cache_path_ref;
-        JSValueRef checked_arrays_ref = NULL;
-        if (config.checked_arrays != NULL) {
-            JSStringRef checked_arrays_str = JSStringCreateWithUTF8CString(config.checked_arrays);
-            checked_arrays_ref = JSValueMakeString(ctx, checked_arrays_str);
-        }
-        arguments[3] = checked_arrays_ref;
-        arguments[4] = JSValueMakeBoolean(ctx, config.static_fns);
-        arguments[5] = JSValueMakeBoolean(ctx, config.fn_invoke_direct);
-        arguments[6] = JSValueMakeBoolean(ctx, config.elide_asserts);
-        JSStringRef optimizations_str = JSStringCreateWithUTF8CString(config.optimizations);
-        JSValueRef optimizations_ref = JSValueMakeString(ctx, optimizations_str);
-        arguments[7] = optimizations_ref;
-
-        JSValueRef compile_opts[config.num_compile_opts];
-        size_t i;
-        for (i=0; i<config.num_compile_opts; i++) {
-            JSStringRef compile_opts_str = JSStringCreateWithUTF8CString(config.compile_opts[i]);
-            compile_opts[i] = JSValueMakeString(ctx, compile_opts_str);
-        }
-        arguments[8] = JSObjectMakeArray(ctx, config.num_compile_opts, compile_opts, NULL);
+static void init_repl(JSContextRef ctx) {
+    JSValueRef arguments[9];
+    arguments[0] = JSValueMakeBoolean(ctx, config.repl);
+    arguments[1] = JSValueMakeBoolean(ctx, config.verbose);
+    JSValueRef cache_path_ref = NULL;
+    if (config.cache_path != NULL) {
+        JSStringRef cache_path_str = JSStringCreateWithUTF8CString(config.cache_path);
+        cache_path_ref = JSValueMakeString(ctx, cache_path_str);
+    }
+    arguments[2] = cache_path_ref;
+    JSValueRef checked_arrays_ref = NULL;
+    if (config.checked_arrays != NULL) {
+        JSStringRef checked_arrays_str = JSStringCreateWithUTF8CString(config.checked_arrays);
+        checked_arrays_ref = JSValueMakeString(ctx, checked_arrays_str);
+    }
+    arguments[3] = checked_arrays_ref;
+    arguments[4] = JSValueMakeBoolean(ctx, config.static_fns);
+    arguments[5] = JSValueMakeBoolean(ctx, config.fn_invoke_direct);
+    arguments[6] = JSValueMakeBoolean(ctx, config.elide_asserts);
+    JSStringRef optimizations_str = JSStringCreateWithUTF8CString(config.optimizations);
+    JSValueRef optimizations_ref = JSValueMakeString(ctx, optimizations_str);
+    arguments[7] = optimizations_ref;
+
+    JSValueRef compile_opts[config.num_compile_opts];
+    size_t i;
+    for (i=0; i<config.num_compile_opts; i++) {
+        JSStringRef compile_opts_str = JSStringCreateWithUTF8CString(config.compile_opts[i]);
+        compile_opts[i] = JSValueMakeString(ctx, compile_opts_str);
+    }
+    arguments[8] = JSObjectMakeArray(ctx, config.num_compile_opts, compile_opts, NULL);
 
-        JSValueRef ex = NULL;
-        JSObjectCallAsFunction(ctx, get_function("planck.repl", "init"), JSContextGetGlobalObject(ctx), 9,
-                               arguments, &ex);
-        debug_print_value("planck.repl/init", ctx, ex);
+    JSValueRef ex = NULL;
+    JSObjectCallAsFunction(ctx, get_function_in_context(ctx, "planck.repl", "init"), JSContextGetGlobalObject(ctx),
+                           9, arguments, &ex);
+    debug_print_value("planck.repl/init", ctx, ex);
 
-        if (ex) {
-            print_value("Error initializing engine: ", ctx, ex);
-        }
+    if (ex) {
+        print_value("Error initializing engine: ", ctx, ex);
     }
 
     display_launch_timing("planck.repl/init");
@@ -655,33 +701,51 @@ void *do_engine_init(void *data) {
     char version_script[1024];
     snprintf(version_script, 1024, "cljs.core._STAR_clojurescript_version_STAR_ = \"%s\";", config.clojurescript_version);
     evaluate_script(ctx, version_script, "<init>");
+}
 
-    if (config.repl) {
-        evaluate_source("text", "(eval `(~'ns ~'cljs.user (:require ~@(-> @planck.repl/app-env :opts (:repl-requires "
-                                "'[[planck.repl :refer-macros [source doc find-doc apropos dir pst]]])))))",
-                        true, false, "cljs.user", "dumb", false, 0);
-        display_launch_timing("repl requires");
-    } else {
-        evaluate_source("text", "(require 'planck.repl)",
-                        true, false, "cljs.user", "dumb", false, 0);
-        display_launch_timing("repl code");
-    }
+static char repl_requires_source[] =
+        "(eval `(~'ns ~'cljs.user (:require ~@(-> @planck.repl/app-env :opts (:repl-requires "
+        "'[[planck.repl :refer-macros [source doc find-doc apropos dir pst]]])))))";
 
+static void init_data_readers(JSContextRef ctx) {
     evaluate_script(ctx, "goog.provide('cljs.user');", "<init>");
     evaluate_script(ctx, "goog.require('cljs.core');", "<init>");
 
-    set_print_sender(NULL);
-
     JSValueRef arguments[0];
     JSValueRef ex = NULL;
-    JSObjectCallAsFunction(ctx, get_function("planck.repl", "init-data-readers"), JSContextGetGlobalObject(ctx), 0,
-                           arguments, &ex);
+    JSObjectCallAsFunction(ctx, get_function_in_context(ctx, "planck.repl", "init-data-readers"),
+                           JSContextGetGlobalObject(ctx), 0, arguments, &ex);
 
     if (ex) {
         print_value("Error initializing data readers: ", ctx, ex);
     }
+}
+
+void *do_engine_init(void *data) {
+    ctx = JSGlobalContextCreate(NULL);
 
-    maybe_load_user_file();
+    display_launch_timing("JS context created");
+
+    load_runtime(ctx);
+
+    set_print_sender(&discarding_sender);
+
+    init_repl(ctx);
+
+    if (config.repl) {
+        evaluate_source("text", repl_requires_source, true, false, "cljs.user", "dumb", false, 0);
+        display_launch_timing("repl requires");
+    } else {
+        evaluate_source("text", "(require 'planck.repl)",
+                        true, false, "cljs.user", "dumb", false, 0);
+        display_launch_timing("repl code");
+    }
+
+    set_print_sender(NULL);
+
+    init_data_readers(ctx);
+
+    maybe_load_user_file(ctx);
 
     if (config.repl) {
         init_paredit(ctx);
@@ -713,6 +777,14 @@ void engine_shutdown() {
 
 void (*cljs_sender)(const char *msg) = NULL;
 
+// Overrides cljs_sender for the calling thread, so that socket REPL sessions
+// evaluating in their own contexts print to their own connections.
+static __thread void (*thread_sender)(const char *msg) = NULL;
+
+void set_thread_print_sender(void (*sender)(const char *msg)) {
+    thread_sender = sender;
+}
+
 void engine_perror(const char *msg) {
     if (cljs_sender == &discarding_sender) {
         perror(msg);
@@ -730,7 +802,7 @@ void engine_print_err_message(const char *msg, int err) {
 }
 
 void engine_print(const char *msg) {
-    void (*current_sender)(const char *msg) = cljs_sender;
+    void (*current_sender)(const char *msg) = thread_sender ? thread_sender : cljs_sender;
     if (current_sender) {
         current_sender(msg);
     } else {
@@ -757,6 +829,12 @@ JSValueRef function_print_fn_sender(JSContextRef ctx, JSObjectRef function, JSOb
     return JSValueMakeNull(ctx);
 }
 
+static void install_print_fns(JSContextRef ctx) {
+    evaluate_script(ctx, "cljs.core.set_print_fn_BANG_.call(null,PLANCK_PRINT_FN);", "<init>");
+    evaluate_script(ctx, "cljs.core.set_print_err_fn_BANG_.call(null,PLANCK_PRINT_ERR_FN);", "<init>");
+    evaluate_script(ctx, "cljs.core._STAR_print_newline_STAR_ = true;", "<init>");
+}
+
 void set_print_sender(void (*sender)(const char *msg)) {
     cljs_sender = sender;
     if (sender) {
@@ -767,9 +845,7 @@ void set_print_sender(void (*sender)(const char *msg)) {
         register_global_function(ctx, "PLANCK_PRINT_ERR_FN", function_print_err_fn);
     }
 
-    evaluate_script(ctx, "cljs.core.set_print_fn_BANG_.call(null,PLANCK_PRINT_FN);", "<init>");
-    evaluate_script(ctx, "cljs.core.set_print_err_fn_BANG_.call(null,PLANCK_PRINT_ERR_FN);", "<init>");
-    evaluate_script(ctx, "cljs.core._STAR_print_newline_STAR_ = true;", "<init>");
+    install_print_fns(ctx);
 }
 
 bool engine_print_newline() {
@@ -846,3 +922,208 @@ void highlight_coords_for_pos(int pos, const char *buf, size_t num_previous_line
         *highlight_pos = (int) JSValueToNumber(ctx, JSObjectGetPropertyAtIndex(ctx, array, 1, NULL), NULL);
     }
 }
+
+// Session contexts
+//
+// Socket REPL sessions and planck.worker workers can each evaluate in their
+// own context. Each such context lives in its own context group, and thus its
+// own VM, so that it can evaluate concurrently with the others and with the
+// main context. Bootstrapping a context takes about as long as Planck's own
+// startup, so a few socket REPL contexts are kept ready ahead of time.
+
+struct engine_session {
+    JSGlobalContextRef ctx;
+    JSObjectRef execute_fn;
+    JSObjectRef get_current_ns_fn;
+    JSObjectRef is_readable_fn;
+    struct engine_session *next;
+};
+
+static pthread_mutex_t session_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t session_pool_cond = PTHREAD_COND_INITIALIZER;
+static engine_session_t *session_pool = NULL;
+static int session_pool_count = 0;
+static int session_pool_size = 0;
+
+// Callbacks for these are delivered to the main context, so they can't be used
+// from a session context.
+static char *main_context_only_fns[] = {
+        "PLANCK_SET_TIMEOUT",
+        "PLANCK_SET_INTERVAL",
+        "PLANCK_SOCKET_CONNECT",
+        "PLANCK_SOCKET_LISTEN",
+        "PLANCK_WORKER_START"
+};
+
+static JSValueRef function_main_context_only(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
+                                             size_t argc, const JSValueRef args[], JSValueRef *exception) {
+    JSValueRef arguments[1];
+    arguments[0] = c_string_to_value(ctx, "Only available in the main context");
+    *exception = JSObjectMakeError(ctx, 1, arguments, NULL);
+    return JSValueMakeNull(ctx);
+}
+
+bool is_main_context(JSContextRef context) {
+    return JSContextGetGlobalContext(context) == ctx;
+}
+
+static JSObjectRef get_protected_function(JSContextRef ctx, char *namespace, char *name) {
+    JSObjectRef fn = get_function_in_context(ctx, namespace, name);
+    JSValueProtect(ctx, fn);
+    return fn;
+}
+
+// Socket REPL sessions print to their connections, while workers print
+// directly to stdout and stderr.
+static engine_session_t *create_engine_session(bool socket_repl) {
+    engine_session_t *session = malloc(sizeof(engine_session_t));
+    if (!session) {
+        return NULL;
+    }
+
+    uint64_t start = system_time();
+
+    // Discard anything printed while bootstrapping
+    void (*saved_sender)(const char *msg) = thread_sender;
+    thread_sender = &discarding_sender;
+
+    JSContextGroupRef group = JSContextGroupCreate();
+    JSGlobalContextRef ctx = JSGlobalContextCreateInGroup(group, NULL);
+    JSContextGroupRelease(group);
+
+    load_runtime(ctx);
+
+    size_t i;
+    for (i = 0; i < sizeof(main_context_only_fns) / sizeof(main_context_only_fns[0]); i++) {
+        register_global_function(ctx, main_context_only_fns[i], function_main_context_only);
+    }
+
+    if (socket_repl) {
+        register_global_function(ctx, "PLANCK_PRINT_FN", function_print_fn_sender);
+        register_global_function(ctx, "PLANCK_PRINT_ERR_FN", function_print_fn_sender);
+    } else {
+        register_global_function(ctx, "PLANCK_PRINT_FN", function_print_fn);
+        register_global_function(ctx, "PLANCK_PRINT_ERR_FN", function_print_err_fn);
+    }
+    install_print_fns(ctx);
+
+    init_repl(ctx);
+
+    session->ctx = ctx;
+    session->execute_fn = get_protected_function(ctx, "planck.repl", "execute");
+    session->get_current_ns_fn = get_protected_function(ctx, "planck.repl", "get-current-ns");
+    session->is_readable_fn = get_protected_function(ctx, "planck.repl", "is-readable?");
+    session->next = NULL;
+
+    if (socket_repl) {
+        execute_source(ctx, session->execute_fn, "text", repl_requires_source, true, false, "cljs.user", "dumb", 0);
+    } else {
+        execute_source(ctx, session->execute_fn, "text", "(require 'planck.repl)", true, false, "cljs.user", "dumb",
+                       0);
+    }
+
+    init_data_readers(ctx);
+
+    if (socket_repl) {
+        maybe_load_user_file(ctx);
+    }
+
+    thread_sender = saved_sender;
+
+    if (config.verbose) {
+        fprintf(stderr, "%s context ready in %.1f ms\n", socket_repl ? "Socket REPL session" : "Worker",
+                1e-6 * (system_time() - start));
+    }
+
+    return session;
+}
+
+static void *fill_session_pool(void *data) {
+    while (true) {
+        pthread_mutex_lock(&session_pool_lock);
+        while (session_pool_count >= session_pool_size) {
+            pthread_cond_wait(&session_pool_cond, &session_pool_lock);
+        }
+        pthread_mutex_unlock(&session_pool_lock);
+
+        engine_session_t *session = create_engine_session(true);
+        if (!session) {
+            break;
+        }
+
+        pthread_mutex_lock(&session_pool_lock);
+        session->next = session_pool;
+        session_pool = session;
+        session_pool_count++;
+        pthread_mutex_unlock(&session_pool_lock);
+    }
+
+    return NULL;
+}
+
+int prewarm_engine_sessions(int count) {
+    pthread_mutex_lock(&session_pool_lock);
+    session_pool_size = count;
+    pthread_mutex_unlock(&session_pool_lock);
+
+    return start_planck_thread(fill_session_pool, NULL);
+}
+
+engine_session_t *acquire_engine_session() {
+    pthread_mutex_lock(&session_pool_lock);
+    engine_session_t *session = session_pool;
+    if (session) {
+        session_pool = session->next;
+        session_pool_count--;
+        session->next = NULL;
+        pthread_cond_signal(&session_pool_cond);
+    }
+    pthread_mutex_unlock(&session_pool_lock);
+
+    // Rather than wait on the pool, bootstrap a context on this thread
+    if (!session) {
+        session = create_engine_session(true);
+    }
+    return session;
+}
+
+engine_session_t *create_worker_session() {
+    return create_engine_session(false);
+}
+
+JSGlobalContextRef get_session_context(engine_session_t *session) {
+    return session->ctx;
+}
+
+void release_engine_session(engine_session_t *session) {
+    JSGlobalContextRef ctx = session->ctx;
+    JSValueUnprotect(ctx, session->execute_fn);
+    JSValueUnprotect(ctx, session->get_current_ns_fn);
+    JSValueUnprotect(ctx, session->is_readable_fn);
+    forget_loaded_goog(ctx);
+    JSGlobalContextRelease(ctx);
+    free(session);
+}
+
+void session_evaluate_source(engine_session_t *session, char *type, char *source, bool expression, bool print_nil,
+                             char *set_ns, const char *theme, int session_id) {
+    execute_source(session->ctx, session->execute_fn, type, source, expression, print_nil, set_ns, theme,
+                   session_id);
+}
+
+char *session_get_current_ns(engine_session_t *session) {
+    JSContextRef ctx = session->ctx;
+    JSValueRef result = JSObjectCallAsFunction(ctx, session->get_current_ns_fn, JSContextGetGlobalObject(ctx), 0,
+                                               NULL, NULL);
+    return value_to_c_string(ctx, result);
+}
+
+char *session_is_readable(engine_session_t *session, char *expression) {
+    JSContextRef ctx = session->ctx;
+    JSValueRef arguments[2];
+    arguments[0] = c_string_to_value(ctx, expression);
+    arguments[1] = c_string_to_value(ctx, "dumb");
+    JSValueRef result = JSObjectCallAsFunction(ctx, session->is_readable_fn, JSContextGetGlobalObject(ctx), 2,
+                                               arguments, NULL);
+    return value_to_c_string(ctx, result);
+}
@@ -17,7 +17,7 @@ void evaluate_source(char *type, char *source_value, bool expression, bool print
 
 char *munge(char *s);
 
-void bootstrap(char *out_path);
+void bootstrap(JSContextRef ctx, char *out_path);
 
 int block_until_engine_ready();
 
@@ -57,3 +57,28 @@ int indent_space_count(char *text);
 
 void highlight_coords_for_pos(int pos, const char *buf, size_t num_previous_lines,
                               char **previous_lines, int *num_lines_up, int *highlight_pos);
+
+void set_thread_print_sender(void (*sender)(const char *msg));
+
+bool is_main_context(JSContextRef context);
+
+// A context, separate from the main one, in which a socket REPL session or a
+// worker evaluates
+typedef struct engine_session engine_session_t;
+
+int prewarm_engine_sessions(int count);
+
+engine_session_t *acquire_engine_session();
+
+engine_session_t *create_worker_session();
+
+JSGlobalContextRef get_session_context(engine_session_t *session);
+
+void release_engine_session(engine_session_t *session);
+
+void session_evaluate_source(engine_session_t *session, char *type, char *source, bool expression, bool print_nil,
+                             char *set_ns, const char *theme, int session_id);
+
+char *session_get_current_ns(engine_session_t *session);
+
+char *session_is_readable(engine_session_t *session, char *expression);
@@ -24,6 +24,14 @@ descriptor_t ufile_open_write(const char *path, bool append, const char *encodin
     return ufile_open(path, encoding, (append ? "a" : "w"));
 }
 
+descriptor_t ufile_open_stream(FILE *file, const char *encoding) {
+    UFILE *ufile = u_fadopt(file, NULL, encoding);
+    if (ufile == NULL) {
+        fclose(file);
+    }
+    return ufile_to_descriptor(ufile);
+}
+
 JSStringRef ufile_read(descriptor_t descriptor) {
     UFILE *ufile = descriptor_to_ufile(descriptor);
     JSStringRef rv = NULL;
@@ -76,6 +84,10 @@ descriptor_t file_open_write(const char *path, bool append) {
     return file_open(path, (append ? "a" : "w"));
 }
 
+descriptor_t file_open_stream(FILE *file) {
+    return file_to_descriptor(file);
+}
+
 size_t file_read(descriptor_t descriptor, size_t buf_size, uint8_t *buf) {
     FILE *file = descriptor_to_file(descriptor);
     return fread(buf, sizeof(uint8_t), buf_size, file);
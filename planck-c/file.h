@@ -1,3 +1,4 @@
+#include <stdio.h>
 #include <JavaScriptCore/JavaScript.h>
 
 typedef unsigned long descriptor_t;
@@ -6,6 +7,9 @@ descriptor_t ufile_open_read(const char *path, const char *encoding);
 
 descriptor_t ufile_open_write(const char *path, bool append, const char *encoding);
 
+// Takes ownership of an open stream, closing it when the descriptor is closed
+descriptor_t ufile_open_stream(FILE *file, const char *encoding);
+
 JSStringRef ufile_read(descriptor_t descriptor);
 
 void ufile_write(descriptor_t descriptor, JSStringRef text);
@@ -18,6 +22,8 @@ descriptor_t file_open_read(const char *path);
 
 descriptor_t file_open_write(const char *path, bool append);
 
+descriptor_t file_open_stream(FILE *file);
+
 size_t file_read(descriptor_t descriptor, size_t buf_size, uint8_t *buffer);
 
 void file_write(descriptor_t descriptor, size_t buf_size, uint8_t *buffer);
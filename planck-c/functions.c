@@ -15,20 +15,28 @@
 #include <fcntl.h>
 
 #include <JavaScriptCore/JavaScript.h>
+#include "unicode/ustring.h"
 
 #include "bundle.h"
+#include "bundle_string.h"
 #include "globals.h"
 #include "io.h"
 #include "jsc_utils.h"
 #include "str.h"
 #include "archive.h"
+#include "classpath.h"
 #include "file.h"
 #include "timers.h"
 #include "engine.h"
 #include "repl.h"
 #include "clock.h"
 #include "sockets.h"
+#include "resolver.h"
 #include "tasks.h"
+#include "prelink.h"
+#include "loader.h"
+#include "prefetch.h"
+#include "cache_store.h"
 
 JSValueRef make_error_with_errno(JSContextRef ctx) {
     JSValueRef arguments[1];
@@ -88,15 +96,12 @@ JSValueRef function_read_file(JSContextRef ctx, JSObjectRef function, JSObjectRe
 
         // debug_print_value("read_file", ctx, args[0]);
 
-        time_t last_modified = 0;
-        char *contents = get_contents(path, &last_modified);
-        if (contents != NULL) {
-            JSStringRef contents_str = JSStringCreateWithUTF8CString(contents);
-            free(contents);
-
+        loaded_source_t source;
+        if (read_source(path, &source)) {
             JSValueRef res[2];
-            res[0] = JSValueMakeString(ctx, contents_str);
-            res[1] = JSValueMakeNumber(ctx, last_modified);
+            res[0] = JSValueMakeString(ctx, source.contents);
+            res[1] = JSValueMakeNumber(ctx, source.last_modified);
+            free_loaded_source(&source);
             return JSObjectMakeArray(ctx, 2, res, NULL);
         }
     }
@@ -117,113 +122,27 @@ JSValueRef function_load(JSContextRef ctx, JSObjectRef function, JSObjectRef thi
 
         // debug_print_value("load", ctx, args[0]);
 
-        time_t last_modified = 0;
-        char *contents = NULL;
-        char *loaded_path = strdup(path);
-        char *loaded_type = NULL;
-        char *loaded_location = NULL;
-
-        bool developing = (config.num_src_paths == 1 &&
-                           strcmp(config.src_paths[0].type, "src") == 0 &&
-                           str_has_suffix(config.src_paths[0].path, "/planck-cljs/src/") == 0);
-
-        if (!developing) {
-            contents = bundle_get_contents(path);
-            loaded_type = "bundled";
-            last_modified = 0;
-        }
-
-        // load from classpath
-        if (contents == NULL) {
-            int i;
-            for (i = 0; i < config.num_src_paths; i++) {
-                if (config.src_paths[i].blacklisted) {
-                    continue;
-                }
-
-                char *type = config.src_paths[i].type;
-                char *location = config.src_paths[i].path;
-
-                if (strcmp(type, "src") == 0) {
-                    char *full_path = str_concat(location, path);
-                    contents = get_contents(full_path, &last_modified);
-                    if (contents != NULL) {
-                        free(loaded_path);
-                        loaded_path = strdup(full_path);
-                        loaded_type = type;
-                        loaded_location = location;
-                    }
-                    free(full_path);
-                } else if (strcmp(type, "jar") == 0) {
-                    struct stat file_stat;
-                    if (stat(location, &file_stat) == 0) {
-                        char *error_msg = NULL;
-                        if (!config.src_paths[i].archive) {
-                            config.src_paths[i].archive = open_archive(location, &error_msg);
-                            if (error_msg) {
-                                engine_print(error_msg);
-                                engine_print("\n");
-                                free(error_msg);
-                            }
-                        }
-                        if (config.src_paths[i].archive) {
-                            contents_zip_t contents_zip;
-                            contents_zip = get_contents_zip(config.src_paths[i].archive, path,
-                                                            &last_modified, &error_msg);
-                            contents = (char *) contents_zip.payload;
-                            if (!contents && error_msg) {
-                                engine_print(error_msg);
-                                engine_print("\n");
-                                free(error_msg);
-                            }
-                        }
-                        loaded_type = type;
-                        loaded_location = location;
-                    } else {
-                        engine_perror(location);
-                        config.src_paths[i].blacklisted = true;
-                    }
-                }
-
-                if (contents != NULL) {
-                    break;
-                }
+        loaded_source_t source;
+        bool prefetched = prefetch_take(path, &source);
+        if (prefetched || load_source(path, false, &source)) {
+            if (!prefetched) {
+                prefetch_requires(path, source.contents);
             }
-        }
 
-        // load from out/
-        if (contents == NULL) {
-            if (config.out_path != NULL) {
-                char *full_path = str_concat(config.out_path, path);
-                contents = get_contents(full_path, &last_modified);
-                free(full_path);
-            }
-        }
-
-        if (developing && contents == NULL) {
-            contents = bundle_get_contents(path);
-            last_modified = 0;
-        }
-
-        if (contents != NULL) {
-            JSStringRef contents_str = JSStringCreateWithUTF8CString(contents);
-            free(contents);
-            JSStringRef loaded_path_str = JSStringCreateWithUTF8CString(loaded_path);
-            free(loaded_path);
-            JSStringRef loaded_type_str = JSStringCreateWithUTF8CString(loaded_type);
-            JSStringRef loaded_location_str = JSStringCreateWithUTF8CString(loaded_location);
+            JSStringRef loaded_path_str = JSStringCreateWithUTF8CString(source.path);
+            JSStringRef loaded_type_str = JSStringCreateWithUTF8CString(source.type);
+            JSStringRef loaded_location_str = JSStringCreateWithUTF8CString(source.location);
 
 
             JSValueRef res[5];
-            res[0] = JSValueMakeString(ctx, contents_str);
-            res[1] = JSValueMakeNumber(ctx, last_modified);
+            res[0] = JSValueMakeString(ctx, source.contents);
+            res[1] = JSValueMakeNumber(ctx, source.last_modified);
             res[2] = JSValueMakeString(ctx, loaded_path_str);
             res[3] = JSValueMakeString(ctx, loaded_type_str);
             res[4] = JSValueMakeString(ctx, loaded_location_str);
+            free_loaded_source(&source);
             return JSObjectMakeArray(ctx, 5, res, NULL);
         }
-
-        free(loaded_path);
     }
 
     return JSValueMakeNull(ctx);
@@ -244,21 +163,43 @@ JSValueRef function_load_all_files(const char* filename, JSContextRef ctx, JSObj
             char *type = config.src_paths[i].type;
             char *location = config.src_paths[i].path;
 
-            if (strcmp(type, "jar") == 0) {
+            if (strcmp(type, "jar") == 0 && classpath_indexed(i)) {
+                const classpath_entry_t *entry = classpath_lookup(filename);
+                while (entry && entry->src_path != i) {
+                    entry = entry->next;
+                }
+                if (entry) {
+                    char *error_msg = NULL;
+                    char *source = entry->contents ? strdup(entry->contents)
+                                                   : (char *) classpath_read(entry, &error_msg);
+                    if (source != NULL) {
+                        num_files += 1;
+                        paths = realloc(paths, num_files * sizeof(char *));
+                        sources = realloc(sources, num_files * sizeof(char *));
+                        char buffer[1024];
+                        snprintf(buffer, 1024, "jar:file://%s!/%s", location, filename);
+                        paths[num_files - 1] = strdup(buffer);
+                        sources[num_files - 1] = source;
+                    } else if (error_msg) {
+                        engine_print(error_msg);
+                        engine_print("\n");
+                        free(error_msg);
+                    }
+                }
+            } else if (strcmp(type, "jar") == 0) {
                 struct stat file_stat;
                 if (stat(location, &file_stat) == 0) {
                     char *error_msg = NULL;
-                    if (!config.src_paths[i].archive) {
-                        config.src_paths[i].archive = open_archive(location, &error_msg);
-                        if (error_msg) {
-                            engine_print(error_msg);
-                            engine_print("\n");
-                            free(error_msg);
-                        }
+                    void *archive = classpath_archive(i, &error_msg);
+                    if (error_msg) {
+                        engine_print(error_msg);
+                        engine_print("\n");
+                        free(error_msg);
+                        error_msg = NULL;
                     }
-                    if (config.src_paths[i].archive) {
+                    if (archive) {
                         contents_zip_t contents_zip;
-                        contents_zip = get_contents_zip(config.src_paths[i].archive, filename,
+                        contents_zip = get_contents_zip(archive, filename,
                                                         NULL, &error_msg);
                         char *source = (char *) contents_zip.payload;
                         if (source != NULL) {
@@ -360,9 +301,14 @@ JSValueRef function_load_from_jar(JSContextRef ctx, JSObjectRef function, JSObje
                 error_msg = strdup("Failed to open JAR");
             }
         } else {
-            contents = get_contents_zip(archive, resource_path, NULL, &error_msg);
-
-            close_archive(archive);
+            // Entries stored without compression are read in place
+            const uint8_t *view = convertToString ? NULL
+                                                  : get_contents_zip_view(archive, resource_path, &contents.length);
+            if (view) {
+                contents.payload = (uint8_t *) view;
+            } else {
+                contents = get_contents_zip(archive, resource_path, NULL, &error_msg);
+            }
 
             if (contents.payload != NULL) {
                 if (convertToString) {
@@ -373,12 +319,16 @@ JSValueRef function_load_from_jar(JSContextRef ctx, JSObjectRef function, JSObje
                         contents_arr[i] = JSValueMakeNumber(ctx, contents.payload[i]);
                     }
                 }
-                free(contents.payload);
+                if (!view) {
+                    free(contents.payload);
+                }
             } else {
                 if (!error_msg) {
                     error_msg = strdup("Resource not found in JAR");
                 }
             }
+
+            close_archive(archive);
         }
 
         JSStringRef error_msg_str = NULL;
@@ -408,49 +358,77 @@ JSValueRef function_load_from_jar(JSContextRef ctx, JSObjectRef function, JSObje
 
 JSValueRef function_cache(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
                           size_t argc, const JSValueRef args[], JSValueRef *exception) {
-    if (argc == 4 &&
+    if (argc == 5 &&
         JSValueGetType(ctx, args[0]) == kJSTypeString &&
         JSValueGetType(ctx, args[1]) == kJSTypeString &&
-        (JSValueGetType(ctx, args[2]) == kJSTypeString
-         || JSValueGetType(ctx, args[2]) == kJSTypeNull) &&
+        JSValueGetType(ctx, args[2]) == kJSTypeString &&
         (JSValueGetType(ctx, args[3]) == kJSTypeString
-         || JSValueGetType(ctx, args[3]) == kJSTypeNull)) {
+         || JSValueGetType(ctx, args[3]) == kJSTypeNull) &&
+        (JSValueGetType(ctx, args[4]) == kJSTypeString
+         || JSValueGetType(ctx, args[4]) == kJSTypeNull)) {
         // debug_print_value("cache", ctx, args[0]);
 
-        char *cache_prefix = value_to_c_string(ctx, args[0]);
-        char *source = value_to_c_string(ctx, args[1]);
-        char *cache = value_to_c_string(ctx, args[2]);
-        char *sourcemap = value_to_c_string(ctx, args[3]);
-
-        char *suffix = NULL;
-        int max_suffix_len = 20;
-        size_t prefix_len = strlen(cache_prefix);
-        char *path = malloc((prefix_len + max_suffix_len) * sizeof(char));
-        memset(path, 0, prefix_len + max_suffix_len);
-
-        suffix = ".js";
-        strcpy(path, cache_prefix);
-        strcat(path, suffix);
-        write_contents(path, source);
-
-        suffix = ".cache.json";
-        strcpy(path, cache_prefix);
-        strcat(path, suffix);
-        write_contents(path, cache);
-
-        suffix = ".js.map.json";
-        strcpy(path, cache_prefix);
-        strcat(path, suffix);
-        if (sourcemap) {
-            write_contents(path, sourcemap);
-        }
+        char *key = value_to_c_string(ctx, args[0]);
+        char *build_info = value_to_c_string(ctx, args[1]);
+        char *source = value_to_c_string(ctx, args[2]);
+        char *cache = value_to_c_string(ctx, args[3]);
+        char *sourcemap = value_to_c_string(ctx, args[4]);
 
-        free(cache_prefix);
+        cache_store_write(key, build_info, source, cache, sourcemap);
+
+        free(key);
+        free(build_info);
         free(source);
         free(cache);
         free(sourcemap);
+    }
 
-        free(path);
+    return JSValueMakeNull(ctx);
+}
+
+JSValueRef function_cache_key(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
+                              size_t argc, const JSValueRef args[], JSValueRef *exception) {
+    if (argc == 2 &&
+        JSValueGetType(ctx, args[0]) == kJSTypeString &&
+        JSValueGetType(ctx, args[1]) == kJSTypeString) {
+        char *name = value_to_c_string(ctx, args[0]);
+        JSStringRef source_str = JSValueToStringCopy(ctx, args[1], NULL);
+        char *key = cache_store_key(name, source_str);
+        JSStringRelease(source_str);
+        free(name);
+        JSValueRef rv = c_string_to_value(ctx, key);
+        free(key);
+        return rv;
+    }
+
+    return JSValueMakeNull(ctx);
+}
+
+JSValueRef function_cache_read(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
+                               size_t argc, const JSValueRef args[], JSValueRef *exception) {
+    if (argc == 3 &&
+        JSValueGetType(ctx, args[0]) == kJSTypeString &&
+        JSValueGetType(ctx, args[1]) == kJSTypeString) {
+        char *key = value_to_c_string(ctx, args[0]);
+        char *build_info = value_to_c_string(ctx, args[1]);
+        bool source_map = JSValueToBoolean(ctx, args[2]);
+
+        JSValueRef rv = JSValueMakeNull(ctx);
+        cache_entry_t entry;
+        if (prefetch_take_cache_entry(key, &entry) || cache_store_read(key, build_info, source_map, &entry)) {
+            if (strcmp(entry.build_info, build_info) == 0) {
+                JSValueRef res[3];
+                res[0] = JSValueMakeString(ctx, entry.js);
+                res[1] = entry.analysis_cache ? JSValueMakeString(ctx, entry.analysis_cache) : JSValueMakeNull(ctx);
+                res[2] = entry.source_map && source_map ? JSValueMakeString(ctx, entry.source_map) : JSValueMakeNull(ctx);
+                rv = JSObjectMakeArray(ctx, 3, res, NULL);
+            }
+            free_cache_entry(&entry);
+        }
+
+        free(key);
+        free(build_info);
+        return rv;
     }
 
     return JSValueMakeNull(ctx);
@@ -602,22 +580,114 @@ unsigned long hash(unsigned char *str) {
     return hash;
 }
 
-static unsigned long loaded_goog_hashes[2048];
-static size_t count_loaded_goog_hashes = 0;
+// Tracks the goog files loaded into each context. Besides the main context
+// there may be a context per socket REPL session. The hashes of their paths
+// are kept in an open addressing hash set, in which 0 marks an empty slot.
+typedef struct loaded_goog {
+    JSGlobalContextRef ctx;
+    unsigned long *hashes;
+    size_t capacity;
+    size_t count;
+    // Set while prelinked startup files are evaluated
+    bool prelinking;
+    struct loaded_goog *next;
+} loaded_goog_t;
+
+static pthread_mutex_t loaded_goog_lock = PTHREAD_MUTEX_INITIALIZER;
+static loaded_goog_t *loaded_goog = NULL;
+
+static loaded_goog_t *loaded_goog_for_context(JSContextRef ctx) {
+    JSGlobalContextRef global_ctx = JSContextGetGlobalContext(ctx);
+
+    pthread_mutex_lock(&loaded_goog_lock);
+    loaded_goog_t *entry = loaded_goog;
+    while (entry && entry->ctx != global_ctx) {
+        entry = entry->next;
+    }
+    if (!entry) {
+        entry = malloc(sizeof(loaded_goog_t));
+        if (entry) {
+            entry->ctx = global_ctx;
+            entry->hashes = NULL;
+            entry->capacity = 0;
+            entry->count = 0;
+            entry->prelinking = false;
+            entry->next = loaded_goog;
+            loaded_goog = entry;
+        }
+    }
+    pthread_mutex_unlock(&loaded_goog_lock);
 
-bool is_loaded(unsigned long h) {
-    size_t i;
-    for (i = 0; i < count_loaded_goog_hashes; ++i) {
-        if (loaded_goog_hashes[i] == h) {
-            return true;
+    return entry;
+}
+
+void forget_loaded_goog(JSGlobalContextRef ctx) {
+    pthread_mutex_lock(&loaded_goog_lock);
+    loaded_goog_t **p = &loaded_goog;
+    while (*p) {
+        if ((*p)->ctx == ctx) {
+            loaded_goog_t *entry = *p;
+            *p = entry->next;
+            free(entry->hashes);
+            free(entry);
+            break;
+        }
+        p = &(*p)->next;
+    }
+    pthread_mutex_unlock(&loaded_goog_lock);
+}
+
+static size_t loaded_slot(unsigned long *hashes, size_t capacity, unsigned long h) {
+    size_t i = h & (capacity - 1);
+    while (hashes[i] != 0 && hashes[i] != h) {
+        i = (i + 1) & (capacity - 1);
+    }
+    return i;
+}
+
+bool is_loaded(loaded_goog_t *loaded, unsigned long h) {
+    h = h ? h : 1;
+    return loaded->count > 0 && loaded->hashes[loaded_slot(loaded->hashes, loaded->capacity, h)] == h;
+}
+
+void add_loaded_hash(loaded_goog_t *loaded, unsigned long h) {
+    h = h ? h : 1;
+    // Grow to keep the set at most half full
+    if (2 * (loaded->count + 1) > loaded->capacity) {
+        size_t capacity = loaded->capacity ? 2 * loaded->capacity : 512;
+        unsigned long *hashes = calloc(capacity, sizeof(unsigned long));
+        if (!hashes) {
+            return;
+        }
+        size_t i;
+        for (i = 0; i < loaded->capacity; i++) {
+            if (loaded->hashes[i] != 0) {
+                hashes[loaded_slot(hashes, capacity, loaded->hashes[i])] = loaded->hashes[i];
+            }
         }
+        free(loaded->hashes);
+        loaded->hashes = hashes;
+        loaded->capacity = capacity;
+    }
+    size_t i = loaded_slot(loaded->hashes, loaded->capacity, h);
+    if (loaded->hashes[i] == 0) {
+        loaded->hashes[i] = h;
+        loaded->count++;
     }
-    return false;
 }
 
-void add_loaded_hash(unsigned long h) {
-    if (count_loaded_goog_hashes < 2048) {
-        loaded_goog_hashes[count_loaded_goog_hashes++] = h;
+void mark_goog_loaded(JSContextRef ctx, const char *path) {
+    loaded_goog_t *loaded = loaded_goog_for_context(ctx);
+    unsigned long h = hash((unsigned char *) path);
+    if (loaded && !is_loaded(loaded, h)) {
+        add_loaded_hash(loaded, h);
+    }
+}
+
+void set_prelinking(JSContextRef ctx, bool prelinking) {
+    loaded_goog_t *loaded = loaded_goog_for_context(ctx);
+    if (loaded) {
+        loaded->prelinking = prelinking;
     }
 }
 
@@ -633,31 +703,44 @@ JSValueRef function_import_script(JSContextRef ctx, JSObjectRef function, JSObje
 
         bool can_skip_load = false;
         char *path = tmp;
+        loaded_goog_t *loaded = loaded_goog_for_context(ctx);
         if (str_has_prefix(path, "goog/../") == 0) {
             path = path + 8;
         } else {
             unsigned long h = hash((unsigned char *) path);
-            if (is_loaded(h)) {
-                can_skip_load = true;
-            } else {
-                add_loaded_hash(h);
+            if (loaded) {
+                if (is_loaded(loaded, h)) {
+                    can_skip_load = true;
+                } else {
+                    add_loaded_hash(loaded, h);
+                }
             }
         }
 
+        // Prelinked files are evaluated in dependency order, so anything they
+        // import has already been evaluated
+        if (loaded && loaded->prelinking && prelink_contains(path)) {
+            can_skip_load = true;
+        }
+
         if (!can_skip_load) {
-            char *source = NULL;
             if (config.out_path == NULL) {
-                source = bundle_get_contents(path);
+                JSStringRef source = bundle_string_create(path);
+                if (source != NULL) {
+                    evaluate_script_string(ctx, source, path);
+                    display_launch_timing(path);
+                    prelink_trace(path);
+                    JSStringRelease(source);
+                }
             } else {
                 char *full_path = str_concat(config.out_path, path);
-                source = get_contents(full_path, NULL);
+                char *source = get_contents(full_path, NULL);
                 free(full_path);
-            }
-
-            if (source != NULL) {
-                evaluate_script(ctx, source, path);
-                display_launch_timing(path);
-                free(source);
+                if (source != NULL) {
+                    evaluate_script(ctx, source, path);
+                    display_launch_timing(path);
+                    free(source);
+                }
             }
         }
     }
@@ -876,6 +959,66 @@ JSValueRef function_file_input_stream_close(JSContextRef ctx, JSObjectRef functi
     return JSValueMakeNull(ctx);
 }
 
+// Opens a resource in a JAR as a reader or input stream, streaming it rather
+// than extracting it, and returns its descriptor along with any error
+static JSValueRef jar_stream_open(JSContextRef ctx, const JSValueRef args[], bool reader) {
+    char *jar_path = value_to_c_string(ctx, args[0]);
+    char *resource_path = value_to_c_string(ctx, args[1]);
+
+    descriptor_t descriptor = 0;
+    char *error_msg = NULL;
+    FILE *file = open_archive_stream(jar_path, resource_path, &error_msg);
+    if (file) {
+        if (reader) {
+            char *encoding = value_to_c_string(ctx, args[2]);
+            descriptor = ufile_open_stream(file, encoding);
+            free(encoding);
+        } else {
+            descriptor = file_open_stream(file);
+        }
+        if (!descriptor) {
+            error_msg = strdup("Failed to open resource in JAR");
+        }
+    } else if (!error_msg) {
+        error_msg = strdup("Resource not found in JAR");
+    }
+
+    free(jar_path);
+    free(resource_path);
+
+    char *descriptor_str = descriptor_int_to_str(descriptor);
+    JSValueRef res[2];
+    res[0] = c_string_to_value(ctx, descriptor_str);
+    res[1] = error_msg ? c_string_to_value(ctx, error_msg) : JSValueMakeNull(ctx);
+    free(descriptor_str);
+    free(error_msg);
+
+    return JSObjectMakeArray(ctx, 2, res, NULL);
+}
+
+JSValueRef function_jar_reader_open(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
+                                    size_t argc, const JSValueRef args[], JSValueRef *exception) {
+    if (argc == 3
+        && JSValueGetType(ctx, args[0]) == kJSTypeString
+        && JSValueGetType(ctx, args[1]) == kJSTypeString
+        && JSValueGetType(ctx, args[2]) == kJSTypeString) {
+        return jar_stream_open(ctx, args, true);
+    }
+
+    return JSValueMakeNull(ctx);
+}
+
+JSValueRef function_jar_input_stream_open(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
+                                          size_t argc, const JSValueRef args[], JSValueRef *exception) {
+    if (argc == 2
+        && JSValueGetType(ctx, args[0]) == kJSTypeString
+        && JSValueGetType(ctx, args[1]) == kJSTypeString) {
+        return jar_stream_open(ctx, args, false);
+    }
+
+    return JSValueMakeNull(ctx);
+}
+
 JSValueRef function_file_output_stream_open(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
                                             size_t argc, const JSValueRef args[], JSValueRef *exception) {
     if (argc == 2
@@ -1273,14 +1416,10 @@ JSValueRef function_read_password(JSContextRef ctx, JSObjectRef function, JSObje
     return JSValueMakeNull(ctx);
 }
 
-void do_run_timeout(void *data) {
-
-    unsigned long *timeout_data = data;
+void run_timeout_task(void *data) {
 
-    acquire_eval_lock();
     JSValueRef args[1];
-    args[0] = JSValueMakeNumber(ctx, (double)*timeout_data);
-    free(timeout_data);
+    args[0] = JSValueMakeNumber(ctx, (double)(uintptr_t)data);
 
     static JSObjectRef run_timeout_fn = NULL;
     if (!run_timeout_fn) {
@@ -1288,10 +1427,14 @@ void do_run_timeout(void *data) {
         JSValueProtect(ctx, run_timeout_fn);
     }
     JSObjectCallAsFunction(ctx, run_timeout_fn, NULL, 1, args, NULL);
-    release_eval_lock();
 }
 
-static unsigned long timeout_id = 0;
+void do_run_timeout(unsigned long timer_id, void *data) {
+    int err = post_task(run_timeout_task, (void *)(uintptr_t)timer_id);
+    if (err) {
+        engine_print_err_message("timeout post_task", err);
+    }
+}
 
 JSValueRef function_set_timeout(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
                                 size_t argc, const JSValueRef args[], JSValueRef *exception) {
@@ -1300,37 +1443,26 @@ JSValueRef function_set_timeout(JSContextRef ctx, JSObjectRef function, JSObject
 
         int millis = (int) JSValueToNumber(ctx, args[0], NULL);
 
-        if (timeout_id == 9007199254740991) {
-            timeout_id = 0;
-        } else {
-            ++timeout_id;
+        unsigned long timeout_id = start_timer(millis, do_run_timeout, NULL);
+        if (!timeout_id) {
+            *exception = make_error_with_errno(ctx);
+            return JSValueMakeNull(ctx);
         }
 
-        JSValueRef rv = JSValueMakeNumber(ctx, (double)timeout_id);
-
-        unsigned long *timeout_data = malloc(sizeof(unsigned long));
-        *timeout_data = timeout_id;
-
         int err = signal_task_started();
         if (err) {
             engine_print_err_message("signal_task_started", err);
         }
 
-        start_timer(millis, do_run_timeout, (void *) timeout_data);
-
-        return rv;
+        return JSValueMakeNumber(ctx, (double)timeout_id);
     }
     return JSValueMakeNull(ctx);
 }
 
-void do_run_interval(void *data) {
-
-    unsigned long *interval_data = data;
+void run_interval_task(void *data) {
 
-    acquire_eval_lock();
     JSValueRef args[1];
-    args[0] = JSValueMakeNumber(ctx, (double)*interval_data);
-    free(interval_data);
+    args[0] = JSValueMakeNumber(ctx, (double)(uintptr_t)data);
 
     static JSObjectRef run_interval_fn = NULL;
     if (!run_interval_fn) {
@@ -1339,44 +1471,46 @@ void do_run_interval(void *data) {
     }
 
     JSObjectCallAsFunction(ctx, run_interval_fn, NULL, 1, args, NULL);
-    release_eval_lock();
 }
 
-static unsigned long interval_id = 0;
+void do_run_interval(unsigned long timer_id, void *data) {
+    int err = post_task(run_interval_task, (void *)(uintptr_t)timer_id);
+    if (err) {
+        engine_print_err_message("interval post_task", err);
+    }
+}
 
 JSValueRef function_set_interval(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
                                  size_t argc, const JSValueRef args[], JSValueRef *exception) {
-    if (argc == 2
+    if (argc == 1
         && JSValueGetType(ctx, args[0]) == kJSTypeNumber) {
 
         int millis = (int) JSValueToNumber(ctx, args[0], NULL);
 
-        unsigned long curr_interval_id;
-
-        if (JSValueIsNull(ctx, args[1])) {
-            if (interval_id == 9007199254740991) {
-                interval_id = 0;
-            } else {
-                ++interval_id;
-            }
-            curr_interval_id = interval_id;
+        unsigned long interval_id = start_interval(millis, do_run_interval, NULL);
+        if (!interval_id) {
+            *exception = make_error_with_errno(ctx);
+            return JSValueMakeNull(ctx);
+        }
 
-            int err = signal_task_started();
-            if (err) {
-                engine_print_err_message("signal_task_started", err);
-            }
-        } else {
-            curr_interval_id = (unsigned long) JSValueToNumber(ctx, args[1], NULL);
+        int err = signal_task_started();
+        if (err) {
+            engine_print_err_message("signal_task_started", err);
         }
 
-        JSValueRef rv = JSValueMakeNumber(ctx, (double)curr_interval_id);
+        return JSValueMakeNumber(ctx, (double)interval_id);
+    }
+    return JSValueMakeNull(ctx);
+}
 
-        unsigned long *interval_data = malloc(sizeof(unsigned long));
-        *interval_data = curr_interval_id;
+JSValueRef function_clear_timer(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
+                                size_t argc, const JSValueRef args[], JSValueRef *exception) {
+    if (argc == 1
+        && JSValueGetType(ctx, args[0]) == kJSTypeNumber) {
 
-        start_timer(millis, do_run_interval, (void *) interval_data);
+        unsigned long timer_id = (unsigned long) JSValueToNumber(ctx, args[0], NULL);
 
-        return rv;
+        return JSValueMakeBoolean(ctx, cancel_timer(timer_id));
     }
     return JSValueMakeNull(ctx);
 }
@@ -1388,84 +1522,403 @@ JSValueRef function_high_res_timer(JSContextRef ctx, JSObjectRef function, JSObj
 
 }
 
+JSValueRef function_task_queue_stats(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
+                                     size_t argc, const JSValueRef args[], JSValueRef *exception) {
+    struct task_queue_stats stats;
+    get_task_queue_stats(&stats);
+
+    JSValueRef arguments[5];
+    arguments[0] = JSValueMakeNumber(ctx, (double)stats.depth);
+    arguments[1] = JSValueMakeNumber(ctx, (double)stats.run);
+    arguments[2] = JSValueMakeNumber(ctx, (double)stats.batches);
+    arguments[3] = JSValueMakeNumber(ctx, 1e-6 * stats.max_latency);
+    arguments[4] = JSValueMakeNumber(ctx, stats.run ? 1e-6 * stats.total_latency / stats.run : 0);
+    return JSObjectMakeArray(ctx, 5, arguments, NULL);
+}
+
 typedef struct data_arrived_info {
     JSObjectRef data_arrived_cb;
+    JSObjectRef drain_cb;
+    JSObjectRef connect_cb;
+    bool binary;
 } data_arrived_info_t;
 
-conn_data_cb_ret_t *socket_conn_data_arrived(char *data, int sock, void *info) {
+typedef struct data_arrived_task {
+    data_arrived_info_t *data_arrived_info;
+    int sock;
+    char *data;
+    size_t len;
+    JSStringRef text;
+} data_arrived_task_t;
 
-    data_arrived_info_t *data_arrived_info = info;
+static void free_bytes(void *bytes, void *deallocator_context) {
+    free(bytes);
+}
+
+// Hands ownership of data to a new Uint8Array
+static JSValueRef make_uint8_array(JSContextRef ctx, char *data, size_t len) {
+#ifdef HAVE_JSC_TYPED_ARRAYS
+    JSObjectRef array = JSObjectMakeTypedArrayWithBytesNoCopy(ctx, kJSTypedArrayTypeUint8Array, data, len,
+                                                              free_bytes, NULL, NULL);
+    if (array) {
+        return array;
+    }
+    free(data);
+    return JSValueMakeNull(ctx);
+#else
+    JSValueRef *bytes = malloc(sizeof(JSValueRef) * len);
+    size_t i;
+    for (i = 0; i < len; i++) {
+        bytes[i] = JSValueMakeNumber(ctx, (uint8_t) data[i]);
+    }
+    JSValueRef args[1];
+    args[0] = JSObjectMakeArray(ctx, len, bytes, NULL);
+    free(bytes);
+    free(data);
+
+    JSStringRef name = JSStringCreateWithUTF8CString("Uint8Array");
+    JSObjectRef constructor = JSValueToObject(ctx, JSObjectGetProperty(ctx, JSContextGetGlobalObject(ctx), name, NULL),
+                                              NULL);
+    JSStringRelease(name);
+    return JSObjectCallAsConstructor(ctx, constructor, 1, args, NULL);
+#endif
+}
+
+// Decodes UTF-8 (which may contain NULs), substituting U+FFFD for malformed sequences
+static JSStringRef utf8_to_js_string(const char *data, size_t len) {
+    UChar *chars = malloc(sizeof(UChar) * (len + 1));
+    int32_t chars_len = 0;
+    UErrorCode status = U_ZERO_ERROR;
+    u_strFromUTF8WithSub(chars, (int32_t) len + 1, &chars_len, data, (int32_t) len, 0xFFFD, NULL, &status);
+    JSStringRef text = U_SUCCESS(status) ? JSStringCreateWithCharacters((const JSChar *) chars, (size_t) chars_len)
+                                         : JSStringCreateWithUTF8CString(data);
+    free(chars);
+    return text;
+}
+
+void socket_data_arrived_task(void *data) {
+
+    data_arrived_task_t *data_arrived_task = data;
+    data_arrived_info_t *data_arrived_info = data_arrived_task->data_arrived_info;
 
-    acquire_eval_lock();
     JSValueRef args[2];
-    args[0] = JSValueMakeNumber(ctx, sock);
+    args[0] = JSValueMakeNumber(ctx, data_arrived_task->sock);
 
-    if (data) {
-        // TODO what if we need bytes instead of dealing with an encoding?
-        args[1] = JSValueMakeString(ctx, JSStringCreateWithUTF8CString(data));
+    if (data_arrived_task->text) {
+        args[1] = JSValueMakeString(ctx, data_arrived_task->text);
+        JSStringRelease(data_arrived_task->text);
+    } else if (data_arrived_task->data) {
+        args[1] = make_uint8_array(ctx, data_arrived_task->data, data_arrived_task->len);
     } else {
         args[1] = JSValueMakeNull(ctx);
     }
 
-    JSObjectCallAsFunction(ctx, data_arrived_info->data_arrived_cb, NULL, 2, args, NULL);
-    release_eval_lock();
+    if (data_arrived_info->data_arrived_cb) {
+        JSObjectCallAsFunction(ctx, data_arrived_info->data_arrived_cb, NULL, 2, args, NULL);
+    }
+
+    free(data_arrived_task);
+}
+
+conn_data_cb_ret_t *socket_conn_data_arrived(char *data, size_t len, int sock, void *info) {
+
+    data_arrived_info_t *data_arrived_info = info;
+
+    data_arrived_task_t *data_arrived_task = malloc(sizeof(data_arrived_task_t));
+    data_arrived_task->data_arrived_info = data_arrived_info;
+    data_arrived_task->sock = sock;
+    data_arrived_task->data = NULL;
+    data_arrived_task->len = len;
+    data_arrived_task->text = NULL;
+
+    // Text is decoded here, on a socket worker thread, rather than under the eval lock
+    if (data && data_arrived_info->binary) {
+        data_arrived_task->data = data;
+    } else if (data) {
+        data_arrived_task->text = utf8_to_js_string(data, len);
+        free(data);
+    }
+
+    int err = post_task(socket_data_arrived_task, data_arrived_task);
+    if (err) {
+        free(data_arrived_task->data);
+        if (data_arrived_task->text) {
+            JSStringRelease(data_arrived_task->text);
+        }
+        free(data_arrived_task);
+    }
 
     conn_data_cb_ret_t *conn_data_arrived_ret = malloc(sizeof(conn_data_cb_ret_t));
 
-    conn_data_arrived_ret->err = 0;
+    conn_data_arrived_ret->err = err;
     conn_data_arrived_ret->close = false;
 
     return conn_data_arrived_ret;
 }
 
+void socket_drained_task(void *data) {
+
+    data_arrived_task_t *drained_task = data;
+
+    JSValueRef args[1];
+    args[0] = JSValueMakeNumber(ctx, drained_task->sock);
+
+    JSObjectCallAsFunction(ctx, drained_task->data_arrived_info->drain_cb, NULL, 1, args, NULL);
+
+    free(drained_task);
+}
+
+void socket_conn_drained(int sock, void *info) {
+
+    data_arrived_info_t *data_arrived_info = info;
+    if (!data_arrived_info || !data_arrived_info->drain_cb) {
+        return;
+    }
+
+    data_arrived_task_t *drained_task = malloc(sizeof(data_arrived_task_t));
+    drained_task->data_arrived_info = data_arrived_info;
+    drained_task->sock = sock;
+    drained_task->data = NULL;
+
+    if (post_task(socket_drained_task, drained_task)) {
+        free(drained_task);
+    }
+}
+
+static void free_data_arrived_info(JSContextRef ctx, data_arrived_info_t *data_arrived_info) {
+    JSValueUnprotect(ctx, data_arrived_info->data_arrived_cb);
+    if (data_arrived_info->drain_cb) {
+        JSValueUnprotect(ctx, data_arrived_info->drain_cb);
+    }
+    if (data_arrived_info->connect_cb) {
+        JSValueUnprotect(ctx, data_arrived_info->connect_cb);
+    }
+    free(data_arrived_info);
+}
+
+typedef struct connect_task {
+    data_arrived_info_t *data_arrived_info;
+    int sock;
+    char *err;
+} connect_task_t;
+
+void socket_connected_task(void *data) {
+
+    connect_task_t *connect_task = data;
+    data_arrived_info_t *data_arrived_info = connect_task->data_arrived_info;
+
+    JSValueRef args[2];
+    if (connect_task->sock == -1) {
+        JSValueRef arguments[1];
+        arguments[0] = c_string_to_value(ctx, connect_task->err);
+        args[0] = JSValueMakeNull(ctx);
+        args[1] = JSObjectMakeError(ctx, 1, arguments, NULL);
+    } else {
+        args[0] = JSValueMakeNumber(ctx, connect_task->sock);
+        args[1] = JSValueMakeNull(ctx);
+    }
+
+    JSObjectRef connect_cb = data_arrived_info->connect_cb;
+    JSObjectCallAsFunction(ctx, connect_cb, NULL, 2, args, NULL);
+
+    if (connect_task->sock == -1) {
+        free_data_arrived_info(ctx, data_arrived_info);
+    } else {
+        data_arrived_info->connect_cb = NULL;
+        JSValueUnprotect(ctx, connect_cb);
+    }
+
+    free(connect_task->err);
+    free(connect_task);
+}
+
+void socket_connected(int sock, const char *err, void *info) {
+
+    connect_task_t *connect_task = malloc(sizeof(connect_task_t));
+    connect_task->data_arrived_info = info;
+    connect_task->sock = sock;
+    connect_task->err = err ? strdup(err) : NULL;
+
+    if (post_task(socket_connected_task, connect_task)) {
+        free(connect_task->err);
+        free(connect_task);
+    }
+}
+
 typedef struct accept_info {
     JSObjectRef accept_cb;
+    JSObjectRef drain_cb;
+    bool binary;
 } accept_info_t;
 
-accepted_conn_cb_ret_t *accepted_socket_connection(int sock, void *info) {
+typedef struct accept_task {
+    accept_info_t *accept_info;
+    int sock;
+    data_arrived_info_t *data_arrived_info;
+} accept_task_t;
 
-    accept_info_t *accept_info = info;
+void socket_accept_task(void *data) {
+
+    accept_task_t *accept_task = data;
 
-    acquire_eval_lock();
     JSValueRef args[1];
-    args[0] = JSValueMakeNumber(ctx, sock);
+    args[0] = JSValueMakeNumber(ctx, accept_task->sock);
+
+    JSValueRef data_arrived_cb_ref = JSObjectCallAsFunction(ctx, accept_task->accept_info->accept_cb, NULL,
+                                                            1, args, NULL);
 
-    JSValueRef data_arrived_cb_ref = JSObjectCallAsFunction(ctx, accept_info->accept_cb, NULL, 1, args, NULL);
+    if (data_arrived_cb_ref && JSValueIsObject(ctx, data_arrived_cb_ref)) {
+        accept_task->data_arrived_info->data_arrived_cb = JSValueToObject(ctx, data_arrived_cb_ref, NULL);
+        JSValueProtect(ctx, data_arrived_cb_ref);
+    }
 
+    free(accept_task);
+}
+
+accepted_conn_cb_ret_t *accepted_socket_connection(int sock, void *info) {
+
+    accept_info_t *accept_info = info;
+
+    // Data arriving on the socket is queued behind this accept task, so
+    // the data handler will have been filled in by the time it is needed.
     data_arrived_info_t *data_arrived_info = malloc(sizeof(data_arrived_info_t));
-    data_arrived_info->data_arrived_cb = JSValueToObject(ctx, data_arrived_cb_ref, NULL);
-    JSValueProtect(ctx, data_arrived_cb_ref);
-    release_eval_lock();
+    data_arrived_info->data_arrived_cb = NULL;
+    data_arrived_info->drain_cb = accept_info->drain_cb;
+    data_arrived_info->connect_cb = NULL;
+    data_arrived_info->binary = accept_info->binary;
+
+    accept_task_t *accept_task = malloc(sizeof(accept_task_t));
+    accept_task->accept_info = accept_info;
+    accept_task->sock = sock;
+    accept_task->data_arrived_info = data_arrived_info;
+
+    int err = post_task(socket_accept_task, accept_task);
+    if (err) {
+        free(accept_task);
+    }
 
     accepted_conn_cb_ret_t *accepted_conn_cb_ret = malloc(sizeof(accepted_conn_cb_ret_t));
 
-    accepted_conn_cb_ret->err = 0;
+    accepted_conn_cb_ret->err = err;
     accepted_conn_cb_ret->info = data_arrived_info;
 
     return accepted_conn_cb_ret;
 }
 
+static JSValueRef get_socket_opt(JSContextRef ctx, JSValueRef opts_ref, const char *name) {
+    if (!JSValueIsObject(ctx, opts_ref)) {
+        return JSValueMakeUndefined(ctx);
+    }
+    JSStringRef name_str = JSStringCreateWithUTF8CString(name);
+    JSValueRef val = JSObjectGetProperty(ctx, JSValueToObject(ctx, opts_ref, NULL), name_str, NULL);
+    JSStringRelease(name_str);
+    return val;
+}
+
+// Reads the options common to connected and listening sockets, returning the drain handler, if any.
+static JSObjectRef read_socket_opts(JSContextRef ctx, JSValueRef opts_ref, socket_opts_t *opts) {
+    memset(opts, 0, sizeof(socket_opts_t));
+
+    JSValueRef receive_buffer_size_ref = get_socket_opt(ctx, opts_ref, "receive-buffer-size");
+    if (JSValueIsNumber(ctx, receive_buffer_size_ref)) {
+        opts->receive_buffer_size = (size_t) JSValueToNumber(ctx, receive_buffer_size_ref, NULL);
+    }
+    opts->binary = JSValueToBoolean(ctx, get_socket_opt(ctx, opts_ref, "binary?"));
+
+    JSValueRef framing_ref = get_socket_opt(ctx, opts_ref, "framing");
+    if (JSValueIsString(ctx, framing_ref)) {
+        char *framing = value_to_c_string(ctx, framing_ref);
+        if (strcmp(framing, "line") == 0) {
+            opts->framing = SOCKET_FRAMING_LINE;
+        } else if (strcmp(framing, "length-prefixed-u32") == 0) {
+            opts->framing = SOCKET_FRAMING_LENGTH_PREFIXED_U32;
+        } else if (strcmp(framing, "delimiter") == 0) {
+            opts->framing = SOCKET_FRAMING_DELIMITER;
+        }
+        free(framing);
+    }
+    JSValueRef delimiter_ref = get_socket_opt(ctx, opts_ref, "delimiter");
+    if (JSValueIsString(ctx, delimiter_ref)) {
+        char *delimiter = value_to_c_string(ctx, delimiter_ref);
+        size_t delimiter_len = strlen(delimiter);
+        if (delimiter_len <= MAX_SOCKET_DELIMITER_LEN) {
+            memcpy(opts->delimiter, delimiter, delimiter_len);
+            opts->delimiter_len = delimiter_len;
+        }
+        free(delimiter);
+    }
+    JSValueRef max_frame_size_ref = get_socket_opt(ctx, opts_ref, "max-frame-size");
+    if (JSValueIsNumber(ctx, max_frame_size_ref)) {
+        opts->max_frame_size = (size_t) JSValueToNumber(ctx, max_frame_size_ref, NULL);
+    }
+
+    JSValueRef high_watermark_ref = get_socket_opt(ctx, opts_ref, "high-watermark");
+    if (JSValueIsNumber(ctx, high_watermark_ref)) {
+        opts->high_watermark = (size_t) JSValueToNumber(ctx, high_watermark_ref, NULL);
+    }
+    JSValueRef low_watermark_ref = get_socket_opt(ctx, opts_ref, "low-watermark");
+    if (JSValueIsNumber(ctx, low_watermark_ref)) {
+        opts->low_watermark = (size_t) JSValueToNumber(ctx, low_watermark_ref, NULL);
+    }
+
+    JSValueRef drain_cb_ref = get_socket_opt(ctx, opts_ref, "drain-handler");
+    if (JSValueIsObject(ctx, drain_cb_ref)) {
+        opts->conn_drain_cb = socket_conn_drained;
+        JSValueProtect(ctx, drain_cb_ref);
+        return JSValueToObject(ctx, drain_cb_ref, NULL);
+    }
+    return NULL;
+}
+
 JSValueRef function_socket_connect(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
                                    size_t argc, JSValueRef const *args, JSValueRef *exception) {
-    if (argc == 3
+    if (argc == 4
         && JSValueGetType(ctx, args[0]) == kJSTypeString
-        && JSValueGetType(ctx, args[1]) == kJSTypeNumber
+        && (JSValueGetType(ctx, args[1]) == kJSTypeNumber || JSValueIsNull(ctx, args[1]))
         && JSValueGetType(ctx, args[2]) == kJSTypeObject) {
 
+        // A null port means that host is a UNIX domain socket path
         char *host = value_to_c_string(ctx, args[0]);
-        int port = (int) JSValueToNumber(ctx, args[1], NULL);
+        bool unix_domain = JSValueIsNull(ctx, args[1]);
+        int port = unix_domain ? 0 : (int) JSValueToNumber(ctx, args[1], NULL);
 
         JSValueRef data_arrived_cb_ref = args[2];
 
+        socket_opts_t opts;
         data_arrived_info_t *data_arrived_info = malloc(sizeof(data_arrived_info_t));
         data_arrived_info->data_arrived_cb = JSValueToObject(ctx, data_arrived_cb_ref, NULL);
+        data_arrived_info->drain_cb = read_socket_opts(ctx, args[3], &opts);
+        data_arrived_info->connect_cb = NULL;
+        data_arrived_info->binary = opts.binary;
         JSValueProtect(ctx, data_arrived_cb_ref);
 
-        int sock = connect_socket(host, port, socket_conn_data_arrived, data_arrived_info);
+        // With a connect handler, connect in the background and report the socket to it
+        JSValueRef connect_cb_ref = get_socket_opt(ctx, args[3], "connect-handler");
+        if (JSValueIsObject(ctx, connect_cb_ref)) {
+            data_arrived_info->connect_cb = JSValueToObject(ctx, connect_cb_ref, NULL);
+            JSValueProtect(ctx, connect_cb_ref);
+        }
+
+        int sock;
+        if (unix_domain) {
+            sock = connect_unix_socket(host, socket_conn_data_arrived, data_arrived_info, &opts);
+            if (data_arrived_info->connect_cb) {
+                socket_connected(sock, sock == -1 ? strerror(errno) : NULL, data_arrived_info);
+                sock = 0;
+            }
+        } else if (data_arrived_info->connect_cb) {
+            sock = connect_socket_async(host, port, socket_connected, socket_conn_data_arrived, data_arrived_info,
+                                        &opts);
+        } else {
+            sock = connect_socket(host, port, socket_conn_data_arrived, data_arrived_info, &opts);
+        }
+
+        free(host);
 
         if (sock == -1) {
             *exception = make_error_with_errno(ctx);
-        } else {
+            free_data_arrived_info(ctx, data_arrived_info);
+        } else if (!data_arrived_info->connect_cb) {
             return JSValueMakeNumber(ctx, sock);
         }
     }
@@ -1474,30 +1927,62 @@ JSValueRef function_socket_connect(JSContextRef ctx, JSObjectRef function, JSObj
 
 JSValueRef function_socket_listen(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
                                   size_t argc, const JSValueRef args[], JSValueRef *exception) {
-    if (argc == 2
-        && JSValueGetType(ctx, args[0]) == kJSTypeNumber
+    if (argc == 3
+        && (JSValueGetType(ctx, args[0]) == kJSTypeNumber || JSValueGetType(ctx, args[0]) == kJSTypeString)
         && JSValueGetType(ctx, args[1]) == kJSTypeObject) {
 
-        int port = (int) JSValueToNumber(ctx, args[0], NULL);
+        socket_accept_info_t *socket_accept_info = malloc(sizeof(socket_accept_info_t));
 
-        accept_info_t *accept_info = malloc(sizeof(accept_info_t));
-        accept_info->accept_cb = JSValueToObject(ctx, args[1], NULL);
-        JSValueProtect(ctx, args[1]);
+        // A UNIX domain socket path may be given in place of a port
+        int port = 0;
+        socket_accept_info->path = NULL;
+        if (JSValueGetType(ctx, args[0]) == kJSTypeString) {
+            socket_accept_info->path = value_to_c_string(ctx, args[0]);
+        } else {
+            port = (int) JSValueToNumber(ctx, args[0], NULL);
+        }
 
-        socket_accept_info_t *socket_accept_info = malloc(sizeof(socket_accept_info_t));
         socket_accept_info->host = NULL;
+        JSValueRef host_ref = get_socket_opt(ctx, args[2], "host");
+        if (JSValueIsString(ctx, host_ref)) {
+            socket_accept_info->host = value_to_c_string(ctx, host_ref);
+        }
         socket_accept_info->port = port;
         socket_accept_info->listen_successful_cb = NULL;
         socket_accept_info->accepted_conn_cb = accepted_socket_connection;
         socket_accept_info->conn_data_cb = socket_conn_data_arrived;
+        socket_accept_info->backlog = 0;
+        JSValueRef backlog_ref = get_socket_opt(ctx, args[2], "backlog");
+        if (JSValueIsNumber(ctx, backlog_ref)) {
+            socket_accept_info->backlog = (int) JSValueToNumber(ctx, backlog_ref, NULL);
+        }
+        socket_accept_info->reuse_port = JSValueToBoolean(ctx, get_socket_opt(ctx, args[2], "reuse-port?"));
+
+        accept_info_t *accept_info = malloc(sizeof(accept_info_t));
+        accept_info->accept_cb = JSValueToObject(ctx, args[1], NULL);
+        accept_info->drain_cb = read_socket_opts(ctx, args[2], &socket_accept_info->opts);
+        accept_info->binary = socket_accept_info->opts.binary;
         socket_accept_info->info = accept_info;
 
         int err = bind_and_listen(socket_accept_info);
+        if (err != -1) {
+            err = accept_connections(socket_accept_info);
+            if (err == -1) {
+                close(socket_accept_info->socket_desc);
+            }
+        }
+
         if (err == -1) {
             *exception = make_error_with_errno(ctx);
+            if (accept_info->drain_cb) {
+                JSValueUnprotect(ctx, accept_info->drain_cb);
+            }
+            free(accept_info);
+            free(socket_accept_info->host);
+            free(socket_accept_info->path);
+            free(socket_accept_info);
         } else {
-            pthread_t thread;
-            pthread_create(&thread, NULL, accept_connections, socket_accept_info);
+            JSValueProtect(ctx, args[1]);
         }
     }
     return JSValueMakeNull(ctx);
@@ -1507,14 +1992,41 @@ JSValueRef function_socket_write(JSContextRef ctx, JSObjectRef function, JSObjec
                                  size_t argc, const JSValueRef args[], JSValueRef *exception) {
     if (argc == 2
         && JSValueGetType(ctx, args[0]) == kJSTypeNumber
-        && JSValueGetType(ctx, args[1]) == kJSTypeString) {
+        && (JSValueGetType(ctx, args[1]) == kJSTypeString || JSValueGetType(ctx, args[1]) == kJSTypeObject)) {
 
         int sock = (int) JSValueToNumber(ctx, args[0], NULL);
 
-        int err = write_to_socket(sock, value_to_c_string(ctx, args[1]));
+        int rv;
+        if (JSValueGetType(ctx, args[1]) == kJSTypeString) {
+            size_t len = 0;
+            char *data = value_to_c_string_len(ctx, args[1], &len);
+            rv = socket_write(sock, data, len);
+            free(data);
+        } else {
+            // A Uint8Array
+            JSObjectRef array = JSValueToObject(ctx, args[1], NULL);
+#ifdef HAVE_JSC_TYPED_ARRAYS
+            char *bytes = JSObjectGetTypedArrayBytesPtr(ctx, array, NULL);
+            size_t len = JSObjectGetTypedArrayByteLength(ctx, array, NULL);
+            rv = socket_write(sock, bytes ? bytes : "", bytes ? len : 0);
+#else
+            size_t len = (size_t) array_get_count(ctx, array);
+            char *bytes = malloc(len);
+            size_t i;
+            for (i = 0; i < len; i++) {
+                bytes[i] = (char) (uint8_t) JSValueToNumber(ctx, JSObjectGetPropertyAtIndex(ctx, array, (unsigned) i,
+                                                                                           NULL), NULL);
+            }
+            rv = socket_write(sock, bytes, len);
+            free(bytes);
+#endif
+        }
 
-        if (err == -1) {
+        if (rv == -1) {
             *exception = make_error_with_errno(ctx);
+        } else {
+            // false once the write queue is over its high watermark
+            return JSValueMakeBoolean(ctx, rv == 0);
         }
     }
     return JSValueMakeNull(ctx);
@@ -1536,6 +2048,26 @@ JSValueRef function_socket_close(JSContextRef ctx, JSObjectRef function, JSObjec
     return JSValueMakeNull(ctx);
 }
 
+JSValueRef function_socket_stats(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
+                                 size_t argc, const JSValueRef args[], JSValueRef *exception) {
+    socket_stats_t stats;
+    get_socket_stats(&stats);
+
+    resolver_stats_t resolver_stats;
+    get_resolver_stats(&resolver_stats);
+
+    JSValueRef arguments[8];
+    arguments[0] = JSValueMakeNumber(ctx, (double)stats.accepts);
+    arguments[1] = JSValueMakeNumber(ctx, (double)stats.reads);
+    arguments[2] = JSValueMakeNumber(ctx, (double)stats.writes);
+    arguments[3] = JSValueMakeNumber(ctx, (double)stats.bytes_read);
+    arguments[4] = JSValueMakeNumber(ctx, (double)stats.bytes_written);
+    arguments[5] = JSValueMakeNumber(ctx, (double)stats.open_connections);
+    arguments[6] = JSValueMakeNumber(ctx, (double)resolver_stats.lookups);
+    arguments[7] = JSValueMakeNumber(ctx, (double)resolver_stats.cache_hits);
+    return JSObjectMakeArray(ctx, 8, arguments, NULL);
+}
+
 JSValueRef function_sleep(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
                           size_t argc, const JSValueRef args[], JSValueRef *exception) {
     if (argc == 2
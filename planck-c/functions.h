@@ -25,6 +25,14 @@ JSValueRef
 function_cache(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject, size_t argc, const JSValueRef args[],
                JSValueRef *exception);
 
+JSValueRef
+function_cache_key(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject, size_t argc, const JSValueRef args[],
+                   JSValueRef *exception);
+
+JSValueRef
+function_cache_read(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject, size_t argc, const JSValueRef args[],
+                    JSValueRef *exception);
+
 JSValueRef
 function_eval(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject, size_t argc, const JSValueRef args[],
               JSValueRef *exception);
@@ -60,6 +68,12 @@ JSValueRef function_raw_flush_stderr(JSContextRef ctx, JSObjectRef function, JSO
 JSValueRef function_import_script(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject, size_t argc,
                                   const JSValueRef args[], JSValueRef *exception);
 
+void forget_loaded_goog(JSGlobalContextRef ctx);
+
+void mark_goog_loaded(JSContextRef ctx, const char *path);
+
+void set_prelinking(JSContextRef ctx, bool prelinking);
+
 JSValueRef function_file_reader_open(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject, size_t argc,
                                      const JSValueRef args[], JSValueRef *exception);
 
@@ -90,6 +104,12 @@ JSValueRef function_file_input_stream_read(JSContextRef ctx, JSObjectRef functio
 JSValueRef function_file_input_stream_close(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject, size_t argc,
                                             const JSValueRef args[], JSValueRef *exception);
 
+JSValueRef function_jar_reader_open(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject, size_t argc,
+                                    const JSValueRef args[], JSValueRef *exception);
+
+JSValueRef function_jar_input_stream_open(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject, size_t argc,
+                                          const JSValueRef args[], JSValueRef *exception);
+
 JSValueRef function_file_output_stream_open(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject, size_t argc,
                                             const JSValueRef args[], JSValueRef *exception);
 
@@ -136,9 +156,15 @@ JSValueRef function_set_timeout(JSContextRef ctx, JSObjectRef function, JSObject
 JSValueRef function_set_interval(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
                                  size_t argc, const JSValueRef args[], JSValueRef *exception);
 
+JSValueRef function_clear_timer(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
+                                size_t argc, const JSValueRef args[], JSValueRef *exception);
+
 JSValueRef function_high_res_timer(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
                                    size_t argc, const JSValueRef args[], JSValueRef *exception);
 
+JSValueRef function_task_queue_stats(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
+                                     size_t argc, const JSValueRef args[], JSValueRef *exception);
+
 JSValueRef function_socket_connect(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
                                    size_t argc, JSValueRef const *args, JSValueRef *exception);
 
@@ -151,6 +177,9 @@ JSValueRef function_socket_write(JSContextRef ctx, JSObjectRef function, JSObjec
 JSValueRef function_socket_close(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
                                  size_t argc, const JSValueRef args[], JSValueRef *exception);
 
+JSValueRef function_socket_stats(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
+                                 size_t argc, const JSValueRef args[], JSValueRef *exception);
+
 JSValueRef function_sleep(JSContextRef ctx, JSObjectRef function, JSObjectRef thisObject,
                           size_t argc, const JSValueRef args[], JSValueRef *exception);
 
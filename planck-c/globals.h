@@ -45,6 +45,9 @@ struct config {
 
     char *socket_repl_host;
     int socket_repl_port;
+    int socket_repl_contexts;
+
+    bool server;
 
     char *clojurescript_version;
 
@@ -17,6 +17,7 @@
 #endif
 
 struct header_state {
+    JSContextRef ctx;
     JSObjectRef *headers;
 };
 
@@ -27,6 +28,7 @@ int curl_has_feature(int feature_const) {
 
 size_t header_to_object_callback(char *buffer, size_t size, size_t nitems, void *userdata) {
     struct header_state *state = (struct header_state *) userdata;
+    JSContextRef ctx = state->ctx;
 
     // printf("'%s'\n", buffer);
 
@@ -263,6 +265,7 @@ JSValueRef function_http_request(JSContextRef ctx, JSObjectRef function, JSObjec
 
         JSObjectRef response_headers = JSObjectMake(ctx, NULL, NULL);
         struct header_state header_state;
+        header_state.ctx = ctx;
         header_state.headers = &response_headers;
         curl_easy_setopt(handle, CURLOPT_HEADERDATA, &header_state);
         curl_easy_setopt(handle, CURLOPT_HEADERFUNCTION, header_to_object_callback);
@@ -10,12 +10,18 @@ JSStringRef to_string(JSContextRef ctx, JSValueRef val);
 
 void print_value(char *prefix, JSContextRef ctx, JSValueRef val);
 
-JSValueRef evaluate_script(JSContextRef ctx, char *script, char *source);
+JSValueRef evaluate_script(JSContextRef ctx, const char *script, char *source);
+
+JSValueRef evaluate_script_string(JSContextRef ctx, JSStringRef script, char *source);
 
 char *value_to_c_string(JSContextRef ctx, JSValueRef val);
 
 char* value_to_c_string_ext(JSContextRef ctx, JSValueRef val, bool handle_non_string_values);
 
+// Converts a string value to UTF-8, setting len to its length in bytes, which
+// counts any NULs in the string
+char *value_to_c_string_len(JSContextRef ctx, JSValueRef val, size_t *len);
+
 JSValueRef c_string_to_value(JSContextRef ctx, const char *s);
 
 int array_get_count(JSContextRef ctx, JSObjectRef arr);
@@ -0,0 +1,174 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "archive.h"
+#include "bundle_string.h"
+#include "classpath.h"
+#include "dir_cache.h"
+#include "engine.h"
+#include "globals.h"
+#include "io.h"
+#include "loader.h"
+#include "str.h"
+
+bool load_source(const char *path, bool background, loaded_source_t *source) {
+    time_t last_modified = 0;
+    char *contents = NULL;
+    JSStringRef contents_str = NULL;
+    char *loaded_path = strdup(path);
+    const char *loaded_type = NULL;
+    const char *loaded_location = NULL;
+    source_origin_t origin = ORIGIN_BUNDLE;
+
+    bool developing = (config.num_src_paths == 1 &&
+                       strcmp(config.src_paths[0].type, "src") == 0 &&
+                       str_has_suffix(config.src_paths[0].path, "/planck-cljs/src/") == 0);
+
+    if (!developing) {
+        contents_str = bundle_string_create(path);
+        loaded_type = "bundled";
+        last_modified = 0;
+    }
+
+    // load from classpath
+    if (contents_str == NULL) {
+        const classpath_entry_t *entry = classpath_lookup(path);
+        dir_cache_sync();
+        int i;
+        for (i = 0; i < config.num_src_paths; i++) {
+            if (config.src_paths[i].blacklisted) {
+                continue;
+            }
+
+            char *type = config.src_paths[i].type;
+            char *location = config.src_paths[i].path;
+
+            if (strcmp(type, "jar") == 0 && classpath_indexed(i)) {
+                if (entry && entry->src_path == i) {
+                    char *error_msg = NULL;
+                    contents = (char *) classpath_read(entry, background ? NULL : &error_msg);
+                    if (!contents && error_msg) {
+                        engine_print(error_msg);
+                        engine_print("\n");
+                        free(error_msg);
+                    }
+                    last_modified = entry->mtime;
+                    loaded_type = type;
+                    origin = ORIGIN_JAR;
+                    loaded_location = location;
+                }
+            } else if (strcmp(type, "src") == 0) {
+                char *full_path = str_concat(location, path);
+                contents = dir_cache_may_exist(full_path) ? get_contents(full_path, &last_modified) : NULL;
+                if (contents != NULL) {
+                    free(loaded_path);
+                    loaded_path = strdup(full_path);
+                    loaded_type = type;
+                    origin = ORIGIN_SRC;
+                    loaded_location = location;
+                }
+                free(full_path);
+            } else if (strcmp(type, "jar") == 0) {
+                if (background) {
+                    // JARs that aren't indexed are probed on the engine thread
+                    free(loaded_path);
+                    return false;
+                }
+                struct stat file_stat;
+                if (stat(location, &file_stat) == 0) {
+                    char *error_msg = NULL;
+                    void *archive = classpath_archive(i, &error_msg);
+                    if (error_msg) {
+                        engine_print(error_msg);
+                        engine_print("\n");
+                        free(error_msg);
+                        error_msg = NULL;
+                    }
+                    if (archive) {
+                        contents_zip_t contents_zip;
+                        contents_zip = get_contents_zip(archive, path,
+                                                        &last_modified, &error_msg);
+                        contents = (char *) contents_zip.payload;
+                        if (!contents && error_msg) {
+                            engine_print(error_msg);
+                            engine_print("\n");
+                            free(error_msg);
+                        }
+                    }
+                    loaded_type = type;
+                    loaded_location = location;
+                    origin = ORIGIN_JAR;
+                } else {
+                    engine_perror(location);
+                    config.src_paths[i].blacklisted = true;
+                }
+            }
+
+            if (contents != NULL) {
+                break;
+            }
+        }
+    }
+
+    // load from out/
+    if (contents_str == NULL && contents == NULL) {
+        if (config.out_path != NULL) {
+            char *full_path = str_concat(config.out_path, path);
+            dir_cache_sync();
+            contents = dir_cache_may_exist(full_path) ? get_contents(full_path, &last_modified) : NULL;
+            free(full_path);
+            origin = ORIGIN_OUT;
+        }
+    }
+
+    if (developing && contents == NULL) {
+        contents_str = bundle_string_create(path);
+        last_modified = 0;
+        origin = ORIGIN_BUNDLE;
+    }
+
+    if (contents != NULL) {
+        contents_str = JSStringCreateWithUTF8CString(contents);
+        free(contents);
+    }
+
+    if (contents_str == NULL) {
+        free(loaded_path);
+        return false;
+    }
+
+    source->contents = contents_str;
+    source->last_modified = last_modified;
+    source->path = loaded_path;
+    source->type = loaded_type;
+    source->location = loaded_location;
+    source->origin = origin;
+    return true;
+}
+
+bool read_source(const char *path, loaded_source_t *source) {
+    time_t last_modified = 0;
+    dir_cache_sync();
+    char *contents = dir_cache_may_exist(path) ? get_contents((char *) path, &last_modified) : NULL;
+    if (contents == NULL) {
+        return false;
+    }
+
+    source->contents = JSStringCreateWithUTF8CString(contents);
+    free(contents);
+    source->last_modified = last_modified;
+    source->path = NULL;
+    source->type = NULL;
+    source->location = NULL;
+    source->origin = ORIGIN_FILE;
+    return true;
+}
+
+void free_loaded_source(loaded_source_t *source) {
+    if (source->contents) {
+        JSStringRelease(source->contents);
+    }
+    free(source->path);
+}
@@ -0,0 +1,33 @@
+#include <stdbool.h>
+#include <time.h>
+#include <JavaScriptCore/JavaScript.h>
+
+// Where a loaded file's contents were read from. This can differ from its
+// type, which is "bundled" for files in the output directory.
+typedef enum {
+    ORIGIN_BUNDLE,
+    ORIGIN_SRC,
+    ORIGIN_JAR,
+    ORIGIN_OUT,
+    ORIGIN_FILE
+} source_origin_t;
+
+// A file found by load_source or read_source
+typedef struct loaded_source {
+    JSStringRef contents;
+    time_t last_modified;
+    char *path;
+    const char *type;
+    const char *location;
+    source_origin_t origin;
+} loaded_source_t;
+
+// Finds a file the way PLANCK_LOAD does, in the bundle, on the classpath, or in
+// the output directory. In the background, errors aren't reported, and false
+// is also returned if the file could be in a JAR that isn't indexed.
+bool load_source(const char *path, bool background, loaded_source_t *source);
+
+// Reads a file the way PLANCK_READ_FILE does
+bool read_source(const char *path, loaded_source_t *source);
+
+void free_loaded_source(loaded_source_t *source);
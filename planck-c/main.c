@@ -14,11 +14,14 @@
 #endif
 
 #include "bundle.h"
+#include "cache_store.h"
 #include "engine.h"
 #include "globals.h"
 #include "io.h"
 #include "legal.h"
+#include "prefetch.h"
 #include "repl.h"
+#include "server.h"
 #include "str.h"
 #include "theme.h"
 #include "tasks.h"
@@ -67,6 +70,8 @@ void usage(char *program_name) {
     "    -d, --dumb-terminal         Disable line editing / VT100 terminal control\n"
     "    -t theme, --theme theme     Set the color theme\n"
     "    -n x, --socket-repl x       Enable socket REPL where x is port or IP:port\n"
+    "    --socket-repl-contexts n    Evaluate each socket REPL session in its own\n"
+    "                                JavaScript context, keeping n contexts ready\n"
     "    -s, --static-fns            Generate static dispatch function calls\n"
     "    -f, --fn-invoke-direct      Do not not generate .call(null...) calls\n"
     "                                for unknown functions, but instead direct\n"
@@ -81,6 +86,11 @@ void usage(char *program_name) {
     "    -m ns-name, --main ns-name Call the -main function from a namespace with\n"
     "                               args\n"
     "    -r, --repl                 Run a repl\n"
+    "    --server                   Keep an initialized engine for planck-client to\n"
+    "                               run requests in\n"
+    "    --cache-gc                 Evict the least recently used compiled\n"
+    "                               namespaces from the cache down to its maximum\n"
+    "                               size, and remove stale cache files\n"
     "    path                       Run a script from a file or resource\n"
     "    -                          Run a script from standard input\n"
     "    -h, -?, --help             Print this help message and exit\n"
@@ -106,16 +116,7 @@ void usage(char *program_name) {
 }
 
 char *get_cljs_version() {
-    char *bundle_js = bundle_get_contents("planck/bundle.js");
-    if (bundle_js != NULL) {
-        char *start = bundle_js + 29;
-        char *version = strtok(start, " ");
-        version = strdup(version);
-        free(bundle_js);
-        return version;
-    } else {
-        return strdup("(Unknown)");
-    }
+    return strdup(bundle_get_cljs_version());
 }
 
 struct config config;
@@ -142,6 +143,14 @@ char *fully_qualify(char *cwd, char *path) {
     }
 }
 
+char *append_line(char *s, const char *line) {
+    char *with_newline = str_concat(line, "\n");
+    char *rv = str_concat(s, with_newline);
+    free(with_newline);
+    free(s);
+    return rv;
+}
+
 char *get_current_working_dir() {
     char cwd[PATH_MAX];
     if (getcwd(cwd, sizeof(cwd)) != NULL) {
@@ -292,7 +301,7 @@ bool should_ignore_arg(const char *opt) {
     }
 
     // opt is a short opt or clump of short opts. If the clump
-    // ends with i, e, m, c, n, k, t, S, A, O, D, L, or \1
+    // ends with i, e, m, c, n, k, t, S, A, O, D, L, \1, or \2
     // then this opt takes an argument.
     int idx = 0;
     char c = 0;
@@ -314,7 +323,8 @@ bool should_ignore_arg(const char *opt) {
             last_c == 'O' ||
             last_c == 'D' ||
             last_c == 'L' ||
-            last_c == '\1');
+            last_c == '\1' ||
+            last_c == '\2');
 }
 
 void control_FTL_JIT() {
@@ -349,11 +359,41 @@ char** expand_medium_opts(int argc, char **argv) {
     return rv;
 }
 
-int main(int argc, char **argv) {
+void init_config() {
+    config.verbose = false;
+    config.quiet = false;
+    config.repl = false;
+    config.javascript = false;
+    config.checked_arrays = NULL;
+    config.static_fns = false;
+    config.fn_invoke_direct = false;
+    config.elide_asserts = false;
+    config.optimizations = "none";
+    config.cache_path = NULL;
+    config.theme = NULL;
+    config.dumb_terminal = false;
 
-    control_FTL_JIT();
+    config.out_path = NULL;
+    config.num_src_paths = 0;
+    config.src_paths = NULL;
+    config.num_scripts = 0;
+    config.scripts = NULL;
 
-    ignore_sigpipe();
+    config.main_ns_name = NULL;
+
+    config.socket_repl_port = 0;
+    config.socket_repl_host = NULL;
+    config.socket_repl_contexts = 0;
+
+    config.server = false;
+
+    config.num_compile_opts = 0;
+    config.compile_opts = NULL;
+}
+
+// Parses the command line into config, returning -1 if Planck should go on to
+// run, or otherwise an exit status.
+int configure(int argc, char **argv) {
 
     argv = expand_medium_opts(argc, argv);
 
@@ -382,37 +422,12 @@ int main(int argc, char **argv) {
         }
     }
 
-    config.verbose = false;
-    config.quiet = false;
-    config.repl = false;
-    config.javascript = false;
-    config.checked_arrays = NULL;
-    config.static_fns = false;
-    config.elide_asserts = false;
-    config.optimizations = "none";
-    config.cache_path = NULL;
-    config.theme = NULL;
-    config.dumb_terminal = false;
-
-    config.out_path = NULL;
-    config.num_src_paths = 0;
-    config.src_paths = NULL;
-    config.num_scripts = 0;
-    config.scripts = NULL;
-
-    config.main_ns_name = NULL;
-
-    config.socket_repl_port = 0;
-    config.socket_repl_host = NULL;
-
-    config.clojurescript_version = get_cljs_version();
-
-    config.num_compile_opts = 0;
-    config.compile_opts = NULL;
+    init_config();
 
     char *classpath = NULL;
     char *dependencies = NULL;
     char *local_repo = NULL;
+    bool cache_gc = false;
 
     struct option long_options[] = {
             {"help",             no_argument,       NULL, 'h'},
@@ -431,6 +446,7 @@ int main(int argc, char **argv) {
             {"eval",             required_argument, NULL, 'e'},
             {"theme",            required_argument, NULL, 't'},
             {"socket-repl",      required_argument, NULL, 'n'},
+            {"socket-repl-contexts", required_argument, NULL, '\2'},
             {"dumb-terminal",    no_argument,       NULL, 'd'},
             {"classpath",        required_argument, NULL, 'c'},
             {"dependencies",     required_argument, NULL, 'D'},
@@ -439,6 +455,8 @@ int main(int argc, char **argv) {
             {"init",             required_argument, NULL, 'i'},
             {"main",             required_argument, NULL, 'm'},
             {"compile-opts",     required_argument, NULL, '\1'},
+            {"server",           no_argument,       NULL, '\3'},
+            {"cache-gc",         no_argument,       NULL, '\4'},
 
             // development options
             {"javascript",       no_argument,       NULL, 'j'},
@@ -449,14 +467,36 @@ int main(int argc, char **argv) {
     };
     int opt, option_index;
     bool did_encounter_main_opt = false;
+
+    // Reset getopt, as a server parses the command line of each request
+#ifdef __APPLE__
+    optreset = 1;
+    optind = 1;
+#else
+    optind = 0;
+#endif
+
     // pass index_of_script_path_or_hyphen instead of argc to guarantee that everything
     // after a bare dash "-" or a script path gets passed as *command-line-args*
     while (!did_encounter_main_opt &&
-           (opt = getopt_long(index_of_script_path_or_hyphen, argv, "O:Xh?VS:D:L:\1:lvrA:sfak:je:t:n:dc:o:Ki:qm:", long_options, &option_index)) != -1) {
+           (opt = getopt_long(index_of_script_path_or_hyphen, argv, "O:Xh?VS:D:L:\1:\2:\3\4lvrA:sfak:je:t:n:dc:o:Ki:qm:", long_options, &option_index)) != -1) {
         switch (opt) {
             case '\1':
                 process_compile_opts(optarg);
                 break;
+            case '\2':
+                config.socket_repl_contexts = atoi(optarg);
+                if (config.socket_repl_contexts < 1) {
+                    print_usage_error("socket-repl-contexts value must be a positive number", argv[0]);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case '\3':
+                config.server = true;
+                break;
+            case '\4':
+                cache_gc = true;
+                break;
             case 'X':
                 init_launch_timing();
                 break;
@@ -602,6 +642,14 @@ int main(int argc, char **argv) {
 
     display_launch_timing("check cache path");
 
+    if (cache_gc) {
+        if (!config.cache_path) {
+            print_usage_error("--cache-gc requires -k/--cache or -K/--auto-cache.", argv[0]);
+            return EXIT_FAILURE;
+        }
+        return cache_store_gc();
+    }
+
     char *dependencies_classpath = NULL;
     if (dependencies) {
         if (!local_repo) {
@@ -654,7 +702,12 @@ int main(int argc, char **argv) {
         }
     }
 
-    if (config.num_scripts == 0 && config.main_ns_name == NULL && config.num_rest_args == 0
+    if (config.server) {
+        if (config.num_scripts > 0 || config.main_ns_name != NULL || config.repl || config.num_rest_args > 0) {
+            print_usage_error("--server can't be combined with -e, -i, or a main option.", argv[0]);
+            return EXIT_FAILURE;
+        }
+    } else if (config.num_scripts == 0 && config.main_ns_name == NULL && config.num_rest_args == 0
         && config.num_compile_opts == 0) {
         config.repl = true;
     }
@@ -674,7 +727,13 @@ int main(int argc, char **argv) {
 
     display_launch_timing("check tty");
 
-    engine_init();
+    return -1;
+}
+
+// Runs the init and main options, returning the exit status.
+int run() {
+
+    int i;
 
     // Process init arguments
     
@@ -731,7 +790,89 @@ int main(int argc, char **argv) {
         block_until_tasks_complete();
     }
 
+    return exit_value;
+}
+
+// Describes the options that determine how the engine is initialized, so the
+// server can tell whether its engine can handle a request.
+char *engine_fingerprint() {
+    char *cwd = get_current_working_dir();
+    char buffer[1024];
+    snprintf(buffer, sizeof(buffer), "%d %d %d %d %d %s %s %s\n", config.verbose, config.javascript,
+             config.static_fns, config.fn_invoke_direct, config.elide_asserts, config.optimizations,
+             config.checked_arrays ? config.checked_arrays : "-", config.out_path ? config.out_path : "-");
+    char *rv = strdup(buffer);
+
+    char *cache_path = config.cache_path ? fully_qualify(cwd, config.cache_path) : strdup("-");
+    rv = append_line(rv, cache_path);
+    free(cache_path);
+
+    int i;
+    for (i = 0; i < config.num_compile_opts; i++) {
+        rv = append_line(rv, config.compile_opts[i]);
+    }
+    for (i = 0; i < config.num_src_paths; i++) {
+        rv = append_line(rv, config.src_paths[i].path);
+    }
+
+    free(cwd);
+    return rv;
+}
+
+char *server_fingerprint = NULL;
+
+int handle_server_request(int argc, char **argv, int *exit_status) {
+    int rv = configure(argc, argv);
+    if (rv != -1) {
+        *exit_status = rv;
+        return SERVER_REQUEST_HANDLED;
+    }
+
+    if (config.repl || config.server) {
+        return SERVER_REQUEST_UNSUPPORTED;
+    }
+
+    char *fingerprint = engine_fingerprint();
+    bool stale = strcmp(fingerprint, server_fingerprint) != 0;
+    free(fingerprint);
+    if (stale) {
+        return SERVER_REQUEST_STALE;
+    }
+
+    prefetch_start();
+
+    *exit_status = run();
+    cache_store_evict();
+    return SERVER_REQUEST_HANDLED;
+}
+
+int main(int argc, char **argv) {
+
+    control_FTL_JIT();
+
+    ignore_sigpipe();
+
+    config.clojurescript_version = get_cljs_version();
+
+    int rv = configure(argc, argv);
+    if (rv != -1) {
+        return rv;
+    }
+
+    if (config.server) {
+        server_fingerprint = engine_fingerprint();
+        return run_server(handle_server_request);
+    }
+
+    prefetch_start();
+
+    engine_init();
+
+    rv = run();
+
+    cache_store_evict();
+
     engine_shutdown();
 
-    return exit_value;
+    return rv;
 }
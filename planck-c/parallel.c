@@ -0,0 +1,362 @@
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include <JavaScriptCore/JavaScript.h>
+
+#include "clock.h"
+#include "jsc_utils.h"
+#include "parallel.h"
+#include "prefetch.h"
+#include "shell.h"
+#include "threads.h"
+
+// Work is run in forked children, each of which inherits a copy-on-write image
+// of the warm engine, including the function to apply and the items to apply it
+// to. Items are striped across the children by index. Each child writes a line
+// per item, holding the item's index and the (newline-free) string the work
+// function returned, and then exits.
+
+#define MAX_PROCESSES 64
+
+typedef struct child {
+    pid_t pid;
+    int pipe;
+    bool eof;
+    char *buf;
+    size_t total;
+} child_t;
+
+// The JavaScriptCore options set by parallel_control_engine_threads, unless
+// already set. Those it sets are removed from the environment once the engine
+// has read them, so that they aren't passed on to subprocesses.
+static struct {
+    const char *name;
+    const char *value;
+    bool set;
+} engine_thread_options[] = {
+    {"JSC_useConcurrentJIT", "false", false},
+    {"JSC_useConcurrentGC", "false", false},
+    {"JSC_numberOfGCMarkers", "1", false}
+};
+
+#define NUM_ENGINE_THREAD_OPTIONS (sizeof(engine_thread_options) / sizeof(engine_thread_options[0]))
+
+static bool engine_threads_controlled = false;
+
+static bool option_is_false(const char *name) {
+    const char *value = getenv(name);
+    return value && strcmp(value, "false") == 0;
+}
+
+void parallel_control_engine_threads(void) {
+    size_t i;
+    for (i = 0; i < NUM_ENGINE_THREAD_OPTIONS; i++) {
+        if (getenv(engine_thread_options[i].name) == NULL) {
+            engine_thread_options[i].set = setenv(engine_thread_options[i].name,
+                                                  engine_thread_options[i].value, 0) == 0;
+        }
+    }
+    engine_threads_controlled = option_is_false("JSC_useConcurrentJIT") && option_is_false("JSC_useConcurrentGC");
+}
+
+void parallel_restore_environment(void) {
+    size_t i;
+    for (i = 0; i < NUM_ENGINE_THREAD_OPTIONS; i++) {
+        if (engine_thread_options[i].set) {
+            unsetenv(engine_thread_options[i].name);
+            engine_thread_options[i].set = false;
+        }
+    }
+}
+
+// Forking while JavaScriptCore threads hold locks can deadlock the children
+static bool engine_threads_off() {
+    return engine_threads_controlled ||
+           (option_is_false("JSC_useConcurrentJIT") && option_is_false("JSC_useConcurrentGC"));
+}
+
+static JSValueRef make_error(JSContextRef ctx, const char *msg) {
+    JSValueRef arguments[1];
+    arguments[0] = c_string_to_value(ctx, msg);
+    return JSObjectMakeError(ctx, 1, arguments, NULL);
+}
+
+static bool write_fully(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+static void run_child(JSContextRef ctx, JSObjectRef work_fn, int fd, int first, int stride, int count) {
+    char header[32];
+    int i;
+    for (i = first; i < count; i += stride) {
+        JSValueRef arguments[1];
+        arguments[0] = JSValueMakeNumber(ctx, i);
+        JSValueRef exception = NULL;
+        JSValueRef result = JSObjectCallAsFunction(ctx, work_fn, NULL, 1, arguments, &exception);
+        if (exception || JSValueGetType(ctx, result) != kJSTypeString) {
+            _exit(1);
+        }
+        char *s = value_to_c_string(ctx, result);
+        snprintf(header, sizeof(header), "%d\t", i);
+        if (!s || !write_fully(fd, header, strlen(header)) || !write_fully(fd, s, strlen(s))
+            || !write_fully(fd, "\n", 1)) {
+            _exit(1);
+        }
+        free(s);
+    }
+    fflush(stdout);
+    fflush(stderr);
+    _exit(0);
+}
+
+static void kill_children(child_t *children, int n) {
+    int i;
+    for (i = 0; i < n; i++) {
+        if (children[i].pid > 0) {
+            kill(children[i].pid, SIGKILL);
+        }
+    }
+}
+
+static int wait_for_child(pid_t pid) {
+    int status = 0;
+    while (waitpid(pid, &status, 0) == -1 && errno == EINTR) {
+    }
+    return status;
+}
+
+static void kill_and_wait_for_children(child_t *children, int n) {
+    kill_children(children, n);
+    int i;
+    for (i = 0; i < n; i++) {
+        wait_for_child(children[i].pid);
+    }
+}
+
+// Reads output from all of the children until each reaches EOF, returning false
+// if the deadline (if any) passes first.
+static bool process_children(child_t *children, int n, uint64_t deadline) {
+    struct pollfd fds[MAX_PROCESSES];
+    int open = n;
+    while (open > 0) {
+        int i;
+        for (i = 0; i < n; i++) {
+            fds[i].fd = children[i].eof ? -1 : children[i].pipe;
+            fds[i].events = POLLIN | POLLHUP;
+        }
+
+        int timeout = -1;
+        if (deadline) {
+            uint64_t now = system_time();
+            if (now >= deadline) {
+                return false;
+            }
+            timeout = (int) ((deadline - now + 999999) / 1000000);
+        }
+
+        int rv = poll(fds, (nfds_t) n, timeout);
+        if (rv == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+
+        for (i = 0; i < n; i++) {
+            if (!children[i].eof && (fds[i].revents & (POLLIN | POLLHUP | POLLERR))) {
+                if (read_child_pipe(children[i].pipe, &children[i].buf, &children[i].total) <= 0) {
+                    children[i].eof = true;
+                    open--;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+// Sets each result line found in buf at its index in results.
+static void collect_results(JSContextRef ctx, char *buf, size_t total, JSValueRef *results, int count) {
+    char *end = buf + total;
+    char *line = buf;
+    while (line < end) {
+        char *newline = memchr(line, '\n', end - line);
+        if (!newline) {
+            // Partial line from a child that died mid-write
+            break;
+        }
+        *newline = '\0';
+        char *tab = strchr(line, '\t');
+        if (tab) {
+            *tab = '\0';
+            int index = atoi(line);
+            if (index >= 0 && index < count) {
+                results[index] = c_string_to_value(ctx, tab + 1);
+            }
+        }
+        line = newline + 1;
+    }
+}
+
+static char *describe_status(int status, char *buf, size_t len) {
+    if (WIFSIGNALED(status)) {
+        snprintf(buf, len, "Child process terminated by signal %d", WTERMSIG(status));
+    } else if (WIFEXITED(status)) {
+        snprintf(buf, len, "Child process exited with status %d", WEXITSTATUS(status));
+    } else {
+        snprintf(buf, len, "Child process failed");
+    }
+    return buf;
+}
+
+JSValueRef function_parallel_run(JSContextRef ctx, JSObjectRef function, JSObjectRef this_object,
+                                 size_t argc, const JSValueRef args[], JSValueRef *exception) {
+    if (argc == 4
+        && JSValueGetType(ctx, args[0]) == kJSTypeObject
+        && JSObjectIsFunction(ctx, (JSObjectRef) args[0])
+        && JSValueGetType(ctx, args[1]) == kJSTypeNumber
+        && JSValueGetType(ctx, args[2]) == kJSTypeNumber
+        && JSValueGetType(ctx, args[3]) == kJSTypeNumber) {
+
+        JSObjectRef work_fn = (JSObjectRef) args[0];
+        int count = (int) JSValueToNumber(ctx, args[1], NULL);
+        long processes = (long) JSValueToNumber(ctx, args[2], NULL);
+        double timeout_ms = JSValueToNumber(ctx, args[3], NULL);
+
+        if (count <= 0) {
+            return JSObjectMakeArray(ctx, 0, NULL, NULL);
+        }
+
+        if (!engine_threads_off()) {
+            *exception = make_error(ctx, "planck.parallel requires planck --server, or JSC_useConcurrentJIT "
+                                         "and JSC_useConcurrentGC to be false");
+            return JSValueMakeNull(ctx);
+        }
+
+        // Prefetching is only an optimization, so it is let finish, while
+        // Planck's other threads could be holding locks the children need
+        prefetch_wait_idle();
+        if (planck_threads_running() > 0) {
+            *exception = make_error(ctx, "planck.parallel can't fork once timers, sockets, workers or "
+                                         "asynchronous shell commands have started threads");
+            return JSValueMakeNull(ctx);
+        }
+
+        if (processes <= 0) {
+            processes = sysconf(_SC_NPROCESSORS_ONLN);
+        }
+        if (processes < 1) {
+            processes = 1;
+        } else if (processes > MAX_PROCESSES) {
+            processes = MAX_PROCESSES;
+        }
+        if (processes > count) {
+            processes = count;
+        }
+        int n = (int) processes;
+
+        JSObjectRef rv = NULL;
+        child_t children[MAX_PROCESSES];
+        memset(children, 0, sizeof(children));
+
+        // Don't let children inherit (and later also write) buffered output.
+        fflush(stdout);
+        fflush(stderr);
+
+        int i;
+        for (i = 0; i < n; i++) {
+            int fds[2];
+            if (pipe(fds) == -1) {
+                int err = errno;
+                kill_and_wait_for_children(children, i);
+                *exception = make_error(ctx, strerror(err));
+                goto cleanup;
+            }
+            pid_t pid = fork();
+            if (pid == -1) {
+                int err = errno;
+                close(fds[0]);
+                close(fds[1]);
+                kill_and_wait_for_children(children, i);
+                *exception = make_error(ctx, strerror(err));
+                goto cleanup;
+            }
+            if (pid == 0) {
+                int j;
+                for (j = 0; j < i; j++) {
+                    close(children[j].pipe);
+                }
+                close(fds[0]);
+                run_child(ctx, work_fn, fds[1], i, n, count);
+            }
+            close(fds[1]);
+            children[i].pid = pid;
+            children[i].pipe = fds[0];
+        }
+
+        uint64_t deadline = timeout_ms > 0 ? system_time() + (uint64_t) (timeout_ms * 1000000) : 0;
+        bool timed_out = !process_children(children, n, deadline);
+        if (timed_out) {
+            kill_children(children, n);
+        }
+
+        char msg[128];
+        msg[0] = '\0';
+        for (i = 0; i < n; i++) {
+            int status = wait_for_child(children[i].pid);
+            if (!timed_out && !msg[0] && !(WIFEXITED(status) && WEXITSTATUS(status) == 0)) {
+                describe_status(status, msg, sizeof(msg));
+            }
+        }
+
+        if (timed_out) {
+            snprintf(msg, sizeof(msg), "Timed out after %g ms", timeout_ms);
+        }
+
+        if (msg[0]) {
+            *exception = make_error(ctx, msg);
+            goto cleanup;
+        }
+
+        JSValueRef *results = calloc((size_t) count, sizeof(JSValueRef));
+        for (i = 0; i < n; i++) {
+            collect_results(ctx, children[i].buf, children[i].total, results, count);
+        }
+        for (i = 0; i < count; i++) {
+            if (!results[i]) {
+                results[i] = JSValueMakeNull(ctx);
+            }
+        }
+        rv = JSObjectMakeArray(ctx, (size_t) count, results, NULL);
+        free(results);
+
+        cleanup:
+        for (i = 0; i < n; i++) {
+            if (children[i].pid > 0) {
+                close(children[i].pipe);
+            }
+            free(children[i].buf);
+        }
+
+        return rv ? rv : JSValueMakeNull(ctx);
+    }
+    return JSValueMakeNull(ctx);
+}
@@ -0,0 +1,16 @@
+#include <JavaScriptCore/JavaScript.h>
+
+// Threads don't survive fork, so keeps JavaScriptCore from compiling or
+// collecting garbage on background threads, unless the JSC_useConcurrentJIT
+// and JSC_useConcurrentGC environment variables say otherwise, in which case
+// planck.parallel refuses to fork. Used by planck --server, and called before
+// the engine is initialized. Without it, planck.parallel only forks if those
+// variables are set to false.
+void parallel_control_engine_threads(void);
+
+// Removes the variables set by parallel_control_engine_threads from the
+// environment. Call once the engine is ready.
+void parallel_restore_environment(void);
+
+JSValueRef function_parallel_run(JSContextRef ctx, JSObjectRef function, JSObjectRef this_object,
+                                 size_t argc, const JSValueRef args[], JSValueRef *exception);
@@ -0,0 +1,648 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <wchar.h>
+
+#include "cache_store.h"
+#include "edn.h"
+#include "globals.h"
+#include "loader.h"
+#include "prefetch.h"
+#include "prelink.h"
+#include "str.h"
+#include "threads.h"
+
+#define NUM_THREADS 4
+#define NUM_BUCKETS 1024
+
+// Files are no longer prefetched while those not yet taken hold this many bytes
+#define MAX_PENDING_BYTES (64 * 1024 * 1024)
+
+#define SOURCE_FILE 0
+#define CACHE_ENTRY 1
+// Entries recording the namespaces whose files have been prefetched
+#define SEEN_NAMESPACE 2
+#define SEEN_MACROS_NAMESPACE 3
+
+enum file_state {
+    LOADING,
+    READY,
+    // Taken or not found, and not to be prefetched again
+    DONE
+};
+
+struct file {
+    int kind;
+    // The path of a source, or the key of a cache entry
+    char *path;
+    enum file_state state;
+    loaded_source_t source;
+    cache_entry_t entry;
+    size_t bytes;
+    struct file *next;
+};
+
+enum job_type {
+    JOB_NAMESPACE,
+    JOB_SOURCE,
+    JOB_SCRIPT
+};
+
+struct job {
+    enum job_type type;
+    // The namespace, or the path of the source or script
+    char *name;
+    bool macros;
+    JSStringRef source;
+    struct job *next;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t idle = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t published = PTHREAD_COND_INITIALIZER;
+
+static bool started = false;
+static int num_threads = 0;
+static struct job *queue_head = NULL;
+static struct job *queue_tail = NULL;
+static struct file *files[NUM_BUCKETS];
+static size_t pending_bytes = 0;
+
+static pthread_once_t atfork_once = PTHREAD_ONCE_INIT;
+
+// The workers don't survive fork, so the child starts over, leaking what the
+// parent had prefetched
+static void reset_in_child() {
+    pthread_mutex_t initial_lock = PTHREAD_MUTEX_INITIALIZER;
+    pthread_cond_t initial_cond = PTHREAD_COND_INITIALIZER;
+    lock = initial_lock;
+    idle = initial_cond;
+    published = initial_cond;
+    started = false;
+    num_threads = 0;
+    queue_head = NULL;
+    queue_tail = NULL;
+    memset(files, 0, sizeof(files));
+    pending_bytes = 0;
+}
+
+static void register_atfork() {
+    pthread_atfork(NULL, NULL, reset_in_child);
+}
+
+static bool enabled() {
+    const char *value = getenv("PLANCK_PREFETCH");
+    return value == NULL || strcmp(value, "0") != 0;
+}
+
+static uint32_t file_hash(int kind, const char *path) {
+    uint32_t hash = 2166136261u ^ (uint32_t) kind;
+    for (; *path; path++) {
+        hash ^= (uint8_t) *path;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Called with the lock held
+static struct file *lookup(int kind, const char *path) {
+    struct file *file = files[file_hash(kind, path) % NUM_BUCKETS];
+    while (file && (file->kind != kind || strcmp(file->path, path) != 0)) {
+        file = file->next;
+    }
+    return file;
+}
+
+// Called with the lock held
+static struct file *insert(int kind, const char *path, enum file_state state) {
+    struct file *file = calloc(1, sizeof(struct file));
+    file->kind = kind;
+    file->path = strdup(path);
+    file->state = state;
+    uint32_t bucket = file_hash(kind, path) % NUM_BUCKETS;
+    file->next = files[bucket];
+    files[bucket] = file;
+    return file;
+}
+
+// Records that the files of a namespace are being prefetched, returning false
+// if they already were
+static bool first_seen(int kind, const char *name) {
+    pthread_mutex_lock(&lock);
+    bool first = lookup(kind, name) == NULL;
+    if (first) {
+        insert(kind, name, DONE);
+    }
+    pthread_mutex_unlock(&lock);
+    return first;
+}
+
+// Returns an entry to load a file into, or NULL if the file has already been
+// prefetched or taken, or too much is waiting to be taken
+static struct file *claim(int kind, const char *path) {
+    struct file *file = NULL;
+    pthread_mutex_lock(&lock);
+    if (lookup(kind, path) == NULL && pending_bytes < MAX_PENDING_BYTES) {
+        file = insert(kind, path, LOADING);
+    }
+    pthread_mutex_unlock(&lock);
+    return file;
+}
+
+// Publishes a file once it has been loaded into its entry, or not found
+static void publish(struct file *file, bool loaded) {
+    pthread_mutex_lock(&lock);
+    if (loaded) {
+        file->bytes = file->kind == SOURCE_FILE
+                      ? JSStringGetLength(file->source.contents) * sizeof(JSChar)
+                      : JSStringGetLength(file->entry.js) * sizeof(JSChar);
+        file->state = READY;
+        pending_bytes += file->bytes;
+    } else {
+        file->state = DONE;
+    }
+    pthread_cond_broadcast(&published);
+    pthread_mutex_unlock(&lock);
+}
+
+// Prefetches a source, returning whether it was found, and, if it was loaded
+// here, its contents, retained for the caller
+static bool prefetch_source(const char *path, JSStringRef *contents) {
+    struct file *file = claim(SOURCE_FILE, path);
+    if (file == NULL) {
+        return true;
+    }
+
+    bool loaded = load_source(path, true, &file->source);
+    if (loaded && contents) {
+        *contents = JSStringRetain(file->source.contents);
+    }
+    publish(file, loaded);
+    return loaded;
+}
+
+static void prefetch_cache_entry(const char *ns, bool macros, JSStringRef source) {
+    char *name = str_concat(ns, macros ? "$macros" : "");
+    char *key = cache_store_key(name, source);
+    free(name);
+    struct file *file = claim(CACHE_ENTRY, key);
+    if (file) {
+        publish(file, cache_store_read(key, NULL, true, &file->entry));
+    }
+    free(key);
+}
+
+static void run_workers();
+
+static void enqueue(struct job *job) {
+    pthread_mutex_lock(&lock);
+    if (queue_tail) {
+        queue_tail->next = job;
+    } else {
+        queue_head = job;
+    }
+    queue_tail = job;
+    pthread_mutex_unlock(&lock);
+    run_workers();
+}
+
+static void enqueue_namespace(const char *ns, bool macros) {
+    if (!first_seen(macros ? SEEN_MACROS_NAMESPACE : SEEN_NAMESPACE, ns)) {
+        return;
+    }
+    struct job *job = calloc(1, sizeof(struct job));
+    job->type = JOB_NAMESPACE;
+    job->name = strdup(ns);
+    job->macros = macros;
+    enqueue(job);
+}
+
+// Reading the ns form of a source, with the reader in edn.c, to find the
+// namespaces it requires
+
+enum clause {
+    CLAUSE_NONE,
+    CLAUSE_REQUIRE,
+    CLAUSE_REQUIRE_MACROS
+};
+
+#define MAX_NS_DEPTH 5
+
+struct ns_reader {
+    const JSChar *chars;
+    size_t length;
+    size_t offset;
+    // Set once the ns form has been read, or the first form isn't one
+    bool done;
+    // Whether the source is being loaded as a macros namespace
+    bool macros;
+    // The type of the form being read at each depth and the index of the next
+    // element in it
+    clj_Type types[MAX_NS_DEPTH];
+    int indexes[MAX_NS_DEPTH];
+    enum clause clause;
+    // The prefix of a prefix list, and the lib of a libspec
+    char *prefix;
+    char *lib;
+};
+
+static wint_t ns_reader_getwchar(const clj_Reader *r) {
+    struct ns_reader *reader = r->data;
+    if (reader->done || reader->offset == reader->length) {
+        return WEOF;
+    }
+    return reader->chars[reader->offset++];
+}
+
+static char *ascii_name(const wchar_t *value) {
+    size_t length = wcslen(value);
+    char *name = malloc(length + 1);
+    size_t i;
+    for (i = 0; i < length; i++) {
+        if (value[i] > 127) {
+            free(name);
+            return NULL;
+        }
+        name[i] = (char) value[i];
+    }
+    name[length] = '\0';
+    return name;
+}
+
+static void require(struct ns_reader *reader, const char *prefix, const wchar_t *value, bool macros) {
+    char *name = ascii_name(value);
+    if (name == NULL) {
+        return;
+    }
+    if (prefix) {
+        char *prefixed = malloc(strlen(prefix) + strlen(name) + 2);
+        sprintf(prefixed, "%s.%s", prefix, name);
+        free(name);
+        name = prefixed;
+    }
+    enqueue_namespace(name, reader->macros || macros);
+    if (macros == false && reader->lib == NULL) {
+        reader->lib = strdup(name);
+    }
+    free(name);
+}
+
+static void ns_reader_emit(const clj_Reader *r, const clj_Node *node) {
+    struct ns_reader *reader = r->data;
+    int depth = r->depth;
+    if (clj_is_end(node->type) || depth >= MAX_NS_DEPTH) {
+        if (depth == 0) {
+            reader->done = true;
+        }
+        return;
+    }
+
+    int index = reader->indexes[depth]++;
+    clj_Type parent = depth > 0 ? reader->types[depth - 1] : 0;
+    if (clj_is_begin(node->type) && depth + 1 < MAX_NS_DEPTH) {
+        reader->types[depth] = node->type;
+        reader->indexes[depth + 1] = 0;
+    }
+
+    if (depth == 0) {
+        reader->done = node->type != CLJ_LIST;
+    } else if (depth == 1) {
+        if (index == 0) {
+            reader->done = node->type != CLJ_SYMBOL || wcscmp(node->value, L"ns") != 0;
+        }
+        reader->clause = CLAUSE_NONE;
+    } else if (depth == 2 && parent == CLJ_LIST) {
+        if (index == 0) {
+            if (node->type == CLJ_KEYWORD) {
+                if (wcscmp(node->value, L":require") == 0 || wcscmp(node->value, L":use") == 0) {
+                    reader->clause = CLAUSE_REQUIRE;
+                } else if (wcscmp(node->value, L":require-macros") == 0 ||
+                           wcscmp(node->value, L":use-macros") == 0) {
+                    reader->clause = CLAUSE_REQUIRE_MACROS;
+                }
+            }
+        } else if (reader->clause != CLAUSE_NONE) {
+            free(reader->prefix);
+            reader->prefix = NULL;
+            free(reader->lib);
+            reader->lib = NULL;
+            if (node->type == CLJ_SYMBOL) {
+                require(reader, NULL, node->value, reader->clause == CLAUSE_REQUIRE_MACROS);
+            }
+        }
+    } else if (depth >= 3 && reader->clause != CLAUSE_NONE) {
+        bool macros = reader->clause == CLAUSE_REQUIRE_MACROS;
+        // A libspec, [lib & options], or a prefix list, (prefix lib-or-libspec...)
+        bool in_prefix_list = reader->types[2] == CLJ_LIST;
+        bool libspec_lib = index == 0 && parent == CLJ_VECTOR &&
+                           (depth == 3 || (depth == 4 && in_prefix_list && reader->prefix));
+        if (node->type == CLJ_SYMBOL && depth == 3 && index == 0 && in_prefix_list) {
+            reader->prefix = ascii_name(node->value);
+        } else if (node->type == CLJ_SYMBOL && depth == 3 && in_prefix_list && reader->prefix) {
+            require(reader, reader->prefix, node->value, macros);
+        } else if (node->type == CLJ_SYMBOL && libspec_lib) {
+            free(reader->lib);
+            reader->lib = NULL;
+            require(reader, depth == 4 ? reader->prefix : NULL, node->value, macros);
+        } else if (node->type == CLJ_KEYWORD && parent == CLJ_VECTOR && reader->lib && !macros &&
+                   (wcscmp(node->value, L":refer-macros") == 0 ||
+                    wcscmp(node->value, L":include-macros") == 0)) {
+            enqueue_namespace(reader->lib, true);
+        }
+    }
+}
+
+static void prefetch_requires_of(JSStringRef source, bool macros) {
+    struct ns_reader reader;
+    memset(&reader, 0, sizeof(reader));
+    reader.chars = JSStringGetCharactersPtr(source);
+    reader.length = JSStringGetLength(source);
+    reader.macros = macros;
+
+    clj_Reader r;
+    r.getwchar = ns_reader_getwchar;
+    r.emit = ns_reader_emit;
+    r.data = &reader;
+    // Comments before the ns form are read as forms of their own
+    while (!reader.done && clj_read(&r) == CLJ_MORE) {
+    }
+
+    free(reader.prefix);
+    free(reader.lib);
+}
+
+// Munges a namespace into the path of its files, as cljs.analyzer.api/ns->relpath
+// does, without the extension
+static char *ns_relpath(const char *ns) {
+    static const struct {
+        char c;
+        const char *munged;
+    } char_map[] = {
+            {'-',  "_"},
+            {'!',  "_BANG_"},
+            {'?',  "_QMARK_"},
+            {'*',  "_STAR_"},
+            {'+',  "_PLUS_"},
+            {'>',  "_GT_"},
+            {'<',  "_LT_"},
+            {'=',  "_EQ_"},
+            {'\'', "_SINGLEQUOTE_"},
+            {'&',  "_AMPERSAND_"},
+            {'#',  "_SHARP_"},
+            {'%',  "_PERCENT_"},
+            {':',  "_COLON_"},
+            {'.',  "/"}
+    };
+    char *relpath = malloc(strlen(ns) * 13 + 1);
+    char *p = relpath;
+    for (; *ns; ns++) {
+        size_t i;
+        for (i = 0; i < sizeof(char_map) / sizeof(char_map[0]); i++) {
+            if (char_map[i].c == *ns) {
+                break;
+            }
+        }
+        if (i < sizeof(char_map) / sizeof(char_map[0])) {
+            strcpy(p, char_map[i].munged);
+            p += strlen(char_map[i].munged);
+        } else {
+            *p++ = *ns;
+        }
+    }
+    *p = '\0';
+    return relpath;
+}
+
+// Prefetches the source of a namespace, as planck.repl/load-other finds it,
+// then its compiled JavaScript and analysis cache, as planck.repl/cached-callback-data
+// finds them
+static void prefetch_namespace(const char *ns, bool macros) {
+    if (strcmp(ns, "cljs.core") == 0 || strcmp(ns, "goog") == 0 || strncmp(ns, "goog.", 5) == 0) {
+        return;
+    }
+
+    char *relpath = ns_relpath(ns);
+    char *js_path = str_concat(relpath, macros ? "$macros.js" : ".js");
+    bool prelinked = prelink_contains(js_path);
+    free(js_path);
+    if (prelinked) {
+        free(relpath);
+        return;
+    }
+
+    static const char *extensions[] = {".cljs", ".cljc", ".js", NULL};
+    static const char *macros_extensions[] = {".clj", ".cljc", NULL};
+    const char **extension;
+    for (extension = macros ? macros_extensions : extensions; *extension; extension++) {
+        char *path = str_concat(relpath, *extension);
+        JSStringRef contents = NULL;
+        bool found = prefetch_source(path, &contents);
+        if (contents) {
+            prefetch_requires_of(contents, macros);
+            if (config.cache_path && strcmp(*extension, ".js") != 0) {
+                prefetch_cache_entry(ns, macros, contents);
+            }
+            JSStringRelease(contents);
+        }
+        free(path);
+        if (found) {
+            break;
+        }
+    }
+
+    if (*extension && strcmp(*extension, ".js") != 0) {
+        char *path = str_concat(relpath, *extension);
+        if (macros) {
+            char *macros_path = str_concat(path, "$macros");
+            free(path);
+            path = macros_path;
+        }
+
+        char *cached_js_path = str_concat(macros ? path : relpath, ".js");
+        prefetch_source(cached_js_path, NULL);
+        free(cached_js_path);
+        char *cache_json_path = str_concat(path, ".cache.json");
+        prefetch_source(cache_json_path, NULL);
+        free(cache_json_path);
+        free(path);
+    }
+
+    free(relpath);
+}
+
+static void run_job(struct job *job) {
+    switch (job->type) {
+        case JOB_NAMESPACE:
+            prefetch_namespace(job->name, job->macros);
+            break;
+        case JOB_SOURCE:
+            prefetch_requires_of(job->source, job->macros);
+            break;
+        case JOB_SCRIPT: {
+            loaded_source_t source;
+            if (read_source(job->name, &source)) {
+                prefetch_requires_of(source.contents, false);
+                free_loaded_source(&source);
+            }
+            break;
+        }
+    }
+}
+
+// Workers exit once the queue is empty, and are started again as jobs are
+// queued, so that none are left running when planck.parallel forks
+static void *worker(void *data) {
+    pthread_mutex_lock(&lock);
+    while (queue_head != NULL) {
+        struct job *job = queue_head;
+        queue_head = job->next;
+        if (queue_head == NULL) {
+            queue_tail = NULL;
+        }
+        pthread_mutex_unlock(&lock);
+
+        run_job(job);
+        if (job->source) {
+            JSStringRelease(job->source);
+        }
+        free(job->name);
+        free(job);
+
+        pthread_mutex_lock(&lock);
+    }
+    if (--num_threads == 0) {
+        pthread_cond_broadcast(&idle);
+    }
+    planck_thread_exiting();
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+static void run_workers() {
+    pthread_mutex_lock(&lock);
+    if (num_threads < NUM_THREADS && start_planck_thread(worker, NULL) == 0) {
+        num_threads++;
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+void prefetch_start(void) {
+    if (!enabled()) {
+        return;
+    }
+    pthread_once(&atfork_once, register_atfork);
+
+    pthread_mutex_lock(&lock);
+    started = true;
+    pthread_mutex_unlock(&lock);
+
+    if (config.main_ns_name) {
+        enqueue_namespace(config.main_ns_name, false);
+    }
+    size_t i;
+    for (i = 0; i < config.num_scripts; i++) {
+        if (strcmp(config.scripts[i].type, "path") == 0 && !config.scripts[i].expression) {
+            struct job *job = calloc(1, sizeof(struct job));
+            job->type = JOB_SCRIPT;
+            job->name = strdup(config.scripts[i].source);
+            enqueue(job);
+        }
+    }
+}
+
+void prefetch_requires(const char *path, JSStringRef source) {
+    if (!started) {
+        return;
+    }
+    bool macros = str_has_suffix(path, ".clj") == 0;
+    if (!macros && str_has_suffix(path, ".cljs") != 0 && str_has_suffix(path, ".cljc") != 0) {
+        return;
+    }
+    struct job *job = calloc(1, sizeof(struct job));
+    job->type = JOB_SOURCE;
+    job->name = strdup(path);
+    job->macros = macros;
+    job->source = JSStringRetain(source);
+    enqueue(job);
+}
+
+// Returns whether a prefetched source is unchanged since it was read,
+// checking files read from directories, as those in the bundle and JARs
+// don't change
+static bool unchanged(const char *path, loaded_source_t *source) {
+    char *full_path = NULL;
+    if (source->origin == ORIGIN_SRC) {
+        full_path = strdup(source->path);
+    } else if (source->origin == ORIGIN_OUT) {
+        full_path = str_concat(config.out_path, path);
+    } else {
+        return true;
+    }
+    struct stat file_stat;
+    bool rv = stat(full_path, &file_stat) == 0 && file_stat.st_mtime == source->last_modified;
+    free(full_path);
+    return rv;
+}
+
+// Takes a prefetched file, waiting for it if it is being read, or returns NULL
+// if it wasn't prefetched
+static struct file *take(int kind, const char *path) {
+    if (!started) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&lock);
+    struct file *file = lookup(kind, path);
+    if (file == NULL) {
+        // Loaded by the caller, so not worth prefetching later
+        insert(kind, path, DONE);
+        pthread_mutex_unlock(&lock);
+        return NULL;
+    }
+    while (file->state == LOADING) {
+        pthread_cond_wait(&published, &lock);
+    }
+    bool taken = file->state == READY;
+    if (taken) {
+        pending_bytes -= file->bytes;
+        file->state = DONE;
+    }
+    pthread_mutex_unlock(&lock);
+    return taken ? file : NULL;
+}
+
+bool prefetch_take(const char *path, loaded_source_t *source) {
+    struct file *file = take(SOURCE_FILE, path);
+    if (file == NULL) {
+        return false;
+    }
+    *source = file->source;
+    memset(&file->source, 0, sizeof(file->source));
+    if (!unchanged(path, source)) {
+        free_loaded_source(source);
+        return false;
+    }
+    return true;
+}
+
+bool prefetch_take_cache_entry(const char *key, cache_entry_t *entry) {
+    struct file *file = take(CACHE_ENTRY, key);
+    if (file == NULL) {
+        return false;
+    }
+    *entry = file->entry;
+    memset(&file->entry, 0, sizeof(file->entry));
+    return true;
+}
+
+void prefetch_wait_idle(void) {
+    pthread_mutex_lock(&lock);
+    while (num_threads > 0) {
+        pthread_cond_wait(&idle, &lock);
+    }
+    pthread_mutex_unlock(&lock);
+}
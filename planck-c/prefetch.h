@@ -0,0 +1,29 @@
+#include <stdbool.h>
+#include <JavaScriptCore/JavaScript.h>
+
+// While a namespace is being compiled on the engine thread, the sources of the
+// namespaces it requires, and their compiled JavaScript and analysis caches,
+// are read on background threads, following the ns form of each source read,
+// so that they are ready when the loader asks for them. Each prefetched file
+// is handed to the loader once. Disabled by setting PLANCK_PREFETCH to 0.
+
+struct loaded_source;
+struct cache_entry;
+
+// Starts prefetching the main namespace and the dependencies of scripts,
+// before the engine is ready
+void prefetch_start(void);
+
+// Starts prefetching the namespaces required by a source loaded from a path
+void prefetch_requires(const char *path, JSStringRef source);
+
+// Takes a file loaded by PLANCK_LOAD, if it was prefetched, waiting for it if
+// it is being read
+bool prefetch_take(const char *path, struct loaded_source *source);
+
+// Takes an entry of the compilation cache store, if it was prefetched
+bool prefetch_take_cache_entry(const char *key, struct cache_entry *entry);
+
+// Waits for the files being prefetched to be read, and the threads reading
+// them to exit
+void prefetch_wait_idle(void);
@@ -0,0 +1,159 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bundle.h"
+#include "bundle_string.h"
+#include "clock.h"
+#include "functions.h"
+#include "jsc_utils.h"
+#include "prelink.h"
+
+#define PRELINK_BLOB_PATH "planck/prelinked.js"
+#define PRELINK_INDEX_PATH "planck/prelinked.idx"
+
+// Each line of the index names a phase and a file, and gives the length of
+// the file as UTF-8 bytes and as UTF-16 characters, since the blob may be
+// bundled in either encoding.
+struct prelink_segment {
+    char *phase;
+    char *path;
+    size_t utf8_len;
+    size_t utf16_len;
+};
+
+static pthread_once_t index_once = PTHREAD_ONCE_INIT;
+static struct prelink_segment *segments = NULL;
+static size_t num_segments = 0;
+
+// The blob is decoded once, and kept for the life of the process, as
+// JavaScriptCore may refer to its characters without having copied them
+static const uint16_t *blob_characters = NULL;
+static const char *blob_utf8 = NULL;
+
+static FILE *trace_file = NULL;
+static const char *trace_phase = NULL;
+
+static bool tracing() {
+    return getenv("PLANCK_PRELINK_TRACE") != NULL;
+}
+
+static void load_index() {
+    if (tracing()) {
+        return;
+    }
+
+    char *index = bundle_get_contents(PRELINK_INDEX_PATH);
+    if (index == NULL) {
+        return;
+    }
+
+    size_t capacity = 256;
+    segments = malloc(capacity * sizeof(struct prelink_segment));
+    char *saveptr = NULL;
+    char *line = strtok_r(index, "\n", &saveptr);
+    while (line) {
+        char *fields[4];
+        char *field_saveptr = NULL;
+        int i;
+        for (i = 0; i < 4; i++) {
+            fields[i] = strtok_r(i == 0 ? line : NULL, "\t", &field_saveptr);
+        }
+        if (fields[3]) {
+            if (num_segments == capacity) {
+                capacity *= 2;
+                segments = realloc(segments, capacity * sizeof(struct prelink_segment));
+            }
+            struct prelink_segment *segment = &segments[num_segments++];
+            segment->phase = strdup(fields[0]);
+            segment->path = strdup(fields[1]);
+            segment->utf8_len = strtoul(fields[2], NULL, 10);
+            segment->utf16_len = strtoul(fields[3], NULL, 10);
+        }
+        line = strtok_r(NULL, "\n", &saveptr);
+    }
+    free(index);
+
+    size_t length = 0;
+    blob_characters = bundle_map_characters(PRELINK_BLOB_PATH, &length);
+    if (blob_characters == NULL) {
+        blob_utf8 = bundle_map_contents(PRELINK_BLOB_PATH);
+    }
+    if (blob_characters == NULL && blob_utf8 == NULL) {
+        num_segments = 0;
+    }
+}
+
+bool prelink_contains(const char *path) {
+    pthread_once(&index_once, load_index);
+    size_t i;
+    for (i = 0; i < num_segments; i++) {
+        if (strcmp(segments[i].path, path) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void evaluate_segment(JSContextRef ctx, struct prelink_segment *segment, JSStringRef source) {
+    if (strncmp(segment->path, "goog/", 5) == 0) {
+        mark_goog_loaded(ctx, segment->path);
+    }
+    evaluate_script_string(ctx, source, segment->path);
+    JSStringRelease(source);
+    display_launch_timing(segment->path);
+}
+
+bool prelink_evaluate(JSContextRef ctx, const char *phase) {
+    pthread_once(&index_once, load_index);
+    if (num_segments == 0) {
+        return false;
+    }
+
+    set_prelinking(ctx, true);
+    size_t offset = 0;
+    size_t i;
+    for (i = 0; i < num_segments; i++) {
+        struct prelink_segment *segment = &segments[i];
+        bool in_phase = strcmp(segment->phase, phase) == 0;
+        if (blob_characters) {
+            if (in_phase) {
+                evaluate_segment(ctx, segment,
+                                 bundle_string_create_with_characters(blob_characters + offset,
+                                                                      segment->utf16_len));
+            }
+            offset += segment->utf16_len;
+        } else {
+            if (in_phase) {
+                char *source = strndup(blob_utf8 + offset, segment->utf8_len);
+                evaluate_segment(ctx, segment, JSStringCreateWithUTF8CString(source));
+                free(source);
+            }
+            offset += segment->utf8_len;
+        }
+    }
+    set_prelinking(ctx, false);
+
+    return true;
+}
+
+void prelink_trace_phase(const char *phase) {
+    trace_phase = phase;
+}
+
+void prelink_trace(const char *path) {
+    if (trace_phase == NULL || !tracing()) {
+        return;
+    }
+    if (trace_file == NULL) {
+        trace_file = fopen(getenv("PLANCK_PRELINK_TRACE"), "w");
+        if (trace_file == NULL) {
+            perror(getenv("PLANCK_PRELINK_TRACE"));
+            trace_phase = NULL;
+            return;
+        }
+    }
+    fprintf(trace_file, "%s\t%s\n", trace_phase, path);
+    fflush(trace_file);
+}
@@ -0,0 +1,23 @@
+#include <stdbool.h>
+
+#include <JavaScriptCore/JavaScript.h>
+
+// The files imported at startup are prelinked by script/bundle into a single
+// bundled blob, in the order they are evaluated, in two phases: those loaded
+// by goog.require('cljs.core') during bootstrap, and those loaded by
+// goog.require('planck.repl').
+
+#define PRELINK_PHASE_CORE "core"
+#define PRELINK_PHASE_APP "app"
+
+// Evaluates the prelinked files for a phase, returning false if there are none,
+// in which case they need to be required instead.
+bool prelink_evaluate(JSContextRef ctx, const char *phase);
+
+bool prelink_contains(const char *path);
+
+// Records the files imported in each phase if PLANCK_PRELINK_TRACE names a
+// file, which script/bundle uses to prelink them.
+void prelink_trace_phase(const char *phase);
+
+void prelink_trace(const char *path);
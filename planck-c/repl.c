@@ -26,6 +26,7 @@ struct repl {
     size_t num_previous_lines;
     char **previous_lines;
     int session_id;
+    engine_session_t *session;
 };
 
 typedef struct repl repl_t;
@@ -40,6 +41,7 @@ repl_t *make_repl() {
     repl->num_previous_lines = 0;
     repl->previous_lines = NULL;
     repl->session_id = 0;
+    repl->session = NULL;
     return repl;
 }
 
@@ -178,7 +180,12 @@ bool process_line(repl_t *repl, char *input_line, bool split_on_newlines) {
     char *balance_text = NULL;
 
     while (!done) {
-        if ((balance_text = is_readable(repl->input)) != NULL) {
+        if (repl->session) {
+            balance_text = session_is_readable(repl->session, repl->input);
+        } else {
+            balance_text = is_readable(repl->input);
+        }
+        if (balance_text != NULL) {
             repl->input[strlen(repl->input) - strlen(balance_text)] = '\0';
 
             if (!is_whitespace(repl->input)) { // Guard against empty string being read
@@ -193,8 +200,13 @@ bool process_line(repl_t *repl, char *input_line, bool split_on_newlines) {
 
                 const char *theme = repl->session_id == 0 ? config.theme : "dumb";
 
-                evaluate_source("text", repl->input, true, true, repl->current_ns, theme, true,
-                                repl->session_id);
+                if (repl->session) {
+                    session_evaluate_source(repl->session, "text", repl->input, true, true, repl->current_ns, theme,
+                                            repl->session_id);
+                } else {
+                    evaluate_source("text", repl->input, true, true, repl->current_ns, theme, true,
+                                    repl->session_id);
+                }
 
                 if (repl->session_id == 0) {
                     clear_int_handler();
@@ -218,7 +230,7 @@ bool process_line(repl_t *repl, char *input_line, bool split_on_newlines) {
 
             // Fetch the current namespace and use it to set the prompt
 
-            char *current_ns = get_current_ns();
+            char *current_ns = repl->session ? session_get_current_ns(repl->session) : get_current_ns();
             if (current_ns) {
                 free(repl->current_ns);
                 repl->current_ns = current_ns;
@@ -393,7 +405,7 @@ struct hl_restore {
 
 struct hl_restore hl_restore = {0, 0, 0};
 
-void do_highlight_restore(void *data) {
+void do_highlight_restore(unsigned long timer_id, void *data) {
 
     struct hl_restore *hl_restore = data;
 
@@ -486,7 +498,9 @@ void highlight(const char *buf, int pos) {
 
             hl_restore = *hl_restore_local;
 
-            start_timer(500, do_highlight_restore, (void *) hl_restore_local);
+            if (!start_timer(500, do_highlight_restore, (void *) hl_restore_local)) {
+                free(hl_restore_local);
+            }
         }
     }
 }
@@ -495,21 +509,61 @@ void highlight_cancel() {
     if (hl_restore.id != 0) {
         struct hl_restore *hl_restore_tmp = malloc(sizeof(struct hl_restore));
         *hl_restore_tmp = hl_restore;
-        do_highlight_restore(hl_restore_tmp);
+        do_highlight_restore(0, hl_restore_tmp);
+    }
+}
+
+// Output printed while a socket REPL form is evaluated is collected and written
+// out in one go when the evaluation completes (or the buffer fills up). This is
+// per thread, as sessions with their own contexts evaluate concurrently.
+#define SOCKET_REPL_OUTPUT_FLUSH_SIZE 65536
+
+static __thread int sock_to_write_to = 0;
+static __thread char *socket_repl_output = NULL;
+static __thread size_t socket_repl_output_len = 0;
+static __thread size_t socket_repl_output_capacity = 0;
+
+static int flush_socket_repl_output(int sock) {
+    int err = 0;
+    if (socket_repl_output_len) {
+        err = socket_write(sock, socket_repl_output, socket_repl_output_len) == -1 ? -1 : 0;
+        socket_repl_output_len = 0;
     }
+    return err;
 }
 
-int sock_to_write_to = 0;
+static void append_socket_repl_output(const char *text) {
+    size_t len = strlen(text);
+    if (socket_repl_output_len + len > socket_repl_output_capacity) {
+        size_t new_capacity = socket_repl_output_capacity ? socket_repl_output_capacity : 4096;
+        while (new_capacity < socket_repl_output_len + len) {
+            new_capacity *= 2;
+        }
+        char *new_output = realloc(socket_repl_output, new_capacity);
+        if (!new_output) {
+            flush_socket_repl_output(sock_to_write_to);
+            write_to_socket(sock_to_write_to, text);
+            return;
+        }
+        socket_repl_output = new_output;
+        socket_repl_output_capacity = new_capacity;
+    }
+    memcpy(socket_repl_output + socket_repl_output_len, text, len);
+    socket_repl_output_len += len;
+}
 
 void socket_sender(const char *text) {
     if (sock_to_write_to) {
-        write_to_socket(sock_to_write_to, text);
+        append_socket_repl_output(text);
+        if (socket_repl_output_len >= SOCKET_REPL_OUTPUT_FLUSH_SIZE) {
+            flush_socket_repl_output(sock_to_write_to);
+        }
     }
 }
 
 static int session_id_counter = 0;
 
-conn_data_cb_ret_t* socket_repl_data_arrived(char *data, int sock, void *state) {
+conn_data_cb_ret_t* socket_repl_data_arrived(char *data, size_t len, int sock, void *state) {
 
     int err = 0;
     bool exit = false;
@@ -521,24 +575,41 @@ conn_data_cb_ret_t* socket_repl_data_arrived(char *data, int sock, void *state)
             data[strlen(data) - 2] = '\0';
         }
 
-        sock_to_write_to = sock;
-
-        pthread_mutex_lock(&repl_print_mutex);
+        // Sessions with their own contexts needn't wait on other sessions
+        if (repl->session) {
+            set_thread_print_sender(&socket_sender);
+        } else {
+            pthread_mutex_lock(&repl_print_mutex);
+            set_print_sender(&socket_sender);
+        }
 
-        set_print_sender(&socket_sender);
+        sock_to_write_to = sock;
 
         exit = process_line(repl, strdup(data), false);
 
-        set_print_sender(NULL);
-        sock_to_write_to = 0;
-
-        pthread_mutex_unlock(&repl_print_mutex);
-
+        if (repl->session) {
+            set_thread_print_sender(NULL);
+        } else {
+            set_print_sender(NULL);
+        }
 
         if (!exit && repl->current_prompt != NULL) {
-            err = write_to_socket(sock, repl->current_prompt);
+            append_socket_repl_output(repl->current_prompt);
+        }
+        err = flush_socket_repl_output(sock);
+        sock_to_write_to = 0;
+
+        if (!repl->session) {
+            pthread_mutex_unlock(&repl_print_mutex);
         }
+
+        free(data);
     } else {
+        repl_t *repl = state;
+        if (repl && repl->session) {
+            release_engine_session(repl->session);
+            repl->session = NULL;
+        }
         exit = true;
     }
 
@@ -554,6 +625,9 @@ accepted_conn_cb_ret_t* accepted_socket_repl_connection(int sock, void* state) {
     repl_t *repl = make_repl();
     repl->current_prompt = form_prompt(repl, false);
     repl->session_id = ++session_id_counter;
+    if (config.socket_repl_contexts) {
+        repl->session = acquire_engine_session();
+    }
 
     int err = write_to_socket(sock, repl->current_prompt);
 
@@ -624,12 +698,19 @@ int run_repl() {
             set_print_sender(&linenoisePrintNow);
         }
 
+        if (config.socket_repl_contexts) {
+            int err = prewarm_engine_sessions(config.socket_repl_contexts);
+            if (err) {
+                engine_print_err_message("Failed to pre-warm socket REPL contexts", err);
+            }
+        }
+
         int err = bind_and_listen(&socket_accept_data);
+        if (err != -1) {
+            err = accept_connections(&socket_accept_data);
+        }
         if (err == -1) {
             engine_perror("Failed to set up socket REPL");
-        } else {
-            pthread_t thread;
-            pthread_create(&thread, NULL, accept_connections, &socket_accept_data);
         }
     }
 
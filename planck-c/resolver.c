@@ -0,0 +1,344 @@
+#include <ctype.h>
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <netinet/in.h>
+#include "resolver.h"
+#include "clock.h"
+#include "threads.h"
+
+// Host names are resolved with getaddrinfo, which may block for seconds, on a
+// dedicated resolver thread. As getaddrinfo doesn't report record TTLs, results
+// are cached in-process for a fixed time; hosts that don't exist are cached for
+// a shorter time. Numeric addresses bypass both the thread and the cache.
+
+#define RESOLVER_CACHE_TTL (60 * 1000000000ULL)
+#define RESOLVER_NEGATIVE_CACHE_TTL (5 * 1000000000ULL)
+#define RESOLVER_CACHE_BUCKETS 64
+#define MAX_RESOLVER_CACHE_ENTRIES 1024
+
+struct cache_entry {
+    char *host;
+    uint64_t expires;
+    int err;
+    resolved_address_t *addrs;
+    size_t count;
+    struct cache_entry *next;
+};
+
+struct resolve_request {
+    char *host;
+    int port;
+    resolve_cb_t resolve_cb;
+    void *data;
+    struct resolve_request *next;
+};
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct cache_entry *cache[RESOLVER_CACHE_BUCKETS];
+static size_t cache_count = 0;
+
+static pthread_mutex_t requests_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t requests_cond = PTHREAD_COND_INITIALIZER;
+static struct resolve_request *requests_head = NULL;
+static struct resolve_request *requests_tail = NULL;
+static pthread_once_t resolver_once = PTHREAD_ONCE_INIT;
+static int resolver_err = 0;
+
+static atomic_uint_fast64_t lookup_count = 0;
+static atomic_uint_fast64_t cache_hit_count = 0;
+
+static void set_port(resolved_address_t *addrs, size_t count, int port) {
+    size_t i;
+    for (i = 0; i < count; i++) {
+        if (addrs[i].family == AF_INET) {
+            ((struct sockaddr_in *) &addrs[i].addr)->sin_port = htons((uint16_t) port);
+        } else if (addrs[i].family == AF_INET6) {
+            ((struct sockaddr_in6 *) &addrs[i].addr)->sin6_port = htons((uint16_t) port);
+        }
+    }
+}
+
+static resolved_address_t *copy_addresses(const resolved_address_t *addrs, size_t count, int port) {
+    resolved_address_t *copy = malloc(count * sizeof(resolved_address_t));
+    if (copy) {
+        memcpy(copy, addrs, count * sizeof(resolved_address_t));
+        set_port(copy, count, port);
+    }
+    return copy;
+}
+
+static int lookup(const char *host, int flags, resolved_address_t **addrs, size_t *count) {
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = flags;
+
+    struct addrinfo *result;
+    int err = getaddrinfo(host, NULL, &hints, &result);
+    if (err) {
+        return err;
+    }
+
+    size_t n = 0;
+    struct addrinfo *ai;
+    for (ai = result; ai; ai = ai->ai_next) {
+        if ((ai->ai_family == AF_INET || ai->ai_family == AF_INET6) && ai->ai_addrlen <= sizeof(struct sockaddr_storage)) {
+            n++;
+        }
+    }
+    if (!n) {
+        freeaddrinfo(result);
+        return EAI_NONAME;
+    }
+
+    resolved_address_t *resolved = calloc(n, sizeof(resolved_address_t));
+    if (!resolved) {
+        freeaddrinfo(result);
+        return EAI_MEMORY;
+    }
+
+    // Keep getaddrinfo's order, which follows the system's address selection policy
+    size_t i = 0;
+    for (ai = result; ai; ai = ai->ai_next) {
+        if ((ai->ai_family == AF_INET || ai->ai_family == AF_INET6) && ai->ai_addrlen <= sizeof(struct sockaddr_storage)) {
+            resolved[i].family = ai->ai_family;
+            resolved[i].addr_len = ai->ai_addrlen;
+            memcpy(&resolved[i].addr, ai->ai_addr, ai->ai_addrlen);
+            i++;
+        }
+    }
+
+    freeaddrinfo(result);
+    *addrs = resolved;
+    *count = n;
+    return 0;
+}
+
+// Cache
+
+static size_t bucket_for_host(const char *host) {
+    // FNV-1a, ignoring case
+    uint32_t hash = 2166136261u;
+    for (; *host; host++) {
+        hash ^= (unsigned char) tolower((unsigned char) *host);
+        hash *= 16777619u;
+    }
+    return hash & (RESOLVER_CACHE_BUCKETS - 1);
+}
+
+static void free_cache_entry(struct cache_entry *entry) {
+    free(entry->host);
+    free(entry->addrs);
+    free(entry);
+}
+
+// Called with cache_lock held
+static void cache_clear() {
+    size_t i;
+    for (i = 0; i < RESOLVER_CACHE_BUCKETS; i++) {
+        while (cache[i]) {
+            struct cache_entry *next = cache[i]->next;
+            free_cache_entry(cache[i]);
+            cache[i] = next;
+        }
+    }
+    cache_count = 0;
+}
+
+// Returns true on a hit, filling in either the addresses or the error
+static bool cache_lookup(const char *host, int port, resolved_address_t **addrs, size_t *count, int *err) {
+    bool hit = false;
+    uint64_t now = system_time();
+
+    pthread_mutex_lock(&cache_lock);
+    struct cache_entry **p = &cache[bucket_for_host(host)];
+    while (*p) {
+        struct cache_entry *entry = *p;
+        if (entry->expires <= now) {
+            *p = entry->next;
+            free_cache_entry(entry);
+            cache_count--;
+            continue;
+        }
+        if (strcasecmp(entry->host, host) == 0) {
+            if (entry->count) {
+                *addrs = copy_addresses(entry->addrs, entry->count, port);
+                hit = *addrs != NULL;
+            } else {
+                *addrs = NULL;
+                hit = true;
+            }
+            *count = entry->count;
+            *err = entry->err;
+            break;
+        }
+        p = &entry->next;
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    if (hit) {
+        atomic_fetch_add(&cache_hit_count, 1);
+    }
+    return hit;
+}
+
+static void cache_insert(const char *host, const resolved_address_t *addrs, size_t count, int err) {
+    struct cache_entry *entry = malloc(sizeof(struct cache_entry));
+    if (!entry) {
+        return;
+    }
+    entry->host = strdup(host);
+    entry->addrs = count ? copy_addresses(addrs, count, 0) : NULL;
+    if (!entry->host || (count && !entry->addrs)) {
+        free_cache_entry(entry);
+        return;
+    }
+    entry->count = count;
+    entry->err = err;
+    entry->expires = system_time() + (err ? RESOLVER_NEGATIVE_CACHE_TTL : RESOLVER_CACHE_TTL);
+
+    pthread_mutex_lock(&cache_lock);
+    struct cache_entry **p = &cache[bucket_for_host(host)];
+    while (*p) {
+        if (strcasecmp((*p)->host, host) == 0) {
+            struct cache_entry *replaced = *p;
+            *p = replaced->next;
+            free_cache_entry(replaced);
+            cache_count--;
+            break;
+        }
+        p = &(*p)->next;
+    }
+    // Rather than track recency, start over should the cache fill up
+    if (cache_count >= MAX_RESOLVER_CACHE_ENTRIES) {
+        cache_clear();
+    }
+    size_t bucket = bucket_for_host(host);
+    entry->next = cache[bucket];
+    cache[bucket] = entry;
+    cache_count++;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+static int lookup_and_cache(const char *host, int port, resolved_address_t **addrs, size_t *count) {
+    atomic_fetch_add(&lookup_count, 1);
+    int err = lookup(host, 0, addrs, count);
+    if (!err) {
+        cache_insert(host, *addrs, *count, 0);
+        set_port(*addrs, *count, port);
+    } else if (err == EAI_NONAME) {
+        cache_insert(host, NULL, 0, err);
+    }
+    return err;
+}
+
+// Resolver thread
+
+static void *resolver_thread(void *data) {
+    while (true) {
+        pthread_mutex_lock(&requests_lock);
+        while (!requests_head) {
+            pthread_cond_wait(&requests_cond, &requests_lock);
+        }
+        struct resolve_request *request = requests_head;
+        requests_head = request->next;
+        if (!requests_head) {
+            requests_tail = NULL;
+        }
+        pthread_mutex_unlock(&requests_lock);
+
+        resolved_address_t *addrs = NULL;
+        size_t count = 0;
+        int err;
+        // A request queued ahead of this one may have resolved the same host
+        if (!cache_lookup(request->host, request->port, &addrs, &count, &err)) {
+            err = lookup_and_cache(request->host, request->port, &addrs, &count);
+        }
+        request->resolve_cb(addrs, count, err, request->data);
+
+        free(request->host);
+        free(request);
+    }
+
+    return NULL;
+}
+
+static void start_resolver() {
+    resolver_err = start_planck_thread(resolver_thread, NULL);
+}
+
+int resolve_host_async(const char *host, int port, resolve_cb_t resolve_cb, void *data) {
+    resolved_address_t *addrs = NULL;
+    size_t count = 0;
+    int err;
+
+    if (lookup(host, AI_NUMERICHOST, &addrs, &count) == 0) {
+        set_port(addrs, count, port);
+        resolve_cb(addrs, count, 0, data);
+        return 0;
+    }
+    if (cache_lookup(host, port, &addrs, &count, &err)) {
+        resolve_cb(addrs, count, err, data);
+        return 0;
+    }
+
+    pthread_once(&resolver_once, start_resolver);
+    if (resolver_err) {
+        errno = resolver_err;
+        return -1;
+    }
+
+    struct resolve_request *request = malloc(sizeof(struct resolve_request));
+    char *host_copy = strdup(host);
+    if (!request || !host_copy) {
+        free(request);
+        free(host_copy);
+        errno = ENOMEM;
+        return -1;
+    }
+    request->host = host_copy;
+    request->port = port;
+    request->resolve_cb = resolve_cb;
+    request->data = data;
+    request->next = NULL;
+
+    pthread_mutex_lock(&requests_lock);
+    if (requests_tail) {
+        requests_tail->next = request;
+    } else {
+        requests_head = request;
+    }
+    requests_tail = request;
+    pthread_cond_signal(&requests_cond);
+    pthread_mutex_unlock(&requests_lock);
+
+    return 0;
+}
+
+int resolve_host(const char *host, int port, resolved_address_t **addrs, size_t *count) {
+    *addrs = NULL;
+    *count = 0;
+
+    if (lookup(host, AI_NUMERICHOST, addrs, count) == 0) {
+        set_port(*addrs, *count, port);
+        return 0;
+    }
+
+    int err;
+    if (cache_lookup(host, port, addrs, count, &err)) {
+        return err;
+    }
+    return lookup_and_cache(host, port, addrs, count);
+}
+
+void get_resolver_stats(resolver_stats_t *stats) {
+    stats->lookups = atomic_load(&lookup_count);
+    stats->cache_hits = atomic_load(&cache_hit_count);
+}
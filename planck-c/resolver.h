@@ -0,0 +1,28 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+typedef struct resolved_address {
+    int family;
+    socklen_t addr_len;
+    struct sockaddr_storage addr;
+} resolved_address_t;
+
+// Called with the addresses a host resolved to, or with an EAI_ error code
+// and no addresses. Ownership of addrs passes to the callback.
+typedef void (*resolve_cb_t)(resolved_address_t *addrs, size_t count, int err, void *data);
+
+typedef struct resolver_stats {
+    uint64_t lookups;
+    uint64_t cache_hits;
+} resolver_stats_t;
+
+// Resolves host on the resolver thread. Numeric and cached hosts are resolved
+// immediately, with the callback made before returning.
+int resolve_host_async(const char *host, int port, resolve_cb_t resolve_cb, void *data);
+
+// Resolves host on the calling thread, returning an EAI_ error code on failure.
+// The caller should free the returned addresses.
+int resolve_host(const char *host, int port, resolved_address_t **addrs, size_t *count);
+
+void get_resolver_stats(resolver_stats_t *stats);
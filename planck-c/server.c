@@ -0,0 +1,384 @@
+// Define _GNU_SOURCE so that struct ucred is defined for non macOS builds
+#ifndef __APPLE__
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "engine.h"
+#include "globals.h"
+#include "parallel.h"
+#include "server.h"
+#include "server_protocol.h"
+
+// The server initializes an engine once, and then forks a process from it for
+// each request made by planck-client, which is handed the client's standard
+// streams. Each process starts with a copy-on-write image of the warm engine,
+// so requests don't pay for bootstrapping or loading the analysis cache.
+
+extern char **environ;
+
+typedef struct request {
+    pid_t pid;
+    int conn;
+    int status_pipe;
+    struct request *next;
+} request_t;
+
+static request_t *requests = NULL;
+static int sigchld_pipe[2] = {-1, -1};
+
+static void sigchld_handler(int sig) {
+    int saved_errno = errno;
+    ssize_t rv = write(sigchld_pipe[1], "", 1);
+    (void) rv;
+    errno = saved_errno;
+}
+
+static void set_non_blocking(int fd) {
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+static int listen_on(const char *path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Server socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) {
+        perror("socket");
+        return -1;
+    }
+
+    // Replace a socket left behind by a server that is no longer running
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == 0) {
+        fprintf(stderr, "A Planck server is already listening on %s\n", path);
+        close(fd);
+        return -1;
+    }
+    unlink(path);
+
+    mode_t mask = umask(077);
+    int rv = bind(fd, (struct sockaddr *) &addr, sizeof(addr));
+    umask(mask);
+    if (rv == -1 || listen(fd, 64) == -1) {
+        perror(path);
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static bool is_same_user(int conn) {
+#ifdef __APPLE__
+    uid_t uid;
+    gid_t gid;
+    return getpeereid(conn, &uid, &gid) == 0 && uid == getuid();
+#else
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    return getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0 && cred.uid == getuid();
+#endif
+}
+
+static bool receive_request(int conn, struct server_request *request, int fds[3], char **payload) {
+    struct iovec iov;
+    iov.iov_base = request;
+    iov.iov_len = sizeof(*request);
+
+    union {
+        char buf[CMSG_SPACE(3 * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    ssize_t n;
+    while ((n = recvmsg(conn, &msg, 0)) == -1 && errno == EINTR) {
+    }
+
+    struct cmsghdr *cmsg = n > 0 ? CMSG_FIRSTHDR(&msg) : NULL;
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS
+        || cmsg->cmsg_len != CMSG_LEN(3 * sizeof(int))) {
+        return false;
+    }
+    memcpy(fds, CMSG_DATA(cmsg), 3 * sizeof(int));
+
+    if (n != sizeof(*request) || request->payload_size > SERVER_MAX_PAYLOAD_SIZE) {
+        return false;
+    }
+
+    *payload = malloc(request->payload_size + 1);
+    if (!*payload || !server_read_fully(conn, *payload, request->payload_size)) {
+        return false;
+    }
+    (*payload)[request->payload_size] = '\0';
+    return true;
+}
+
+// Splits the payload into count strings, returning the position after them or
+// NULL if the payload is too short.
+static char *split_strings(char *p, char *end, uint32_t count, char **strings) {
+    uint32_t i;
+    for (i = 0; i < count; i++) {
+        if (p >= end) {
+            return NULL;
+        }
+        strings[i] = p;
+        p += strlen(p) + 1;
+    }
+    strings[count] = NULL;
+    return p;
+}
+
+static void report_unsupported(int status_pipe, char status) {
+    ssize_t rv = write(status_pipe, &status, 1);
+    (void) rv;
+    _exit(EXIT_SUCCESS);
+}
+
+// Runs in the forked process
+static void handle_connection(int conn, int status_pipe, server_request_fn handle_request) {
+    struct server_request request;
+    int fds[3] = {-1, -1, -1};
+    char *payload = NULL;
+    if (!receive_request(conn, &request, fds, &payload)) {
+        report_unsupported(status_pipe, 'U');
+    }
+    close(conn);
+
+    char *end = payload + request.payload_size;
+    char *cwd = payload;
+    char **argv = malloc((request.argc + 1) * sizeof(char *));
+    char **envp = malloc((request.envc + 1) * sizeof(char *));
+    char *p = split_strings(cwd + strlen(cwd) + 1, end, request.argc, argv);
+    if (request.argc < 1 || !p || !split_strings(p, end, request.envc, envp) || chdir(cwd) == -1) {
+        report_unsupported(status_pipe, 'U');
+    }
+
+    // Run in a new session, with no controlling terminal, so that the client's
+    // terminal can be read from and signals can be forwarded to the process group
+    setsid();
+
+    int i;
+    for (i = 0; i < 3; i++) {
+        dup2(fds[i], i);
+        if (fds[i] > 2) {
+            close(fds[i]);
+        }
+    }
+    umask((mode_t) request.umask);
+    environ = envp;
+
+    int exit_status = EXIT_SUCCESS;
+    int rv = handle_request((int) request.argc, argv, &exit_status);
+    if (rv == SERVER_REQUEST_STALE) {
+        report_unsupported(status_pipe, 'S');
+    } else if (rv == SERVER_REQUEST_UNSUPPORTED) {
+        report_unsupported(status_pipe, 'U');
+    }
+
+    exit(exit_status);
+}
+
+static void send_reply(int conn, int32_t kind, int32_t value) {
+    struct server_reply reply;
+    reply.kind = kind;
+    reply.value = value;
+    server_write_fully(conn, &reply, sizeof(reply));
+}
+
+static void start_request(int conn, int listen_fd, server_request_fn handle_request) {
+    int status_pipe[2];
+    if (pipe(status_pipe) == -1) {
+        send_reply(conn, SERVER_REPLY_FALLBACK, 0);
+        close(conn);
+        return;
+    }
+
+    fflush(stdout);
+    fflush(stderr);
+
+    pid_t pid = fork();
+    if (pid == -1) {
+        send_reply(conn, SERVER_REPLY_FALLBACK, 0);
+        close(conn);
+        close(status_pipe[0]);
+        close(status_pipe[1]);
+        return;
+    }
+
+    if (pid == 0) {
+        signal(SIGCHLD, SIG_DFL);
+        close(listen_fd);
+        close(sigchld_pipe[0]);
+        close(sigchld_pipe[1]);
+        close(status_pipe[0]);
+        request_t *request;
+        for (request = requests; request; request = request->next) {
+            close(request->conn);
+            close(request->status_pipe);
+        }
+        handle_connection(conn, status_pipe[1], handle_request);
+    }
+
+    close(status_pipe[1]);
+    set_non_blocking(status_pipe[0]);
+
+    send_reply(conn, SERVER_REPLY_STARTED, pid);
+
+    request_t *request = malloc(sizeof(request_t));
+    request->pid = pid;
+    request->conn = conn;
+    request->status_pipe = status_pipe[0];
+    request->next = requests;
+    requests = request;
+}
+
+// Replies to the client of a completed request, returning true if the engine
+// was found to be stale.
+static bool finish_request(pid_t pid, int status) {
+    request_t **p = &requests;
+    while (*p && (*p)->pid != pid) {
+        p = &(*p)->next;
+    }
+    request_t *request = *p;
+    if (!request) {
+        return false;
+    }
+    *p = request->next;
+
+    bool stale = false;
+    char c = 0;
+    if (read(request->status_pipe, &c, 1) == 1) {
+        stale = c == 'S';
+        send_reply(request->conn, SERVER_REPLY_FALLBACK, 0);
+    } else if (WIFEXITED(status)) {
+        send_reply(request->conn, SERVER_REPLY_EXITED, WEXITSTATUS(status));
+    } else if (WIFSIGNALED(status)) {
+        send_reply(request->conn, SERVER_REPLY_EXITED, 128 + WTERMSIG(status));
+    } else {
+        send_reply(request->conn, SERVER_REPLY_EXITED, EXIT_FAILURE);
+    }
+
+    close(request->conn);
+    close(request->status_pipe);
+    free(request);
+    return stale;
+}
+
+int run_server(server_request_fn handle_request) {
+
+    parallel_control_engine_threads();
+
+    char *path = server_socket_path();
+    int listen_fd = listen_on(path);
+    if (listen_fd == -1) {
+        return EXIT_FAILURE;
+    }
+
+    if (pipe(sigchld_pipe) == -1) {
+        perror("pipe");
+        return EXIT_FAILURE;
+    }
+    set_non_blocking(sigchld_pipe[0]);
+    set_non_blocking(sigchld_pipe[1]);
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(struct sigaction));
+    sigemptyset(&sa.sa_mask);
+    sa.sa_handler = sigchld_handler;
+    sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    if (sigaction(SIGCHLD, &sa, 0) == -1) {
+        perror("sigaction");
+        return EXIT_FAILURE;
+    }
+
+    engine_init();
+    if (block_until_engine_ready()) {
+        fprintf(stderr, "%s\n", block_until_engine_ready_failed_msg);
+        return EXIT_FAILURE;
+    }
+    parallel_restore_environment();
+
+    if (config.verbose) {
+        fprintf(stderr, "Planck server listening on %s\n", path);
+    }
+
+    bool stale = false;
+    while (!stale || requests) {
+        struct pollfd fds[2];
+        fds[0].fd = listen_fd;
+        fds[0].events = POLLIN;
+        fds[1].fd = sigchld_pipe[0];
+        fds[1].events = POLLIN;
+
+        if (poll(fds, 2, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll");
+            break;
+        }
+
+        if (fds[1].revents & POLLIN) {
+            char buffer[64];
+            while (read(sigchld_pipe[0], buffer, sizeof(buffer)) > 0) {
+            }
+            pid_t pid;
+            int status;
+            while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+                if (finish_request(pid, status)) {
+                    stale = true;
+                }
+            }
+        }
+
+        if (!stale && (fds[0].revents & POLLIN)) {
+            int conn = accept(listen_fd, NULL, NULL);
+            if (conn != -1) {
+                if (is_same_user(conn)) {
+                    start_request(conn, listen_fd, handle_request);
+                } else {
+                    close(conn);
+                }
+            }
+        }
+
+        // Stop taking requests, but finish those underway
+        if (stale && listen_fd != -1) {
+            if (config.verbose) {
+                fprintf(stderr, "Planck server options changed, shutting down\n");
+            }
+            close(listen_fd);
+            unlink(path);
+            listen_fd = -1;
+        }
+    }
+
+    free(path);
+    return EXIT_SUCCESS;
+}
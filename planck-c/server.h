@@ -0,0 +1,10 @@
+// What a request handler returns. Requests that can't be handled by the
+// server's engine are instead run by the client itself. If the engine is stale,
+// the server also shuts down once its other requests are handled.
+#define SERVER_REQUEST_HANDLED 0
+#define SERVER_REQUEST_UNSUPPORTED 1
+#define SERVER_REQUEST_STALE 2
+
+typedef int (*server_request_fn)(int argc, char **argv, int *exit_status);
+
+int run_server(server_request_fn handle_request);
@@ -0,0 +1,53 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "server_protocol.h"
+
+char *server_socket_path() {
+    char *path = getenv("PLANCK_SERVER_SOCKET");
+    if (path && *path) {
+        return strdup(path);
+    }
+
+    // Not under TMPDIR, as that differs between login sessions and cron on macOS
+    char buffer[64];
+    snprintf(buffer, sizeof(buffer), "/tmp/planck-%d.sock", (int) getuid());
+    return strdup(buffer);
+}
+
+bool server_write_fully(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+bool server_read_fully(int fd, void *buf, size_t len) {
+    char *p = buf;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        } else if (n == 0) {
+            return false;
+        }
+        p += n;
+        len -= n;
+    }
+    return true;
+}
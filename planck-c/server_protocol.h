@@ -0,0 +1,35 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// A client sends a request header, passing its stdin, stdout, and stderr with
+// SCM_RIGHTS, followed by a payload of NUL-terminated strings: its working
+// directory, then argc arguments, then envc environment entries.
+
+struct server_request {
+    uint32_t payload_size;
+    uint32_t argc;
+    uint32_t envc;
+    uint32_t umask;
+};
+
+// The server replies with the pid of the process handling the request, and
+// then with its exit status. If the request can't be handled by the server, the
+// client is instead told to fall back to running planck itself.
+
+#define SERVER_REPLY_STARTED 0
+#define SERVER_REPLY_EXITED 1
+#define SERVER_REPLY_FALLBACK 2
+
+struct server_reply {
+    int32_t kind;
+    int32_t value;
+};
+
+#define SERVER_MAX_PAYLOAD_SIZE (16 * 1024 * 1024)
+
+char *server_socket_path();
+
+bool server_write_fully(int fd, const void *buf, size_t len);
+
+bool server_read_fully(int fd, void *buf, size_t len);
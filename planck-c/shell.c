@@ -18,6 +18,7 @@
 #include "engine.h"
 #include "jsc_utils.h"
 #include "tasks.h"
+#include "threads.h"
 #include "io.h"
 
 static char **cmd(JSContextRef ctx, const JSObjectRef array) {
@@ -213,6 +214,35 @@ void process_child_pipes(struct ThreadParams *params) {
     params->res.stderr = err_buf ? err_buf : strdup("");
 }
 
+static void async_sh_callback_task(void *data) {
+    struct ThreadParams *params = data;
+
+    JSValueRef args[1];
+    args[0] = result_to_object_ref(ctx, &params->res);
+    static JSObjectRef translate_async_result_fn = NULL;
+    if (!translate_async_result_fn) {
+        translate_async_result_fn = get_function("global", "translate_async_result");
+        JSValueProtect(ctx, translate_async_result_fn);
+    }
+    JSObjectRef result = (JSObjectRef) JSObjectCallAsFunction(ctx, translate_async_result_fn, NULL,
+                                                              1, args, NULL);
+
+    args[0] = JSValueMakeNumber(ctx, params->cb_idx);
+    static JSObjectRef do_async_sh_callback_fn = NULL;
+    if (!do_async_sh_callback_fn) {
+        do_async_sh_callback_fn = get_function("global", "do_async_sh_callback");
+        JSValueProtect(ctx, do_async_sh_callback_fn);
+    }
+    JSObjectCallAsFunction(ctx, do_async_sh_callback_fn, result, 1, args, NULL);
+
+    free(params);
+
+    int err = signal_task_complete();
+    if (err) {
+        engine_print_err_message("shell signal_task_complete", err);
+    }
+}
+
 static struct SystemResult *wait_for_child(struct ThreadParams *params) {
 
     params->res.status = 0;
@@ -240,29 +270,9 @@ static struct SystemResult *wait_for_child(struct ThreadParams *params) {
     if (params->cb_idx == -1) {
         return &params->res;
     } else {
-        JSValueRef args[1];
-        args[0] = result_to_object_ref(ctx, &params->res);
-        static JSObjectRef translate_async_result_fn = NULL;
-        if (!translate_async_result_fn) {
-            translate_async_result_fn = get_function("global", "translate_async_result");
-            JSValueProtect(ctx, translate_async_result_fn);
-        }
-        JSObjectRef result = (JSObjectRef) JSObjectCallAsFunction(ctx, translate_async_result_fn, NULL,
-                                                                  1, args, NULL);
-
-        args[0] = JSValueMakeNumber(ctx, params->cb_idx);
-        static JSObjectRef do_async_sh_callback_fn = NULL;
-        if (!do_async_sh_callback_fn) {
-            do_async_sh_callback_fn = get_function("global", "do_async_sh_callback");
-            JSValueProtect(ctx, do_async_sh_callback_fn);
-        }
-        JSObjectCallAsFunction(ctx, do_async_sh_callback_fn, result, 1, args, NULL);
-
-        free(params);
-
-        int err = signal_task_complete();
+        int err = post_task(async_sh_callback_task, params);
         if (err) {
-            engine_print_err_message("shell signal_task_complete", err);
+            engine_print_err_message("shell post_task", err);
         }
 
         return NULL;
@@ -270,7 +280,9 @@ static struct SystemResult *wait_for_child(struct ThreadParams *params) {
 }
 
 static void *thread_proc(void *params) {
-    return (void *) wait_for_child((struct ThreadParams *) params);
+    wait_for_child((struct ThreadParams *) params);
+    planck_thread_exiting();
+    return NULL;
 }
 
 #ifdef __APPLE__
@@ -429,8 +441,10 @@ static JSValueRef system_call(JSContextRef ctx, char **cmd, char *in_str, char *
                     engine_print_err_message("shell signal_task_started", err);
                 }
 
-                pthread_t thrd;
-                pthread_create(&thrd, NULL, thread_proc, params);
+                err = start_planck_thread(thread_proc, params);
+                if (err) {
+                    engine_print_err_message("shell pthread_create", err);
+                }
             }
         }
 
@@ -461,6 +475,13 @@ static JSValueRef system_call(JSContextRef ctx, char **cmd, char *in_str, char *
 JSValueRef function_shellexec(JSContextRef ctx, JSObjectRef function, JSObjectRef this_object,
                               size_t argc, const JSValueRef args[], JSValueRef *exception) {
     if (argc == 6) {
+        // Completion callbacks are delivered to the main context
+        if (!JSValueIsNull(ctx, args[5]) && !is_main_context(ctx)) {
+            JSValueRef arguments[1];
+            arguments[0] = c_string_to_value(ctx, "Only available in the main context");
+            *exception = JSObjectMakeError(ctx, 1, arguments, NULL);
+            return JSValueMakeNull(ctx);
+        }
         char **command = cmd(ctx, (JSObjectRef) args[0]);
         if (command) {
             char *in_str = NULL;
@@ -2,3 +2,5 @@
 
 JSValueRef function_shellexec(JSContextRef ctx, JSObjectRef function, JSObjectRef this_object,
                               size_t argc, const JSValueRef args[], JSValueRef *exception);
+
+int read_child_pipe(int pipe, char **buf_p, size_t *total_p);
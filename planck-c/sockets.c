@@ -1,226 +1,1508 @@
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <pthread.h>
 #include <string.h>
 #include <strings.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <unistd.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
 
 #include "sockets.h"
+#include "resolver.h"
 #include "engine.h"
+#include "threads.h"
 
-int write_to_socket(int fd, const char *text) {
+// All listening and connected sockets are multiplexed on a single reactor
+// thread (epoll on Linux, poll elsewhere). The reactor only accepts and reads;
+// the accept and data callbacks, which may block (the socket REPL evaluates
+// forms in them), are run on a small pool of worker threads. Each connection's
+// callbacks are run in order, by at most one worker at a time.
+//
+// Writes never block the caller. Whatever the kernel won't take immediately
+// is queued on the connection and flushed with writev by the reactor when the
+// socket becomes writable. Once the queue grows past the high watermark the
+// writer is told to back off, and a drain callback is run when the queue falls
+// back under the low watermark.
+//
+// Data is read straight into a heap buffer which is handed, without copying,
+// to the data callback. Unless the connection is binary, incomplete UTF-8
+// sequences at the end of a read are held back and prepended to the next one.
+// Alternatively, the reactor can split the data into messages (lines,
+// delimited, or length-prefixed), making one callback per complete message.
+//
+// Asynchronous connects resolve the host on the resolver thread, then hand a
+// non-blocking connect to the reactor, which moves on to the host's next
+// address should one fail.
 
-    while (true) {
+#define DEFAULT_RECEIVE_BUFFER_SIZE (16 * 1024)
+#define DEFAULT_MAX_FRAME_SIZE (1024 * 1024)
+#define DEFAULT_HIGH_WATERMARK (64 * 1024)
+#define DEFAULT_LOW_WATERMARK (16 * 1024)
+#define MAX_WRITE_IOVECS 64
+#define MIN_SOCKET_WORKERS 2
+#define MAX_SOCKET_WORKERS 16
+
+typedef enum {
+    CONN_EVENT_CONNECTED,
+    CONN_EVENT_ACCEPTED,
+    CONN_EVENT_DATA,
+    CONN_EVENT_DRAINED,
+    CONN_EVENT_CLOSED
+} conn_event_type_t;
+
+typedef struct conn_event {
+    conn_event_type_t type;
+    char *data;
+    size_t len;
+    struct conn_event *next;
+} conn_event_t;
+
+typedef struct out_buffer {
+    char *data;
+    size_t len;
+    size_t offset;
+    struct out_buffer *next;
+} out_buffer_t;
+
+typedef struct pending_connect {
+    resolved_address_t *addrs;
+    size_t count;
+    size_t next;
+    int last_err;
+    conn_connect_cb_t conn_connect_cb;
+    conn_data_cb_t conn_data_cb;
+    void *state;
+    socket_opts_t opts;
+} pending_connect_t;
 
-        fd_set fds;
-        FD_ZERO(&fds);
+typedef struct socket_conn {
+    int fd;
+    atomic_int refs;
+    bool listening;
+    socket_accept_info_t *socket_accept_info;
+    conn_data_cb_t conn_data_cb;
+    conn_connect_cb_t conn_connect_cb;
+    socket_opts_t opts;
+    void *state;
+    bool failed;
+    // Reactor thread only
+    pending_connect_t *connecting;
+    char utf8_pending[3];
+    size_t utf8_pending_len;
+    char *frame_buffer;
+    size_t frame_len;
+    size_t frame_capacity;
+    bool frame_overflow;
+    // Guarded by out_lock
+    pthread_mutex_t out_lock;
+    out_buffer_t *out_head;
+    out_buffer_t *out_tail;
+    size_t out_queued;
+    bool above_high_watermark;
+    bool shutdown_pending;
+    bool closed;
+    // Guarded by dispatch_lock
+    conn_event_t *events_head;
+    conn_event_t *events_tail;
+    bool scheduled;
+    struct socket_conn *next_ready;
+} socket_conn_t;
+
+static atomic_uint_fast64_t accept_count = 0;
+static atomic_uint_fast64_t read_count = 0;
+static atomic_uint_fast64_t write_count = 0;
+static atomic_uint_fast64_t bytes_read_count = 0;
+static atomic_uint_fast64_t bytes_written_count = 0;
+static atomic_uint_fast64_t open_connection_count = 0;
+
+// Connections by descriptor, so that writes from JavaScript can find their queue
+static pthread_mutex_t conns_lock = PTHREAD_MUTEX_INITIALIZER;
+static socket_conn_t **conns_by_fd = NULL;
+static size_t conns_by_fd_capacity = 0;
 
-        FD_SET(fd, &fds);
+static pthread_once_t reactor_once = PTHREAD_ONCE_INIT;
+static int reactor_err = 0;
 
-        int rv = select(fd + 1, NULL, &fds, NULL, NULL);
+static pthread_mutex_t dispatch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dispatch_cond = PTHREAD_COND_INITIALIZER;
+static socket_conn_t *ready_head = NULL;
+static socket_conn_t *ready_tail = NULL;
 
-        if (rv == -1) {
+#ifdef __linux__
+static int epoll_fd = -1;
+#else
+static pthread_mutex_t poll_lock = PTHREAD_MUTEX_INITIALIZER;
+static socket_conn_t **poll_conns = NULL;
+static size_t poll_conn_count = 0;
+static size_t poll_conn_capacity = 0;
+static int wake_pipe[2] = {-1, -1};
+#endif
+
+static int set_non_blocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags == -1) {
+        return -1;
+    }
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static void reactor_wake();
+
+// Connection lifetime. The reactor holds one reference until the close
+// event has been run; writers hold one for the duration of a write.
+
+static void free_conn(socket_conn_t *conn);
+
+static void conn_release(socket_conn_t *conn) {
+    if (atomic_fetch_sub(&conn->refs, 1) == 1) {
+        close(conn->fd);
+        free_conn(conn);
+    }
+}
+
+static int conn_table_put(socket_conn_t *conn) {
+    pthread_mutex_lock(&conns_lock);
+    if ((size_t) conn->fd >= conns_by_fd_capacity) {
+        size_t new_capacity = conns_by_fd_capacity ? conns_by_fd_capacity : 256;
+        while (new_capacity <= (size_t) conn->fd) {
+            new_capacity *= 2;
+        }
+        socket_conn_t **new_conns = realloc(conns_by_fd, new_capacity * sizeof(socket_conn_t *));
+        if (!new_conns) {
+            pthread_mutex_unlock(&conns_lock);
+            errno = ENOMEM;
+            return -1;
+        }
+        memset(new_conns + conns_by_fd_capacity, 0,
+               (new_capacity - conns_by_fd_capacity) * sizeof(socket_conn_t *));
+        conns_by_fd = new_conns;
+        conns_by_fd_capacity = new_capacity;
+    }
+    conns_by_fd[conn->fd] = conn;
+    pthread_mutex_unlock(&conns_lock);
+    return 0;
+}
+
+static void conn_table_remove(socket_conn_t *conn) {
+    pthread_mutex_lock(&conns_lock);
+    if ((size_t) conn->fd < conns_by_fd_capacity && conns_by_fd[conn->fd] == conn) {
+        conns_by_fd[conn->fd] = NULL;
+    }
+    pthread_mutex_unlock(&conns_lock);
+}
+
+static socket_conn_t *conn_acquire(int fd) {
+    socket_conn_t *conn = NULL;
+    pthread_mutex_lock(&conns_lock);
+    if (fd >= 0 && (size_t) fd < conns_by_fd_capacity) {
+        conn = conns_by_fd[fd];
+        if (conn) {
+            atomic_fetch_add(&conn->refs, 1);
+        }
+    }
+    pthread_mutex_unlock(&conns_lock);
+    return conn;
+}
+
+// Outbound queues
+
+static void free_out_buffers(socket_conn_t *conn) {
+    out_buffer_t *buffer = conn->out_head;
+    while (buffer) {
+        out_buffer_t *next = buffer->next;
+        free(buffer->data);
+        free(buffer);
+        buffer = next;
+    }
+    conn->out_head = NULL;
+    conn->out_tail = NULL;
+    conn->out_queued = 0;
+}
+
+// Writes as much of the queue as the socket will take. Called with out_lock held.
+static int flush_out_buffers(socket_conn_t *conn) {
+    while (conn->out_head) {
+        struct iovec iov[MAX_WRITE_IOVECS];
+        int iovcnt = 0;
+        out_buffer_t *buffer;
+        for (buffer = conn->out_head; buffer && iovcnt < MAX_WRITE_IOVECS; buffer = buffer->next) {
+            iov[iovcnt].iov_base = buffer->data + buffer->offset;
+            iov[iovcnt].iov_len = buffer->len - buffer->offset;
+            iovcnt++;
+        }
+
+        ssize_t n = writev(conn->fd, iov, iovcnt);
+        if (n == -1) {
             if (errno == EINTR) {
-                // We ignore interrupts and loop back around
-            } else {
-                return -1;
+                continue;
             }
-        } else {
-            size_t len = strlen(text);
-            ssize_t n = write(fd, text, len);
-            if (n == len) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
                 return 0;
             }
-            if (n == -1) {
-                return -1;
+            return -1;
+        }
+
+        atomic_fetch_add(&write_count, 1);
+        atomic_fetch_add(&bytes_written_count, n);
+        conn->out_queued -= n;
+
+        size_t remaining = (size_t) n;
+        while (remaining) {
+            buffer = conn->out_head;
+            size_t available = buffer->len - buffer->offset;
+            if (remaining < available) {
+                buffer->offset += remaining;
+                break;
             }
-            text += n;
+            remaining -= available;
+            conn->out_head = buffer->next;
+            free(buffer->data);
+            free(buffer);
+        }
+        if (!conn->out_head) {
+            conn->out_tail = NULL;
         }
     }
+    return 0;
 }
 
-typedef struct conn_handler_info {
-    int sock;
-    socket_accept_info_t *socket_accept_info;
-} conn_handler_info_t;
+// Shuts the connection down once its queue has been flushed. Called with out_lock held.
+static void shutdown_when_flushed(socket_conn_t *conn) {
+    if (conn->out_head) {
+        conn->shutdown_pending = true;
+    } else {
+        shutdown(conn->fd, SHUT_RDWR);
+    }
+}
 
-void *conn_handler(void *data) {
+static int queue_write(socket_conn_t *conn, const char *data, size_t len) {
+    pthread_mutex_lock(&conn->out_lock);
 
-    conn_handler_info_t *conn_handler_info = (conn_handler_info_t *) data;
+    if (conn->closed || conn->shutdown_pending) {
+        pthread_mutex_unlock(&conn->out_lock);
+        errno = EPIPE;
+        return -1;
+    }
 
-    accepted_conn_cb_ret_t *accepted_conn_cb_ret = NULL;
-    if (conn_handler_info->socket_accept_info->accepted_conn_cb) {
-        accepted_conn_cb_ret = conn_handler_info->socket_accept_info->accepted_conn_cb(
-                conn_handler_info->sock, conn_handler_info->socket_accept_info->info);
+    // Write directly if nothing is queued ahead of this data
+    size_t written = 0;
+    bool was_empty = conn->out_head == NULL;
+    while (was_empty && written < len) {
+        ssize_t n = write(conn->fd, data + written, len - written);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            pthread_mutex_unlock(&conn->out_lock);
+            return -1;
+        }
+        atomic_fetch_add(&write_count, 1);
+        atomic_fetch_add(&bytes_written_count, n);
+        written += n;
     }
 
-    int err = 0;
-    void *state = NULL;
-    if (accepted_conn_cb_ret) {
-        err = accepted_conn_cb_ret->err;
-        state = accepted_conn_cb_ret->info;
-        free(accepted_conn_cb_ret);
+    if (written < len) {
+        out_buffer_t *buffer = malloc(sizeof(out_buffer_t));
+        char *copy = malloc(len - written);
+        if (!buffer || !copy) {
+            free(buffer);
+            free(copy);
+            pthread_mutex_unlock(&conn->out_lock);
+            errno = ENOMEM;
+            return -1;
+        }
+        memcpy(copy, data + written, len - written);
+        buffer->data = copy;
+        buffer->len = len - written;
+        buffer->offset = 0;
+        buffer->next = NULL;
+        if (conn->out_tail) {
+            conn->out_tail->next = buffer;
+        } else {
+            conn->out_head = buffer;
+        }
+        conn->out_tail = buffer;
+        conn->out_queued += buffer->len;
+        if (conn->out_queued >= conn->opts.high_watermark) {
+            conn->above_high_watermark = true;
+        }
+    }
+
+    int rv = conn->above_high_watermark ? 1 : 0;
+    pthread_mutex_unlock(&conn->out_lock);
+
+    if (was_empty && written < len) {
+        reactor_wake();
     }
 
-    ssize_t read_size;
-    char receive_buffer[4096];
+    return rv;
+}
 
-    conn_data_cb_ret_t *conn_data_cb_ret = NULL;
+int socket_write(int fd, const char *data, size_t len) {
+    socket_conn_t *conn = conn_acquire(fd);
+    if (!conn) {
+        errno = EBADF;
+        return -1;
+    }
+    int rv = queue_write(conn, data, len);
+    conn_release(conn);
+    return rv;
+}
 
-    while (!err && (read_size = recv(conn_handler_info->sock, receive_buffer, 4095, 0)) > 0) {
-        receive_buffer[read_size] = '\0';
-        conn_data_cb_ret = conn_handler_info->socket_accept_info->conn_data_cb(
-                receive_buffer, conn_handler_info->sock, state);
+int write_to_socket(int fd, const char *text) {
+    return socket_write(fd, text, strlen(text)) == -1 ? -1 : 0;
+}
+
+// Dispatch of callbacks to the worker pool
+
+static void enqueue_conn_event(socket_conn_t *conn, conn_event_type_t type, char *data, size_t len) {
+    conn_event_t *event = malloc(sizeof(conn_event_t));
+    event->type = type;
+    event->data = data;
+    event->len = len;
+    event->next = NULL;
+
+    pthread_mutex_lock(&dispatch_lock);
+    if (conn->events_tail) {
+        conn->events_tail->next = event;
+    } else {
+        conn->events_head = event;
+    }
+    conn->events_tail = event;
+    if (!conn->scheduled) {
+        conn->scheduled = true;
+        conn->next_ready = NULL;
+        if (ready_tail) {
+            ready_tail->next_ready = conn;
+        } else {
+            ready_head = conn;
+        }
+        ready_tail = conn;
+        pthread_cond_signal(&dispatch_cond);
+    }
+    pthread_mutex_unlock(&dispatch_lock);
+}
 
-        err = conn_data_cb_ret->err;
-        bool close_socket = conn_data_cb_ret->close;
+static void handle_conn_data_cb_ret(socket_conn_t *conn, conn_data_cb_ret_t *conn_data_cb_ret) {
+    if (conn_data_cb_ret) {
+        if (conn_data_cb_ret->err || conn_data_cb_ret->close) {
+            // The reactor will see the resulting EOF and deliver the close event
+            conn->failed = true;
+            pthread_mutex_lock(&conn->out_lock);
+            shutdown_when_flushed(conn);
+            pthread_mutex_unlock(&conn->out_lock);
+        }
         free(conn_data_cb_ret);
+    }
+}
 
-        if (close_socket) {
-            close(conn_handler_info->sock);
-            break;
+// Returns true if the connection has been closed and freed.
+static bool run_conn_events(socket_conn_t *conn, conn_event_t *event) {
+    bool freed = false;
+
+    while (event) {
+        conn_event_t *next = event->next;
+
+        switch (event->type) {
+            case CONN_EVENT_CONNECTED:
+                conn->conn_connect_cb(conn->fd, NULL, conn->state);
+                break;
+            case CONN_EVENT_ACCEPTED: {
+                accepted_conn_cb_t accepted_conn_cb = conn->socket_accept_info->accepted_conn_cb;
+                if (accepted_conn_cb) {
+                    accepted_conn_cb_ret_t *accepted_conn_cb_ret = accepted_conn_cb(conn->fd,
+                                                                                    conn->socket_accept_info->info);
+                    if (accepted_conn_cb_ret) {
+                        conn->state = accepted_conn_cb_ret->info;
+                        if (accepted_conn_cb_ret->err) {
+                            conn->failed = true;
+                            shutdown(conn->fd, SHUT_RDWR);
+                        }
+                        free(accepted_conn_cb_ret);
+                    }
+                }
+                break;
+            }
+            case CONN_EVENT_DATA:
+                if (!conn->failed) {
+                    handle_conn_data_cb_ret(conn, conn->conn_data_cb(event->data, event->len, conn->fd,
+                                                                     conn->state));
+                } else {
+                    free(event->data);
+                }
+                break;
+            case CONN_EVENT_DRAINED:
+                if (!conn->failed && conn->opts.conn_drain_cb) {
+                    conn->opts.conn_drain_cb(conn->fd, conn->state);
+                }
+                break;
+            case CONN_EVENT_CLOSED:
+                conn_table_remove(conn);
+                pthread_mutex_lock(&conn->out_lock);
+                conn->closed = true;
+                free_out_buffers(conn);
+                pthread_mutex_unlock(&conn->out_lock);
+
+                // Call with final NULL to indicate socket close
+                free(conn->conn_data_cb(NULL, 0, conn->fd, conn->state));
+                conn_release(conn);
+                atomic_fetch_sub(&open_connection_count, 1);
+                freed = true;
+                break;
         }
+
+        free(event);
+        event = next;
     }
 
-    // Call with final NULL to indicate socket close
-    conn_data_cb_ret = conn_handler_info->socket_accept_info->conn_data_cb(
-            NULL, conn_handler_info->sock, state);
-    free(conn_data_cb_ret);
+    return freed;
+}
+
+static void *socket_worker(void *data) {
 
-    free(data);
+    pthread_mutex_lock(&dispatch_lock);
+
+    while (true) {
+        while (!ready_head) {
+            pthread_cond_wait(&dispatch_cond, &dispatch_lock);
+        }
+
+        socket_conn_t *conn = ready_head;
+        ready_head = conn->next_ready;
+        if (!ready_head) {
+            ready_tail = NULL;
+        }
+
+        conn_event_t *events = conn->events_head;
+        conn->events_head = NULL;
+        conn->events_tail = NULL;
+
+        pthread_mutex_unlock(&dispatch_lock);
+        bool freed = run_conn_events(conn, events);
+        pthread_mutex_lock(&dispatch_lock);
+
+        if (!freed) {
+            if (conn->events_head) {
+                // More events arrived while running; go to the back of the line
+                conn->next_ready = NULL;
+                if (ready_tail) {
+                    ready_tail->next_ready = conn;
+                } else {
+                    ready_head = conn;
+                }
+                ready_tail = conn;
+            } else {
+                conn->scheduled = false;
+            }
+        }
+    }
 
     return NULL;
 }
 
-int bind_and_listen(socket_accept_info_t *socket_accept_info) {
+// Reactor registration
 
-    struct sockaddr_in server;
+static int reactor_add(socket_conn_t *conn) {
+#ifdef __linux__
+    struct epoll_event event;
+    // Writability is watched throughout; with edge triggering it is only
+    // reported as the socket's send buffer drains.
+    event.events = conn->listening ? EPOLLIN | EPOLLET : EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.ptr = conn;
+    return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, conn->fd, &event);
+#else
+    pthread_mutex_lock(&poll_lock);
+    if (poll_conn_count == poll_conn_capacity) {
+        size_t new_capacity = poll_conn_capacity ? 2 * poll_conn_capacity : 64;
+        socket_conn_t **new_conns = realloc(poll_conns, new_capacity * sizeof(socket_conn_t *));
+        if (!new_conns) {
+            pthread_mutex_unlock(&poll_lock);
+            errno = ENOMEM;
+            return -1;
+        }
+        poll_conns = new_conns;
+        poll_conn_capacity = new_capacity;
+    }
+    poll_conns[poll_conn_count++] = conn;
+    pthread_mutex_unlock(&poll_lock);
 
-    int socket_desc = socket(AF_INET, SOCK_STREAM, 0);
-    if (socket_desc == -1) {
-        return socket_desc;
+    reactor_wake();
+    return 0;
+#endif
+}
+
+static void reactor_wake() {
+#ifndef __linux__
+    char c = 0;
+    if (write(wake_pipe[1], &c, 1) == -1) {
+        // The pipe is full, so the reactor is already due to wake
     }
-    socket_accept_info->socket_desc = socket_desc;
+#endif
+}
+
+static void reactor_remove(socket_conn_t *conn) {
+#ifdef __linux__
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+#else
+    pthread_mutex_lock(&poll_lock);
+    size_t i;
+    for (i = 0; i < poll_conn_count; i++) {
+        if (poll_conns[i] == conn) {
+            poll_conns[i] = poll_conns[--poll_conn_count];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&poll_lock);
+#endif
+}
 
-    server.sin_family = AF_INET;
-    server.sin_addr.s_addr = INADDR_ANY;
-    server.sin_port = htons(socket_accept_info->port);
+static socket_conn_t *make_conn(int fd, socket_accept_info_t *socket_accept_info, conn_data_cb_t conn_data_cb,
+                                void *state, const socket_opts_t *opts) {
+    socket_conn_t *conn = calloc(1, sizeof(socket_conn_t));
+    if (conn) {
+        conn->fd = fd;
+        atomic_init(&conn->refs, 1);
+        conn->socket_accept_info = socket_accept_info;
+        conn->conn_data_cb = conn_data_cb;
+        conn->state = state;
+        pthread_mutex_init(&conn->out_lock, NULL);
 
-    int err = bind(socket_desc, (struct sockaddr *) &server, sizeof(server));
-    if (err == -1) {
-        return err;
+        if (opts) {
+            conn->opts = *opts;
+        }
+        if (!conn->opts.receive_buffer_size) {
+            conn->opts.receive_buffer_size = DEFAULT_RECEIVE_BUFFER_SIZE;
+        }
+        if (!conn->opts.max_frame_size) {
+            conn->opts.max_frame_size = DEFAULT_MAX_FRAME_SIZE;
+        }
+        if (conn->opts.framing == SOCKET_FRAMING_LINE) {
+            conn->opts.delimiter[0] = '\n';
+            conn->opts.delimiter_len = 1;
+        } else if (conn->opts.framing == SOCKET_FRAMING_DELIMITER && !conn->opts.delimiter_len) {
+            conn->opts.framing = SOCKET_FRAMING_NONE;
+        }
+        if (!conn->opts.high_watermark) {
+            conn->opts.high_watermark = DEFAULT_HIGH_WATERMARK;
+        }
+        if (!conn->opts.low_watermark) {
+            conn->opts.low_watermark = DEFAULT_LOW_WATERMARK;
+        }
+        if (conn->opts.low_watermark > conn->opts.high_watermark) {
+            conn->opts.low_watermark = conn->opts.high_watermark;
+        }
     }
+    return conn;
+}
 
-    return listen(socket_desc, 3);
+static void free_conn(socket_conn_t *conn) {
+    pthread_mutex_destroy(&conn->out_lock);
+    free(conn->frame_buffer);
+    free(conn);
 }
 
-void *accept_connections(void *data) {
+// Reactor event handling (reactor thread only)
+
+static void accept_pending(socket_conn_t *listener) {
+    while (true) {
+        int sock = accept(listener->fd, NULL, NULL);
+        if (sock == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                engine_perror("accept failed");
+            }
+            return;
+        }
 
-    socket_accept_info_t *socket_accept_info = (socket_accept_info_t *) data;
+        atomic_fetch_add(&accept_count, 1);
 
-    if (socket_accept_info->listen_successful_cb) {
-        socket_accept_info->listen_successful_cb();
+        socket_accept_info_t *socket_accept_info = listener->socket_accept_info;
+        socket_conn_t *conn = NULL;
+        if (set_non_blocking(sock) == 0) {
+            conn = make_conn(sock, socket_accept_info, socket_accept_info->conn_data_cb, NULL,
+                             &socket_accept_info->opts);
+        }
+        if (conn && conn_table_put(conn) == -1) {
+            free_conn(conn);
+            conn = NULL;
+        }
+        if (!conn) {
+            close(sock);
+            continue;
+        }
+
+        atomic_fetch_add(&open_connection_count, 1);
+
+        // Queue the accept callback before registering, so that it runs ahead
+        // of any data callbacks for the connection.
+        enqueue_conn_event(conn, CONN_EVENT_ACCEPTED, NULL, 0);
+        if (reactor_add(conn) == -1) {
+            engine_perror("could not watch socket");
+            enqueue_conn_event(conn, CONN_EVENT_CLOSED, NULL, 0);
+        }
+    }
+}
+
+// A buffer left over from a read which found no data, kept for the next read
+static char *spare_buffer = NULL;
+static size_t spare_buffer_capacity = 0;
+
+static char *take_receive_buffer(size_t capacity) {
+    if (spare_buffer && spare_buffer_capacity >= capacity) {
+        char *buffer = spare_buffer;
+        spare_buffer = NULL;
+        return buffer;
     }
+    return malloc(capacity);
+}
 
-    int c = sizeof(struct sockaddr_in);
-    int new_socket;
-    struct sockaddr_in client;
-    while ((new_socket = accept(socket_accept_info->socket_desc, (struct sockaddr *) &client, (socklen_t *) &c))) {
+static void return_receive_buffer(char *buffer, size_t capacity) {
+    if (!spare_buffer || spare_buffer_capacity < capacity) {
+        free(spare_buffer);
+        spare_buffer = buffer;
+        spare_buffer_capacity = capacity;
+    } else {
+        free(buffer);
+    }
+}
 
-        pthread_t handler_thread;
+// The number of bytes at the end of data which begin, but don't complete, a UTF-8 sequence
+static size_t utf8_incomplete_tail(const char *data, size_t len) {
+    size_t i;
+    for (i = 1; i <= 3 && i <= len; i++) {
+        unsigned char c = (unsigned char) data[len - i];
+        if ((c & 0xC0) == 0x80) {
+            continue;
+        }
+        size_t expected = c >= 0xF0 ? 4 : c >= 0xE0 ? 3 : c >= 0xC0 ? 2 : 1;
+        return expected > i ? i : 0;
+    }
+    return 0;
+}
 
-        conn_handler_info_t *connection_handler_data = malloc(sizeof(conn_handler_info_t));
-        connection_handler_data->sock = new_socket;
-        connection_handler_data->socket_accept_info = socket_accept_info;
+// Message framing (reactor thread only)
 
-        if (pthread_create(&handler_thread, NULL, conn_handler, connection_handler_data) < 0) {
-            engine_perror("could not create thread");
-            return NULL;
+static bool append_to_frame_buffer(socket_conn_t *conn, const char *data, size_t len) {
+    if (conn->frame_len + len + 1 > conn->frame_capacity) {
+        size_t new_capacity = conn->frame_capacity ? conn->frame_capacity : 256;
+        while (new_capacity < conn->frame_len + len + 1) {
+            new_capacity *= 2;
+        }
+        char *new_buffer = realloc(conn->frame_buffer, new_capacity);
+        if (!new_buffer) {
+            return false;
         }
+        conn->frame_buffer = new_buffer;
+        conn->frame_capacity = new_capacity;
     }
+    memcpy(conn->frame_buffer + conn->frame_len, data, len);
+    conn->frame_len += len;
+    return true;
+}
 
-    if (new_socket < 0) {
-        engine_perror("accept failed");
-        return NULL;
+static void enqueue_message(socket_conn_t *conn, const char *data, size_t len) {
+    char *message = malloc(len + 1);
+    if (message) {
+        memcpy(message, data, len);
+        message[len] = '\0';
+        enqueue_conn_event(conn, CONN_EVENT_DATA, message, len);
     }
+}
 
+static const char *find_delimiter(const char *data, size_t len, const char *delimiter, size_t delimiter_len) {
+    if (delimiter_len == 1) {
+        return memchr(data, delimiter[0], len);
+    }
+    const char *end = data + len;
+    while ((size_t) (end - data) >= delimiter_len) {
+        const char *candidate = memchr(data, delimiter[0], (size_t) (end - data) - delimiter_len + 1);
+        if (!candidate) {
+            return NULL;
+        }
+        if (memcmp(candidate, delimiter, delimiter_len) == 0) {
+            return candidate;
+        }
+        data = candidate + 1;
+    }
     return NULL;
 }
 
-int close_socket(int fd) {
-    return shutdown(fd, SHUT_RDWR);
+static uint32_t read_u32_be(const char *data) {
+    const unsigned char *bytes = (const unsigned char *) data;
+    return ((uint32_t) bytes[0] << 24) | ((uint32_t) bytes[1] << 16) | ((uint32_t) bytes[2] << 8) | bytes[3];
 }
 
-typedef struct read_inbound_socket_info {
-    int socket_desc;
-    conn_data_cb_t conn_data_cb;
-    void *data_arrived_info;
-} read_inbound_socket_info_t;
+// Splits data off into messages, holding on to any incomplete message that
+// remains. Takes ownership of data. Returns false if a message is too large.
+static bool deliver_framed(socket_conn_t *conn, char *data, size_t len) {
+    char *work = data;
+    size_t work_len = len;
+    size_t pos = 0;
 
-void *read_inbound_socket_data(void *data) {
+    // Continue any partial message, rescanning enough of it to find a delimiter split across reads
+    if (conn->frame_len) {
+        size_t previous_len = conn->frame_len;
+        bool appended = append_to_frame_buffer(conn, data, len);
+        free(data);
+        if (!appended) {
+            return false;
+        }
+        work = conn->frame_buffer;
+        work_len = conn->frame_len;
+        if (conn->opts.framing != SOCKET_FRAMING_LENGTH_PREFIXED_U32 && previous_len >= conn->opts.delimiter_len) {
+            pos = previous_len - (conn->opts.delimiter_len - 1);
+        }
+    }
 
-    read_inbound_socket_info_t *read_inbound_socket_info = data;
+    size_t message_start = 0;
+    bool too_large = false;
 
-    ssize_t read_size;
-    char receive_buffer[4096];
+    if (conn->opts.framing == SOCKET_FRAMING_LENGTH_PREFIXED_U32) {
+        while (work_len - message_start >= 4) {
+            uint32_t message_len = read_u32_be(work + message_start);
+            if (message_len > conn->opts.max_frame_size) {
+                too_large = true;
+                break;
+            }
+            if (work_len - message_start - 4 < message_len) {
+                break;
+            }
+            enqueue_message(conn, work + message_start + 4, message_len);
+            message_start += 4 + message_len;
+        }
+    } else {
+        const char *delimiter = conn->opts.delimiter;
+        size_t delimiter_len = conn->opts.delimiter_len;
+        const char *found;
+        while ((found = find_delimiter(work + pos, work_len - pos, delimiter, delimiter_len)) != NULL) {
+            size_t message_end = (size_t) (found - work);
+            size_t next_start = message_end + delimiter_len;
+            size_t message_len = message_end - message_start;
+            if (conn->opts.framing == SOCKET_FRAMING_LINE && message_len && work[message_end - 1] == '\r') {
+                message_len--;
+            }
+            if (message_len > conn->opts.max_frame_size) {
+                too_large = true;
+                break;
+            }
+            if (work == data && message_start == 0 && next_start == work_len) {
+                // The read holds exactly one message; hand over its buffer
+                data[message_len] = '\0';
+                enqueue_conn_event(conn, CONN_EVENT_DATA, data, message_len);
+                return true;
+            }
+            enqueue_message(conn, work + message_start, message_len);
+            message_start = next_start;
+            pos = next_start;
+        }
+        if (work_len - message_start > conn->opts.max_frame_size) {
+            too_large = true;
+        }
+    }
 
-    while ((read_size = recv(read_inbound_socket_info->socket_desc, receive_buffer, 4095, 0)) > 0) {
-        receive_buffer[read_size] = '\0';
-        conn_data_cb_ret_t *conn_data_cb_ret = read_inbound_socket_info->conn_data_cb(
-                receive_buffer, read_inbound_socket_info->socket_desc, read_inbound_socket_info->data_arrived_info);
-        free(conn_data_cb_ret);
+    size_t remaining = work_len - message_start;
+    if (work == data) {
+        bool appended = too_large || append_to_frame_buffer(conn, data + message_start, remaining);
+        free(data);
+        if (!appended) {
+            return false;
+        }
+    } else {
+        memmove(conn->frame_buffer, conn->frame_buffer + message_start, remaining);
+        conn->frame_len = remaining;
+    }
+
+    return !too_large;
+}
+
+static void deliver_data(socket_conn_t *conn, char *data, size_t len) {
+    if (conn->opts.framing == SOCKET_FRAMING_NONE) {
+        enqueue_conn_event(conn, CONN_EVENT_DATA, data, len);
+    } else if (conn->frame_overflow) {
+        free(data);
+    } else if (!deliver_framed(conn, data, len)) {
+        // An oversized message; drop the connection
+        conn->frame_overflow = true;
+        conn->frame_len = 0;
+        shutdown(conn->fd, SHUT_RDWR);
     }
+}
+
+static void read_pending(socket_conn_t *conn) {
+    size_t buffer_size = conn->opts.receive_buffer_size;
+    // Room for held back UTF-8 bytes and a terminating NUL
+    size_t capacity = sizeof(conn->utf8_pending) + buffer_size + 1;
+
+    // Read until the socket is drained, as edge-triggered readiness won't be reported again until then
+    while (true) {
+        char *buffer = take_receive_buffer(capacity);
+        if (!buffer) {
+            engine_perror("socket receive buffer");
+            return;
+        }
+
+        size_t pending = conn->utf8_pending_len;
+        memcpy(buffer, conn->utf8_pending, pending);
+
+        ssize_t read_size = recv(conn->fd, buffer + pending, buffer_size, 0);
+        if (read_size > 0) {
+            atomic_fetch_add(&read_count, 1);
+            atomic_fetch_add(&bytes_read_count, read_size);
+
+            size_t len = pending + (size_t) read_size;
+            conn->utf8_pending_len = 0;
+            if (!conn->opts.binary && conn->opts.framing == SOCKET_FRAMING_NONE) {
+                size_t tail = utf8_incomplete_tail(buffer, len);
+                len -= tail;
+                memcpy(conn->utf8_pending, buffer + len, tail);
+                conn->utf8_pending_len = tail;
+            }
+            if (!len) {
+                return_receive_buffer(buffer, capacity);
+                continue;
+            }
+            buffer[len] = '\0';
 
-    // Call with final NULL to indicate socket close
-    conn_data_cb_ret_t *conn_data_cb_ret = read_inbound_socket_info->conn_data_cb(
-            NULL, read_inbound_socket_info->socket_desc, read_inbound_socket_info->data_arrived_info);
-    free(conn_data_cb_ret);
+            // Don't tie up a large buffer with a small read
+            if (len < buffer_size / 2) {
+                char *shrunk = realloc(buffer, len + 1);
+                if (shrunk) {
+                    buffer = shrunk;
+                }
+            }
+            deliver_data(conn, buffer, len);
+        } else {
+            return_receive_buffer(buffer, capacity);
 
-    free(read_inbound_socket_info);
+            if (read_size == -1 && errno == EINTR) {
+                continue;
+            } else if (read_size == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                return;
+            }
+
+            if (conn->utf8_pending_len) {
+                // Pass on whatever was left of a truncated sequence
+                char *data = malloc(conn->utf8_pending_len + 1);
+                if (data) {
+                    memcpy(data, conn->utf8_pending, conn->utf8_pending_len);
+                    data[conn->utf8_pending_len] = '\0';
+                    enqueue_conn_event(conn, CONN_EVENT_DATA, data, conn->utf8_pending_len);
+                }
+                conn->utf8_pending_len = 0;
+            }
+            if (conn->frame_len && conn->opts.framing != SOCKET_FRAMING_LENGTH_PREFIXED_U32) {
+                // A final unterminated message
+                enqueue_message(conn, conn->frame_buffer, conn->frame_len);
+                conn->frame_len = 0;
+            }
+            reactor_remove(conn);
+            enqueue_conn_event(conn, CONN_EVENT_CLOSED, NULL, 0);
+            return;
+        }
+    }
+}
+
+static void write_pending(socket_conn_t *conn) {
+    bool drained = false;
+
+    pthread_mutex_lock(&conn->out_lock);
+    if (conn->out_head) {
+        if (flush_out_buffers(conn) == -1) {
+            // Nothing more can be sent; the read side will see the error and close
+            free_out_buffers(conn);
+            shutdown(conn->fd, SHUT_RDWR);
+        } else if (conn->above_high_watermark && conn->out_queued <= conn->opts.low_watermark) {
+            conn->above_high_watermark = false;
+            drained = true;
+        }
+        if (!conn->out_head && conn->shutdown_pending) {
+            shutdown(conn->fd, SHUT_RDWR);
+        }
+    }
+    pthread_mutex_unlock(&conn->out_lock);
+
+    if (drained) {
+        enqueue_conn_event(conn, CONN_EVENT_DRAINED, NULL, 0);
+    }
+}
+
+static void connect_next_address(pending_connect_t *pending);
+
+// Completes a connect once the socket reports writability or an error,
+// returning true if the connection is now established.
+static bool finish_connect(socket_conn_t *conn, bool readable, bool writable) {
+    int err = 0;
+    socklen_t err_len = sizeof(err);
+    if (getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &err_len) == -1) {
+        err = errno;
+    }
+    if (!err && !writable) {
+        return false;
+    }
+
+    pending_connect_t *pending = conn->connecting;
+    conn->connecting = NULL;
+
+    if (!err && conn_table_put(conn) == -1) {
+        err = errno;
+    }
+    if (err) {
+        reactor_remove(conn);
+        conn_release(conn);
+        pending->last_err = err;
+        connect_next_address(pending);
+        return false;
+    }
+
+    atomic_fetch_add(&open_connection_count, 1);
+    free(pending->addrs);
+    free(pending);
+
+    // Queued ahead of any data events for the connection
+    enqueue_conn_event(conn, CONN_EVENT_CONNECTED, NULL, 0);
+    return true;
+}
+
+static void handle_ready(socket_conn_t *conn, bool readable, bool writable) {
+    if (conn->connecting && !finish_connect(conn, readable, writable)) {
+        return;
+    }
+    if (conn->listening) {
+        accept_pending(conn);
+    } else {
+        if (writable) {
+            write_pending(conn);
+        }
+        if (readable) {
+            read_pending(conn);
+        }
+    }
+}
+
+#ifdef __linux__
+
+static void *reactor_thread(void *data) {
+    struct epoll_event events[256];
+
+    while (true) {
+        int n = epoll_wait(epoll_fd, events, 256, -1);
+        if (n == -1) {
+            if (errno != EINTR) {
+                engine_perror("epoll_wait");
+            }
+            continue;
+        }
+        int i;
+        for (i = 0; i < n; i++) {
+            uint32_t ready = events[i].events;
+            handle_ready(events[i].data.ptr,
+                         (ready & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) != 0,
+                         (ready & EPOLLOUT) != 0);
+        }
+    }
 
     return NULL;
 }
 
-int connect_socket(const char *host, int port, conn_data_cb_t conn_data_cb,
-                   void *data_arrived_info) {
+#else
+
+static void *reactor_thread(void *data) {
+    struct pollfd *fds = NULL;
+    socket_conn_t **conns = NULL;
+    size_t capacity = 0;
+
+    while (true) {
+        pthread_mutex_lock(&poll_lock);
+        size_t count = poll_conn_count;
+        if (count + 1 > capacity) {
+            capacity = 2 * (count + 1);
+            fds = realloc(fds, capacity * sizeof(struct pollfd));
+            conns = realloc(conns, capacity * sizeof(socket_conn_t *));
+        }
+        fds[0].fd = wake_pipe[0];
+        fds[0].events = POLLIN;
+        size_t i;
+        for (i = 0; i < count; i++) {
+            socket_conn_t *conn = poll_conns[i];
+            conns[i + 1] = conn;
+            fds[i + 1].fd = conn->fd;
+            fds[i + 1].events = POLLIN;
+            if (conn->connecting) {
+                fds[i + 1].events |= POLLOUT;
+            } else if (!conn->listening) {
+                pthread_mutex_lock(&conn->out_lock);
+                if (conn->out_head) {
+                    fds[i + 1].events |= POLLOUT;
+                }
+                pthread_mutex_unlock(&conn->out_lock);
+            }
+        }
+        pthread_mutex_unlock(&poll_lock);
+
+        if (poll(fds, count + 1, -1) == -1) {
+            if (errno != EINTR) {
+                engine_perror("poll");
+            }
+            continue;
+        }
+
+        if (fds[0].revents) {
+            char buffer[64];
+            while (read(wake_pipe[0], buffer, sizeof(buffer)) > 0) {}
+        }
+        for (i = 1; i <= count; i++) {
+            if (fds[i].revents) {
+                handle_ready(conns[i],
+                             (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) != 0,
+                             (fds[i].revents & POLLOUT) != 0);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+#endif
+
+static void start_reactor() {
+#ifdef __linux__
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd == -1) {
+        reactor_err = errno;
+        return;
+    }
+#else
+    if (pipe(wake_pipe) == -1) {
+        reactor_err = errno;
+        return;
+    }
+    set_non_blocking(wake_pipe[0]);
+    set_non_blocking(wake_pipe[1]);
+#endif
+
+    reactor_err = start_planck_thread(reactor_thread, NULL);
+    if (reactor_err) {
+        return;
+    }
+
+    long workers = sysconf(_SC_NPROCESSORS_ONLN);
+    if (workers < MIN_SOCKET_WORKERS) {
+        workers = MIN_SOCKET_WORKERS;
+    } else if (workers > MAX_SOCKET_WORKERS) {
+        workers = MAX_SOCKET_WORKERS;
+    }
+
+    long i;
+    for (i = 0; i < workers; i++) {
+        int err = start_planck_thread(socket_worker, NULL);
+        if (err) {
+            engine_print_err_message("socket worker pthread_create", err);
+            if (i == 0) {
+                reactor_err = err;
+            }
+            break;
+        }
+    }
+}
+
+static int ensure_reactor() {
+    pthread_once(&reactor_once, start_reactor);
+    if (reactor_err) {
+        errno = reactor_err;
+        return -1;
+    }
+    return 0;
+}
+
+static int watch_socket(int fd, socket_accept_info_t *socket_accept_info, bool listening,
+                        conn_data_cb_t conn_data_cb, void *state, const socket_opts_t *opts) {
+    if (ensure_reactor() == -1 || set_non_blocking(fd) == -1) {
+        return -1;
+    }
+
+    socket_conn_t *conn = make_conn(fd, socket_accept_info, conn_data_cb, state, opts);
+    if (!conn) {
+        errno = ENOMEM;
+        return -1;
+    }
+    conn->listening = listening;
+
+    if (!listening) {
+        if (conn_table_put(conn) == -1) {
+            free_conn(conn);
+            return -1;
+        }
+        atomic_fetch_add(&open_connection_count, 1);
+    }
+
+    if (reactor_add(conn) == -1) {
+        int saved_errno = errno;
+        if (!listening) {
+            conn_table_remove(conn);
+            atomic_fetch_sub(&open_connection_count, 1);
+        }
+        free_conn(conn);
+        errno = saved_errno;
+        return -1;
+    }
 
-    int socket_desc = socket(AF_INET, SOCK_STREAM, 0);
+    return 0;
+}
+
+// Listening on the bind address. An unspecified host listens on all IPv4
+// interfaces, as before. IPv4 addresses are preferred when a host name
+// resolves to both families, so that "localhost" remains reachable as 127.0.0.1.
+
+static int bind_address(socket_accept_info_t *socket_accept_info, struct addrinfo *addr) {
+    int socket_desc = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
     if (socket_desc == -1) {
-        return socket_desc;
+        return -1;
+    }
+
+    int on = 1;
+    setsockopt(socket_desc, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    if (socket_accept_info->reuse_port) {
+#ifdef SO_REUSEPORT
+        if (setsockopt(socket_desc, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == -1) {
+            close(socket_desc);
+            return -1;
+        }
+#else
+        close(socket_desc);
+        errno = ENOPROTOOPT;
+        return -1;
+#endif
+    }
+
+    if (bind(socket_desc, addr->ai_addr, addr->ai_addrlen) == -1) {
+        int saved_errno = errno;
+        close(socket_desc);
+        errno = saved_errno;
+        return -1;
+    }
+
+    return socket_desc;
+}
+
+static int bind_inet_address(socket_accept_info_t *socket_accept_info) {
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = socket_accept_info->host ? AF_UNSPEC : AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+
+    char port[16];
+    snprintf(port, sizeof(port), "%d", socket_accept_info->port);
+
+    struct addrinfo *addrs;
+    int rv = getaddrinfo(socket_accept_info->host, port, &hints, &addrs);
+    if (rv) {
+        errno = rv == EAI_SYSTEM ? errno : EADDRNOTAVAIL;
+        return -1;
+    }
+
+    int socket_desc = -1;
+    int families[] = {AF_INET, AF_INET6};
+    size_t i;
+    for (i = 0; i < 2 && socket_desc == -1; i++) {
+        struct addrinfo *addr;
+        for (addr = addrs; addr && socket_desc == -1; addr = addr->ai_next) {
+            if (addr->ai_family == families[i]) {
+                socket_desc = bind_address(socket_accept_info, addr);
+            }
+        }
+    }
+
+    int saved_errno = errno;
+    freeaddrinfo(addrs);
+    errno = saved_errno;
+    return socket_desc;
+}
+
+// Fills in a UNIX domain socket address. On Linux, a path starting with @
+// names a socket in the abstract namespace, which has no file system presence.
+static int make_unix_address(const char *path, struct sockaddr_un *addr, socklen_t *addr_len) {
+    size_t path_len = strlen(path);
+    if (path_len == 0 || path_len >= sizeof(addr->sun_path)) {
+        errno = path_len ? ENAMETOOLONG : EINVAL;
+        return -1;
+    }
+
+    memset(addr, 0, sizeof(struct sockaddr_un));
+    addr->sun_family = AF_UNIX;
+    memcpy(addr->sun_path, path, path_len);
+#ifdef __linux__
+    if (path[0] == '@') {
+        addr->sun_path[0] = '\0';
+        *addr_len = (socklen_t) (offsetof(struct sockaddr_un, sun_path) + path_len);
+        return 0;
+    }
+#endif
+    *addr_len = (socklen_t) (offsetof(struct sockaddr_un, sun_path) + path_len + 1);
+    return 0;
+}
+
+// Whether a socket file is still being listened on, or is otherwise not ours to replace
+static bool unix_socket_in_use(struct sockaddr_un *addr, socklen_t addr_len) {
+    struct stat st;
+    if (stat(addr->sun_path, &st) == -1 || !S_ISSOCK(st.st_mode)) {
+        return true;
     }
+    int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (probe == -1) {
+        return true;
+    }
+    bool in_use = connect(probe, (struct sockaddr *) addr, addr_len) == 0 || errno != ECONNREFUSED;
+    close(probe);
+    return in_use;
+}
 
-    struct hostent *server = gethostbyname(host);
-    if (server == NULL) {
-        // no such host
+static int bind_unix_address(socket_accept_info_t *socket_accept_info) {
+    struct sockaddr_un addr;
+    socklen_t addr_len;
+    if (make_unix_address(socket_accept_info->path, &addr, &addr_len) == -1) {
         return -1;
     }
 
-    struct sockaddr_in serv_addr;
-    bzero((char *) &serv_addr, sizeof(serv_addr));
-    serv_addr.sin_family = AF_INET;
-    bcopy((char *) server->h_addr,
-          (char *) &serv_addr.sin_addr.s_addr,
-          server->h_length);
-    serv_addr.sin_port = htons(port);
+    int socket_desc = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (socket_desc == -1) {
+        return -1;
+    }
 
-    int err = connect(socket_desc, (struct sockaddr *) &serv_addr, sizeof(serv_addr));
+    int err = bind(socket_desc, (struct sockaddr *) &addr, addr_len);
+    if (err == -1 && errno == EADDRINUSE && addr.sun_path[0] && !unix_socket_in_use(&addr, addr_len)) {
+        // Left behind by a process that is no longer listening
+        unlink(addr.sun_path);
+        err = bind(socket_desc, (struct sockaddr *) &addr, addr_len);
+    }
     if (err == -1) {
-        return err;
+        int saved_errno = errno;
+        close(socket_desc);
+        errno = saved_errno;
+        return -1;
+    }
+
+    return socket_desc;
+}
+
+int bind_and_listen(socket_accept_info_t *socket_accept_info) {
+
+    int socket_desc;
+    if (socket_accept_info->path) {
+        socket_desc = bind_unix_address(socket_accept_info);
     } else {
-        read_inbound_socket_info_t *read_inbound_socket_info = malloc(sizeof(read_inbound_socket_info_t));
-        read_inbound_socket_info->socket_desc = socket_desc;
-        read_inbound_socket_info->conn_data_cb = conn_data_cb;
-        read_inbound_socket_info->data_arrived_info = data_arrived_info;
+        socket_desc = bind_inet_address(socket_accept_info);
+    }
+    if (socket_desc == -1) {
+        return -1;
+    }
 
-        pthread_t reader_thread;
+    int backlog = socket_accept_info->backlog > 0 ? socket_accept_info->backlog : SOMAXCONN;
+    if (listen(socket_desc, backlog) == -1) {
+        int saved_errno = errno;
+        close(socket_desc);
+        errno = saved_errno;
+        return -1;
+    }
 
-        if (pthread_create(&reader_thread, NULL, read_inbound_socket_data, read_inbound_socket_info) < 0) {
-            engine_perror("could not create thread");
-            return -1;
+    socket_accept_info->socket_desc = socket_desc;
+    return 0;
+}
+
+int accept_connections(socket_accept_info_t *socket_accept_info) {
+
+    if (watch_socket(socket_accept_info->socket_desc, socket_accept_info, true, NULL, NULL, NULL) == -1) {
+        return -1;
+    }
+
+    if (socket_accept_info->listen_successful_cb) {
+        socket_accept_info->listen_successful_cb();
+    }
+
+    return 0;
+}
+
+int close_socket(int fd) {
+    socket_conn_t *conn = conn_acquire(fd);
+    if (!conn) {
+        return shutdown(fd, SHUT_RDWR);
+    }
+
+    // Let anything already written go out first
+    pthread_mutex_lock(&conn->out_lock);
+    if (!conn->closed) {
+        shutdown_when_flushed(conn);
+    }
+    pthread_mutex_unlock(&conn->out_lock);
+
+    conn_release(conn);
+    return 0;
+}
+
+static int connect_and_watch(int socket_desc, struct sockaddr *addr, socklen_t addr_len,
+                             conn_data_cb_t conn_data_cb, void *data_arrived_info, const socket_opts_t *opts) {
+
+    int err = connect(socket_desc, addr, addr_len);
+    if (err == -1 || watch_socket(socket_desc, NULL, false, conn_data_cb, data_arrived_info, opts) == -1) {
+        int saved_errno = errno;
+        close(socket_desc);
+        errno = saved_errno;
+        return -1;
+    }
+
+    return socket_desc;
+}
+
+int connect_socket(const char *host, int port, conn_data_cb_t conn_data_cb,
+                   void *data_arrived_info, const socket_opts_t *opts) {
+
+    resolved_address_t *addrs;
+    size_t count;
+    int rv = resolve_host(host, port, &addrs, &count);
+    if (rv) {
+        errno = rv == EAI_SYSTEM ? errno : EHOSTUNREACH;
+        return -1;
+    }
+
+    // Try each address in turn
+    int socket_desc = -1;
+    size_t i;
+    for (i = 0; i < count && socket_desc == -1; i++) {
+        socket_desc = socket(addrs[i].family, SOCK_STREAM, 0);
+        if (socket_desc != -1) {
+            socket_desc = connect_and_watch(socket_desc, (struct sockaddr *) &addrs[i].addr, addrs[i].addr_len,
+                                            conn_data_cb, data_arrived_info, opts);
         }
+    }
+
+    int saved_errno = errno;
+    free(addrs);
+    errno = saved_errno;
+    return socket_desc;
+}
+
+static void connect_failed(pending_connect_t *pending, const char *err) {
+    pending->conn_connect_cb(-1, err, pending->state);
+    free(pending->addrs);
+    free(pending);
+}
+
+// Starts a non-blocking connect to the next of the host's addresses, for the reactor to complete
+static void connect_next_address(pending_connect_t *pending) {
+    while (pending->next < pending->count) {
+        resolved_address_t *address = &pending->addrs[pending->next++];
+
+        int fd = socket(address->family, SOCK_STREAM, 0);
+        if (fd == -1) {
+            pending->last_err = errno;
+            continue;
+        }
+        if (set_non_blocking(fd) == -1
+            || (connect(fd, (struct sockaddr *) &address->addr, address->addr_len) == -1 && errno != EINPROGRESS)) {
+            pending->last_err = errno;
+            close(fd);
+            continue;
+        }
+
+        socket_conn_t *conn = make_conn(fd, NULL, pending->conn_data_cb, pending->state, &pending->opts);
+        if (!conn) {
+            pending->last_err = ENOMEM;
+            close(fd);
+            continue;
+        }
+        conn->conn_connect_cb = pending->conn_connect_cb;
+        conn->connecting = pending;
+        if (reactor_add(conn) == -1) {
+            pending->last_err = errno;
+            conn_release(conn);
+            continue;
+        }
+        return;
+    }
+
+    connect_failed(pending, strerror(pending->last_err ? pending->last_err : EHOSTUNREACH));
+}
+
+static void host_resolved(resolved_address_t *addrs, size_t count, int err, void *data) {
+    pending_connect_t *pending = data;
+    if (err) {
+        connect_failed(pending, err == EAI_SYSTEM ? strerror(errno) : gai_strerror(err));
+        return;
+    }
+    pending->addrs = addrs;
+    pending->count = count;
+    connect_next_address(pending);
+}
+
+int connect_socket_async(const char *host, int port, conn_connect_cb_t conn_connect_cb, conn_data_cb_t conn_data_cb,
+                         void *data_arrived_info, const socket_opts_t *opts) {
+
+    if (ensure_reactor() == -1) {
+        return -1;
+    }
+
+    pending_connect_t *pending = calloc(1, sizeof(pending_connect_t));
+    if (!pending) {
+        errno = ENOMEM;
+        return -1;
+    }
+    pending->conn_connect_cb = conn_connect_cb;
+    pending->conn_data_cb = conn_data_cb;
+    pending->state = data_arrived_info;
+    if (opts) {
+        pending->opts = *opts;
+    }
+
+    if (resolve_host_async(host, port, host_resolved, pending) == -1) {
+        int saved_errno = errno;
+        free(pending);
+        errno = saved_errno;
+        return -1;
+    }
+    return 0;
+}
+
+int connect_unix_socket(const char *path, conn_data_cb_t conn_data_cb,
+                        void *data_arrived_info, const socket_opts_t *opts) {
+
+    struct sockaddr_un addr;
+    socklen_t addr_len;
+    if (make_unix_address(path, &addr, &addr_len) == -1) {
+        return -1;
+    }
+
+    int socket_desc = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (socket_desc == -1) {
         return socket_desc;
     }
+
+    return connect_and_watch(socket_desc, (struct sockaddr *) &addr, addr_len,
+                             conn_data_cb, data_arrived_info, opts);
+}
+
+void get_socket_stats(socket_stats_t *stats) {
+    stats->accepts = atomic_load(&accept_count);
+    stats->reads = atomic_load(&read_count);
+    stats->writes = atomic_load(&write_count);
+    stats->bytes_read = atomic_load(&bytes_read_count);
+    stats->bytes_written = atomic_load(&bytes_written_count);
+    stats->open_connections = atomic_load(&open_connection_count);
 }
@@ -1,4 +1,6 @@
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 typedef void *(*connection_handler_t)(void *socket_desc);
 
@@ -16,7 +18,34 @@ typedef struct conn_data_cb_ret {
     bool close;
 } conn_data_cb_ret_t;
 
-typedef conn_data_cb_ret_t* (*conn_data_cb_t)(char* data, int sock, void* state);
+// data is NUL-terminated, and ownership passes to the callback. It is NULL when the socket closes.
+typedef conn_data_cb_ret_t* (*conn_data_cb_t)(char* data, size_t len, int sock, void* state);
+
+typedef void (*conn_drain_cb_t)(int sock, void* state);
+
+// Called once a connection attempt completes, with sock set to -1 and an error message on failure.
+typedef void (*conn_connect_cb_t)(int sock, const char *err, void* state);
+
+typedef enum {
+    SOCKET_FRAMING_NONE,
+    SOCKET_FRAMING_LINE,
+    SOCKET_FRAMING_LENGTH_PREFIXED_U32,
+    SOCKET_FRAMING_DELIMITER
+} socket_framing_t;
+
+#define MAX_SOCKET_DELIMITER_LEN 16
+
+typedef struct socket_opts {
+    size_t receive_buffer_size;
+    bool binary;
+    socket_framing_t framing;
+    char delimiter[MAX_SOCKET_DELIMITER_LEN];
+    size_t delimiter_len;
+    size_t max_frame_size;
+    size_t high_watermark;
+    size_t low_watermark;
+    conn_drain_cb_t conn_drain_cb;
+} socket_opts_t;
 
 typedef struct socket_accept_info {
     char *host;
@@ -26,15 +55,42 @@ typedef struct socket_accept_info {
     conn_data_cb_t conn_data_cb;
     int socket_desc;
     void* info;
+    int backlog;
+    bool reuse_port;
+    socket_opts_t opts;
+    // When set, listen on this UNIX domain socket path instead of host and port
+    char *path;
 } socket_accept_info_t;
 
+typedef struct socket_stats {
+    uint64_t accepts;
+    uint64_t reads;
+    uint64_t writes;
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    uint64_t open_connections;
+} socket_stats_t;
+
+int socket_write(int fd, const char *data, size_t len);
+
 int write_to_socket(int fd, const char *text);
 
 int bind_and_listen(socket_accept_info_t* socket_accept_info1);
 
-void *accept_connections(void *data);
+int accept_connections(socket_accept_info_t *socket_accept_info);
 
 int close_socket(int fd);
 
 int connect_socket(const char *host, int port, conn_data_cb_t conn_data_cb,
-                   void *data_arrived_info);
+                   void *data_arrived_info, const socket_opts_t *opts);
+
+// Resolves host and connects without blocking the caller. The connect
+// callback is made on a socket thread, and should not block.
+int connect_socket_async(const char *host, int port, conn_connect_cb_t conn_connect_cb, conn_data_cb_t conn_data_cb,
+                         void *data_arrived_info, const socket_opts_t *opts);
+
+// Paths starting with @ are in the abstract namespace on Linux.
+int connect_unix_socket(const char *path, conn_data_cb_t conn_data_cb,
+                        void *data_arrived_info, const socket_opts_t *opts);
+
+void get_socket_stats(socket_stats_t *stats);
@@ -1,15 +1,195 @@
 #include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
 #include "tasks.h"
+#include "engine.h"
+#include "clock.h"
+#include "threads.h"
 
+// Native threads (timers, socket readers, async shell commands) don't call
+// into JavaScriptCore themselves. Instead they post tasks to a lock-free
+// many-producer / single-consumer queue which is drained by one dispatch
+// thread, taking the eval lock once per batch of tasks.
+
+#define MAX_TASKS_PER_BATCH 256
+
+struct task {
+    _Atomic(struct task *) next;
+    task_fn_t task_fn;
+    void *data;
+    uint64_t posted_time;
+};
+
+static struct task stub_task;
+static _Atomic(struct task *) queue_head = &stub_task;
+static struct task *queue_tail = &stub_task;
+
+static atomic_uint_fast64_t queue_depth = 0;
+static atomic_uint_fast64_t tasks_posted = 0;
+static atomic_uint_fast64_t tasks_run = 0;
+static atomic_uint_fast64_t task_batches = 0;
+static atomic_uint_fast64_t max_task_latency = 0;
+static atomic_uint_fast64_t total_task_latency = 0;
+
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static atomic_bool dispatcher_waiting = false;
+static pthread_once_t dispatcher_once = PTHREAD_ONCE_INIT;
+static int dispatcher_err = 0;
+
+// Event sources (pending timers, async shell commands) which will eventually post tasks
 static int tasks_outstanding = 0;
 pthread_mutex_t tasks_complete_lock = PTHREAD_MUTEX_INITIALIZER;
 pthread_cond_t tasks_complete_cond = PTHREAD_COND_INITIALIZER;
 
+static void queue_push(struct task *task) {
+    atomic_store(&task->next, NULL);
+    struct task *prev = atomic_exchange(&queue_head, task);
+    atomic_store(&prev->next, task);
+}
+
+// Only called from the dispatch thread. May return NULL while a producer
+// is part way through queue_push, even though queue_depth is non-zero.
+static struct task *queue_pop() {
+    struct task *tail = queue_tail;
+    struct task *next = atomic_load(&tail->next);
+
+    if (tail == &stub_task) {
+        if (!next) {
+            return NULL;
+        }
+        queue_tail = next;
+        tail = next;
+        next = atomic_load(&next->next);
+    }
+
+    if (next) {
+        queue_tail = next;
+        return tail;
+    }
+
+    if (tail != atomic_load(&queue_head)) {
+        return NULL;
+    }
+
+    queue_push(&stub_task);
+
+    next = atomic_load(&tail->next);
+    if (next) {
+        queue_tail = next;
+        return tail;
+    }
+
+    return NULL;
+}
+
+static void wait_for_tasks() {
+    pthread_mutex_lock(&queue_lock);
+    atomic_store(&dispatcher_waiting, true);
+    while (atomic_load(&queue_depth) == 0) {
+        pthread_cond_wait(&queue_cond, &queue_lock);
+    }
+    atomic_store(&dispatcher_waiting, false);
+    pthread_mutex_unlock(&queue_lock);
+}
+
+static void record_latency(uint64_t latency) {
+    atomic_fetch_add(&total_task_latency, latency);
+    uint_fast64_t max = atomic_load(&max_task_latency);
+    while (latency > max && !atomic_compare_exchange_weak(&max_task_latency, &max, latency)) {}
+}
+
+static void notify_tasks_complete() {
+    pthread_mutex_lock(&tasks_complete_lock);
+    pthread_cond_broadcast(&tasks_complete_cond);
+    pthread_mutex_unlock(&tasks_complete_lock);
+}
+
+static void *dispatch_tasks(void *data) {
+
+    int err = block_until_engine_ready();
+    if (err) {
+        engine_println(block_until_engine_ready_failed_msg);
+        planck_thread_exiting();
+        return NULL;
+    }
+
+    while (true) {
+        wait_for_tasks();
+
+        int count = 0;
+        struct task *task;
+
+        acquire_eval_lock();
+        while (count < MAX_TASKS_PER_BATCH && (task = queue_pop()) != NULL) {
+            record_latency(system_time() - task->posted_time);
+            task->task_fn(task->data);
+            free(task);
+            atomic_fetch_sub(&queue_depth, 1);
+            atomic_fetch_add(&tasks_run, 1);
+            count++;
+        }
+        release_eval_lock();
+
+        if (count) {
+            atomic_fetch_add(&task_batches, 1);
+            notify_tasks_complete();
+        } else {
+            // A producer is mid-push; give it a chance to finish
+            sched_yield();
+        }
+    }
+
+    return NULL;
+}
+
+static void start_dispatcher() {
+    dispatcher_err = start_planck_thread(dispatch_tasks, NULL);
+}
+
+int post_task(task_fn_t task_fn, void *data) {
+    pthread_once(&dispatcher_once, start_dispatcher);
+    if (dispatcher_err) {
+        return dispatcher_err;
+    }
+
+    struct task *task = malloc(sizeof(struct task));
+    if (!task) {
+        return -1;
+    }
+    task->task_fn = task_fn;
+    task->data = data;
+    task->posted_time = system_time();
+
+    atomic_fetch_add(&queue_depth, 1);
+    atomic_fetch_add(&tasks_posted, 1);
+    queue_push(task);
+
+    if (atomic_load(&dispatcher_waiting)) {
+        pthread_mutex_lock(&queue_lock);
+        pthread_cond_signal(&queue_cond);
+        pthread_mutex_unlock(&queue_lock);
+    }
+
+    return 0;
+}
+
+void get_task_queue_stats(struct task_queue_stats *stats) {
+    stats->depth = atomic_load(&queue_depth);
+    stats->posted = atomic_load(&tasks_posted);
+    stats->run = atomic_load(&tasks_run);
+    stats->batches = atomic_load(&task_batches);
+    stats->max_latency = atomic_load(&max_task_latency);
+    stats->total_latency = atomic_load(&total_task_latency);
+}
+
 int block_until_tasks_complete() {
     int err = pthread_mutex_lock(&tasks_complete_lock);
     if (err) return err;
 
-    while (tasks_outstanding) {
+    while (tasks_outstanding || atomic_load(&queue_depth)) {
         err = pthread_cond_wait(&tasks_complete_cond, &tasks_complete_lock);
         if (err) {
             pthread_mutex_unlock(&tasks_complete_lock);
@@ -1,5 +1,22 @@
+#include <stdint.h>
+
+typedef void (*task_fn_t)(void *data);
+
+struct task_queue_stats {
+    uint64_t depth;
+    uint64_t posted;
+    uint64_t run;
+    uint64_t batches;
+    uint64_t max_latency;
+    uint64_t total_latency;
+};
+
 int block_until_tasks_complete();
 
 int signal_task_started();
 
 int signal_task_complete();
+
+int post_task(task_fn_t task_fn, void *data);
+
+void get_task_queue_stats(struct task_queue_stats *stats);
@@ -0,0 +1,31 @@
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "threads.h"
+
+static atomic_int running = 0;
+
+int start_planck_thread(void *(*start_routine)(void *), void *arg) {
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    // Counted before it starts, so that it can't be seen to exit first
+    atomic_fetch_add(&running, 1);
+    pthread_t thread;
+    int err = pthread_create(&thread, &attr, start_routine, arg);
+    if (err) {
+        atomic_fetch_sub(&running, 1);
+    }
+
+    pthread_attr_destroy(&attr);
+    return err;
+}
+
+void planck_thread_exiting(void) {
+    atomic_fetch_sub(&running, 1);
+}
+
+int planck_threads_running(void) {
+    return atomic_load(&running);
+}
@@ -0,0 +1,12 @@
+// Planck's background threads are started through here, so that
+// planck.parallel can tell whether any are running, as they don't survive
+// fork and may hold locks a forked child would need.
+
+// Starts a detached thread, returning 0 or an error number
+int start_planck_thread(void *(*start_routine)(void *), void *arg);
+
+// Called by a thread started with start_planck_thread just before it returns
+void planck_thread_exiting(void);
+
+// The number of threads started with start_planck_thread that are running
+int planck_threads_running(void);
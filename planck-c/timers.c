@@ -1,70 +1,337 @@
 #include <stddef.h>
+#include <stdint.h>
 #include <time.h>
 #include <pthread.h>
 #include <stdlib.h>
 #include <errno.h>
 #include "timers.h"
 #include "engine.h"
-#include "tasks.h"
+#include "clock.h"
+#include "threads.h"
 
-struct timer_data_t {
-    long millis;
+// All timers are serviced by a single scheduler thread which sleeps until the
+// earliest deadline held in a binary min-heap. Timers are also indexed by id
+// in a hash table so that cancel_timer can remove them from the heap directly.
+
+struct timer {
+    unsigned long id;
+    uint64_t deadline;
+    uint64_t interval;
     timer_callback_t timer_callback;
     void *data;
+    size_t heap_index;
+    struct timer *next_in_bucket;
 };
 
-void *timer_thread(void *data) {
+static pthread_mutex_t timers_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t timers_cond;
+static pthread_once_t scheduler_once = PTHREAD_ONCE_INIT;
+static bool scheduler_running = false;
 
-    struct timer_data_t *timer_data = data;
+static struct timer **heap = NULL;
+static size_t heap_count = 0;
+static size_t heap_capacity = 0;
 
-    struct timespec t;
-    t.tv_sec = timer_data->millis / 1000;
-    t.tv_nsec = 1000 * 1000 * (timer_data->millis % 1000);
-    if (t.tv_sec == 0 && t.tv_nsec == 0) {
-        t.tv_nsec = 1; /* Evidently needed on Ubuntu 14.04 */
+static struct timer **buckets = NULL;
+static size_t bucket_count = 0;
+static size_t timer_count = 0;
+
+static unsigned long last_timer_id = 0;
+
+// The timer whose callback is currently executing (outside of timers_lock)
+static struct timer *running_timer = NULL;
+static bool running_timer_cancelled = false;
+
+static void heap_set(size_t index, struct timer *timer) {
+    heap[index] = timer;
+    timer->heap_index = index;
+}
+
+static void heap_sift_up(size_t index) {
+    struct timer *timer = heap[index];
+    while (index > 0) {
+        size_t parent = (index - 1) / 2;
+        if (heap[parent]->deadline <= timer->deadline) {
+            break;
+        }
+        heap_set(index, heap[parent]);
+        index = parent;
     }
+    heap_set(index, timer);
+}
 
-    int err;
-    while ((err = nanosleep(&t, &t)) && errno == EINTR) {}
-    if (err) {
-        free(data);
-        engine_perror("timer nanosleep");
+static void heap_sift_down(size_t index) {
+    struct timer *timer = heap[index];
+    while (true) {
+        size_t child = 2 * index + 1;
+        if (child >= heap_count) {
+            break;
+        }
+        if (child + 1 < heap_count && heap[child + 1]->deadline < heap[child]->deadline) {
+            child++;
+        }
+        if (timer->deadline <= heap[child]->deadline) {
+            break;
+        }
+        heap_set(index, heap[child]);
+        index = child;
+    }
+    heap_set(index, timer);
+}
+
+static bool heap_push(struct timer *timer) {
+    if (heap_count == heap_capacity) {
+        size_t new_capacity = heap_capacity ? 2 * heap_capacity : 64;
+        struct timer **new_heap = realloc(heap, new_capacity * sizeof(struct timer *));
+        if (!new_heap) {
+            return false;
+        }
+        heap = new_heap;
+        heap_capacity = new_capacity;
+    }
+    heap_set(heap_count++, timer);
+    heap_sift_up(timer->heap_index);
+    return true;
+}
+
+static void heap_remove(size_t index) {
+    struct timer *last = heap[--heap_count];
+    if (index < heap_count) {
+        heap_set(index, last);
+        heap_sift_up(index);
+        heap_sift_down(last->heap_index);
+    }
+}
+
+static size_t bucket_for_id(unsigned long id) {
+    return id & (bucket_count - 1);
+}
+
+static bool table_grow() {
+    size_t new_bucket_count = bucket_count ? 2 * bucket_count : 64;
+    struct timer **new_buckets = calloc(new_bucket_count, sizeof(struct timer *));
+    if (!new_buckets) {
+        return false;
+    }
+    size_t i;
+    for (i = 0; i < bucket_count; i++) {
+        struct timer *timer = buckets[i];
+        while (timer) {
+            struct timer *next = timer->next_in_bucket;
+            size_t bucket = timer->id & (new_bucket_count - 1);
+            timer->next_in_bucket = new_buckets[bucket];
+            new_buckets[bucket] = timer;
+            timer = next;
+        }
+    }
+    free(buckets);
+    buckets = new_buckets;
+    bucket_count = new_bucket_count;
+    return true;
+}
+
+static struct timer *table_lookup(unsigned long id) {
+    if (!bucket_count) {
         return NULL;
     }
+    struct timer *timer = buckets[bucket_for_id(id)];
+    while (timer && timer->id != id) {
+        timer = timer->next_in_bucket;
+    }
+    return timer;
+}
 
-    timer_data->timer_callback(timer_data->data);
+static bool table_insert(struct timer *timer) {
+    if (timer_count >= bucket_count && !table_grow()) {
+        return false;
+    }
+    size_t bucket = bucket_for_id(timer->id);
+    timer->next_in_bucket = buckets[bucket];
+    buckets[bucket] = timer;
+    timer_count++;
+    return true;
+}
 
-    free(data);
+static void table_remove(struct timer *timer) {
+    struct timer **p = &buckets[bucket_for_id(timer->id)];
+    while (*p != timer) {
+        p = &(*p)->next_in_bucket;
+    }
+    *p = timer->next_in_bucket;
+    timer_count--;
+}
 
-    return NULL;
+static bool arm_timer(struct timer *timer) {
+    if (!table_insert(timer)) {
+        return false;
+    }
+    if (!heap_push(timer)) {
+        table_remove(timer);
+        return false;
+    }
+    if (timer->heap_index == 0) {
+        pthread_cond_signal(&timers_cond);
+    }
+    return true;
 }
 
-int start_timer(long millis, timer_callback_t timer_callback, void *data) {
+static void wait_until(uint64_t deadline, uint64_t now) {
+#ifdef __APPLE__
+    uint64_t delta = deadline - now;
+    struct timespec t;
+    t.tv_sec = delta / 1000000000;
+    t.tv_nsec = delta % 1000000000;
+    pthread_cond_timedwait_relative_np(&timers_cond, &timers_lock, &t);
+#else
+    struct timespec t;
+    t.tv_sec = deadline / 1000000000;
+    t.tv_nsec = deadline % 1000000000;
+    pthread_cond_timedwait(&timers_cond, &timers_lock, &t);
+#endif
+}
 
-    struct timer_data_t *timer_data = malloc(sizeof(struct timer_data_t));
-    if (!timer_data) return -1;
+static void *scheduler_thread(void *data) {
 
-    timer_data->millis = millis;
-    timer_data->timer_callback = timer_callback;
-    timer_data->data = data;
+    pthread_mutex_lock(&timers_lock);
 
-    pthread_attr_t attr;
-    int err = pthread_attr_init(&attr);
-    if (err) {
-        free(timer_data);
-        return err;
+    while (true) {
+        if (heap_count == 0) {
+            pthread_cond_wait(&timers_cond, &timers_lock);
+            continue;
+        }
+
+        struct timer *timer = heap[0];
+        uint64_t now = system_time();
+        if (timer->deadline > now) {
+            wait_until(timer->deadline, now);
+            continue;
+        }
+
+        heap_remove(0);
+        table_remove(timer);
+        running_timer = timer;
+        running_timer_cancelled = false;
+
+        pthread_mutex_unlock(&timers_lock);
+        timer->timer_callback(timer->id, timer->data);
+        pthread_mutex_lock(&timers_lock);
+
+        running_timer = NULL;
+
+        bool rearmed = false;
+        if (timer->interval && !running_timer_cancelled) {
+            // Stay on the original cadence, unless the callback overran it
+            now = system_time();
+            timer->deadline += timer->interval;
+            if (timer->deadline <= now) {
+                timer->deadline = now + timer->interval;
+            }
+            rearmed = arm_timer(timer);
+            if (!rearmed) {
+                engine_println("Failed to re-arm interval timer");
+            }
+        }
+
+        if (!rearmed) {
+            free(timer);
+        }
     }
 
-    err = pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    return NULL;
+}
+
+static void start_scheduler() {
+    pthread_condattr_t cond_attr;
+    pthread_condattr_init(&cond_attr);
+#ifndef __APPLE__
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+#endif
+    pthread_cond_init(&timers_cond, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+
+    int err = start_planck_thread(scheduler_thread, NULL);
     if (err) {
-        free(timer_data);
-        return err;
+        engine_print_err_message("timer scheduler pthread_create", err);
+    } else {
+        scheduler_running = true;
     }
+}
 
-    pthread_t thread;
-    err = pthread_create(&thread, &attr, timer_thread, timer_data);
-    if (err) {
-        free(timer_data);
+static unsigned long next_timer_id() {
+    // Ids are exposed to JavaScript, so keep them within 2^53 - 1, and
+    // skip any that are still in use after wrapping around.
+    do {
+        if (last_timer_id == 9007199254740991) {
+            last_timer_id = 1;
+        } else {
+            ++last_timer_id;
+        }
+    } while (table_lookup(last_timer_id) || (running_timer && running_timer->id == last_timer_id));
+    return last_timer_id;
+}
+
+static unsigned long schedule_timer(long millis, long interval_millis, timer_callback_t timer_callback, void *data) {
+
+    pthread_once(&scheduler_once, start_scheduler);
+    if (!scheduler_running) {
+        return 0;
     }
-    return err;
+
+    struct timer *timer = malloc(sizeof(struct timer));
+    if (!timer) {
+        return 0;
+    }
+
+    if (millis < 0) {
+        millis = 0;
+    }
+
+    timer->deadline = system_time() + 1000000ULL * millis;
+    timer->interval = 1000000ULL * interval_millis;
+    timer->timer_callback = timer_callback;
+    timer->data = data;
+
+    pthread_mutex_lock(&timers_lock);
+    timer->id = next_timer_id();
+    unsigned long timer_id = timer->id;
+    if (!arm_timer(timer)) {
+        free(timer);
+        timer_id = 0;
+    }
+    pthread_mutex_unlock(&timers_lock);
+
+    return timer_id;
+}
+
+unsigned long start_timer(long millis, timer_callback_t timer_callback, void *data) {
+    return schedule_timer(millis, 0, timer_callback, data);
+}
+
+unsigned long start_interval(long millis, timer_callback_t timer_callback, void *data) {
+    // A zero period would have the scheduler spin on this timer
+    if (millis < 1) {
+        millis = 1;
+    }
+    return schedule_timer(millis, millis, timer_callback, data);
+}
+
+bool cancel_timer(unsigned long timer_id) {
+    bool cancelled = false;
+
+    pthread_mutex_lock(&timers_lock);
+    struct timer *timer = table_lookup(timer_id);
+    if (timer) {
+        table_remove(timer);
+        heap_remove(timer->heap_index);
+        free(timer);
+        cancelled = true;
+    } else if (running_timer && running_timer->id == timer_id && running_timer->interval
+               && !running_timer_cancelled) {
+        // An interval cancelled from within (or during) its own callback
+        running_timer_cancelled = true;
+        cancelled = true;
+    }
+    pthread_mutex_unlock(&timers_lock);
+
+    return cancelled;
 }
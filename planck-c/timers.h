@@ -1,3 +1,9 @@
-typedef void (*timer_callback_t)(void *data);
+#include <stdbool.h>
 
-int start_timer(long millis, timer_callback_t timer_callback, void *data);
+typedef void (*timer_callback_t)(unsigned long timer_id, void *data);
+
+unsigned long start_timer(long millis, timer_callback_t timer_callback, void *data);
+
+unsigned long start_interval(long millis, timer_callback_t timer_callback, void *data);
+
+bool cancel_timer(unsigned long timer_id);
@@ -0,0 +1,569 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <JavaScriptCore/JavaScript.h>
+
+#include "engine.h"
+#include "jsc_utils.h"
+#include "tasks.h"
+#include "threads.h"
+#include "worker.h"
+
+// A worker pool runs a number of threads, each evaluating in its own context
+// (see engine_session_t) with a given namespace loaded. Messages are transit
+// strings, encoded and decoded by planck.worker, along with any ArrayBuffers
+// being shared. Messages posted to a pool go onto a single queue and are
+// taken by whichever worker is free. Messages posted by workers are delivered
+// to the main context through the task queue.
+
+#define MAX_WORKERS 64
+#define SHARED_BYTES_BUCKETS 64
+
+// ArrayBuffers shared with messages are backed by memory that all contexts
+// refer to, without copying or detaching, so that the sender and receiver see
+// each other's writes. The memory is freed once every ArrayBuffer backed by it
+// has been collected.
+typedef struct shared_bytes {
+    void *bytes;
+    size_t len;
+    size_t refs;
+    struct shared_bytes *next;
+} shared_bytes_t;
+
+typedef struct worker_message {
+    JSStringRef payload;
+    size_t num_buffers;
+    shared_bytes_t **buffers;
+    struct worker_message *next;
+} worker_message_t;
+
+typedef struct worker_pool {
+    int id;
+    char *ns;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    worker_message_t *inbox_head;
+    worker_message_t *inbox_tail;
+    bool terminated;
+    // Only used from the main context
+    JSObjectRef message_handler;
+    atomic_int refs;
+    struct worker_pool *next;
+} worker_pool_t;
+
+typedef struct worker_message_task {
+    worker_pool_t *pool;
+    worker_message_t *message;
+} worker_message_task_t;
+
+static pthread_mutex_t shared_bytes_lock = PTHREAD_MUTEX_INITIALIZER;
+static shared_bytes_t *shared_bytes_table[SHARED_BYTES_BUCKETS];
+
+static pthread_mutex_t pools_lock = PTHREAD_MUTEX_INITIALIZER;
+static worker_pool_t *pools = NULL;
+static int pool_id_counter = 0;
+
+// Set on worker threads
+static __thread worker_pool_t *current_pool = NULL;
+static __thread JSObjectRef current_handler = NULL;
+
+static JSValueRef make_error(JSContextRef ctx, const char *msg) {
+    JSValueRef arguments[1];
+    arguments[0] = c_string_to_value(ctx, msg);
+    return JSObjectMakeError(ctx, 1, arguments, NULL);
+}
+
+// Shared bytes
+
+static size_t bucket_for_bytes(void *bytes) {
+    return ((uintptr_t) bytes >> 4) & (SHARED_BYTES_BUCKETS - 1);
+}
+
+// Takes ownership of bytes
+static shared_bytes_t *make_shared_bytes(void *bytes, size_t len) {
+    shared_bytes_t *shared = malloc(sizeof(shared_bytes_t));
+    if (!shared) {
+        free(bytes);
+        return NULL;
+    }
+    shared->bytes = bytes;
+    shared->len = len;
+    shared->refs = 1;
+
+    pthread_mutex_lock(&shared_bytes_lock);
+    size_t bucket = bucket_for_bytes(bytes);
+    shared->next = shared_bytes_table[bucket];
+    shared_bytes_table[bucket] = shared;
+    pthread_mutex_unlock(&shared_bytes_lock);
+
+    return shared;
+}
+
+// Returns a new reference to the shared bytes, if bytes are shared
+static shared_bytes_t *retain_shared_bytes(void *bytes) {
+    pthread_mutex_lock(&shared_bytes_lock);
+    shared_bytes_t *shared = shared_bytes_table[bucket_for_bytes(bytes)];
+    while (shared && shared->bytes != bytes) {
+        shared = shared->next;
+    }
+    if (shared) {
+        shared->refs++;
+    }
+    pthread_mutex_unlock(&shared_bytes_lock);
+    return shared;
+}
+
+static void release_shared_bytes(void *bytes, void *deallocator_context) {
+    shared_bytes_t *shared = deallocator_context;
+
+    pthread_mutex_lock(&shared_bytes_lock);
+    bool last = --shared->refs == 0;
+    if (last) {
+        shared_bytes_t **p = &shared_bytes_table[bucket_for_bytes(shared->bytes)];
+        while (*p != shared) {
+            p = &(*p)->next;
+        }
+        *p = shared->next;
+    }
+    pthread_mutex_unlock(&shared_bytes_lock);
+
+    if (last) {
+        free(shared->bytes);
+        free(shared);
+    }
+}
+
+// Messages
+
+static void free_message(worker_message_t *message) {
+    size_t i;
+    for (i = 0; i < message->num_buffers; i++) {
+        if (message->buffers[i]) {
+            release_shared_bytes(message->buffers[i]->bytes, message->buffers[i]);
+        }
+    }
+    free(message->buffers);
+    JSStringRelease(message->payload);
+    free(message);
+}
+
+// Buffers backed by shared bytes are shared without copying; any others are
+// copied once into shared bytes.
+static bool add_shared_buffer(JSContextRef ctx, worker_message_t *message, JSValueRef value,
+                                   JSValueRef *exception) {
+#ifdef HAVE_JSC_TYPED_ARRAYS
+    if (JSValueGetTypedArrayType(ctx, value, NULL) != kJSTypedArrayTypeArrayBuffer) {
+        *exception = make_error(ctx, "Only ArrayBuffers can be shared");
+        return false;
+    }
+    JSObjectRef buffer = JSValueToObject(ctx, value, NULL);
+    void *bytes = JSObjectGetArrayBufferBytesPtr(ctx, buffer, NULL);
+    size_t len = JSObjectGetArrayBufferByteLength(ctx, buffer, NULL);
+
+    shared_bytes_t *shared = bytes ? retain_shared_bytes(bytes) : NULL;
+    if (!shared) {
+        void *copy = malloc(len ? len : 1);
+        if (!copy) {
+            *exception = make_error(ctx, strerror(ENOMEM));
+            return false;
+        }
+        memcpy(copy, bytes, len);
+        shared = make_shared_bytes(copy, len);
+        if (!shared) {
+            *exception = make_error(ctx, strerror(ENOMEM));
+            return false;
+        }
+    }
+    message->buffers[message->num_buffers++] = shared;
+    return true;
+#else
+    *exception = make_error(ctx, "Sharing ArrayBuffers requires JavaScriptCore typed array support");
+    return false;
+#endif
+}
+
+static worker_message_t *make_message(JSContextRef ctx, JSValueRef payload, JSValueRef shared,
+                                      JSValueRef *exception) {
+    if (!JSValueIsString(ctx, payload)) {
+        *exception = make_error(ctx, "Message payload must be a string");
+        return NULL;
+    }
+
+    worker_message_t *message = calloc(1, sizeof(worker_message_t));
+    if (!message) {
+        *exception = make_error(ctx, strerror(ENOMEM));
+        return NULL;
+    }
+    message->payload = JSValueToStringCopy(ctx, payload, NULL);
+
+    if (JSValueIsObject(ctx, shared)) {
+        JSObjectRef array = JSValueToObject(ctx, shared, NULL);
+        size_t count = (size_t) array_get_count(ctx, array);
+        message->buffers = calloc(count ? count : 1, sizeof(shared_bytes_t *));
+        if (!message->buffers) {
+            free_message(message);
+            *exception = make_error(ctx, strerror(ENOMEM));
+            return NULL;
+        }
+        size_t i;
+        for (i = 0; i < count; i++) {
+            if (!add_shared_buffer(ctx, message, array_get_value_at_index(ctx, array, (unsigned) i),
+                                        exception)) {
+                free_message(message);
+                return NULL;
+            }
+        }
+    }
+
+    return message;
+}
+
+// Calls handler with the payload, followed by an array of any shared
+// buffers. The message's buffer references pass to the new ArrayBuffers.
+static void deliver_message(JSContextRef ctx, JSObjectRef handler, worker_message_t *message) {
+    JSValueRef args[2];
+    size_t num_args = 1;
+    args[0] = JSValueMakeString(ctx, message->payload);
+
+#ifdef HAVE_JSC_TYPED_ARRAYS
+    if (message->buffers) {
+        JSValueRef buffers[message->num_buffers ? message->num_buffers : 1];
+        size_t i;
+        for (i = 0; i < message->num_buffers; i++) {
+            shared_bytes_t *shared = message->buffers[i];
+            buffers[i] = JSObjectMakeArrayBufferWithBytesNoCopy(ctx, shared->bytes, shared->len,
+                                                                release_shared_bytes, shared, NULL);
+            if (buffers[i]) {
+                message->buffers[i] = NULL;
+            } else {
+                buffers[i] = JSValueMakeNull(ctx);
+            }
+        }
+        args[1] = JSObjectMakeArray(ctx, message->num_buffers, buffers, NULL);
+        num_args = 2;
+    }
+#endif
+
+    JSValueRef ex = NULL;
+    JSObjectCallAsFunction(ctx, handler, NULL, num_args, args, &ex);
+    if (ex) {
+        print_value("Error handling worker message: ", ctx, ex);
+    }
+}
+
+// Pools
+
+static void release_pool(worker_pool_t *pool) {
+    if (atomic_fetch_sub(&pool->refs, 1) == 1) {
+        while (pool->inbox_head) {
+            worker_message_t *next = pool->inbox_head->next;
+            free_message(pool->inbox_head);
+            pool->inbox_head = next;
+        }
+        pthread_mutex_destroy(&pool->lock);
+        pthread_cond_destroy(&pool->cond);
+        free(pool->ns);
+        free(pool);
+    }
+}
+
+// Returns a new reference to the pool with the given id
+static worker_pool_t *find_pool(int id) {
+    pthread_mutex_lock(&pools_lock);
+    worker_pool_t *pool = pools;
+    while (pool && pool->id != id) {
+        pool = pool->next;
+    }
+    if (pool) {
+        atomic_fetch_add(&pool->refs, 1);
+    }
+    pthread_mutex_unlock(&pools_lock);
+    return pool;
+}
+
+static worker_pool_t *remove_pool(int id) {
+    pthread_mutex_lock(&pools_lock);
+    worker_pool_t **p = &pools;
+    while (*p && (*p)->id != id) {
+        p = &(*p)->next;
+    }
+    worker_pool_t *pool = *p;
+    if (pool) {
+        *p = pool->next;
+    }
+    pthread_mutex_unlock(&pools_lock);
+    return pool;
+}
+
+// Blocks until a message arrives, returning NULL once the pool is terminated
+static worker_message_t *take_message(worker_pool_t *pool) {
+    pthread_mutex_lock(&pool->lock);
+    while (!pool->inbox_head && !pool->terminated) {
+        pthread_cond_wait(&pool->cond, &pool->lock);
+    }
+    worker_message_t *message = NULL;
+    if (!pool->terminated) {
+        message = pool->inbox_head;
+        pool->inbox_head = message->next;
+        if (!pool->inbox_head) {
+            pool->inbox_tail = NULL;
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return message;
+}
+
+static void *worker_thread(void *data) {
+    worker_pool_t *pool = data;
+    current_pool = pool;
+
+    engine_session_t *session = create_worker_session();
+    if (session) {
+        JSGlobalContextRef ctx = get_session_context(session);
+
+        size_t len = strlen(pool->ns) + 12;
+        char source[len];
+        snprintf(source, len, "(require '%s)", pool->ns);
+        session_evaluate_source(session, "text", source, true, false, "cljs.user", "dumb", 0);
+
+        worker_message_t *message;
+        while ((message = take_message(pool))) {
+            if (current_handler) {
+                deliver_message(ctx, current_handler, message);
+            }
+            free_message(message);
+        }
+
+        if (current_handler) {
+            JSValueUnprotect(ctx, current_handler);
+            current_handler = NULL;
+        }
+        release_engine_session(session);
+    } else {
+        engine_perror("planck.worker context");
+    }
+
+    release_pool(pool);
+    planck_thread_exiting();
+    return NULL;
+}
+
+static void worker_message_task(void *data) {
+    worker_message_task_t *task = data;
+
+    if (task->pool->message_handler) {
+        deliver_message(ctx, task->pool->message_handler, task->message);
+    }
+    free_message(task->message);
+    release_pool(task->pool);
+    free(task);
+}
+
+JSValueRef function_worker_start(JSContextRef ctx, JSObjectRef function, JSObjectRef this_object,
+                                 size_t argc, const JSValueRef args[], JSValueRef *exception) {
+    if (argc == 2
+        && JSValueGetType(ctx, args[0]) == kJSTypeString
+        && JSValueGetType(ctx, args[1]) == kJSTypeNumber) {
+
+        long size = (long) JSValueToNumber(ctx, args[1], NULL);
+        if (size <= 0) {
+            size = sysconf(_SC_NPROCESSORS_ONLN);
+        }
+        if (size < 1) {
+            size = 1;
+        } else if (size > MAX_WORKERS) {
+            size = MAX_WORKERS;
+        }
+
+        worker_pool_t *pool = calloc(1, sizeof(worker_pool_t));
+        if (!pool) {
+            *exception = make_error(ctx, strerror(ENOMEM));
+            return JSValueMakeNull(ctx);
+        }
+        pool->ns = value_to_c_string(ctx, args[0]);
+        pthread_mutex_init(&pool->lock, NULL);
+        pthread_cond_init(&pool->cond, NULL);
+        atomic_init(&pool->refs, 1);
+
+        long i;
+        int err = 0;
+        for (i = 0; i < size && !err; i++) {
+            atomic_fetch_add(&pool->refs, 1);
+            err = start_planck_thread(worker_thread, pool);
+            if (err) {
+                atomic_fetch_sub(&pool->refs, 1);
+            }
+        }
+
+        if (err) {
+            // Stop any workers that did start
+            pthread_mutex_lock(&pool->lock);
+            pool->terminated = true;
+            pthread_cond_broadcast(&pool->cond);
+            pthread_mutex_unlock(&pool->lock);
+            release_pool(pool);
+            *exception = make_error(ctx, strerror(err));
+            return JSValueMakeNull(ctx);
+        }
+
+        pthread_mutex_lock(&pools_lock);
+        pool->id = ++pool_id_counter;
+        pool->next = pools;
+        pools = pool;
+        pthread_mutex_unlock(&pools_lock);
+
+        // Keep Planck running until the pool is terminated
+        err = signal_task_started();
+        if (err) {
+            engine_print_err_message("signal_task_started", err);
+        }
+
+        return JSValueMakeNumber(ctx, pool->id);
+    }
+    return JSValueMakeNull(ctx);
+}
+
+JSValueRef function_worker_post_message(JSContextRef ctx, JSObjectRef function, JSObjectRef this_object,
+                                        size_t argc, const JSValueRef args[], JSValueRef *exception) {
+    if (argc == 3) {
+        if (JSValueIsNull(ctx, args[0])) {
+            // From a worker to the main context
+            if (!current_pool) {
+                *exception = make_error(ctx, "Not running in a worker");
+                return JSValueMakeNull(ctx);
+            }
+            worker_message_t *message = make_message(ctx, args[1], args[2], exception);
+            if (!message) {
+                return JSValueMakeNull(ctx);
+            }
+            worker_message_task_t *task = malloc(sizeof(worker_message_task_t));
+            if (!task) {
+                free_message(message);
+                *exception = make_error(ctx, strerror(ENOMEM));
+                return JSValueMakeNull(ctx);
+            }
+            atomic_fetch_add(&current_pool->refs, 1);
+            task->pool = current_pool;
+            task->message = message;
+            int err = post_task(worker_message_task, task);
+            if (err) {
+                free_message(message);
+                release_pool(current_pool);
+                free(task);
+                *exception = make_error(ctx, strerror(err));
+            }
+        } else {
+            // To a pool's workers
+            worker_pool_t *pool = find_pool((int) JSValueToNumber(ctx, args[0], NULL));
+            if (!pool) {
+                *exception = make_error(ctx, "No such worker pool");
+                return JSValueMakeNull(ctx);
+            }
+            worker_message_t *message = make_message(ctx, args[1], args[2], exception);
+            if (message) {
+                pthread_mutex_lock(&pool->lock);
+                if (pool->inbox_tail) {
+                    pool->inbox_tail->next = message;
+                } else {
+                    pool->inbox_head = message;
+                }
+                pool->inbox_tail = message;
+                pthread_cond_signal(&pool->cond);
+                pthread_mutex_unlock(&pool->lock);
+            }
+            release_pool(pool);
+        }
+    }
+    return JSValueMakeNull(ctx);
+}
+
+JSValueRef function_worker_on_message(JSContextRef ctx, JSObjectRef function, JSObjectRef this_object,
+                                      size_t argc, const JSValueRef args[], JSValueRef *exception) {
+    if (argc == 2 && JSValueIsObject(ctx, args[1])) {
+        JSObjectRef handler = JSValueToObject(ctx, args[1], NULL);
+        if (JSValueIsNull(ctx, args[0])) {
+            if (!current_pool) {
+                *exception = make_error(ctx, "Not running in a worker");
+                return JSValueMakeNull(ctx);
+            }
+            if (current_handler) {
+                JSValueUnprotect(ctx, current_handler);
+            }
+            current_handler = handler;
+            JSValueProtect(ctx, current_handler);
+        } else {
+            worker_pool_t *pool = find_pool((int) JSValueToNumber(ctx, args[0], NULL));
+            if (!pool) {
+                *exception = make_error(ctx, "No such worker pool");
+                return JSValueMakeNull(ctx);
+            }
+            if (pool->message_handler) {
+                JSValueUnprotect(ctx, pool->message_handler);
+            }
+            pool->message_handler = handler;
+            JSValueProtect(ctx, pool->message_handler);
+            release_pool(pool);
+        }
+    }
+    return JSValueMakeNull(ctx);
+}
+
+JSValueRef function_worker_terminate(JSContextRef ctx, JSObjectRef function, JSObjectRef this_object,
+                                     size_t argc, const JSValueRef args[], JSValueRef *exception) {
+    if (argc == 1 && JSValueGetType(ctx, args[0]) == kJSTypeNumber) {
+        worker_pool_t *pool = remove_pool((int) JSValueToNumber(ctx, args[0], NULL));
+        if (pool) {
+            pthread_mutex_lock(&pool->lock);
+            pool->terminated = true;
+            pthread_cond_broadcast(&pool->cond);
+            pthread_mutex_unlock(&pool->lock);
+
+            // Messages from workers still in the task queue are dropped
+            if (pool->message_handler) {
+                JSValueUnprotect(ctx, pool->message_handler);
+                pool->message_handler = NULL;
+            }
+
+            int err = signal_task_complete();
+            if (err) {
+                engine_print_err_message("signal_task_complete", err);
+            }
+
+            release_pool(pool);
+        }
+    }
+    return JSValueMakeNull(ctx);
+}
+
+JSValueRef function_worker_array_buffer(JSContextRef ctx, JSObjectRef function, JSObjectRef this_object,
+                                        size_t argc, const JSValueRef args[], JSValueRef *exception) {
+#ifdef HAVE_JSC_TYPED_ARRAYS
+    if (argc == 1 && JSValueGetType(ctx, args[0]) == kJSTypeNumber) {
+        size_t len = (size_t) JSValueToNumber(ctx, args[0], NULL);
+        void *bytes = calloc(len ? len : 1, 1);
+        shared_bytes_t *shared = bytes ? make_shared_bytes(bytes, len) : NULL;
+        if (!shared) {
+            *exception = make_error(ctx, strerror(ENOMEM));
+            return JSValueMakeNull(ctx);
+        }
+        JSObjectRef buffer = JSObjectMakeArrayBufferWithBytesNoCopy(ctx, bytes, len, release_shared_bytes, shared,
+                                                                    exception);
+        if (!buffer) {
+            release_shared_bytes(bytes, shared);
+            return JSValueMakeNull(ctx);
+        }
+        return buffer;
+    }
+    return JSValueMakeNull(ctx);
+#else
+    *exception = make_error(ctx, "Shared ArrayBuffers require JavaScriptCore typed array support");
+    return JSValueMakeNull(ctx);
+#endif
+}
@@ -0,0 +1,16 @@
+#include <JavaScriptCore/JavaScript.h>
+
+JSValueRef function_worker_start(JSContextRef ctx, JSObjectRef function, JSObjectRef this_object,
+                                 size_t argc, const JSValueRef args[], JSValueRef *exception);
+
+JSValueRef function_worker_post_message(JSContextRef ctx, JSObjectRef function, JSObjectRef this_object,
+                                        size_t argc, const JSValueRef args[], JSValueRef *exception);
+
+JSValueRef function_worker_on_message(JSContextRef ctx, JSObjectRef function, JSObjectRef this_object,
+                                      size_t argc, const JSValueRef args[], JSValueRef *exception);
+
+JSValueRef function_worker_terminate(JSContextRef ctx, JSObjectRef function, JSObjectRef this_object,
+                                     size_t argc, const JSValueRef args[], JSValueRef *exception);
+
+JSValueRef function_worker_array_buffer(JSContextRef ctx, JSObjectRef function, JSObjectRef this_object,
+                                        size_t argc, const JSValueRef args[], JSValueRef *exception);